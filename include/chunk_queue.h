@@ -0,0 +1,100 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include "file_transfer.h"
+#include <stddef.h>
+#include <atomic>
+
+namespace trackle
+{
+	/**
+	 * Bounded single-producer/single-consumer ring of OTA chunks.
+	 *
+	 * The protocol loop pushes each chunk that passed the CRC check, copying it with its
+	 * descriptor into a buffer of the pool allocated by configure(); a writer thread pops
+	 * the chunks and stores them, so slow storage doesn't delay the chunk ACKs.
+	 */
+	class ChunkQueue
+	{
+	public:
+		typedef int (*Writer)(FileTransfer::Descriptor &descriptor, const unsigned char *chunk, void *reserved);
+
+	private:
+		struct Slot
+		{
+			FileTransfer::Descriptor descriptor;
+			// followed by chunk_size bytes of data
+		};
+
+		uint8_t *pool;
+		size_t slot_size;
+		uint16_t capacity;
+		uint16_t chunk_size;
+
+		// monotonic counters, the slot in use is counter % capacity
+		std::atomic<uint32_t> head; // written by the consumer only
+		std::atomic<uint32_t> tail; // written by the producer only
+
+		Slot *slot(uint32_t index) const
+		{
+			return (Slot *)(pool + (index % capacity) * slot_size);
+		}
+
+	public:
+		ChunkQueue();
+		~ChunkQueue();
+
+		/**
+		 * Allocates the buffers for the given number of chunks. A capacity of 0 frees them.
+		 * Pending chunks are discarded, so this must not run while the queue is being drained.
+		 *
+		 * @param capacity Number of chunks that can be pending.
+		 * @param chunk_size Maximum size of a chunk.
+		 * @return false if the buffers could not be allocated.
+		 */
+		bool configure(uint16_t capacity, uint16_t chunk_size);
+
+		bool enabled() const
+		{
+			return pool != nullptr;
+		}
+
+		bool empty() const
+		{
+			return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+		}
+
+		/**
+		 * Called from the protocol loop. Copies the chunk in the next free buffer.
+		 *
+		 * @return false if the queue is full or the chunk is too long.
+		 */
+		bool push(const FileTransfer::Descriptor &descriptor, const unsigned char *chunk);
+
+		/**
+		 * Called by one consumer at a time, the writer thread or the protocol loop finishing the
+		 * transfer. Stores all the pending chunks with the given writer.
+		 *
+		 * @return The number of chunks the writer failed to store.
+		 */
+		int drain(Writer writer);
+	};
+}
@@ -24,13 +24,15 @@
 #include "file_transfer.h"
 #include "message_channel.h"
 #include "messages.h"
+#include "delta_patch.h"
+#include "decompressor.h"
 
 namespace trackle
 {
 	namespace protocol
 	{
 
-		class ChunkedTransfer
+		class ChunkedTransfer : private DeltaPatch::Target, private Decompressor::Target
 		{
 
 		public:
@@ -63,8 +65,37 @@ namespace trackle
 				virtual uint32_t calculate_crc(const unsigned char *buf, uint32_t buflen) = 0;
 
 				virtual system_tick_t millis() = 0;
+
+				/**
+				 * Persist the state of the transfer, an empty state clears it.
+				 * @return 0 on success
+				 */
+				virtual int save_transfer_state(const void *data, size_t length) = 0;
+
+				/**
+				 * Restore the state of the transfer to the given buffer.
+				 * @return the number of bytes restored, negative if there is none.
+				 */
+				virtual int restore_transfer_state(void *data, size_t max_length) = 0;
+
+				/**
+				 * Read the installed firmware, needed by delta updates.
+				 * @return the number of bytes read, negative on error.
+				 */
+				virtual int read_installed_firmware(uint32_t offset, uint8_t *buf, size_t length) = 0;
 			};
 
+			/**
+			 * UpdateBegin flag: the file is a delta patch, see DeltaPatch.
+			 */
+			static const uint8_t UPDATE_FLAG_DELTA = 0x02;
+
+			/**
+			 * UpdateBegin flag: the file is compressed, see Decompressor for the stream format. The file
+			 * length is the compressed length. Sent only to devices with the compressed OTA hello flag.
+			 */
+			static const uint8_t UPDATE_FLAG_COMPRESSED = 0x04;
+
 		private:
 			uint8_t updating;
 			system_tick_t last_chunk_millis;
@@ -83,12 +114,108 @@ namespace trackle
 			unsigned short chunk_size;
 
 			uint8_t *bitmap;
+			/**
+			 * Number of chunks flagged in the bitmap.
+			 */
+			unsigned received_chunks;
+			/**
+			 * All the chunks before this one are received, so scans for missing chunks start from here.
+			 */
+			unsigned first_missing;
 
 			Callbacks *callbacks;
 
 			bool fast_ota_override;
 			bool fast_ota_value;
 
+			/**
+			 * Persisted identity of the transfer, followed by the chunk bitmap.
+			 */
+			struct __attribute__((packed)) TransferState
+			{
+				uint32_t file_length;
+				uint32_t file_address;
+				uint16_t chunk_size;
+				uint8_t store;
+				uint8_t reserved;
+				uint32_t bitmap_crc;
+			};
+
+			/**
+			 * The chunks are sent without waiting for each ACK and tracked in the bitmap.
+			 */
+			bool fast_transfer;
+			/**
+			 * One past the highest chunk received.
+			 */
+			unsigned received_end;
+			/**
+			 * The missing chunks before this one have already been reported during the transfer.
+			 */
+			unsigned report_cursor;
+			/**
+			 * A missing chunk is reported once chunks this far after it have been received, 0 to disable.
+			 */
+			uint16_t report_distance;
+			/**
+			 * Time without chunks after which all the missing chunks are reported, 0 to disable.
+			 */
+			system_tick_t report_timeout;
+
+			/**
+			 * Chunks received between two saves of the transfer state, 0 to not persist it.
+			 */
+			uint16_t checkpoint_interval;
+			uint16_t chunks_since_checkpoint;
+			/**
+			 * The transfer state is persisted, only for fast OTA where the bitmap tracks the chunks.
+			 */
+			bool resumable;
+
+			/**
+			 * The file is a patch applied to the installed firmware and/or is compressed: the chunks are
+			 * received in order, decoded as they arrive and the stored image is described by target.
+			 */
+			bool delta_update;
+			bool compressed_update;
+			DeltaPatch delta;
+			Decompressor decompressor;
+			FileTransfer::Descriptor target;
+
+			bool decoded_update()
+			{
+				return delta_update || compressed_update;
+			}
+
+			bool decoding_failed()
+			{
+				return (compressed_update && decompressor.failed()) || (delta_update && delta.failed());
+			}
+
+			bool decoding_complete()
+			{
+				return (!compressed_update || decompressor.complete()) && (!delta_update || delta.complete());
+			}
+
+			FileTransfer::Descriptor &stored_file()
+			{
+				return decoded_update() ? target : file;
+			}
+
+			int save_chunk(const unsigned char *chunk);
+			/**
+			 * The bytes of the current chunk that belong to the file, without the padding of the last chunk.
+			 */
+			uint16_t chunk_data_length();
+			void abort_decoded_update();
+
+			virtual int begin_target(uint32_t length);
+			virtual int read_source(uint32_t offset, uint8_t *buf, size_t length);
+			virtual int write_target(uint32_t offset, const uint8_t *buf, size_t length);
+
+			virtual int begin_output(uint32_t length, size_t block_size);
+			virtual int write_output(uint32_t offset, const uint8_t *buf, size_t length);
+
 		protected:
 			unsigned chunk_bitmap_size()
 			{
@@ -103,7 +230,12 @@ namespace trackle
 			inline void flag_chunk_received(chunk_index_t idx)
 			{
 				//    serial_dump("flagged chunk %d", idx);
-				chunk_bitmap()[idx >> 3] |= uint8_t(1 << (idx & 7));
+				const uint8_t bit = uint8_t(1 << (idx & 7));
+				if (!(chunk_bitmap()[idx >> 3] & bit))
+				{
+					chunk_bitmap()[idx >> 3] |= bit;
+					received_chunks++;
+				}
 			}
 
 			inline bool is_chunk_received(chunk_index_t idx)
@@ -111,11 +243,22 @@ namespace trackle
 				return (chunk_bitmap()[idx >> 3] & uint8_t(1 << (idx & 7)));
 			}
 
+			/**
+			 * Reads up to 8 bytes of the bitmap as a word where bit n is chunk n, bytes past the end read as received.
+			 */
+			uint64_t chunk_bitmap_word(unsigned word);
+
 			chunk_index_t next_chunk_missing(chunk_index_t start);
 			void set_chunks_received(uint8_t value);
+			void count_chunks_received();
+
+			bool restore_transfer_state();
+			void save_transfer_state();
 
 		public:
-			ChunkedTransfer() : updating(false), callbacks(nullptr), fast_ota_override(false), fast_ota_value(true)
+			ChunkedTransfer() : updating(false), bitmap(nullptr), received_chunks(0), first_missing(0), callbacks(nullptr), fast_ota_override(false), fast_ota_value(true),
+								fast_transfer(false), received_end(0), report_cursor(0), report_distance(0), report_timeout(0),
+								checkpoint_interval(0), chunks_since_checkpoint(0), resumable(false), delta_update(false), compressed_update(false)
 			{
 			}
 
@@ -137,7 +280,7 @@ namespace trackle
 
 			ProtocolError handle_update_done(token_t token, Message &message, MessageChannel &channel);
 
-			ProtocolError send_missing_chunks(MessageChannel &channel, size_t count);
+			ProtocolError send_missing_chunks(MessageChannel &channel, size_t count, chunk_index_t start = 0, unsigned end = MAX_CHUNKS);
 
 			ProtocolError idle(MessageChannel &channel);
 
@@ -147,6 +290,27 @@ namespace trackle
 				fast_ota_override = true;
 			}
 
+			/**
+			 * Persist the received chunks every given number of chunks and when the transfer is interrupted,
+			 * so that an update of the same file resumes from them instead of writing them again. The cloud
+			 * still streams every chunk. 0 disables it.
+			 */
+			void set_checkpoint_interval(uint16_t chunks)
+			{
+				checkpoint_interval = chunks;
+			}
+
+			/**
+			 * Report the missing chunks of a fast OTA transfer while it's running: a gap is reported once the chunks
+			 * received are the given distance after it, and all the gaps are reported when no chunk is received for
+			 * the given time. 0 disables each of them.
+			 */
+			void set_missing_chunks_report(uint16_t distance, system_tick_t timeout)
+			{
+				report_distance = distance;
+				report_timeout = timeout;
+			}
+
 			bool is_updating()
 			{
 				return updating;
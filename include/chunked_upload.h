@@ -0,0 +1,197 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+  Copyright (c) 2015 Particle Industries, Inc.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+#pragma once
+
+#include "protocol_defs.h"
+#include "message_channel.h"
+#include "completion_handler.h"
+#include "coap.h"
+
+namespace trackle
+{
+	namespace protocol
+	{
+
+		/**
+		 * Sends a file from the device to the cloud, the reverse of ChunkedTransfer.
+		 *
+		 * UploadBegin (CON POST "U", payload: chunk size, file length and name) is acknowledged by the
+		 * cloud, then the chunks are sent as NON POST "C" with the index in a Uri-Query option. Every
+		 * half window a chunk is sent CON, and no more than two of them are pending, so the acknowledgements
+		 * pace the sender. When a checkpoint is not acknowledged the chunks of its window are sent again. The cloud reports the chunks it misses (GET "C", payload: 2 byte indices), while
+		 * the file is sent or after UploadDone (CON PUT "U", payload: CRC32 of the file), and once the file
+		 * is complete and its CRC verified it sends the result (PUT "U", payload: 0 on success).
+		 */
+		class ChunkedUpload
+		{
+		public:
+			struct Callbacks
+			{
+				virtual system_tick_t millis() = 0;
+
+				virtual void add_ack_handler(message_id_t msg_id, CompletionHandler handler) = 0;
+
+				/**
+				 * Reads the file.
+				 * @return the number of bytes read, < 0 on error.
+				 */
+				virtual int read_upload(uint32_t offset, uint8_t *buf, size_t length) = 0;
+
+				virtual void upload_complete(const char *name, int error) = 0;
+			};
+
+			static const uint16_t CHUNK_SIZE = 1024;
+			static const uint16_t DEFAULT_WINDOW = 32;
+			static const uint8_t MAX_NAME_LENGTH = 64;
+			/**
+			 * Time to wait for the result or for missing chunks after UploadDone.
+			 */
+			static const system_tick_t RESULT_TIMEOUT = 60000;
+			/**
+			 * Time the channel may refuse every message before the upload fails.
+			 */
+			static const system_tick_t SEND_TIMEOUT = 60000;
+
+		private:
+			enum State
+			{
+				IDLE,
+				BEGIN_SENT,
+				SENDING,
+				DONE_SENT
+			};
+
+			Callbacks *callbacks;
+			State state;
+			/**
+			 * Changed by each upload, so that acknowledgements of a previous one are ignored.
+			 */
+			uint8_t upload_id;
+
+			char name[MAX_NAME_LENGTH + 1];
+			uint32_t file_length;
+			chunk_index_t chunk_count;
+			uint16_t window;
+
+			/**
+			 * One bit per chunk, set while the chunk has to be sent.
+			 */
+			uint64_t *pending;
+			chunk_index_t cursor; // no chunks are pending before this one
+			chunk_index_t crc_next; // the CRC covers the chunks before this one
+			uint32_t crc;
+
+			/**
+			 * A CON chunk waiting for its acknowledgement.
+			 */
+			struct Checkpoint
+			{
+				ChunkedUpload *owner;
+				chunk_index_t first; // the chunks sent for the first time in its window
+				chunk_index_t end;
+				bool active;
+			};
+			static const uint8_t MAX_CHECKPOINTS = 2;
+
+			Checkpoint checkpoints[MAX_CHECKPOINTS];
+			chunk_index_t window_first; // the first chunk sent for the first time in the current window
+			uint16_t sent_since_checkpoint;
+			uint8_t checkpoints_pending;
+			system_tick_t done_millis;
+			bool send_failing;
+			system_tick_t send_failing_since;
+
+			static void begin_acked(int error, const void *data, void *callback_data, void *reserved);
+			static void checkpoint_acked(int error, const void *data, void *callback_data, void *reserved);
+			static void done_acked(int error, const void *data, void *callback_data, void *reserved);
+
+			bool is_current(const void *reserved) const
+			{
+				return state != IDLE && *(const uint8_t *)reserved == upload_id;
+			}
+
+			chunk_index_t next_pending(chunk_index_t from) const;
+			void set_pending(chunk_index_t index);
+
+			ProtocolError send_begin(MessageChannel &channel);
+			ProtocolError send_chunk(MessageChannel &channel, chunk_index_t index, bool checkpoint);
+			ProtocolError send_done(MessageChannel &channel);
+			void send_failed(ProtocolError error);
+			void complete(int error);
+
+		public:
+			ChunkedUpload() : callbacks(nullptr), state(IDLE), upload_id(0), file_length(0), chunk_count(0), window(DEFAULT_WINDOW),
+							  pending(nullptr), cursor(0), crc_next(0), crc(0), window_first(0), sent_since_checkpoint(0), checkpoints_pending(0),
+							  done_millis(0), send_failing(false), send_failing_since(0)
+			{
+				name[0] = 0;
+				for (uint8_t i = 0; i < MAX_CHECKPOINTS; i++)
+				{
+					checkpoints[i].owner = this;
+					checkpoints[i].active = false;
+				}
+			}
+
+			~ChunkedUpload()
+			{
+				delete[] pending;
+			}
+
+			void init(Callbacks *callbacks)
+			{
+				this->callbacks = callbacks;
+			}
+
+			/**
+			 * Starts the upload of a file, sent by idle().
+			 */
+			ProtocolError begin(MessageChannel &channel, const char *name, uint32_t length);
+
+			/**
+			 * Sends the pending chunks, as far as the window allows. A message refused by the channel
+			 * is sent again at the next call, the upload fails if the channel refuses them for SEND_TIMEOUT.
+			 */
+			ProtocolError idle(MessageChannel &channel);
+
+			ProtocolError handle_chunks_missed(Message &message, MessageChannel &channel);
+
+			ProtocolError handle_result(Message &message, MessageChannel &channel);
+
+			/**
+			 * Fails the upload in progress.
+			 */
+			void cancel();
+
+			bool is_uploading() const
+			{
+				return state != IDLE;
+			}
+
+			/**
+			 * The number of chunks sent before waiting for acknowledgements.
+			 */
+			void set_window(uint16_t chunks)
+			{
+				window = chunks ? chunks : DEFAULT_WINDOW;
+			}
+		};
+
+	}
+}
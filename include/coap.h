@@ -53,6 +53,8 @@ namespace trackle
 				PING,
 				ERROR, // 15
 				UPDATE_PROPERTY,
+				UPLOAD_CHUNKS_MISSED,
+				UPLOAD_RESULT,
 				NONE,
 			};
 		}
@@ -115,9 +117,14 @@ namespace trackle
 			enum Enum
 			{
 				NONE = 0,
+				ETAG = 4,
+				OBSERVE = 6,
 				LOCATION_PATH = 8,
 				URI_PATH = 11,
-				URI_QUERY = 15
+				MAX_AGE = 14,
+				URI_QUERY = 15,
+				BLOCK2 = 23,
+				BLOCK1 = 27
 			};
 		}
 
@@ -202,6 +209,62 @@ namespace trackle
 			static CoAPType::Enum type(const unsigned char *message);
 			static size_t option_decode(unsigned char **option);
 
+			/**
+			 * Decodes an option header, including any extended delta and length bytes.
+			 * On return option points to the option value and delta holds the option delta.
+			 * @return the length of the option value.
+			 */
+			static size_t option_decode(unsigned char **option, uint16_t *delta);
+
+			/**
+			 * Decodes an option value encoded as a variable length unsigned integer.
+			 */
+			static uint32_t option_uint_decode(const unsigned char *value, size_t length)
+			{
+				uint32_t result = 0;
+				while (length-- > 0)
+					result = (result << 8) | *value++;
+				return result;
+			}
+
+			/**
+			 * Encodes an unsigned integer option value using the minimum number of bytes.
+			 * @return the number of bytes written.
+			 */
+			static size_t option_uint_encode(uint8_t *buf, uint32_t value)
+			{
+				size_t length = 0;
+				for (uint32_t v = value; v; v >>= 8)
+					length++;
+				for (size_t i = length; i > 0; i--, value >>= 8)
+					buf[i - 1] = value & 0xFF;
+				return length;
+			}
+
+			/**
+			 * Value of a Block1 or Block2 option absent from a message.
+			 */
+			static const uint32_t NO_BLOCK = 0xFFFFFFFF;
+
+			/**
+			 * Encodes the value of a Block1 or Block2 option, block_size being a power of 2 between 16 and 1024.
+			 */
+			static uint32_t block_value(uint32_t num, bool more, size_t block_size)
+			{
+				uint8_t szx = 0;
+				while ((16u << szx) < block_size)
+					szx++;
+				return (num << 4) | (more ? 0x08 : 0) | szx;
+			}
+
+			/**
+			 * Decodes the block size of a Block1 or Block2 option value.
+			 */
+			static size_t block_size(uint32_t value)
+			{
+				return 16u << ((value & 0x07) < 6 ? (value & 0x07) : 6);
+			}
+
 			/**
 			 * Computes the length indicator for a value encoded in CoAP.
 			 * Values less than 13 are encoded directly. Values between 13 and 268 (inclusive) are encoded as 13 (and later as a single byte extended option)
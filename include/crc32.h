@@ -0,0 +1,44 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Calculate CRC-32 (Ethernet, ZIP, etc.), 8 bytes at a time
+ *
+ * @param crc The initial value of the CRC, or the CRC of the preceding data.
+ * @param buf The buffer to calculate the CRC32C for.
+ * @param len the length of the data to be crc'ed
+ *
+ * @return The CRC32 checksum of the data.
+ */
+uint32_t crc32c(uint32_t crc, const unsigned char *buf, uint32_t len);
+
+/**
+ * Combine the CRC-32 of two consecutive blocks of data
+ *
+ * @param crc1 The CRC32 of the first block.
+ * @param crc2 The CRC32 of the second block.
+ * @param len2 The length of the second block.
+ *
+ * @return The CRC32 checksum of the two blocks.
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint32_t len2);
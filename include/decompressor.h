@@ -0,0 +1,130 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace trackle
+{
+	namespace protocol
+	{
+		/**
+		 * Streaming decoder of heatshrink (LZSS) compressed files.
+		 *
+		 * Stream format, integers are big endian:
+		 *   header:  "THS1", uint8 window bits, uint8 lookahead bits,
+		 *            uint32 decompressed length, uint32 CRC-32 of the decompressed data
+		 *   data:    heatshrink bit stream, MSB first: 1 + 8 bit literal, or
+		 *            0 + window bits (distance - 1) + lookahead bits (length - 1) back reference
+		 *
+		 * The window, the only buffer, is allocated at the header and its size is limited by MAX_WINDOW_BITS.
+		 */
+		class Decompressor
+		{
+		public:
+			static const uint8_t MAX_WINDOW_BITS = 11;
+
+			struct Target
+			{
+				/**
+				 * The header has been read, the output is written in blocks of up to block_size bytes.
+				 * @return 0 on success
+				 */
+				virtual int begin_output(uint32_t length, size_t block_size) = 0;
+
+				/**
+				 * Write the next decompressed bytes.
+				 * @return 0 on success
+				 */
+				virtual int write_output(uint32_t offset, const uint8_t *buf, size_t length) = 0;
+			};
+
+		private:
+			enum State
+			{
+				HEADER,
+				TAG,
+				LITERAL,
+				INDEX,
+				COUNT,
+				DONE,
+				FAILED
+			};
+
+			Target *target;
+			State state;
+			uint8_t header[14];
+			uint8_t header_length;
+			uint8_t window_bits;
+			uint8_t lookahead_bits;
+			uint32_t length;
+			uint32_t expected_crc;
+			uint32_t crc;
+			uint8_t *window;
+			uint32_t position; // decompressed bytes
+			uint32_t flushed;  // decompressed bytes written to the target
+			uint32_t bit_buffer;
+			uint8_t bit_count;
+			uint16_t index;
+
+			bool parse_header();
+			bool get_bits(uint8_t count, uint16_t &value);
+			bool put(uint8_t byte);
+			bool flush();
+
+		public:
+			Decompressor() : target(nullptr), state(FAILED), window(nullptr)
+			{
+			}
+
+			~Decompressor()
+			{
+				end();
+			}
+
+			void begin(Target *target);
+
+			/**
+			 * Frees the window.
+			 */
+			void end();
+
+			/**
+			 * Decompress the next bytes of the stream.
+			 * @return 0 on success
+			 */
+			int apply(const uint8_t *data, size_t length);
+
+			/**
+			 * @return true if the whole output has been written and its CRC matches.
+			 */
+			bool complete() const
+			{
+				return state == DONE;
+			}
+
+			bool failed() const
+			{
+				return state == FAILED;
+			}
+		};
+	}
+}
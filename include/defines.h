@@ -43,13 +43,21 @@ typedef enum
 } Cloud_Connection_Error;
 
 typedef int(user_function_int_char_t)(const char *paramString, ...);
+typedef void(user_function_async_t)(const char *paramString, bool isOwner, uint32_t completionToken);
 
 typedef bool (*user_variable_bool_cb_t)(const char *paramString);
 typedef int (*user_variable_int32_cb_t)(const char *paramString);
 typedef double (*user_variable_double_cb_t)(const char *paramString);
 typedef const char *(*user_variable_char_cb_t)(const char *paramString);
+typedef size_t (*user_variable_reader_cb_t)(const char *paramString, size_t offset, char *buf, size_t length);
 
 typedef void (*EventHandler)(const char *name, const char *data);
+/**
+ * Receives the payload of an event one fragment at a time, as blocks arrive, without buffering it.
+ * An event sent in a single message is delivered as one fragment with last set.
+ */
+typedef void (*EventStreamHandler)(void *handler_data, const char *event_name, const char *fragment,
+                                   size_t length, size_t offset, bool last);
 
 typedef enum
 {
@@ -201,6 +209,22 @@ typedef enum
     SEND_URL = 2
 } Ota_Method;
 
+typedef enum
+{
+    EVENT_QUEUE_DROP_NEWEST = 0,    // the incoming event is discarded when it does not fit the queue
+    EVENT_QUEUE_DISPATCH_INLINE = 1 // the incoming event is dispatched synchronously when it does not fit the queue
+} Event_Queue_Policy;
+
+typedef struct
+{
+    uint32_t enqueued;          // events copied in the queue
+    uint32_t dispatched;        // events dispatched from the queue
+    uint32_t dropped;           // events discarded by EVENT_QUEUE_DROP_NEWEST or by a reconfiguration
+    uint32_t dispatched_inline; // events dispatched synchronously by EVENT_QUEUE_DISPATCH_INLINE
+    uint16_t depth;             // events currently pending
+    uint16_t high_watermark;    // maximum number of pending events seen
+} Event_Queue_Metrics;
+
 struct Chunk
 {
     uint32_t chunk_count;
@@ -209,6 +233,18 @@ struct Chunk
     uint32_t file_length;
 };
 
+/**
+ * Connection used by the OTA downloader for the SEND_URL method. The default one is
+ * a plain TCP socket, a TLS transport is needed for https URLs.
+ */
+typedef struct
+{
+    int (*connect)(const char *host, uint16_t port, bool secure, uint32_t timeout); // a handle >= 0, or < 0 on error
+    int (*send)(int handle, const unsigned char *buf, uint32_t length);             // bytes sent, or < 0 on error
+    int (*receive)(int handle, unsigned char *buf, uint32_t length);                // bytes received, 0 when closed, < 0 on error or timeout
+    void (*close)(int handle);
+} Http_Transport;
+
 // The size of the persisted data
 #define SessionPersistBaseSize 208
 #define SessionPersistVariableSize (sizeof(int) + sizeof(int) + sizeof(size_t))
@@ -235,6 +271,7 @@ typedef void(publishSendCallback)(const char *eventName, const char *data, uint3
 typedef void(prepareFirmwareUpdateCallback)(struct Chunk data, uint32_t flags, void *reserved);
 typedef void(firmwareChunkCallback)(struct Chunk data, const unsigned char *chunk, void *);
 typedef void(finishFirmwareUpdateCallback)(char *data, uint32_t fileSize);
+typedef int(readFirmwareCallback)(uint32_t offset, unsigned char *buf, uint32_t length);
 typedef int(otaUpdateCallback)(const char *url, uint32_t crc);
 typedef void(connectionStatusCallback)(Connection_Status_Type status);
 typedef int(updateStateCallback)(const char *function_key, const char *arg, ...);
@@ -247,5 +284,9 @@ typedef void(logCallback)(const char *msg, int level, const char *category, void
 typedef int(restoreSessionCallback)(void *buffer, size_t length, uint8_t type, void *reserved);
 typedef int(saveSessionCallback)(const void *buffer, size_t length, uint8_t type, void *reserved);
 typedef uint32_t(randomNumberCallback)(void);
+typedef void(eventQueueNotifyCallback)(void);
+typedef void(executorCallback)(void (*job)(void *arg), void *arg);
+typedef int(uploadReadCallback)(uint32_t offset, unsigned char *buf, uint32_t length);
+typedef void(uploadCompletionCallback)(const char *name, int error);
 
 #endif
@@ -0,0 +1,125 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace trackle
+{
+	namespace protocol
+	{
+		/**
+		 * Streaming applier of binary delta patches, in the bsdiff control/diff/extra model with the data
+		 * interleaved so that the patch can be applied while it's received, in order.
+		 *
+		 * Patch format, integers are big endian:
+		 *   header:  "TDP1", uint32 new image length, uint32 CRC-32 of the new image
+		 *   blocks:  uint32 diff length, uint32 extra length, int32 seek,
+		 *            diff bytes, added (mod 256) to the old image bytes at the current old position,
+		 *            extra bytes, copied as they are,
+		 *            then the old position moves by seek
+		 *
+		 * Only a block of the new image is held in memory, the old image is read as needed.
+		 */
+		class DeltaPatch
+		{
+		public:
+			static const size_t BLOCK_SIZE = 256;
+
+			struct Target
+			{
+				/**
+				 * The header has been read, the new image can be prepared.
+				 * @return 0 on success
+				 */
+				virtual int begin_target(uint32_t length) = 0;
+
+				/**
+				 * Read the installed image.
+				 * @return the number of bytes read.
+				 */
+				virtual int read_source(uint32_t offset, uint8_t *buf, size_t length) = 0;
+
+				/**
+				 * Write a block of the new image, blocks are BLOCK_SIZE long but the last one.
+				 * @return 0 on success
+				 */
+				virtual int write_target(uint32_t offset, const uint8_t *buf, size_t length) = 0;
+			};
+
+		private:
+			enum State
+			{
+				HEADER,
+				CONTROL,
+				DIFF,
+				EXTRA,
+				DONE,
+				FAILED
+			};
+
+			Target *target;
+			State state;
+			uint8_t control[12];
+			uint8_t control_length;
+			uint32_t new_length;
+			uint32_t new_crc;
+			uint32_t crc;
+			uint32_t new_position;
+			uint32_t old_position;
+			uint32_t diff_length;
+			uint32_t extra_length;
+			int32_t seek;
+			uint8_t block[BLOCK_SIZE];
+			size_t block_length;
+
+			bool parse_control();
+			bool emit(const uint8_t *data, size_t length);
+			size_t apply_diff(const uint8_t *data, size_t length);
+
+		public:
+			DeltaPatch() : target(nullptr), state(FAILED)
+			{
+			}
+
+			void begin(Target *target);
+
+			/**
+			 * Apply the next bytes of the patch.
+			 * @return 0 on success
+			 */
+			int apply(const uint8_t *data, size_t length);
+
+			/**
+			 * @return true if the whole new image has been written and its CRC matches.
+			 */
+			bool complete() const
+			{
+				return state == DONE && crc == new_crc;
+			}
+
+			bool failed() const
+			{
+				return state == FAILED;
+			}
+		};
+	}
+}
@@ -94,6 +94,8 @@ namespace trackle
 
 			Callbacks callbacks;
 			uint32_t keys_checksum;
+			uint64_t saved_rseq_limit;
+			uint64_t saved_cseq_limit;
 			uint32_t handshake_timeout;
 
 			dtls_context_t *dtls_context = NULL;
@@ -124,8 +126,27 @@ namespace trackle
 
 			void cancel_move_session();
 
+			/**
+			 * True when the cloud gave a connection ID (RFC 9146) for the records of this session,
+			 * so address changes need no move-session records.
+			 */
+			bool has_connection_id();
+
 			void reset_session();
 
+			/**
+			 * Persists the security parameters of the connected peer with the save callback.
+			 */
+			void save_session();
+
+			/**
+			 * Rebuilds the peer from the session persisted by save_session().
+			 * Returns true when the session can be used without a new handshake.
+			 */
+			bool restore_session();
+
+			void discard_saved_session();
+
 			enum StateEnum
 			{
 				INIT,
@@ -135,7 +156,7 @@ namespace trackle
 			enum StateEnum status;
 
 		public:
-			DTLSMessageChannel() : coap_state(nullptr), move_session(false) {}
+			DTLSMessageChannel() : keys_checksum(0), saved_rseq_limit(0), saved_cseq_limit(0), coap_state(nullptr), move_session(false) {}
 
 			ProtocolError init(const uint8_t *core_private, size_t core_private_len,
 							   // const uint8_t *core_public, size_t core_public_len,
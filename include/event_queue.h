@@ -0,0 +1,108 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "events.h"
+#include <atomic>
+
+namespace trackle
+{
+	/**
+	 * Bounded single-producer/single-consumer queue of inbound events.
+	 *
+	 * The protocol loop pushes matched events, copying name and payload into a slab
+	 * allocated once by configure(); a user-chosen executor or worker thread drains
+	 * the queue and runs the handlers, so slow handlers don't delay the protocol.
+	 */
+	class EventQueue
+	{
+	private:
+		struct Slot
+		{
+			EventHandler handler;
+			void *handler_data;
+			uint16_t name_length;
+			uint16_t data_length;
+			bool has_data;
+			// followed by name, '\0', data, '\0'
+		};
+
+		uint8_t *slab;
+		size_t slot_size;
+		uint16_t capacity;
+		uint16_t max_event_length;
+		Event_Queue_Policy policy;
+
+		// monotonic counters, the slot in use is counter % capacity
+		std::atomic<uint32_t> head; // written by the consumer only
+		std::atomic<uint32_t> tail; // written by the producer only
+
+		std::atomic<uint32_t> enqueued;
+		std::atomic<uint32_t> dispatched;
+		std::atomic<uint32_t> dropped;
+		std::atomic<uint32_t> dispatched_inline;
+		std::atomic<uint16_t> high_watermark;
+
+		Slot *slot(uint32_t index) const
+		{
+			return (Slot *)(slab + (index % capacity) * slot_size);
+		}
+
+	public:
+		EventQueue();
+		~EventQueue();
+
+		/**
+		 * Allocates the slab for the given number of events. A capacity of 0 frees it and
+		 * restores synchronous dispatch. Pending events are discarded, so this must not run
+		 * while the queue is being drained.
+		 *
+		 * @param capacity Number of events that can be pending.
+		 * @param max_event_length Maximum size of event name and data together.
+		 * @param policy What to do with an event that does not fit.
+		 * @return false if the slab could not be allocated.
+		 */
+		bool configure(uint16_t capacity, uint16_t max_event_length, Event_Queue_Policy policy);
+
+		bool enabled() const
+		{
+			return slab != nullptr;
+		}
+
+		/**
+		 * Called from the protocol loop. Copies the event in the next free slot, or applies
+		 * the drop policy when the queue is full or the event is too long.
+		 *
+		 * @return true if the event has been queued.
+		 */
+		bool push(const FilteringEventHandler &handler, const char *event_name, const char *data);
+
+		/**
+		 * Called from the executor. Runs the handlers of up to max_events pending events,
+		 * or of all of them when max_events is 0.
+		 *
+		 * @return The number of dispatched events.
+		 */
+		int drain(int max_events);
+
+		void get_metrics(Event_Queue_Metrics *metrics) const;
+	};
+}
@@ -79,6 +79,15 @@ namespace SubscriptionScope
 typedef void (*EventHandler)(const char *event_name, const char *data);
 typedef void (*EventHandlerWithData)(void *handler_data, const char *event_name, const char *data);
 
+namespace EventHandlerFlags
+{
+  enum Enum
+  {
+    NONE = 0,
+    STREAM = 0x01, // handler is an EventStreamHandler, declared in defines.h
+  };
+}
+
 /**
  *  This is used in a callback so only change by adding fields to the end
  */
@@ -89,8 +98,28 @@ struct FilteringEventHandler
   void *handler_data;
   SubscriptionScope::Enum scope;
   char device_id[13];
+  uint8_t flags; // EventHandlerFlags
 };
 
+/**
+ * Calls a subscription handler, passing handler_data first when it was registered with one.
+ */
+inline void invoke_event_handler(EventHandler handler, void *handler_data, const char *event_name, const char *data)
+{
+  if (handler_data)
+  {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+    EventHandlerWithData handler_with_data = (EventHandlerWithData)handler;
+#pragma GCC diagnostic pop
+    handler_with_data(handler_data, event_name, data);
+  }
+  else
+  {
+    handler(event_name, data);
+  }
+}
+
 size_t subscription(uint8_t buf[], uint16_t message_id,
                     const char *event_name, const char *device_id);
 
@@ -0,0 +1,139 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include "defines.h"
+#include <stddef.h>
+#include <string>
+#include <atomic>
+#include <mutex>
+
+namespace trackle
+{
+	/**
+	 * Downloads the firmware of a SEND_URL update with HTTP/1.1.
+	 *
+	 * The image is split in ranges fetched by parallel connections with Range requests,
+	 * each one running as a job of the executor. Every range is written to the sink in
+	 * blocks as it's received and, when a connection fails or stalls, it's requested
+	 * again from the last block written. The CRC of the image is combined from the CRCs
+	 * of the ranges and checked before the sink is closed.
+	 */
+	class HttpDownloader
+	{
+	public:
+		/**
+		 * Receives the image. The writes of different ranges don't overlap and are serialized.
+		 */
+		class Sink
+		{
+		public:
+			virtual ~Sink() {}
+			virtual int begin(uint32_t length, uint16_t block_size) = 0;
+			virtual int write(uint32_t offset, const unsigned char *buf, uint32_t length) = 0;
+			virtual void end(bool success) = 0;
+		};
+
+		enum Error
+		{
+			NONE = 0,
+			BAD_URL = -1,
+			CONNECTION = -2,
+			HTTP_STATUS = -3,
+			SINK = -4,
+			CRC_MISMATCH = -5,
+			BUSY = -6
+		};
+
+		static const uint8_t MAX_CONNECTIONS = 8;
+		static const uint16_t BLOCK_SIZE = 1024;
+		static const uint8_t MAX_RETRIES = 5;		// consecutive failures of a range without progress
+		static const uint32_t STALL_TIMEOUT = 5000; // milliseconds without data before a connection is retried
+
+	private:
+		struct Range
+		{
+			HttpDownloader *owner;
+			uint32_t start;
+			uint32_t offset; // next byte to write
+			uint32_t end;	 // exclusive
+			uint32_t crc;	 // of the bytes written
+		};
+
+		const Http_Transport *transport;
+		executorCallback *executor;
+		Sink *sink;
+
+		std::string host;
+		std::string path;
+		uint16_t port;
+		bool secure;
+		uint32_t expected_crc;
+		uint32_t file_length;
+
+		uint8_t connections;
+		Range ranges[MAX_CONNECTIONS];
+		std::mutex sink_lock;
+		std::atomic<uint8_t> active;
+		std::atomic<bool> failed;
+		std::atomic<int> error;
+		std::atomic<bool> running;
+		std::atomic<bool> done;
+
+		static void probe_job(void *arg);
+		static void range_job(void *arg);
+
+		bool parse_url(const char *url);
+		int open_request(uint32_t first, uint32_t last, bool &partial, uint32_t &range_start, uint32_t &total, unsigned char *body, uint32_t &body_length);
+		int download_range(Range &range);
+		void finish_range(int result);
+
+	public:
+		HttpDownloader();
+
+		/**
+		 * The transport of plain TCP sockets, NULL when the platform has none.
+		 */
+		static const Http_Transport *default_transport();
+
+		/**
+		 * Starts the download on the executor.
+		 *
+		 * @param url The http or https URL of the image.
+		 * @param crc The CRC32 of the image, 0 to not check it.
+		 * @param connections The number of parallel range requests.
+		 * @return NONE if the download started.
+		 */
+		int start(const char *url, uint32_t crc, executorCallback *executor, uint8_t connections, const Http_Transport *transport, Sink *sink);
+
+		bool is_running() const
+		{
+			return running;
+		}
+
+		/**
+		 * Called from the protocol loop once the download is over.
+		 *
+		 * @param result The error of the download, NONE on success.
+		 * @return true once, when the download has finished.
+		 */
+		bool poll(int &result);
+	};
+}
@@ -0,0 +1,103 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace trackle
+{
+	/**
+	 * Open-addressing hash index over the keys of an append-only registry, such as the
+	 * cloud variables and functions. Slots hold the position of an entry in the registry
+	 * plus one, 0 marks a free slot. The table is kept at most half full, so a lookup
+	 * takes a small constant number of probes however many entries are registered.
+	 */
+	class KeyIndex
+	{
+	private:
+		std::vector<uint16_t> slots;
+		size_t max_key_length;
+		size_t count;
+
+		uint32_t hash(const char *key) const
+		{
+			// FNV-1a
+			uint32_t h = 2166136261u;
+			for (size_t i = 0; i < max_key_length && key[i]; i++)
+			{
+				h ^= (uint8_t)key[i];
+				h *= 16777619u;
+			}
+			return h;
+		}
+
+		void place(const char *key, uint16_t position)
+		{
+			const size_t mask = slots.size() - 1;
+			size_t i = hash(key) & mask;
+			while (slots[i])
+				i = (i + 1) & mask;
+			slots[i] = position + 1;
+		}
+
+	public:
+		explicit KeyIndex(size_t max_key_length) : max_key_length(max_key_length), count(0) {}
+
+		/**
+		 * Finds the position of the entry with the given key.
+		 * @param key_at returns the key of the entry at a given position.
+		 * @return the position, or -1 if there is no such entry.
+		 */
+		template <typename F>
+		int find(const char *key, F key_at) const
+		{
+			if (!key || slots.empty())
+				return -1;
+
+			const size_t mask = slots.size() - 1;
+			for (size_t i = hash(key) & mask; slots[i]; i = (i + 1) & mask)
+			{
+				const uint16_t position = slots[i] - 1;
+				if (!strncmp(key_at(position), key, max_key_length))
+					return position;
+			}
+			return -1;
+		}
+
+		/**
+		 * Indexes the entry just appended to the registry at the given position.
+		 * @param key_at returns the key of the entry at a given position, used to rehash when the table grows.
+		 */
+		template <typename F>
+		void add(const char *key, uint16_t position, F key_at)
+		{
+			if ((count + 1) * 2 > slots.size())
+			{
+				slots.assign(slots.empty() ? 16 : slots.size() * 2, 0);
+				for (uint16_t p = 0; p < count; p++)
+					place(key_at(p), p);
+			}
+			place(key, position);
+			count++;
+		}
+	};
+}
@@ -25,6 +25,7 @@
 #include "protocol_defs.h"
 #include "ping.h"
 #include "chunked_transfer.h"
+#include "chunked_upload.h"
 #include "trackle_descriptor.h"
 #include "trackle_protocol_functions.h"
 #include "functions.h"
@@ -109,8 +110,48 @@ namespace trackle
 
 				virtual system_tick_t millis();
 
+				virtual int save_transfer_state(const void *data, size_t length);
+
+				virtual int restore_transfer_state(void *data, size_t max_length);
+
+				virtual int read_installed_firmware(uint32_t offset, uint8_t *buf, size_t length);
+
 			} chunkedTransferCallbacks;
 
+			/**
+			 * Manages the upload of files to the cloud.
+			 */
+			ChunkedUpload chunkedUpload;
+			class ChunkedUploadCallbacks : public ChunkedUpload::Callbacks
+			{
+				Protocol *protocol;
+				uploadReadCallback *read;
+				uploadCompletionCallback *completion;
+
+			public:
+				void init(Protocol *protocol)
+				{
+					this->protocol = protocol;
+					read = nullptr;
+					completion = nullptr;
+				}
+
+				void set_file(uploadReadCallback *read, uploadCompletionCallback *completion)
+				{
+					this->read = read;
+					this->completion = completion;
+				}
+
+				virtual system_tick_t millis();
+
+				virtual void add_ack_handler(message_id_t msg_id, CompletionHandler handler);
+
+				virtual int read_upload(uint32_t offset, uint8_t *buf, size_t length);
+
+				virtual void upload_complete(const char *name, int error);
+
+			} chunkedUploadCallbacks;
+
 			/**
 			 * Manages device-hosted variables.
 			 */
@@ -136,6 +177,14 @@ namespace trackle
 			 */
 			Publisher publisher;
 
+			/**
+			 * The application part of the describe message, serialized when the functions and variables
+			 * change, as tracked by the DESCRIBE_APP checksum.
+			 */
+			std::vector<uint8_t> app_description;
+			uint32_t app_description_crc = 0;
+			bool app_description_cached = false;
+
 			/**
 			 * Manages time sync requests
 			 */
@@ -154,6 +203,11 @@ namespace trackle
 
 			uint8_t initialized;
 
+			/**
+			 * Advertise in the hello that compressed updates can be received, see set_compressed_ota().
+			 */
+			bool compressed_ota;
+
 			// uint8_t flags;
 
 		public:
@@ -260,7 +314,16 @@ namespace trackle
 				}
 				else
 				{
-					ProtocolError error = pinger.process(
+					ProtocolError error = variables.process_observers(channel, descriptor, callbacks.millis());
+					if (error)
+						return error;
+					if (chunkedUpload.is_uploading())
+					{
+						error = chunkedUpload.idle(channel);
+						if (error)
+							return error;
+					}
+					error = pinger.process(
 						callbacks.millis() - last_message_millis, [this]
 						{
 							// ping is not ackable, so reset last msg millis to now
@@ -280,27 +343,47 @@ namespace trackle
 			/**
 			 * @brief Generates and sends describe message
 			 *
+			 * A describe message larger than the message buffer is sent in blocks: posted with Block1, each block
+			 * being sent when the cloud acknowledges the previous one, or returned with Block2 as the cloud requests
+			 * them. Each block is generated again, skipping the content before it, so the whole describe message
+			 * is never held in memory.
+			 *
 			 * @param channel The message channel used to send the message
 			 * @param message The message buffer used to store the message
-			 * @param header_size The offset at which to place the message payload
+			 * @param post true to post the describe message, false to send it as the response to a request
+			 * @param token The token of the request
+			 * @param msg_id The message id of the request
 			 * @param desc_flags The information description flags
 			 * @arg \p DESCRIBE_APPLICATION
 			 * @arg \p DESCRIBE_METRICS
 			 * @arg \p DESCRIBE_SYSTEM
+			 * @param block The Block1 or Block2 option value of the block to send, CoAP::NO_BLOCK for the whole message
 			 *
 			 * @returns \s ProtocolError result value
 			 * @retval \p trackle::protocol::NO_ERROR
 			 *
 			 * @sa trackle::protocol::ProtocolError
 			 */
-			ProtocolError generate_and_send_description(MessageChannel &channel, Message &message,
-														size_t header_size, int desc_flags);
+			ProtocolError generate_and_send_description(MessageChannel &channel, Message &message, bool post, token_t token,
+														message_id_t msg_id, int desc_flags, uint32_t block = CoAP::NO_BLOCK);
 
 			/**
 			 * Produces and transmits (PIGGYBACK) a describe message.
 			 * @param desc_flags Flags describing the information to provide. A combination of {@code DESCRIBE_APPLICATION) and {@code DESCRIBE_SYSTEM) flags.
+			 * @param block2 The Block2 option value of the request, CoAP::NO_BLOCK if none.
 			 */
-			ProtocolError send_description(token_t token, message_id_t msg_id, int desc_flags);
+			ProtocolError send_description(token_t token, message_id_t msg_id, int desc_flags, uint32_t block2 = CoAP::NO_BLOCK);
+
+			/**
+			 * A describe message being posted in Block1 blocks.
+			 */
+			struct DescriptionPost
+			{
+				bool active;
+				int desc_flags;
+				uint32_t next_block; // Block1 option value of the next block
+				message_id_t msg_id; // id of the block waiting for 2.31 Continue
+			} description_post = {};
 
 			/**
 			 * Decodes and dispatches a received message to its handler.
@@ -343,7 +426,8 @@ namespace trackle
 												product_firmware_version(PRODUCT_FIRMWARE_VERSION),
 												publisher(this),
 												last_ack_handlers_update(0),
-												initialized(false)
+												initialized(false),
+												compressed_ota(false)
 			{
 			}
 
@@ -368,6 +452,40 @@ namespace trackle
 				chunkedTransfer.set_fast_ota(data);
 			}
 
+			/**
+			 * The cloud sends compressed updates only to devices that advertise them in the hello, off by default
+			 * since the decompression window is allocated during the update.
+			 */
+			void set_compressed_ota(bool enabled)
+			{
+				compressed_ota = enabled;
+			}
+
+			void set_ota_checkpoint_interval(uint16_t chunks)
+			{
+				chunkedTransfer.set_checkpoint_interval(chunks);
+			}
+
+			void set_ota_missing_chunks_report(uint16_t distance, system_tick_t timeout)
+			{
+				chunkedTransfer.set_missing_chunks_report(distance, timeout);
+			}
+
+			ProtocolError begin_upload(const char *name, uint32_t length, uploadReadCallback *read, uploadCompletionCallback *completion)
+			{
+				if (chunkedUpload.is_uploading())
+				{
+					return INVALID_STATE;
+				}
+				chunkedUploadCallbacks.set_file(read, completion);
+				return chunkedUpload.begin(channel, name, length);
+			}
+
+			void set_upload_window(uint16_t chunks)
+			{
+				chunkedUpload.set_window(chunks);
+			}
+
 			void set_handlers(CommunicationsHandlers &handlers)
 			{
 				copy_and_init(&this->handlers, sizeof(this->handlers), &handlers, handlers.size);
@@ -471,6 +589,20 @@ namespace trackle
 
 			void build_describe_message(Appender &appender, int desc_flags);
 
+			/**
+			 * Appends the functions and variables to the describe message, from the cached serialization when
+			 * the application state did not change.
+			 */
+			void append_app_description(Appender &appender);
+
+			static void serialize_app_description(Appender &appender, const TrackleDescriptor &descriptor);
+
+			/**
+			 * Returns the describe flags to post after the handshake, without the parts whose checksum matches
+			 * the one persisted when they were last sent.
+			 */
+			int changed_description_flags();
+
 			inline bool add_event_handler(const char *event_name, EventHandler handler)
 			{
 				return add_event_handler(event_name, handler, NULL,
@@ -479,9 +611,9 @@ namespace trackle
 
 			inline bool add_event_handler(const char *event_name, EventHandler handler,
 										  void *handler_data, SubscriptionScope::Enum scope,
-										  const char *device_id)
+										  const char *device_id, uint8_t flags = EventHandlerFlags::NONE)
 			{
-				return !subscriptions.add_event_handler(event_name, handler, handler_data, scope, device_id);
+				return !subscriptions.add_event_handler(event_name, handler, handler_data, scope, device_id, flags);
 			}
 
 			inline bool send_subscriptions()
@@ -492,6 +624,16 @@ namespace trackle
 				return success;
 			}
 
+			inline void notify_variable_changed(const char *variable_key)
+			{
+				variables.notify_changed(variable_key);
+			}
+
+			inline void set_variable_observe_intervals(system_tick_t min_interval, system_tick_t max_interval)
+			{
+				variables.set_observe_intervals(min_interval, max_interval);
+			}
+
 			inline bool remove_event_handlers(const char *name)
 			{
 				subscriptions.remove_event_handlers(name);
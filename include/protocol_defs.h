@@ -25,7 +25,33 @@ namespace trackle
 #define PRODUCT_FIRMWARE_VERSION (0xffff)
 #endif
 
-#define MAX_SUBSCRIPTIONS (6) // 2 system and 4 application
+// Subscriptions are stored in a growable table indexed by a prefix trie,
+// this only bounds the memory an application can allocate for them.
+#ifndef MAX_SUBSCRIPTIONS
+#define MAX_SUBSCRIPTIONS (512) // 2 system, the rest application
+#endif
+
+#ifndef MAX_BLOCK2_SIZE
+#define MAX_BLOCK2_SIZE 1024 // largest block of a variable value sent with Block2, a power of 2 between 16 and 1024
+#endif
+
+#ifndef MAX_VARIABLE_OBSERVERS
+#define MAX_VARIABLE_OBSERVERS (16) // variables the cloud can observe at the same time
+#endif
+
+#ifndef MAX_VARIABLE_NOTIFICATIONS
+#define MAX_VARIABLE_NOTIFICATIONS (4) // notifications of observed variables sent in a single idle pass
+#endif
+
+// Largest inbound event payload reassembled from Block1 transfers, and
+// how many of these transfers can be in progress at the same time.
+#ifndef MAX_INBOUND_EVENT_SIZE
+#define MAX_INBOUND_EVENT_SIZE (4096)
+#endif
+
+#ifndef MAX_EVENT_REASSEMBLIES
+#define MAX_EVENT_REASSEMBLIES (2)
+#endif
 
         enum ProtocolError
         {
@@ -73,7 +99,7 @@ namespace trackle
         // is system event if start with trackle but not equal to trackle/p
         inline bool is_system(const char *event_name)
         {
-            return !strncmp(event_name, "iotready", 8) || (!strncmp(event_name, "trackle", 7) && strcmp(event_name, "trackle/p") && strcmp(event_name, "trackle/device/update/status"));
+            return !strncmp(event_name, "iotready", 8) || (!strncmp(event_name, "trackle", 7) && strcmp(event_name, "trackle/p") && strcmp(event_name, "trackle/p/d") && strcmp(event_name, "trackle/device/update/status"));
         }
 
         typedef uint16_t chunk_index_t;
@@ -93,8 +119,8 @@ namespace trackle
         const size_t MAX_VARIABLE_ARG_LENGTH = 1024;
         const size_t MAX_COMPONENTS_LIST_LENGTH = 160;
         const size_t MAX_VARIABLE_VALUE_LENGTH = 1024;
-        const size_t MAX_FUNCTION_COUNT = 20;
-        const size_t MAX_VARIABLE_COUNT = 20;
+        const size_t MAX_FUNCTION_COUNT = 256;
+        const size_t MAX_VARIABLE_COUNT = 256;
 
         // Timeout in milliseconds given to receive an acknowledgement for a published event
         const unsigned SEND_EVENT_ACK_TIMEOUT = 30000; // MAX_TRANSMIT_WAIT - max_rand (15*1000)
@@ -153,6 +179,16 @@ namespace trackle
             };
         }
 
+        namespace PrepareFlag
+        {
+            enum Enum
+            {
+                DRY_RUN = 0x01,
+                RESUME = 0x02, // the chunks stored by the interrupted transfer of the same file are kept, an error starts over
+                DELTA = 0x04   // the file is a delta patch applied to the installed firmware
+            };
+        }
+
         typedef uint32_t keepalive_source_t;
 
         typedef struct
@@ -20,6 +20,10 @@
 
 #pragma once
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 namespace trackle
 {
 	namespace protocol
@@ -36,7 +40,248 @@ namespace trackle
 			typedef uint32_t (*calculate_crc_fn)(const unsigned char *buf, uint32_t buflen);
 
 		private:
-			FilteringEventHandler event_handlers[MAX_SUBSCRIPTIONS];
+			/**
+			 * A node of the prefix trie built over the subscription filters.
+			 * Node 0 is the root (the empty filter), so 0 is also used as the
+			 * "no node" marker for child and sibling links.
+			 */
+			struct FilterNode
+			{
+				char c;
+				uint32_t child;
+				uint32_t sibling;
+				std::vector<uint16_t> handlers; // indexes in event_handlers of the filters ending here
+			};
+
+			// handlers, in registration order
+			std::vector<FilteringEventHandler> event_handlers;
+			std::vector<FilterNode> filter_nodes;
+			// scratch list reused by handle_event to avoid an allocation per event
+			std::vector<uint16_t> matched_handlers;
+			// set while handle_event calls the handlers: matched_handlers holds indexes into
+			// event_handlers, so removals are deferred until the dispatch is over
+			bool dispatching;
+			bool removals_pending;
+
+			/**
+			 * An inbound event being received in blocks. The payload keeps its capacity
+			 * once the transfer is over, so the pool is allocated once.
+			 */
+			struct EventReassembly
+			{
+				std::string event_name; // empty when the slot is free
+				std::vector<char> payload;
+				uint32_t started; // order in which transfers started, to evict the oldest
+			};
+
+			EventReassembly reassemblies[MAX_EVENT_REASSEMBLIES];
+			uint32_t reassembly_sequence;
+
+			static size_t filter_length(const FilteringEventHandler &handler)
+			{
+				return strnlen(handler.filter, sizeof(handler.filter));
+			}
+
+			uint32_t find_child(uint32_t node, char c) const
+			{
+				for (uint32_t child = filter_nodes[node].child; child; child = filter_nodes[child].sibling)
+				{
+					if (filter_nodes[child].c == c)
+						return child;
+				}
+				return 0;
+			}
+
+			uint32_t find_or_add_child(uint32_t node, char c)
+			{
+				uint32_t child = find_child(node, c);
+				if (!child)
+				{
+					FilterNode added;
+					added.c = c;
+					added.child = 0;
+					added.sibling = filter_nodes[node].child;
+					child = filter_nodes.size();
+					filter_nodes.push_back(added);
+					filter_nodes[node].child = child;
+				}
+				return child;
+			}
+
+			/**
+			 * Returns the node reached by the given filter, or -1 if the filter is not in the trie.
+			 */
+			int32_t find_node(const char *filter, size_t length) const
+			{
+				uint32_t node = 0;
+				for (size_t i = 0; i < length; i++)
+				{
+					node = find_child(node, filter[i]);
+					if (!node)
+						return -1;
+				}
+				return node;
+			}
+
+			void index_handler(uint16_t index)
+			{
+				const FilteringEventHandler &handler = event_handlers[index];
+				const size_t length = filter_length(handler);
+				uint32_t node = 0;
+				for (size_t i = 0; i < length; i++)
+					node = find_or_add_child(node, handler.filter[i]);
+				filter_nodes[node].handlers.push_back(index);
+			}
+
+			/**
+			 * Erases the handlers removed during a dispatch and reindexes the remaining ones.
+			 */
+			void purge_removed_handlers()
+			{
+				removals_pending = false;
+				event_handlers.erase(std::remove_if(event_handlers.begin(), event_handlers.end(),
+													[](const FilteringEventHandler &handler)
+													{ return !handler.handler; }),
+									 event_handlers.end());
+				rebuild_index();
+			}
+
+			void rebuild_index()
+			{
+				filter_nodes.clear();
+				FilterNode root;
+				root.c = 0;
+				root.child = 0;
+				root.sibling = 0;
+				filter_nodes.push_back(root);
+				for (size_t i = 0; i < event_handlers.size(); i++)
+					index_handler(i);
+			}
+
+			static void dispatch_event(FilteringEventHandler &handler, const char *event_name, const char *data,
+									   void (*call_event_handler)(uint16_t size,
+																  FilteringEventHandler *handler, const char *event,
+																  const char *data, void *reserved))
+			{
+				// don't call the handler directly, use a callback for it.
+				if (!call_event_handler)
+				{
+					invoke_event_handler(handler.handler, handler.handler_data, event_name, data);
+				}
+				else
+				{
+					call_event_handler(sizeof(FilteringEventHandler), &handler, event_name, data, NULL);
+				}
+			}
+
+			/**
+			 * Collects, in registration order, the handlers whose filter is a prefix of the event name.
+			 */
+			void match_handlers(const char *event_name, size_t event_name_length)
+			{
+				// walk the trie along the event name: every node on the path ends a filter
+				// that is a prefix of the event name.
+				matched_handlers.clear();
+				uint32_t node = 0;
+				size_t i = 0;
+				for (;;)
+				{
+					const std::vector<uint16_t> &ending = filter_nodes[node].handlers;
+					matched_handlers.insert(matched_handlers.end(), ending.begin(), ending.end());
+					if (i == event_name_length)
+						break;
+					node = find_child(node, event_name[i++]);
+					if (!node)
+						break;
+				}
+
+				// handlers are called in registration order, as with the previous linear scan
+				if (matched_handlers.size() > 1)
+					std::sort(matched_handlers.begin(), matched_handlers.end());
+			}
+
+			/**
+			 * Determines if any matched handler needs the whole payload of the event.
+			 */
+			bool has_buffered_handlers() const
+			{
+				for (size_t m = 0; m < matched_handlers.size(); m++)
+				{
+					if (!(event_handlers[matched_handlers[m]].flags & EventHandlerFlags::STREAM))
+						return true;
+				}
+				return false;
+			}
+
+			EventReassembly *find_reassembly(const std::string &event_name)
+			{
+				for (size_t i = 0; i < MAX_EVENT_REASSEMBLIES; i++)
+				{
+					if (!reassemblies[i].event_name.empty() && reassemblies[i].event_name == event_name)
+						return &reassemblies[i];
+				}
+				return nullptr;
+			}
+
+			/**
+			 * Takes the slot for a transfer starting with block 0. A transfer of the same event is restarted,
+			 * otherwise a free slot is used or, when all are busy, the transfer started first is evicted.
+			 */
+			EventReassembly *start_reassembly(const std::string &event_name)
+			{
+				EventReassembly *slot = find_reassembly(event_name);
+				for (size_t i = 0; !slot && i < MAX_EVENT_REASSEMBLIES; i++)
+				{
+					if (reassemblies[i].event_name.empty())
+						slot = &reassemblies[i];
+				}
+				if (!slot)
+				{
+					slot = &reassemblies[0];
+					for (size_t i = 1; i < MAX_EVENT_REASSEMBLIES; i++)
+					{
+						if (reassemblies[i].started < slot->started)
+							slot = &reassemblies[i];
+					}
+				}
+				slot->event_name = event_name;
+				slot->payload.clear();
+				slot->payload.reserve(MAX_INBOUND_EVENT_SIZE + 1);
+				slot->started = ++reassembly_sequence;
+				return slot;
+			}
+
+			/**
+			 * Acknowledges an event. Blocks are acknowledged with a piggybacked response echoing the Block1 option,
+			 * other events with an empty ACK.
+			 */
+			ProtocolError send_event_ack(MessageChannel &channel, Message &message, CoAPCode::Enum code, bool block, uint32_t block_value)
+			{
+				Message response;
+				if (channel.response(message, response, 16) != NO_ERROR)
+					return NO_ERROR;
+
+				uint8_t *buf = response.buf();
+				size_t len;
+				if (code == CoAPCode::EMPTY)
+				{
+					len = Messages::empty_ack(buf, 0, 0);
+				}
+				else
+				{
+					const uint8_t *request = message.buf();
+					len = CoAP::header(buf, CoAPType::ACK, code, request[0] & 0xF, request + 4);
+					if (block)
+					{
+						uint8_t value[3];
+						size_t value_len = CoAP::option_uint_encode(value, block_value);
+						len += CoAP::add_option(buf + len, CoAPOption::NONE, CoAPOption::BLOCK1, value, value_len);
+					}
+				}
+				response.set_length(len);
+				response.set_id(message.get_id());
+				return channel.send(response);
+			}
 
 		protected:
 			ProtocolError send_subscription(MessageChannel &channel, const char *filter, const char *device_id, SubscriptionScope::Enum scope)
@@ -59,9 +304,11 @@ namespace trackle
 			}
 
 		public:
-			Subscriptions()
+			Subscriptions() : dispatching(false), removals_pending(false), reassembly_sequence(0)
 			{
-				memset(&event_handlers, 0, sizeof(event_handlers));
+				for (size_t i = 0; i < MAX_EVENT_REASSEMBLIES; i++)
+					reassemblies[i].started = 0;
+				rebuild_index();
 			}
 
 			uint32_t compute_subscriptions_checksum(calculate_crc_fn calculate_crc)
@@ -87,19 +334,7 @@ namespace trackle
 			{
 				const unsigned len = message.length();
 				uint8_t *queue = message.buf();
-				if (CoAP::type(queue) == CoAPType::CON && channel.is_unreliable())
-				{
-					Message response;
-					if (channel.response(message, response, 5) == NO_ERROR)
-					{
-						size_t len = Messages::empty_ack(response.buf(), 0, 0);
-						response.set_length(len);
-						response.set_id(message.get_id());
-						ProtocolError error = channel.send(response);
-						if (error)
-							return error;
-					}
-				}
+				const bool acknowledge = CoAP::type(queue) == CoAPType::CON && channel.is_unreliable();
 
 				// end of CoAP message
 				unsigned char *end = queue + len;
@@ -110,92 +345,146 @@ namespace trackle
 				size_t event_name_length = CoAP::option_decode(&event_name);
 				if (0 == event_name_length)
 				{
+					if (acknowledge)
+						send_event_ack(channel, message, CoAPCode::EMPTY, false, 0);
 					// error, malformed CoAP option
 					return MALFORMED_MESSAGE;
 				}
 
 				unsigned char *next_src = event_name + event_name_length;
 				unsigned char *next_dst = next_src;
-				while (next_src < end && 0x00 == (*next_src & 0xf0))
+				uint16_t option = CoAPOption::URI_PATH;
+				bool block = false;
+				uint32_t block_value = 0;
+				while (next_src < end && 0xff != *next_src)
 				{
-					// there's another Uri-Path option, i.e., event name with slashes
-					size_t option_len = CoAP::option_decode(&next_src);
-					*next_dst++ = '/';
-					if (next_dst != next_src)
+					uint16_t delta;
+					unsigned char *value = next_src;
+					size_t option_len = CoAP::option_decode(&value, &delta);
+					option += delta;
+					if (CoAPOption::URI_PATH == option)
 					{
-						// at least one extra byte has been used to encode a CoAP Uri-Path option length
-						memmove(next_dst, next_src, option_len);
+						// there's another Uri-Path option, i.e., event name with slashes
+						*next_dst++ = '/';
+						if (next_dst != value)
+						{
+							// at least one extra byte has been used to encode a CoAP Uri-Path option length
+							memmove(next_dst, value, option_len);
+						}
+						next_dst += option_len;
+					}
+					else if (CoAPOption::BLOCK1 == option)
+					{
+						block = true;
+						block_value = CoAP::option_uint_decode(value, option_len);
 					}
-					next_src += option_len;
-					next_dst += option_len;
+					// Max-Age and any other option are ignored, Block2 included: it describes
+					// the payload of a response, never the event being posted
+					next_src = value + option_len;
 				}
 				event_name_length = next_dst - event_name;
 
-				if (next_src < end && 0x30 == (*next_src & 0xf0))
-				{
-					// Max-Age option is next, which we ignore
-					size_t next_len = CoAP::option_decode(&next_src);
-					next_src += next_len;
-				}
-
 				unsigned char *data = NULL;
+				size_t data_length = 0;
 				if (next_src < end && 0xff == *next_src)
 				{
 					// payload is next
 					data = next_src + 1;
-					// null terminate data string
-					*end = 0;
+					data_length = end - data;
 				}
-				// null terminate event name string
-				event_name[event_name_length] = 0;
 
-				const int NUM_HANDLERS = sizeof(event_handlers) / sizeof(FilteringEventHandler);
-				for (int i = 0; i < NUM_HANDLERS; i++)
+				match_handlers((const char *)event_name, event_name_length);
+
+				// with a block option, the payload is a fragment of the event data
+				const bool more = block && (block_value & 0x08);
+				const size_t block_size = 16u << (block_value & 0x07);
+				const size_t offset = block ? (block_value >> 4) * block_size : 0;
+				EventReassembly *reassembly = nullptr;
+				CoAPCode::Enum code = CoAPCode::EMPTY;
+				if (block)
 				{
-					if (NULL == event_handlers[i].handler)
+					code = more ? CoAPCode::CONTINUE : CoAPCode::CHANGED;
+					if (has_buffered_handlers())
 					{
-						break;
-					}
-					const size_t MAX_FILTER_LENGTH = sizeof(event_handlers[i].filter);
-					const size_t filter_length = strnlen(event_handlers[i].filter,
-														 MAX_FILTER_LENGTH);
+						std::string name((const char *)event_name, event_name_length);
+						reassembly = offset ? find_reassembly(name) : start_reassembly(name);
+						if (!reassembly || reassembly->payload.size() != offset)
+						{
+							// a block is missing, the sender has to start over
+							code = CoAPCode::REQUEST_ENTITY_INCOMPLETE;
+						}
+						else if (offset + data_length > MAX_INBOUND_EVENT_SIZE)
+						{
+							code = CoAPCode::REQUEST_ENTITY_TOO_LARGE;
+						}
+						else
+						{
+							reassembly->payload.insert(reassembly->payload.end(), data, data + data_length);
+						}
 
-					if (event_name_length < filter_length)
-					{
-						// does not match this filter, try the next event handler
-						continue;
+						if (code != CoAPCode::CONTINUE && code != CoAPCode::CHANGED && reassembly)
+						{
+							reassembly->event_name.clear();
+							reassembly = nullptr;
+						}
 					}
+				}
+
+				if (acknowledge)
+				{
+					ProtocolError error = send_event_ack(channel, message, code, block, block_value);
+					if (error)
+						return error;
+				}
+
+				// the acknowledgement has been built after the message, terminate the strings now
+				// null terminate event name string
+				event_name[event_name_length] = 0;
+				if (data)
+				{
+					// null terminate data string
+					*end = 0;
+				}
 
-					const int cmp = memcmp(event_handlers[i].filter, event_name,
-										   filter_length);
-					if (0 == cmp)
+				dispatching = true;
+				for (size_t m = 0; m < matched_handlers.size(); m++)
+				{
+					FilteringEventHandler &handler = event_handlers[matched_handlers[m]];
+					// removed by one of the handlers called before
+					if (!handler.handler)
+						continue;
+					if (handler.flags & EventHandlerFlags::STREAM)
 					{
-						// don't call the handler directly, use a callback for it.
-						if (!call_event_handler)
+						if (code == CoAPCode::EMPTY || code == CoAPCode::CONTINUE || code == CoAPCode::CHANGED)
 						{
-							if (event_handlers[i].handler_data)
-							{
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-function-type"
-								EventHandlerWithData handler = (EventHandlerWithData)event_handlers[i].handler;
+							EventStreamHandler stream_handler = (EventStreamHandler)handler.handler;
 #pragma GCC diagnostic pop
-								handler(event_handlers[i].handler_data,
-										(char *)event_name, (char *)data);
-							}
-							else
-							{
-								event_handlers[i].handler((char *)event_name,
-														  (char *)data);
-							}
-						}
-						else
-						{
-							call_event_handler(sizeof(FilteringEventHandler),
-											   &event_handlers[i], (const char *)event_name,
-											   (const char *)data, NULL);
+							stream_handler(handler.handler_data, (const char *)event_name, (const char *)data,
+										   data_length, offset, !more);
 						}
 					}
-					// else continue the for loop to try the next handler
+					else if (!block)
+					{
+						dispatch_event(handler, (const char *)event_name, (const char *)data, call_event_handler);
+					}
+					else if (reassembly && !more)
+					{
+						reassembly->payload.push_back(0);
+						dispatch_event(handler, (const char *)event_name, reassembly->payload.data(), call_event_handler);
+						reassembly->payload.pop_back();
+					}
+				}
+
+				dispatching = false;
+				if (removals_pending)
+					purge_removed_handlers();
+
+				if (reassembly && !more)
+				{
+					// the buffer keeps its capacity for the next transfer
+					reassembly->event_name.clear();
 				}
 				return NO_ERROR;
 			}
@@ -203,49 +492,45 @@ namespace trackle
 			template <typename F>
 			ProtocolError for_each(F callback)
 			{
-				const int NUM_HANDLERS = sizeof(event_handlers) / sizeof(FilteringEventHandler);
 				ProtocolError error = NO_ERROR;
-				for (unsigned i = 0; i < NUM_HANDLERS; i++)
+				for (size_t i = 0; i < event_handlers.size(); i++)
 				{
-					if (nullptr != event_handlers[i].handler)
-					{
-						error = callback(event_handlers[i]);
-						if (error)
-							break;
-					}
+					if (!event_handlers[i].handler)
+						continue;
+					error = callback(event_handlers[i]);
+					if (error)
+						break;
 				}
 				return error;
 			}
 
 			void remove_event_handlers(const char *event_name)
 			{
+				if (dispatching)
+				{
+					// called from a handler: clear the entries now, erase them once the dispatch is over
+					for (size_t i = 0; i < event_handlers.size(); i++)
+					{
+						FilteringEventHandler &handler = event_handlers[i];
+						if (NULL == event_name || !strncmp(event_name, handler.filter, sizeof(handler.filter)))
+							handler.handler = nullptr;
+					}
+					removals_pending = true;
+					return;
+				}
+
 				if (NULL == event_name)
 				{
-					memset(event_handlers, 0, sizeof(event_handlers));
+					event_handlers.clear();
 				}
 				else
 				{
-					const int NUM_HANDLERS = sizeof(event_handlers) / sizeof(FilteringEventHandler);
-					int dest = 0;
-					for (int i = 0; i < NUM_HANDLERS; i++)
-					{
-						if (!strcmp(event_name, event_handlers[i].filter))
-						{
-							memset(&event_handlers[i], 0, sizeof(event_handlers[i]));
-						}
-						else
-						{
-							if (dest != i)
-							{
-								memcpy(event_handlers + dest, event_handlers + i,
-									   sizeof(event_handlers[i]));
-								memset(event_handlers + i, 0,
-									   sizeof(event_handlers[i]));
-							}
-							dest++;
-						}
-					}
+					event_handlers.erase(std::remove_if(event_handlers.begin(), event_handlers.end(),
+														[event_name](const FilteringEventHandler &handler)
+														{ return !strncmp(event_name, handler.filter, sizeof(handler.filter)); }),
+										 event_handlers.end());
 				}
+				rebuild_index();
 			}
 
 			/**
@@ -254,23 +539,23 @@ namespace trackle
 			bool event_handler_exists(const char *event_name, EventHandler handler,
 									  void *handler_data, SubscriptionScope::Enum scope, const char *id)
 			{
-				const int NUM_HANDLERS = sizeof(event_handlers) / sizeof(FilteringEventHandler);
-				for (int i = 0; i < NUM_HANDLERS; i++)
+				const size_t MAX_FILTER_LEN = sizeof(((FilteringEventHandler *)0)->filter);
+				const int32_t node = find_node(event_name, strnlen(event_name, MAX_FILTER_LEN));
+				if (node < 0)
+					return false;
+
+				const std::vector<uint16_t> &candidates = filter_nodes[node].handlers;
+				for (size_t i = 0; i < candidates.size(); i++)
 				{
-					if (event_handlers[i].handler == handler && event_handlers[i].handler_data == handler_data && event_handlers[i].scope == scope)
+					const FilteringEventHandler &existing = event_handlers[candidates[i]];
+					if (existing.handler == handler && existing.handler_data == handler_data && existing.scope == scope)
 					{
-						const size_t MAX_FILTER_LEN = sizeof(event_handlers[i].filter);
-						const size_t FILTER_LEN = strnlen(event_name, MAX_FILTER_LEN);
-						if (!strncmp(event_handlers[i].filter, event_name, FILTER_LEN))
-						{
-							const size_t MAX_ID_LEN =
-								sizeof(event_handlers[i].device_id) - 1;
-							const size_t id_len = id ? strnlen(id, MAX_ID_LEN) : 0;
-							if (id_len)
-								return !strncmp(event_handlers[i].device_id, id, id_len);
-							else
-								return !event_handlers[i].device_id[0];
-						}
+						const size_t MAX_ID_LEN = sizeof(existing.device_id) - 1;
+						const size_t id_len = id ? strnlen(id, MAX_ID_LEN) : 0;
+						if (id_len)
+							return !strncmp(existing.device_id, id, id_len);
+						else
+							return !existing.device_id[0];
 					}
 				}
 				return false;
@@ -280,32 +565,31 @@ namespace trackle
 			 * Adds the given handler.
 			 */
 			ProtocolError add_event_handler(const char *event_name, EventHandler handler,
-											void *handler_data, SubscriptionScope::Enum scope, const char *id)
+											void *handler_data, SubscriptionScope::Enum scope, const char *id,
+											uint8_t flags = EventHandlerFlags::NONE)
 			{
 				if (event_handler_exists(event_name, handler, handler_data, scope, id))
 					return NO_ERROR;
 
-				const int NUM_HANDLERS = sizeof(event_handlers) / sizeof(FilteringEventHandler);
-				for (int i = 0; i < NUM_HANDLERS; i++)
-				{
-					if (NULL == event_handlers[i].handler)
-					{
-						const size_t MAX_FILTER_LEN = sizeof(event_handlers[i].filter);
-						const size_t FILTER_LEN = strnlen(event_name, MAX_FILTER_LEN);
-						memcpy(event_handlers[i].filter, event_name, FILTER_LEN);
-						memset(event_handlers[i].filter + FILTER_LEN, 0, MAX_FILTER_LEN - FILTER_LEN);
-						event_handlers[i].handler = handler;
-						event_handlers[i].handler_data = handler_data;
-						event_handlers[i].device_id[0] = 0;
-						const size_t MAX_ID_LEN = sizeof(event_handlers[i].device_id) - 1;
-						const size_t id_len = id ? strnlen(id, MAX_ID_LEN) : 0;
-						memcpy(event_handlers[i].device_id, id, id_len);
-						event_handlers[i].device_id[id_len] = 0;
-						event_handlers[i].scope = scope;
-						return NO_ERROR;
-					}
-				}
-				return INSUFFICIENT_STORAGE;
+				if (event_handlers.size() >= MAX_SUBSCRIPTIONS)
+					return INSUFFICIENT_STORAGE;
+
+				FilteringEventHandler added;
+				memset(&added, 0, sizeof(added));
+				const size_t MAX_FILTER_LEN = sizeof(added.filter);
+				const size_t FILTER_LEN = strnlen(event_name, MAX_FILTER_LEN);
+				memcpy(added.filter, event_name, FILTER_LEN);
+				added.handler = handler;
+				added.handler_data = handler_data;
+				const size_t MAX_ID_LEN = sizeof(added.device_id) - 1;
+				const size_t id_len = id ? strnlen(id, MAX_ID_LEN) : 0;
+				memcpy(added.device_id, id, id_len);
+				added.scope = scope;
+				added.flags = flags;
+
+				event_handlers.push_back(added);
+				index_handler(event_handlers.size() - 1);
+				return NO_ERROR;
 			}
 
 			inline ProtocolError send_subscriptions(MessageChannel &channel)
@@ -82,10 +82,11 @@ private:
          * @param deviceId The device ID of the device you want to subscribe to. If you want to subscribe to
          * all devices, set this to NULL.
          * @param reserved reserved for future use, must be NULL
+         * @param flags EventHandlerFlags of the handler.
          *
          * @return true if the subscription request was successfully sent, false otherwise.
          */
-        bool addSubscription(const char *eventName, EventHandler handler, void *handlerData, Subscription_Scope_Type scope, const char *deviceID, void *reserved);
+        bool addSubscription(const char *eventName, EventHandler handler, void *handlerData, Subscription_Scope_Type scope, const char *deviceID, void *reserved, uint8_t flags = 0);
 
         /**
          * @brief It adds a variable to the list of variables that can be set by the cloud
@@ -96,7 +97,7 @@ private:
          *
          * @return result of operation.
          */
-        bool addGet(const char *varKey, void *(*fn)(const char *), Data_TypeDef userVarType);
+        bool addGet(const char *varKey, void *(*fn)(const char *), Data_TypeDef userVarType, user_variable_reader_cb_t reader = NULL);
 
 public:
         /**
@@ -174,6 +175,56 @@ public:
          */
         bool get(const char *varKey, void *(*fn)(const char *), Data_TypeDef type);
 
+        /**
+         * @brief Add a reader function for a variable of type string or json that can be larger than a single
+         * message. The value is sent to the cloud in blocks, and the reader is called for each of them.
+         *
+         * @param varKey The name of the variable.
+         * @param fn The reader, it copies up to length bytes of the value starting at offset in buf and returns
+         * the whole length of the value.
+         * @param type VAR_STRING or VAR_JSON.
+         */
+        bool getReader(const char *varKey, user_variable_reader_cb_t fn, Data_TypeDef type);
+
+        /**
+         * @brief It caches the value of a variable for the given time. Requests without argument are answered
+         * with the cached value, already serialized, without calling the variable function. Values are only
+         * refreshed by a request that finds them expired: when a refresh executor is set, the refresh runs on
+         * it and the expired value is served meanwhile, otherwise the request calls the variable function.
+         *
+         * @param varKey The name of the variable, already added with get().
+         * @param ttl The time to live of the cached value in milliseconds, 0 to disable the cache.
+         *
+         * @return false if the variable does not exist, is a long, has a reader or is being refreshed.
+         */
+        bool setVariableCache(const char *varKey, uint32_t ttl);
+
+        /**
+         * @brief It sets the executor that refreshes cached variables. The executor must run job(arg), for
+         * example on a worker thread; it is called from loop() when a request finds a cached value expired.
+         *
+         * @param executor The function pointer.
+         */
+        void setVariableRefreshExecutor(executorCallback *executor);
+
+        /**
+         * @brief It signals that the value of a variable changed. If the cloud observes the variable, the new
+         * value is read and pushed to the cloud from loop(), unless its representation did not change.
+         *
+         * @param varKey The name of the variable, NULL for all the variables.
+         */
+        void notifyVariableChanged(const char *varKey);
+
+        /**
+         * @brief It sets the intervals of the notifications of observed variables.
+         *
+         * @param minInterval The minimum time in milliseconds between two notifications of a variable, changes
+         * signalled meanwhile are notified when it elapses.
+         * @param maxInterval The time in milliseconds after which an observed variable is read and notified even
+         * if no change was signalled, 0 to notify only signalled changes.
+         */
+        void setVariableObserveIntervals(uint32_t minInterval, uint32_t maxInterval);
+
         /**
          * @brief It adds a function to the list of functions that can be called by the cloud
          *
@@ -186,6 +237,43 @@ public:
          */
         bool post(const char *funcKey, user_function_int_char_t *func, Function_PermissionDef permission = ALL_USERS);
 
+        /**
+         * @brief It adds a function that completes asynchronously. The call is acknowledged right away and
+         * the function receives a completion token; the result is sent to the cloud once `completeFunction()`
+         * is called with that token, so long running functions don't block the loop.
+         *
+         * @param funcKey The name of the function that will be called from the cloud.
+         * @param func The function to be called, it must return quickly and pass the token to `completeFunction()`.
+         * @param permission This is the permission level of the function. It can be either ALL_USERS or
+         * OWNER_ONLY.
+         *
+         * @return A boolean value.
+         */
+        bool postAsync(const char *funcKey, user_function_async_t *func, Function_PermissionDef permission = ALL_USERS);
+
+        /**
+         * @brief It completes an asynchronous function call, the result is sent to the cloud by the next `loop()`.
+         * It can be called from any thread.
+         *
+         * @param completionToken The token received by the function.
+         * @param result The result of the function.
+         *
+         * @return false if the token is unknown, already completed or timed out.
+         */
+        bool completeFunction(uint32_t completionToken, int result);
+
+        /**
+         * @brief It sets how many asynchronous function calls can be pending at the same time (4 by default, up to 255)
+         * and after how long a pending call is dropped (10 seconds by default). Further calls are refused with 4.29.
+         * To be called from the thread that runs `loop()`, it's refused while a call is pending.
+         *
+         * @param maxPending The maximum number of pending calls.
+         * @param timeout The timeout in milliseconds.
+         *
+         * @return false if a call is pending, the limits are unchanged.
+         */
+        bool setFunctionAsyncLimits(uint8_t maxPending, uint32_t timeout);
+
         /**
          * @brief It sends a publish to the cloud
          *
@@ -275,6 +363,37 @@ public:
          */
         bool syncState(string data);
 
+        /**
+         * @brief It sets the value of a property. Changed properties are sent to the cloud from loop() in a
+         * diff event, trackle/p/d, holding the generation of the last change, the hash of all the properties
+         * and the changed properties: {"g":12,"h":"1a2b3c4d","p":{"temp":21.5}}. The hash is the xor of the
+         * CRC-32 of each property name, followed by a NUL and its value. When the cloud detects a drift it asks
+         * with trackle/p/sync for the whole state, sent to trackle/p.
+         *
+         * @param name The name of the property.
+         * @param value The JSON encoded value, e.g. 21.5, true or "on".
+         *
+         * @return false if the name or the value are missing.
+         */
+        bool setProperty(const char *name, const char *value);
+
+        /**
+         * @brief It sets how long changed properties are held before being sent, so that a burst of changes
+         * is sent in a single diff.
+         *
+         * @param window The time in milliseconds from the first change, 0 to send the changes at the next loop().
+         */
+        void setPropertySyncWindow(uint32_t window);
+
+        /**
+         * @brief It sends the changed properties right away, or all of them.
+         *
+         * @param full true to send the whole state to trackle/p instead of the diff.
+         *
+         * @return false if the event can't be published.
+         */
+        bool syncProperties(bool full = false);
+
         /**
          * @brief It sends a time request to the server
          *
@@ -326,11 +445,63 @@ public:
          */
         bool subscribe(const char *eventName, EventHandler handler, Subscription_Scope_Type scope, const char *deviceId);
 
+        /**
+         * @brief It subscribes to an event, receiving its data incrementally. Large events sent by the cloud
+         * in blocks are passed to the handler as each block arrives, without buffering the whole payload.
+         * Stream handlers are always called from loop(), also when the event queue is enabled.
+         *
+         * @param eventName The name of the event to subscribe to.
+         * @param handler The function called with each fragment, its length and offset, and whether it is the last.
+         * @param handlerData A pointer passed back to the handler.
+         * @param scope The subscription scope, MY_DEVICES or ALL_DEVICES
+         * @param deviceID The device ID of the device you want to subscribe to, NULL for any.
+         *
+         * @return A boolean value.
+         */
+        bool subscribeStream(const char *eventName, EventStreamHandler handler, void *handlerData, Subscription_Scope_Type scope, const char *deviceId);
+
         /**
          * @brief It removes the event handlers that were added in the `subscribe()` function
          */
         void unsubscribe();
 
+        /**
+         * @brief It makes event handlers run outside of loop(). Matched events are copied in a bounded queue
+         * and dispatched by processEvents(), which can be called by a worker thread or any other executor.
+         * The system "trackle" events are always handled synchronously.
+         *
+         * @param capacity The number of events that can be pending, 0 to dispatch synchronously (default).
+         * @param maxEventLength The maximum length of event name and data together.
+         * @param policy What to do with an event when the queue is full or the event is too long.
+         *
+         * @return false if the queue could not be allocated.
+         */
+        bool setEventQueue(uint16_t capacity, uint16_t maxEventLength, Event_Queue_Policy policy);
+
+        /**
+         * @brief This function sets a callback invoked from loop() each time an event is queued,
+         * for example to wake up the thread that calls processEvents().
+         *
+         * @param notify The function pointer.
+         */
+        void setEventQueueNotifyCallback(eventQueueNotifyCallback *notify);
+
+        /**
+         * @brief It runs the handlers of the queued events.
+         *
+         * @param maxEvents The maximum number of events to dispatch, 0 to empty the queue.
+         *
+         * @return The number of dispatched events.
+         */
+        int processEvents(int maxEvents = 0);
+
+        /**
+         * @brief It returns the counters of the event queue.
+         *
+         * @param metrics The structure filled with the counters.
+         */
+        void getEventQueueMetrics(Event_Queue_Metrics *metrics);
+
         /**
          * @brief This function set millis function callback
          *
@@ -415,6 +586,95 @@ public:
          */
         void setFinishFirmwareUpdateCallback(finishFirmwareUpdateCallback *finish);
 
+        /**
+         * @brief It sets a file where the firmware is written chunk by chunk, instead of being held in memory
+         * until the update is complete. It's used when no prepare and save chunk callbacks are set, and the
+         * finish callback receives the file path instead of the firmware content. Only available on POSIX
+         * platforms, elsewhere the path is ignored.
+         *
+         * @param path The path of the file, created or truncated at each update. NULL to keep the firmware in memory.
+         * @param syncChunks The number of chunks written between two flushes to storage, 0 to flush only at the end.
+         */
+        void setFirmwareUpdateFile(const char *path, uint32_t syncChunks = 0);
+
+        /**
+         * @brief It sets an executor that stores the firmware chunks on another thread, so that slow storage
+         * doesn't delay the acknowledgment of the next chunks. The chunks that passed the CRC check are copied
+         * in a pool of buffers and the executor is asked to run the writer job when it's not already running.
+         * When the pool is full the chunk is requested again later. The finish callback is called once all the
+         * chunks are stored.
+         *
+         * @param executor A function that runs the job with its argument, for example on a worker thread. NULL to store the chunks synchronously (default).
+         * @param chunks The number of chunk buffers.
+         */
+        void setFirmwareWriteExecutor(executorCallback *executor, uint16_t chunks);
+
+        /**
+         * @brief It makes fast OTA transfers resumable. The size of the file and of its chunks and the bitmap of the
+         * received chunks are saved with the save session callback, with type 1, every given number of chunks and
+         * when the connection drops; an empty state is saved when the transfer completes. When the cloud starts
+         * again the transfer of the same file, the state is restored with the restore session callback, the prepare
+         * callback is called with the flag 2 to keep the stored chunks and the missing chunks are requested right
+         * away. UpdateReady can't tell the cloud to skip chunks, so it still sends all of them: the chunks already
+         * stored are acknowledged without being written again. Without a prepare callback only the firmware file
+         * survives a reboot, an update kept in memory starts over.
+         *
+         * @param chunks The number of chunks received between two saves, 0 to disable (default).
+         */
+        void setOtaCheckpointInterval(uint16_t chunks);
+
+        /**
+         * @brief It tells the cloud, with the flag 0x40 of the hello message, that the firmware can be sent
+         * compressed. A compressed update has the flag 0x04 in the UpdateBegin flags byte and its file length is
+         * the length of the compressed stream. The stream starts with a 14 bytes header: "THS1", the window bits
+         * (4 to 11), the lookahead bits, the decompressed length and its CRC-32 as big endian 32 bit integers,
+         * followed by the heatshrink (LZSS) bit stream. The window, 2^bits bytes, is allocated for the update.
+         * Compressed updates are sent in order, without fast OTA. Set it before connecting.
+         *
+         * @param enabled true to receive compressed updates, false by default.
+         */
+        void setCompressedOta(bool enabled);
+
+        /**
+         * @brief It makes fast OTA transfers report the missing chunks while the transfer is running, instead of
+         * waiting for the end of the transfer, so that the gaps left by lost packets are filled along the way.
+         *
+         * @param distance A missing chunk is reported once this number of following chunks has been received, 0 to disable (default).
+         * @param timeout The time in milliseconds without chunks after which all the missing chunks are reported, 0 to disable (default).
+         */
+        void setOtaMissingChunksReport(uint16_t distance, uint32_t timeout);
+
+        /**
+         * @brief It uploads a file to the Trackle cloud, like log archives or core dumps too big for publish.
+         * The file is read in chunks of 1024 bytes while it's sent, and the chunks lost are sent again until
+         * the cloud has verified the CRC of the whole file.
+         *
+         * @param name The name of the file in the cloud, up to 64 characters.
+         * @param length The length of the file, up to 64 MB.
+         * @param read The function that reads length bytes of the file at offset into buf, returning the number of bytes read.
+         * @param completion The function called at the end of the upload, with error 0 on success.
+         * @return true if the upload started, false if the device isn't connected or another upload is running.
+         */
+        bool uploadFile(const char *name, uint32_t length, uploadReadCallback *read, uploadCompletionCallback *completion);
+
+        /**
+         * @brief It sets the number of chunks of an upload sent before waiting for the cloud acknowledgement.
+         * A larger window is faster on links with high latency.
+         *
+         * @param chunks The window, 32 by default.
+         */
+        void setUploadWindow(uint16_t chunks);
+
+        /**
+         * @brief This function sets the callback function that reads the installed firmware. It's needed by delta
+         * updates, where the cloud sends a patch that is applied to the installed firmware as it's received: the
+         * new firmware is written with the save chunk callback and the prepare callback gets its length with the
+         * flag 4. Delta updates are refused without it.
+         *
+         * @param read A function that fills buf with length bytes of the installed firmware from offset, and returns the number of bytes read.
+         */
+        void setReadFirmwareCallback(readFirmwareCallback *read);
+
         /**
          * @brief It sets the otaUpdateCallback to the firmwareUrl passed in.
          *
@@ -422,6 +682,17 @@ public:
          */
         void setOtaUpdateCallback(otaUpdateCallback *updateCb);
 
+        /**
+         * @brief It makes the library download the firmware of SEND_URL updates, instead of passing the URL to the
+         * otaUpdateCallback. The image is fetched with parallel HTTP range requests and stored like the chunks of
+         * a PUSH update, then its CRC is checked and the result is sent to the cloud.
+         *
+         * @param executor The function that runs each connection in a background thread, NULL to disable the downloader.
+         * @param connections The number of parallel connections, up to 8.
+         * @param transport The connection for the requests, NULL for plain TCP sockets. A TLS transport is needed for https URLs.
+         */
+        void setOtaDownloader(executorCallback *executor, uint8_t connections = 4, const Http_Transport *transport = NULL);
+
         /**
          * @brief Set update done status with result code.
          *
@@ -490,7 +761,8 @@ public:
 
         /**
          * @brief This function sets the callback function that will be called when it's needed to save the current
-         * DTLS session.
+         * DTLS session. The same callback saves, with type 2, the checksums of the describe messages sent to the
+         * cloud, so that they are not sent again when a restored session is resumed.
          *
          * @param save A pointer to the session save function.
          */
@@ -57,7 +57,8 @@ namespace TrackleAppStateUpdate
   {
     COMPUTE = 1,
     PERSIST = 2,
-    COMPUTE_AND_PERSIST = 3
+    COMPUTE_AND_PERSIST = 3,
+    LOAD = 4 // retrieve the persisted value
   };
 }
 
@@ -91,7 +92,8 @@ struct TrackleDescriptor
    * 	The descriptor state (DESCRIBE_APP/DESCRIBE_SYSTEM) can be computed by the callback and can be used with COMPUTE and COMPUTE_AND_PERSIST operations.
    * 	The subscription state (SUBSCRIPTIONS) is computed by the caller and passed to the callback (secifying PERSIST as the operation.)
    * @param data		when operation==1 this is the value ot set. otherwise unused.
-   * @return when operation==COMPUTE, the crc of the application state is retrieved when operation is COMPUTE. Otherwise the return value is 0.
+   * 	LOAD retrieves the value persisted last, 0 if none.
+   * @return when operation==COMPUTE, the crc of the application state is retrieved when operation is COMPUTE. When operation is LOAD, the persisted crc. Otherwise the return value is 0.
    */
   uint32_t (*app_state_selector_info)(TrackleAppStateSelector::Enum selector, TrackleAppStateUpdate::Enum operation, uint32_t data, void *reserved);
 
@@ -106,5 +108,38 @@ struct TrackleDescriptor
    */
   bool (*append_metrics)(appender_fn appender, void *append, uint32_t flags, uint32_t page, void *reserved);
 
+  /**
+   * Optional callback - may be null, in which case variable_type and get_variable are used.
+   * Looks up a variable once, returning its getter and setting its type.
+   * @param variable_key	The variable to find.
+   * @param type		Set to the type of the variable.
+   * @return the getter of the variable, or null when there is no variable with the given key.
+   */
+  const void *(*find_variable)(const char *variable_key, TrackleReturnType::Enum *type);
+
+  /**
+   * Optional callback - may be null.
+   * Copies the cached value of a variable, serialized as sent in the response.
+   * @param variable_key	The variable to read.
+   * @param arg			The argument of the request.
+   * @param offset		The offset of the first byte to copy.
+   * @param buf			The buffer receiving the value.
+   * @param max_length		The size of buf.
+   * @return the whole length of the value, or -1 when the variable has to be read with its getter.
+   */
+  int (*get_cached_variable)(const char *variable_key, const char *arg, size_t offset, uint8_t *buf, size_t max_length);
+
+  /**
+   * Optional callback - may be null.
+   * Copies a slice of a string variable that is read in parts, as sent in Block2 responses.
+   * @param variable_key	The variable to read.
+   * @param arg			The argument of the request.
+   * @param offset		The offset of the first byte to copy.
+   * @param buf			The buffer receiving the value.
+   * @param max_length		The size of buf.
+   * @return the whole length of the value, or -1 when the variable has to be read with its getter.
+   */
+  int (*read_variable)(const char *variable_key, const char *arg, size_t offset, uint8_t *buf, size_t max_length);
+
   void *reserved[1]; // add a few additional pointers
 };
@@ -58,6 +58,41 @@ extern "C"
      */
     bool trackleGet(Trackle *v, const char *varKey, void *(*fn)(const char *), Data_TypeDef type) DYNLIB;
 
+    /*!
+     * @copybrief Trackle::getReader()
+     * @trackle
+     * @copydetails Trackle::getReader()
+     */
+    bool trackleGetReader(Trackle *v, const char *varKey, user_variable_reader_cb_t fn, Data_TypeDef type) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setVariableCache()
+     * @trackle
+     * @copydetails Trackle::setVariableCache()
+     */
+    bool trackleSetVariableCache(Trackle *v, const char *varKey, uint32_t ttl) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setVariableRefreshExecutor()
+     * @trackle
+     * @copydetails Trackle::setVariableRefreshExecutor()
+     */
+    void trackleSetVariableRefreshExecutor(Trackle *v, executorCallback *executor) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::notifyVariableChanged()
+     * @trackle
+     * @copydetails Trackle::notifyVariableChanged()
+     */
+    void trackleNotifyVariableChanged(Trackle *v, const char *varKey) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setVariableObserveIntervals()
+     * @trackle
+     * @copydetails Trackle::setVariableObserveIntervals()
+     */
+    void trackleSetVariableObserveIntervals(Trackle *v, uint32_t minInterval, uint32_t maxInterval) DYNLIB;
+
     /*!
      * @copybrief Trackle::post()
      * @trackle
@@ -65,6 +100,27 @@ extern "C"
      */
     bool tracklePost(Trackle *v, const char *funcKey, user_function_int_char_t *func, Function_PermissionDef permission) DYNLIB;
 
+    /*!
+     * @copybrief Trackle::postAsync()
+     * @trackle
+     * @copydetails Trackle::postAsync()
+     */
+    bool tracklePostAsync(Trackle *v, const char *funcKey, user_function_async_t *func, Function_PermissionDef permission) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::completeFunction()
+     * @trackle
+     * @copydetails Trackle::completeFunction()
+     */
+    bool trackleCompleteFunction(Trackle *v, uint32_t completionToken, int result) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setFunctionAsyncLimits()
+     * @trackle
+     * @copydetails Trackle::setFunctionAsyncLimits()
+     */
+    bool trackleSetFunctionAsyncLimits(Trackle *v, uint8_t maxPending, uint32_t timeout) DYNLIB;
+
     /*!
      * @copybrief Trackle::publish()
      * @trackle
@@ -79,6 +135,27 @@ extern "C"
      */
     bool trackleSyncState(Trackle *v, const char *data) DYNLIB;
 
+    /*!
+     * @copybrief Trackle::setProperty()
+     * @trackle
+     * @copydetails Trackle::setProperty()
+     */
+    bool trackleSetProperty(Trackle *v, const char *name, const char *value) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setPropertySyncWindow()
+     * @trackle
+     * @copydetails Trackle::setPropertySyncWindow()
+     */
+    void trackleSetPropertySyncWindow(Trackle *v, uint32_t window) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::syncProperties()
+     * @trackle
+     * @copydetails Trackle::syncProperties()
+     */
+    bool trackleSyncProperties(Trackle *v, bool full) DYNLIB;
+
     /*!
      * @copybrief Trackle::getTime()
      * @trackle
@@ -93,6 +170,13 @@ extern "C"
      */
     bool trackleSubscribe(Trackle *v, const char *eventName, EventHandler handler, Subscription_Scope_Type scope, const char *deviceID) DYNLIB;
 
+    /*!
+     * @copybrief Trackle::subscribeStream()
+     * @trackle
+     * @copydetails Trackle::subscribeStream()
+     */
+    bool trackleSubscribeStream(Trackle *v, const char *eventName, EventStreamHandler handler, void *handlerData, Subscription_Scope_Type scope, const char *deviceID) DYNLIB;
+
     /*!
      * @copybrief Trackle::unsubscribe()
      * @trackle
@@ -100,6 +184,34 @@ extern "C"
      */
     void trackleUnsubscribe(Trackle *v) DYNLIB;
 
+    /*!
+     * @copybrief Trackle::setEventQueue()
+     * @trackle
+     * @copydetails Trackle::setEventQueue()
+     */
+    bool trackleSetEventQueue(Trackle *v, uint16_t capacity, uint16_t maxEventLength, Event_Queue_Policy policy) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setEventQueueNotifyCallback()
+     * @trackle
+     * @copydetails Trackle::setEventQueueNotifyCallback()
+     */
+    void trackleSetEventQueueNotifyCallback(Trackle *v, eventQueueNotifyCallback *notify) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::processEvents()
+     * @trackle
+     * @copydetails Trackle::processEvents()
+     */
+    int trackleProcessEvents(Trackle *v, int maxEvents) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::getEventQueueMetrics()
+     * @trackle
+     * @copydetails Trackle::getEventQueueMetrics()
+     */
+    void trackleGetEventQueueMetrics(Trackle *v, Event_Queue_Metrics *metrics) DYNLIB;
+
     /*!
      * @copybrief Trackle::setMillis()
      * @trackle
@@ -184,6 +296,62 @@ extern "C"
      */
     void trackleSetFinishFirmwareUpdateCallback(Trackle *v, finishFirmwareUpdateCallback *finish) DYNLIB;
 
+    /*!
+     * @copybrief Trackle::setFirmwareUpdateFile()
+     * @trackle
+     * @copydetails Trackle::setFirmwareUpdateFile()
+     */
+    void trackleSetFirmwareUpdateFile(Trackle *v, const char *path, uint32_t syncChunks) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setFirmwareWriteExecutor()
+     * @trackle
+     * @copydetails Trackle::setFirmwareWriteExecutor()
+     */
+    void trackleSetFirmwareWriteExecutor(Trackle *v, executorCallback *executor, uint16_t chunks) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setOtaCheckpointInterval()
+     * @trackle
+     * @copydetails Trackle::setOtaCheckpointInterval()
+     */
+    void trackleSetOtaCheckpointInterval(Trackle *v, uint16_t chunks) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setCompressedOta()
+     * @trackle
+     * @copydetails Trackle::setCompressedOta()
+     */
+    void trackleSetCompressedOta(Trackle *v, bool enabled) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setOtaMissingChunksReport()
+     * @trackle
+     * @copydetails Trackle::setOtaMissingChunksReport()
+     */
+    void trackleSetOtaMissingChunksReport(Trackle *v, uint16_t distance, uint32_t timeout) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::uploadFile()
+     * @trackle
+     * @copydetails Trackle::uploadFile()
+     */
+    bool trackleUploadFile(Trackle *v, const char *name, uint32_t length, uploadReadCallback *read, uploadCompletionCallback *completion) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setUploadWindow()
+     * @trackle
+     * @copydetails Trackle::setUploadWindow()
+     */
+    void trackleSetUploadWindow(Trackle *v, uint16_t chunks) DYNLIB;
+
+    /*!
+     * @copybrief Trackle::setReadFirmwareCallback()
+     * @trackle
+     * @copydetails Trackle::setReadFirmwareCallback()
+     */
+    void trackleSetReadFirmwareCallback(Trackle *v, readFirmwareCallback *read) DYNLIB;
+
     /*!
      * @copybrief Trackle::setOtaUpdateCallback()
      * @trackle
@@ -191,6 +359,13 @@ extern "C"
      */
     void trackleSetOtaUpdateCallback(Trackle *v, otaUpdateCallback *updateCb) DYNLIB;
 
+    /*!
+     * @copybrief Trackle::setOtaDownloader()
+     * @trackle
+     * @copydetails Trackle::setOtaDownloader()
+     */
+    void trackleSetOtaDownloader(Trackle *v, executorCallback *executor, uint8_t connections, const Http_Transport *transport) DYNLIB;
+
     /*!
      * @copybrief Trackle::setOtaUpdateDone()
      * @trackle
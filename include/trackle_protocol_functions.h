@@ -107,7 +107,9 @@ extern "C"
 
 		enum PersistType
 		{
-			PERSIST_SESSION = 0
+			PERSIST_SESSION = 0,
+			PERSIST_OTA = 1,	  // chunked transfer state, see ChunkedTransfer::set_checkpoint_interval()
+			PERSIST_APP_STATE = 2 // checksums of the describe messages the cloud got, see Protocol::changed_description_flags()
 		};
 		int (*save)(const void *data, size_t length, uint8_t type, void *reserved);
 		/**
@@ -123,6 +125,11 @@ extern "C"
 		void (*notify_client_messages_processed)(void *reserved);
 
 		// size == 56
+
+		/**
+		 * Read the installed firmware, for delta updates. Returns the number of bytes read.
+		 */
+		int (*read_firmware)(uint32_t offset, unsigned char *buf, size_t length, void *reserved);
 	};
 
 	// TRACKLE_STATIC_ASSERT(TrackleCallbacks_size, sizeof(TrackleCallbacks)==(sizeof(void*)*14));
@@ -184,10 +191,17 @@ extern "C"
 									 uint8_t block_num, uint32_t flags, void *reserved);
 	bool trackle_protocol_send_subscription_device(ProtocolFacade *protocol, const char *event_name, const char *device_id, void *reserved = NULL);
 	bool trackle_protocol_send_subscription_scope(ProtocolFacade *protocol, const char *event_name, SubscriptionScope::Enum scope, void *reserved = NULL);
-	bool trackle_protocol_add_event_handler(ProtocolFacade *protocol, const char *event_name, EventHandler handler, SubscriptionScope::Enum scope, const char *id, void *handler_data = NULL);
+	bool trackle_protocol_add_event_handler(ProtocolFacade *protocol, const char *event_name, EventHandler handler, SubscriptionScope::Enum scope, const char *id, void *handler_data = NULL, uint8_t flags = 0);
 	bool trackle_protocol_send_time_request(ProtocolFacade *protocol, void *reserved = NULL);
 	void trackle_protocol_send_subscriptions(ProtocolFacade *protocol, void *reserved = NULL);
 	void trackle_protocol_remove_event_handlers(ProtocolFacade *protocol, const char *event_name, void *reserved = NULL);
+	void trackle_protocol_notify_variable_changed(ProtocolFacade *protocol, const char *variable_key, void *reserved = NULL);
+	void trackle_protocol_set_variable_observe_intervals(ProtocolFacade *protocol, system_tick_t min_interval, system_tick_t max_interval, void *reserved = NULL);
+	void trackle_protocol_set_ota_checkpoint_interval(ProtocolFacade *protocol, uint16_t chunks, void *reserved = NULL);
+	void trackle_protocol_set_compressed_ota(ProtocolFacade *protocol, bool enabled, void *reserved = NULL);
+	void trackle_protocol_set_ota_missing_chunks_report(ProtocolFacade *protocol, uint16_t distance, system_tick_t timeout, void *reserved = NULL);
+	int trackle_protocol_begin_upload(ProtocolFacade *protocol, const char *name, uint32_t length, uploadReadCallback *read, uploadCompletionCallback *completion, void *reserved = NULL);
+	void trackle_protocol_set_upload_window(ProtocolFacade *protocol, uint16_t chunks, void *reserved = NULL);
 	void trackle_protocol_set_product_id(ProtocolFacade *protocol, product_id_t product_id, unsigned int param = 0, void *reserved = NULL);
 	void trackle_protocol_set_product_firmware_version(ProtocolFacade *protocol, product_firmware_version_t product_firmware_version, unsigned int param = 0, void *reserved = NULL);
 	void trackle_protocol_get_product_details(ProtocolFacade *protocol, product_details_t *product_details, void *reserved = NULL);
@@ -21,6 +21,8 @@
 #pragma once
 
 #include <string.h>
+#include <algorithm>
+#include <vector>
 #include "protocol_defs.h"
 #include "message_channel.h"
 #include "messages.h"
@@ -33,64 +35,91 @@ namespace trackle
 
         class Variables
         {
+            /**
+             * A variable observed by the cloud (RFC 7641), notified when its value changes.
+             */
+            struct VariableObserver
+            {
+                char key[MAX_VARIABLE_KEY_LENGTH + 1];
+                token_t token;
+                uint32_t sequence;
+                system_tick_t last_notified;
+                bool changed;
+                std::vector<uint8_t> value; // last representation sent
+            };
+
+            std::vector<VariableObserver> observers;
+            size_t next_observer = 0;   // where the next pass of process_observers() starts
+            bool notify_failing = false; // the last notification could not be sent
+            system_tick_t observe_min_interval = 0;
+            system_tick_t observe_max_interval = 0;
 
         public:
-            ProtocolError decode_variable_request(char variable_key[MAX_VARIABLE_KEY_LENGTH + 1], char variable_arg[MAX_VARIABLE_ARG_LENGTH + 1], Message &message)
+            /**
+             * Observe value of a request without the option.
+             */
+            static const uint32_t NO_OBSERVE = 0xFFFFFFFF;
+
+            ProtocolError decode_variable_request(char variable_key[MAX_VARIABLE_KEY_LENGTH + 1], char variable_arg[MAX_VARIABLE_ARG_LENGTH + 1], Message &message,
+                                                  uint32_t *block2 = nullptr, uint32_t *observe = nullptr)
             {
                 uint8_t *queue = message.buf();
-                uint8_t queue_offset = 8;
 
-                // copy the variable key
-                size_t variable_key_length;
-                if (queue[7] == 0x0d)
-                {
-                    variable_key_length = 0x0d + (queue[8] & 0xFF);
-                    queue_offset++;
-                }
-                else
+                memset(variable_key, 0, MAX_VARIABLE_KEY_LENGTH + 1);
+                variable_arg[0] = 0; // no arguments
+                if (block2)
                 {
-                    variable_key_length = queue[7] & 0x0F;
+                    *block2 = CoAP::NO_BLOCK;
                 }
-                if (variable_key_length > MAX_VARIABLE_KEY_LENGTH)
+                if (observe)
                 {
-                    variable_key_length = MAX_VARIABLE_KEY_LENGTH;
+                    *observe = NO_OBSERVE;
                 }
 
-                memcpy(variable_key, queue + queue_offset, variable_key_length);
-                memset(variable_key + variable_key_length, 0, MAX_VARIABLE_KEY_LENGTH + 1 - variable_key_length);
-
-                // read arguments
-                size_t q_index = queue_offset + variable_key_length;
-
-                if (message.length() > q_index)
+                // walk the options: Observe, Uri-Path "v", Uri-Path with the key, the argument in Uri-Query and Block2
+                unsigned char *option = queue + 4 + (queue[0] & 0x0F);
+                unsigned char *end = queue + message.length();
+                uint16_t option_number = CoAPOption::NONE;
+                int path_count = 0;
+                while (option < end && 0xff != *option)
                 {
-                    size_t variable_arg_length = queue[q_index] & 0x0F;
-                    if (variable_arg_length == MAX_OPTION_DELTA_LENGTH + 1)
+                    uint16_t delta;
+                    size_t option_length = CoAP::option_decode(&option, &delta);
+                    option_number += delta;
+                    if (option + option_length > end)
                     {
-                        ++q_index;
-                        variable_arg_length = MAX_OPTION_DELTA_LENGTH + 1 + queue[q_index];
+                        return IO_ERROR_GENERIC_RECEIVE;
                     }
-                    else if (variable_arg_length == MAX_OPTION_DELTA_LENGTH + 2)
+
+                    if (CoAPOption::URI_PATH == option_number && ++path_count <= 2)
                     {
-                        ++q_index;
-                        variable_arg_length = queue[q_index] << 8;
-                        ++q_index;
-                        variable_arg_length |= queue[q_index];
-                        variable_arg_length += 269;
+                        // copy the variable key, following "v"
+                        if (path_count == 2)
+                        {
+                            memcpy(variable_key, option, std::min(option_length, MAX_VARIABLE_KEY_LENGTH));
+                        }
                     }
+                    else if (CoAPOption::URI_QUERY == option_number || CoAPOption::URI_PATH == option_number)
+                    {
+                        // the argument is usually sent as Uri-Query, a further Uri-Path is accepted as well
+                        // allocated memory bounds check
+                        if (option_length > MAX_VARIABLE_ARG_LENGTH)
+                        {
+                            return IO_ERROR_GENERIC_RECEIVE;
+                        }
 
-                    // allocated memory bounds check
-                    if (variable_arg_length > MAX_VARIABLE_ARG_LENGTH)
+                        memcpy(variable_arg, option, option_length);
+                        variable_arg[option_length] = 0; // null terminate string
+                    }
+                    else if (CoAPOption::BLOCK2 == option_number && block2 && option_length <= 3)
                     {
-                        return IO_ERROR_GENERIC_RECEIVE;
+                        *block2 = CoAP::option_uint_decode(option, option_length);
                     }
-
-                    memcpy(variable_arg, queue + q_index + 1, variable_arg_length);
-                    variable_arg[variable_arg_length] = 0; // null terminate string
-                }
-                else
-                {                        // no arguments
-                    variable_arg[0] = 0; // null terminate string
+                    else if (CoAPOption::OBSERVE == option_number && observe && option_length <= 3)
+                    {
+                        *observe = CoAP::option_uint_decode(option, option_length);
+                    }
+                    option += option_length;
                 }
 
                 return NO_ERROR;
@@ -98,61 +127,571 @@ namespace trackle
 
             ProtocolError handle_variable_request(char *variable_key, char *variable_arg, Message &message, MessageChannel &channel, token_t token, message_id_t message_id,
                                                   TrackleReturnType::Enum (*variable_type)(const char *variable_key),
-                                                  const void *(*get_variable)(const char *variable_key))
+                                                  const void *(*get_variable)(const char *variable_key),
+                                                  const void *(*find_variable)(const char *variable_key, TrackleReturnType::Enum *type) = nullptr,
+                                                  int (*get_cached_variable)(const char *variable_key, const char *arg, size_t offset, uint8_t *buf, size_t max_length) = nullptr,
+                                                  int (*read_variable)(const char *variable_key, const char *arg, size_t offset, uint8_t *buf, size_t max_length) = nullptr,
+                                                  system_tick_t now = 0)
             {
 
-                ProtocolError err = decode_variable_request(variable_key, variable_arg, message);
+                uint32_t block2;
+                uint32_t observe;
+                ProtocolError err = decode_variable_request(variable_key, variable_arg, message, &block2, &observe);
 
                 // args too long, send error 400
                 if (err == IO_ERROR_GENERIC_RECEIVE)
                 {
-                    Message response;
-                    channel.response(message, response, 16);
-                    size_t response_length = Messages::coded_ack(response.buf(), RESPONSE_CODE(4, 0), 0, 0);
-                    response.set_id(message_id);
-                    response.set_length(response_length);
-                    return channel.send(response);
+                    return send_error(message, channel, message_id, RESPONSE_CODE(4, 0));
                 }
 
                 uint8_t *queue = message.buf();
                 message.set_id(message_id);
 
-                // get variable value according to type using the descriptor
-                TrackleReturnType::Enum var_type = variable_type(variable_key);
+                // get variable getter and type using the descriptor, with a single lookup when available
+                TrackleReturnType::Enum var_type = TrackleReturnType::INT;
+                const void *getter;
+                if (find_variable)
+                {
+                    getter = find_variable(variable_key, &var_type);
+                    if (!getter)
+                    {
+                        // unknown variable, send error 404
+                        return send_error(message, channel, message_id, RESPONSE_CODE(4, 4));
+                    }
+                }
+                else
+                {
+                    var_type = variable_type(variable_key);
+                    getter = get_variable(variable_key);
+                }
+
+                // the value is read at the position of the payload of a Block2 response, and moved back when it fits in a single response
+                uint8_t *payload = queue + MAX_RESPONSE_HEADER;
+                const size_t max_length = message.capacity() - MAX_RESPONSE_HEADER;
+                size_t block_size = MAX_BLOCK2_SIZE;
+                while (block_size > max_length)
+                {
+                    block_size >>= 1;
+                }
+
+                size_t offset = 0;
+                size_t length = max_length;
+                if (block2 != CoAP::NO_BLOCK)
+                {
+                    // the block size requested by the cloud may be reduced, the block number is scaled accordingly
+                    const size_t requested_size = CoAP::block_size(block2);
+                    offset = (block2 >> 4) * requested_size;
+                    block_size = std::min(block_size, requested_size);
+                    length = block_size;
+                }
+
+                // every block reads the value again, the ETag tells the cloud when it changed between two blocks
+                uint32_t etag_value;
+                const int total = read_value(variable_key, variable_arg, var_type, getter, get_cached_variable, read_variable, offset, payload, length, &etag_value);
+
+                if (observe == 1)
+                {
+                    remove_observer(variable_key);
+                }
+
                 size_t response = 0;
+                if (total < 0)
+                {
+                    // no value for the variable type
+                }
+                else if (block2 == CoAP::NO_BLOCK && (size_t)total <= max_length)
+                {
+                    uint32_t sequence = NO_OBSERVE;
+                    if (observe == 0 && !variable_arg[0])
+                    {
+                        // register an observer of the variable, notified without arguments
+                        VariableObserver *observer = add_observer(variable_key, token, now, payload, total);
+                        if (observer)
+                        {
+                            sequence = observer->sequence;
+                        }
+                    }
+                    response = response_header(queue, CoAPType::ACK, message_id, token, sequence, CoAP::NO_BLOCK);
+                    memmove(queue + response, payload, total);
+                    response += total;
+                }
+                else if (offset >= (size_t)total && offset > 0)
+                {
+                    // block out of range, send error 402
+                    return send_error(message, channel, message_id, RESPONSE_CODE(4, 2));
+                }
+                else
+                {
+                    // value larger than a single response, send the requested block
+                    const size_t block_length = std::min(block_size, total - offset);
+                    const bool more = offset + block_length < (size_t)total;
+                    const uint8_t etag[4] = {(uint8_t)(etag_value >> 24), (uint8_t)(etag_value >> 16), (uint8_t)(etag_value >> 8), (uint8_t)etag_value};
+                    response = response_header(queue, CoAPType::ACK, message_id, token, NO_OBSERVE, CoAP::block_value(offset / block_size, more, block_size), etag);
+                    memmove(queue + response, payload, block_length);
+                    response += block_length;
+                }
+
+                message.set_length(response);
+                return channel.send(message);
+            }
 
-                if (TrackleReturnType::BOOLEAN == var_type)
+            /**
+             * Marks an observed variable as changed, it is notified by process_observers().
+             * @param variable_key The variable, or null for all the observed variables.
+             */
+            void notify_changed(const char *variable_key)
+            {
+                for (auto &observer : observers)
                 {
-                    const bool result = ((user_variable_bool_cb_t)(get_variable(variable_key)))(variable_arg);
-                    response = Messages::variable_value(queue, message_id, token, result);
+                    if (!variable_key || !strcmp(observer.key, variable_key))
+                    {
+                        observer.changed = true;
+                    }
                 }
-                else if (TrackleReturnType::INT == var_type)
+            }
+
+            /**
+             * Sets the minimum time between two notifications of a variable, and the maximum time after which the
+             * variable is read and notified even when no change was signalled, 0 to disable.
+             */
+            void set_observe_intervals(system_tick_t min_interval, system_tick_t max_interval)
+            {
+                observe_min_interval = min_interval;
+                observe_max_interval = max_interval;
+            }
+
+            /**
+             * Forgets the observers, that are registered again by the cloud in a new session.
+             */
+            void reset_observers()
+            {
+                observers.clear();
+                next_observer = 0;
+                notify_failing = false;
+            }
+
+            /**
+             * Sends the notifications of the observed variables that changed or whose maximum interval elapsed.
+             * A value whose representation did not change is not notified again before the maximum interval.
+             * At most MAX_VARIABLE_NOTIFICATIONS are sent in a pass, the next pass goes on from the following observer.
+             * A notification that can't be sent is tried again in the next pass, it doesn't fail the connection.
+             */
+            ProtocolError process_observers(MessageChannel &channel, const TrackleDescriptor &descriptor, system_tick_t now)
+            {
+                size_t sent = 0;
+                const size_t count = observers.size();
+                for (size_t visited = 0; visited < count && !observers.empty() && sent < MAX_VARIABLE_NOTIFICATIONS; visited++)
                 {
-                    const int32_t result = ((user_variable_int32_cb_t)(get_variable(variable_key)))(variable_arg);
-                    response = Messages::variable_value(queue, message_id, token, result);
+                    if (next_observer >= observers.size())
+                    {
+                        next_observer = 0;
+                    }
+                    const size_t i = next_observer++;
+                    VariableObserver &observer = observers[i];
+                    const system_tick_t elapsed = now - observer.last_notified;
+                    const bool expired = observe_max_interval && elapsed >= observe_max_interval;
+                    if (!expired && (!observer.changed || elapsed < observe_min_interval))
+                    {
+                        continue;
+                    }
+
+                    Message message;
+                    ProtocolError error = channel.create(message);
+                    if (error != NO_ERROR)
+                    {
+                        notify_failed(error, i);
+                        return NO_ERROR;
+                    }
+
+                    uint8_t *payload = message.buf() + MAX_RESPONSE_HEADER;
+                    const size_t max_length = message.capacity() - MAX_RESPONSE_HEADER;
+                    TrackleReturnType::Enum var_type;
+                    const void *getter = find_variable(descriptor, observer.key, &var_type);
+                    const int total = getter ? read_value(observer.key, "", var_type, getter, descriptor.get_cached_variable, descriptor.read_variable, 0, payload, max_length) : -1;
+                    if (total < 0 || (size_t)total > max_length)
+                    {
+                        // the variable is gone or does not fit in a notification anymore, the cloud has to read it
+                        LOG(WARN, "Cannot notify variable %s", observer.key);
+                        observers.erase(observers.begin() + i);
+                        next_observer = i;
+                        continue;
+                    }
+
+                    if (!expired && observer.value.size() == (size_t)total && !memcmp(observer.value.data(), payload, total))
+                    {
+                        observer.changed = false;
+                        continue;
+                    }
+
+                    // the observer is updated once the notification is sent, until then it's still to be notified
+                    const uint32_t sequence = (observer.sequence + 1) & 0xFFFFFF;
+                    size_t length = response_header(message.buf(), CoAPType::NON, 0, observer.token, sequence, CoAP::NO_BLOCK);
+                    memmove(message.buf() + length, payload, total);
+                    message.set_length(length + total);
+                    error = channel.send(message);
+                    if (error != NO_ERROR)
+                    {
+                        notify_failed(error, i);
+                        return NO_ERROR;
+                    }
+                    notify_failing = false;
+                    observer.changed = false;
+                    observer.value.assign(payload, payload + total);
+                    observer.sequence = sequence;
+                    observer.last_notified = now;
+                    sent++;
                 }
-                else if (TrackleReturnType::STRING == var_type || TrackleReturnType::JSON == var_type)
+                return NO_ERROR;
+            }
+
+            /**
+             * Tells whether a variable request is a bulk read: the Uri-Path is just "v" and each Uri-Query names a variable.
+             */
+            static bool is_bulk_request(Message &message)
+            {
+                uint8_t *queue = message.buf();
+                unsigned char *option = queue + 4 + (queue[0] & 0x0F);
+                unsigned char *end = queue + message.length();
+                uint16_t option_number = CoAPOption::NONE;
+                int path_count = 0;
+                bool has_query = false;
+                while (option < end && 0xff != *option)
                 {
-                    const char *str_val = ((user_variable_char_cb_t)(get_variable(variable_key)))(variable_arg);
+                    uint16_t delta;
+                    size_t option_length = CoAP::option_decode(&option, &delta);
+                    option_number += delta;
+                    path_count += (CoAPOption::URI_PATH == option_number);
+                    has_query |= (CoAPOption::URI_QUERY == option_number);
+                    option += option_length;
+                }
+                return path_count == 1 && has_query;
+            }
+
+            /**
+             * Reads the variables named by a bulk request in a single response, sent in Block2 blocks when it
+             * does not fit in a message. For each variable, in the order of the request, the payload holds its type
+             * (0 if it can't be read), the length of its value on 2 bytes and the value, encoded as for a single read.
+             * Every block reads the values again, so blocks carry an ETag computed from the types and lengths of
+             * the entries: when it differs from the one of block 0 the values moved, and the client has to start
+             * over from block 0.
+             */
+            ProtocolError handle_bulk_variable_request(Message &message, MessageChannel &channel, token_t token, message_id_t message_id,
+                                                       const TrackleDescriptor &descriptor)
+            {
+                uint8_t *queue = message.buf();
 
-                    // 2-byte leading length, 16 potential padding bytes
-                    int max_length = message.capacity();
-                    int str_length = strlen(str_val);
-                    if (str_length > max_length)
+                // copy the keys, the response is written over the request
+                std::vector<char> keys;
+                uint32_t block2 = CoAP::NO_BLOCK;
+                unsigned char *option = queue + 4 + (queue[0] & 0x0F);
+                unsigned char *end = queue + message.length();
+                uint16_t option_number = CoAPOption::NONE;
+                while (option < end && 0xff != *option)
+                {
+                    uint16_t delta;
+                    size_t option_length = CoAP::option_decode(&option, &delta);
+                    option_number += delta;
+                    if (option + option_length > end)
+                    {
+                        return send_error(message, channel, message_id, RESPONSE_CODE(4, 0));
+                    }
+                    if (CoAPOption::URI_QUERY == option_number)
                     {
-                        str_length = max_length;
+                        // a key too long for any variable is kept empty, it is answered as unknown
+                        if (option_length <= MAX_VARIABLE_KEY_LENGTH)
+                        {
+                            keys.insert(keys.end(), option, option + option_length);
+                        }
+                        keys.push_back(0);
                     }
-                    response = Messages::variable_value(queue, message_id, token, str_val, str_length);
+                    else if (CoAPOption::BLOCK2 == option_number && option_length <= 3)
+                    {
+                        block2 = CoAP::option_uint_decode(option, option_length);
+                    }
+                    option += option_length;
                 }
-                else if (TrackleReturnType::DOUBLE == var_type)
+                message.set_id(message_id);
+
+                uint8_t *payload = queue + MAX_BULK_RESPONSE_HEADER;
+                const size_t max_length = message.capacity() - MAX_BULK_RESPONSE_HEADER;
+                size_t block_size = MAX_BLOCK2_SIZE;
+                while (block_size > max_length)
+                {
+                    block_size >>= 1;
+                }
+
+                size_t offset = 0;
+                size_t length = max_length;
+                if (block2 != CoAP::NO_BLOCK)
+                {
+                    offset = (block2 >> 4) * CoAP::block_size(block2);
+                    block_size = std::min(block_size, CoAP::block_size(block2));
+                    length = block_size;
+                }
+
+                // each value is read in the window of the payload first, its length is known afterwards
+                const size_t window_end = offset + length;
+                size_t position = 0;
+                uint32_t layout = FNV_OFFSET_BASIS; // FNV-1a of the entry headers, sent as ETag
+                for (const char *key = keys.data(); key < keys.data() + keys.size(); key += strlen(key) + 1)
+                {
+                    TrackleReturnType::Enum var_type;
+                    const void *getter = find_variable(descriptor, key, &var_type);
+
+                    const size_t value_position = position + 3;
+                    const size_t value_offset = offset > value_position ? offset - value_position : 0;
+                    const size_t value_start = value_position + value_offset;
+                    const size_t value_length = value_start < window_end ? window_end - value_start : 0;
+                    int total = getter ? read_value(key, "", var_type, getter, descriptor.get_cached_variable, descriptor.read_variable,
+                                                    value_offset, payload + (value_start - offset), value_length)
+                                       : -1;
+                    if (total > 0xFFFF)
+                    {
+                        total = -1;
+                    }
+
+                    const uint8_t entry[3] = {(uint8_t)(total < 0 ? 0 : var_type), (uint8_t)(total < 0 ? 0 : total >> 8), (uint8_t)(total < 0 ? 0 : total & 0xFF)};
+                    for (size_t i = 0; i < sizeof(entry); i++)
+                    {
+                        if (position + i >= offset && position + i < window_end)
+                        {
+                            payload[position + i - offset] = entry[i];
+                        }
+                        layout = (layout ^ entry[i]) * 16777619u;
+                    }
+                    position = value_position + (total < 0 ? 0 : total);
+                }
+
+                size_t response;
+                if (block2 == CoAP::NO_BLOCK && position <= max_length)
+                {
+                    response = response_header(queue, CoAPType::ACK, message_id, token, NO_OBSERVE, CoAP::NO_BLOCK);
+                    memmove(queue + response, payload, position);
+                    response += position;
+                }
+                else if (offset >= position && offset > 0)
+                {
+                    // block out of range, send error 402
+                    return send_error(message, channel, message_id, RESPONSE_CODE(4, 2));
+                }
+                else
                 {
-                    const double result = ((user_variable_double_cb_t)(get_variable(variable_key)))(variable_arg);
-                    response = Messages::variable_value(queue, message_id, token, result);
+                    const size_t block_length = std::min(block_size, position - offset);
+                    const bool more = offset + block_length < position;
+                    const uint8_t etag[4] = {(uint8_t)(layout >> 24), (uint8_t)(layout >> 16), (uint8_t)(layout >> 8), (uint8_t)layout};
+                    response = response_header(queue, CoAPType::ACK, message_id, token, NO_OBSERVE, CoAP::block_value(offset / block_size, more, block_size), etag);
+                    memmove(queue + response, payload, block_length);
+                    response += block_length;
                 }
 
                 message.set_length(response);
                 return channel.send(message);
             }
+
+        private:
+            /**
+             * Size reserved for the header of a response: header and token, Observe or ETag and Block2 options, payload marker.
+             */
+            static const size_t MAX_RESPONSE_HEADER = 16;
+
+            /**
+             * Size reserved for the header of a bulk response, which has an ETag option instead of Observe.
+             */
+            static const size_t MAX_BULK_RESPONSE_HEADER = MAX_RESPONSE_HEADER + 5;
+
+            /**
+             * Reads a slice of the value of a variable, serialized as sent to the cloud: from the variable cache,
+             * from the variable reader, or from its getter.
+             * @param etag When not null, filled with the FNV-1a hash of the whole value, sent as ETag of its blocks.
+             * @return the whole length of the value, or -1 if the variable type can't be sent.
+             */
+            static int read_value(const char *variable_key, const char *variable_arg, TrackleReturnType::Enum var_type, const void *getter,
+                                  int (*get_cached_variable)(const char *variable_key, const char *arg, size_t offset, uint8_t *buf, size_t max_length),
+                                  int (*read_variable)(const char *variable_key, const char *arg, size_t offset, uint8_t *buf, size_t max_length),
+                                  size_t offset, uint8_t *buf, size_t length, uint32_t *etag = nullptr)
+            {
+                int total = -1;
+                int (*source)(const char *variable_key, const char *arg, size_t offset, uint8_t *buf, size_t max_length) = get_cached_variable;
+                if (get_cached_variable)
+                {
+                    total = get_cached_variable(variable_key, variable_arg, offset, buf, length);
+                }
+                if (total < 0 && read_variable)
+                {
+                    source = read_variable;
+                    total = read_variable(variable_key, variable_arg, offset, buf, length);
+                }
+                if (total >= 0)
+                {
+                    if (etag)
+                    {
+                        // the value is read again in slices, it may be larger than the message
+                        *etag = FNV_OFFSET_BASIS;
+                        uint8_t slice[64];
+                        for (size_t at = 0; at < (size_t)total; at += sizeof(slice))
+                        {
+                            const size_t slice_length = std::min(sizeof(slice), total - at);
+                            if (source(variable_key, variable_arg, at, slice, slice_length) < 0)
+                            {
+                                break;
+                            }
+                            *etag = fnv1a(*etag, slice, slice_length);
+                        }
+                    }
+                    return total;
+                }
+
+                const uint8_t *value;
+                uint8_t scalar[8];
+                if (TrackleReturnType::STRING == var_type || TrackleReturnType::JSON == var_type)
+                {
+                    const char *str_val = ((user_variable_char_cb_t)(getter))(variable_arg);
+                    value = (const uint8_t *)str_val;
+                    total = strlen(str_val);
+                }
+                else if (TrackleReturnType::BOOLEAN == var_type)
+                {
+                    const bool result = ((user_variable_bool_cb_t)(getter))(variable_arg);
+                    scalar[0] = result ? 1 : 0;
+                    value = scalar;
+                    total = 1;
+                }
+                else if (TrackleReturnType::INT == var_type)
+                {
+                    const int32_t result = ((user_variable_int32_cb_t)(getter))(variable_arg);
+                    scalar[0] = (result >> 24) & 0xff;
+                    scalar[1] = (result >> 16) & 0xff;
+                    scalar[2] = (result >> 8) & 0xff;
+                    scalar[3] = (result >> 0) & 0xff;
+                    value = scalar;
+                    total = 4;
+                }
+                else if (TrackleReturnType::DOUBLE == var_type)
+                {
+                    const double result = ((user_variable_double_cb_t)(getter))(variable_arg);
+                    memcpy(scalar, &result, 8);
+                    value = scalar;
+                    total = 8;
+                }
+                else
+                {
+                    return -1;
+                }
+
+                if (offset < (size_t)total)
+                {
+                    memcpy(buf, value + offset, std::min(length, total - offset));
+                }
+                if (etag)
+                {
+                    *etag = fnv1a(FNV_OFFSET_BASIS, value, total);
+                }
+                return total;
+            }
+
+            static const uint32_t FNV_OFFSET_BASIS = 2166136261u;
+
+            static uint32_t fnv1a(uint32_t hash, const uint8_t *data, size_t length)
+            {
+                for (size_t i = 0; i < length; i++)
+                {
+                    hash = (hash ^ data[i]) * 16777619u;
+                }
+                return hash;
+            }
+
+            static const void *find_variable(const TrackleDescriptor &descriptor, const char *variable_key, TrackleReturnType::Enum *var_type)
+            {
+                if (descriptor.find_variable)
+                {
+                    return descriptor.find_variable(variable_key, var_type);
+                }
+                *var_type = descriptor.variable_type(variable_key);
+                return descriptor.get_variable(variable_key);
+            }
+
+            VariableObserver *add_observer(const char *variable_key, token_t token, system_tick_t now, const uint8_t *value, size_t length)
+            {
+                remove_observer(variable_key);
+                if (observers.size() >= MAX_VARIABLE_OBSERVERS)
+                {
+                    LOG(WARN, "Too many observed variables");
+                    return nullptr;
+                }
+
+                VariableObserver observer;
+                memcpy(observer.key, variable_key, sizeof(observer.key));
+                observer.token = token;
+                observer.sequence = 0;
+                observer.last_notified = now;
+                observer.changed = false;
+                observer.value.assign(value, value + length);
+                observers.push_back(std::move(observer));
+                return &observers.back();
+            }
+
+            /**
+             * A notification was not sent: logged once until one is sent again, the observer is the first one of the next pass.
+             */
+            void notify_failed(ProtocolError error, size_t observer)
+            {
+                if (!notify_failing)
+                {
+                    LOG(WARN, "variable notification not sent: %d", error);
+                    notify_failing = true;
+                }
+                next_observer = observer;
+            }
+
+            void remove_observer(const char *variable_key)
+            {
+                for (size_t i = 0; i < observers.size(); i++)
+                {
+                    if (!strcmp(observers[i].key, variable_key))
+                    {
+                        observers.erase(observers.begin() + i);
+                        return;
+                    }
+                }
+            }
+
+            ProtocolError send_error(Message &message, MessageChannel &channel, message_id_t message_id, uint8_t code)
+            {
+                Message response;
+                channel.response(message, response, 16);
+                size_t response_length = Messages::coded_ack(response.buf(), code, 0, 0);
+                response.set_id(message_id);
+                response.set_length(response_length);
+                return channel.send(response);
+            }
+
+            /**
+             * Writes the header of a 2.05 Content response, with the optional ETag, Observe and Block2 options, up to the payload marker.
+             * @return the length of the header.
+             */
+            static size_t response_header(uint8_t *buf, CoAPType::Enum type, message_id_t message_id, token_t token, uint32_t observe, uint32_t block2,
+                                          const uint8_t etag[4] = nullptr)
+            {
+                size_t size = CoAP::header(buf, type, CoAPCode::CONTENT, 1, &token, message_id);
+                CoAPOption::Enum previous = CoAPOption::NONE;
+                uint8_t value[3];
+                if (etag)
+                {
+                    size += CoAP::add_option(buf + size, previous, CoAPOption::ETAG, etag, 4);
+                    previous = CoAPOption::ETAG;
+                }
+                if (observe != NO_OBSERVE)
+                {
+                    size += CoAP::add_option(buf + size, previous, CoAPOption::OBSERVE, value, CoAP::option_uint_encode(value, observe));
+                    previous = CoAPOption::OBSERVE;
+                }
+                if (block2 != CoAP::NO_BLOCK)
+                {
+                    size += CoAP::add_option(buf + size, previous, CoAPOption::BLOCK2, value, CoAP::option_uint_encode(value, block2));
+                }
+                buf[size++] = 0xff; // payload marker
+                return size;
+            }
         };
     }
 }
@@ -0,0 +1,279 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2011-2020 Olaf Bergmann (TZI) and others.
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v. 1.0 which accompanies this distribution.
+ *
+ * The Eclipse Public License is available at http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ * http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+#include "aesni.h"
+
+#ifdef WITH_AESNI
+
+#include <string.h>
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+/* compiled for AES-NI without -maes, only called after aesni_supported() */
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+#define BLOCKSIZE 16
+
+int
+aesni_supported(void) {
+  static int supported = -1;
+  unsigned int a, b, c, d;
+
+  if (supported < 0)
+    supported = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES) != 0;
+  return supported;
+}
+
+static inline AESNI_TARGET __m128i
+expand_step(__m128i key, __m128i assist) {
+  assist = _mm_shuffle_epi32(assist, 0xff);
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, assist);
+}
+
+#define EXPAND(rk, i, rcon) \
+  rk[i] = expand_step(rk[i - 1], _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+
+AESNI_TARGET int
+aesni_set_key(aesni_ctx *ctx, const unsigned char *key, int bits) {
+  __m128i rk[AESNI_ROUNDS + 1];
+  int i;
+
+  if (bits != 128)
+    return -1;
+
+  rk[0] = _mm_loadu_si128((const __m128i *)key);
+  EXPAND(rk, 1, 0x01);
+  EXPAND(rk, 2, 0x02);
+  EXPAND(rk, 3, 0x04);
+  EXPAND(rk, 4, 0x08);
+  EXPAND(rk, 5, 0x10);
+  EXPAND(rk, 6, 0x20);
+  EXPAND(rk, 7, 0x40);
+  EXPAND(rk, 8, 0x80);
+  EXPAND(rk, 9, 0x1b);
+  EXPAND(rk, 10, 0x36);
+
+  for (i = 0; i <= AESNI_ROUNDS; i++)
+    _mm_store_si128((__m128i *)ctx->rk[i], rk[i]);
+  return 0;
+}
+
+/**
+ * Encrypts two independent blocks. The CBC-MAC is a serial chain
+ * through every block, interleaving it round by round with the CTR
+ * keystream hides most of the AESENC latency.
+ */
+static inline AESNI_TARGET void
+encrypt2(const aesni_ctx *ctx, __m128i *x, __m128i *s) {
+  const __m128i *rk = (const __m128i *)ctx->rk;
+  __m128i a = _mm_xor_si128(*x, rk[0]);
+  __m128i b = _mm_xor_si128(*s, rk[0]);
+  int i;
+
+  for (i = 1; i < AESNI_ROUNDS; i++) {
+    a = _mm_aesenc_si128(a, rk[i]);
+    b = _mm_aesenc_si128(b, rk[i]);
+  }
+  *x = _mm_aesenclast_si128(a, rk[AESNI_ROUNDS]);
+  *s = _mm_aesenclast_si128(b, rk[AESNI_ROUNDS]);
+}
+
+static inline AESNI_TARGET __m128i
+encrypt1(const aesni_ctx *ctx, __m128i x) {
+  const __m128i *rk = (const __m128i *)ctx->rk;
+  int i;
+
+  x = _mm_xor_si128(x, rk[0]);
+  for (i = 1; i < AESNI_ROUNDS; i++)
+    x = _mm_aesenc_si128(x, rk[i]);
+  return _mm_aesenclast_si128(x, rk[AESNI_ROUNDS]);
+}
+
+/* loads up to one block, zero padded */
+static inline AESNI_TARGET __m128i
+load_partial(const unsigned char *p, size_t len) {
+  unsigned char b[BLOCKSIZE] = { 0 };
+
+  memcpy(b, p, len);
+  return _mm_loadu_si128((const __m128i *)b);
+}
+
+static inline AESNI_TARGET void
+store_partial(unsigned char *p, __m128i v, size_t len) {
+  unsigned char b[BLOCKSIZE];
+
+  _mm_storeu_si128((__m128i *)b, v);
+  memcpy(p, b, len);
+}
+
+/* A_i: flags, nonce and the counter in the last L bytes */
+static inline AESNI_TARGET __m128i
+counter_block(unsigned char A[BLOCKSIZE], size_t L, unsigned long counter) {
+  size_t i;
+
+  for (i = 0; i < L; i++, counter >>= 8)
+    A[BLOCKSIZE - 1 - i] = counter & 0xff;
+  return _mm_loadu_si128((const __m128i *)A);
+}
+
+/**
+ * Prepares the CBC-MAC over B_0 and the additional data, and S_0 for
+ * the tag. Same block formatting as block0() and add_auth_data() in
+ * ccm.c.
+ */
+static AESNI_TARGET void
+ccm_start(const aesni_ctx *ctx, size_t M, size_t L,
+          const unsigned char nonce[BLOCKSIZE], size_t lm,
+          const unsigned char *aad, uint64_t la,
+          unsigned char A[BLOCKSIZE], __m128i *X, __m128i *S0) {
+  unsigned char B[BLOCKSIZE];
+  size_t i, j;
+
+  B[0] = ((la > 0) << 6) | (((M - 2) / 2) << 3) | (L - 1);
+  memcpy(B + 1, nonce, BLOCKSIZE - L - 1);
+  for (i = 0; i < L; i++, lm >>= 8)
+    B[BLOCKSIZE - 1 - i] = lm & 0xff;
+
+  A[0] = L - 1;
+  memcpy(A + 1, nonce, BLOCKSIZE - L - 1);
+
+  *X = _mm_loadu_si128((const __m128i *)B);
+  *S0 = counter_block(A, L, 0);
+  encrypt2(ctx, X, S0);
+
+  if (!la)
+    return;
+
+  memset(B, 0, BLOCKSIZE);
+  if (la < 0xFF00) {		/* 2^16 - 2^8 */
+    j = 2;
+    B[0] = la >> 8;
+    B[1] = la;
+  } else if (la <= UINT32_MAX) {
+    j = 6;
+    B[0] = 0xFF;
+    B[1] = 0xFE;
+    for (i = 0; i < 4; i++)
+      B[2 + i] = la >> (24 - 8 * i);
+  } else {
+    j = 10;
+    B[0] = 0xFF;
+    B[1] = 0xFF;
+    for (i = 0; i < 8; i++)
+      B[2 + i] = la >> (56 - 8 * i);
+  }
+
+  i = BLOCKSIZE - j < la ? BLOCKSIZE - j : la;
+  memcpy(B + j, aad, i);
+  aad += i;
+  la -= i;
+  *X = encrypt1(ctx, _mm_xor_si128(*X, _mm_loadu_si128((const __m128i *)B)));
+
+  while (la >= BLOCKSIZE) {
+    *X = encrypt1(ctx, _mm_xor_si128(*X, _mm_loadu_si128((const __m128i *)aad)));
+    aad += BLOCKSIZE;
+    la -= BLOCKSIZE;
+  }
+
+  if (la)
+    *X = encrypt1(ctx, _mm_xor_si128(*X, load_partial(aad, la)));
+}
+
+AESNI_TARGET long int
+aesni_ccm_encrypt_message(const aesni_ctx *ctx, size_t M, size_t L,
+                          const unsigned char nonce[BLOCKSIZE],
+                          unsigned char *msg, size_t lm,
+                          const unsigned char *aad, size_t la) {
+  unsigned char A[BLOCKSIZE];
+  unsigned long counter = 1;
+  size_t len = lm;
+  __m128i X, S, S0, P;
+
+  ccm_start(ctx, M, L, nonce, lm, aad, la, A, &X, &S0);
+
+  while (lm >= BLOCKSIZE) {
+    P = _mm_loadu_si128((const __m128i *)msg);
+    X = _mm_xor_si128(X, P);
+    S = counter_block(A, L, counter++);
+    encrypt2(ctx, &X, &S);
+    _mm_storeu_si128((__m128i *)msg, _mm_xor_si128(P, S));
+
+    msg += BLOCKSIZE;
+    lm -= BLOCKSIZE;
+  }
+
+  if (lm) {
+    P = load_partial(msg, lm);
+    X = _mm_xor_si128(X, P);
+    S = counter_block(A, L, counter);
+    encrypt2(ctx, &X, &S);
+    store_partial(msg, _mm_xor_si128(P, S), lm);
+    msg += lm;
+  }
+
+  store_partial(msg, _mm_xor_si128(X, S0), M);
+  return len + M;
+}
+
+AESNI_TARGET long int
+aesni_ccm_decrypt_message(const aesni_ctx *ctx, size_t M, size_t L,
+                          const unsigned char nonce[BLOCKSIZE],
+                          unsigned char *msg, size_t lm,
+                          const unsigned char *aad, size_t la) {
+  unsigned char A[BLOCKSIZE];
+  unsigned char tag[BLOCKSIZE];
+  unsigned long counter = 1;
+  unsigned char diff = 0;
+  size_t i, len;
+  __m128i X, S, S0, P;
+
+  if (lm < M)
+    return -1;
+  lm -= M;
+  len = lm;
+
+  ccm_start(ctx, M, L, nonce, lm, aad, la, A, &X, &S0);
+
+  /* the MAC needs the plaintext, so the keystream runs one block ahead */
+  if (lm)
+    S = encrypt1(ctx, counter_block(A, L, counter++));
+
+  while (lm >= BLOCKSIZE) {
+    P = _mm_xor_si128(_mm_loadu_si128((const __m128i *)msg), S);
+    _mm_storeu_si128((__m128i *)msg, P);
+    X = _mm_xor_si128(X, P);
+    S = counter_block(A, L, counter++);
+    encrypt2(ctx, &X, &S);
+
+    msg += BLOCKSIZE;
+    lm -= BLOCKSIZE;
+  }
+
+  if (lm) {
+    store_partial(msg, _mm_xor_si128(load_partial(msg, lm), S), lm);
+    /* reloaded so the MAC sees zero padding, not keystream */
+    X = encrypt1(ctx, _mm_xor_si128(X, load_partial(msg, lm)));
+    msg += lm;
+  }
+
+  store_partial(tag, _mm_xor_si128(X, S0), M);
+  for (i = 0; i < M; i++)
+    diff |= tag[i] ^ msg[i];
+
+  return diff ? -1 : (long int)len;
+}
+
+#endif /* WITH_AESNI */
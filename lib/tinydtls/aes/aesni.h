@@ -0,0 +1,75 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2011-2020 Olaf Bergmann (TZI) and others.
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v. 1.0 which accompanies this distribution.
+ *
+ * The Eclipse Public License is available at http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ * http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/**
+ * @file aesni.h
+ * @brief AES-128-CCM using the x86-64 AES-NI instructions
+ *
+ * Selected at runtime by crypto.c when the CPU supports AES-NI, the
+ * portable rijndael code is used otherwise. Define WITHOUT_AESNI to
+ * leave the backend out of x86-64 builds.
+ */
+
+#ifndef __AESNI_H
+#define __AESNI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(WITHOUT_AESNI)
+#define WITH_AESNI 1
+#endif
+
+#ifdef WITH_AESNI
+
+#define AESNI_ROUNDS 10
+
+/** Expanded AES-128 encryption key in the layout used by AESENC. */
+typedef struct {
+  uint8_t rk[AESNI_ROUNDS + 1][16] __attribute__((aligned(16)));
+} aesni_ctx;
+
+/** Returns 1 when the CPU implements the AES-NI instructions. */
+int aesni_supported(void);
+
+/**
+ * Expands @p key into @p ctx. Only 128 bit keys are supported.
+ * @return 0 on success, -1 if the key size is not supported.
+ */
+int aesni_set_key(aesni_ctx *ctx, const unsigned char *key, int bits);
+
+/**
+ * Same contract as dtls_ccm_encrypt_message(): encrypts @p lm bytes of
+ * @p msg in place and appends the @p M bytes authentication tag.
+ * @return the length of the encrypted message including the tag.
+ */
+long int
+aesni_ccm_encrypt_message(const aesni_ctx *ctx, size_t M, size_t L,
+                          const unsigned char nonce[16],
+                          unsigned char *msg, size_t lm,
+                          const unsigned char *aad, size_t la);
+
+/**
+ * Same contract as dtls_ccm_decrypt_message(): decrypts @p lm bytes of
+ * @p msg in place, the last @p M bytes are the authentication tag.
+ * @return the length of the plaintext, -1 if the tag does not match.
+ */
+long int
+aesni_ccm_decrypt_message(const aesni_ctx *ctx, size_t M, size_t L,
+                          const unsigned char nonce[16],
+                          unsigned char *msg, size_t lm,
+                          const unsigned char *aad, size_t la);
+
+#endif /* WITH_AESNI */
+
+#endif /* __AESNI_H */
@@ -45,7 +45,10 @@
   if (Seed)                                     \
   dtls_hmac_update(Context, (Seed), (Length))
 
-static struct dtls_cipher_context_t cipher_context;
+/* separate contexts, so records sent and received alternately keep their
+ * expanded keys */
+static struct dtls_cipher_context_t encrypt_context;
+static struct dtls_cipher_context_t decrypt_context;
 
 void crypto_init(void)
 {
@@ -237,6 +240,16 @@ dtls_ccm_encrypt(aes128_ccm_t *ccm_ctx, const unsigned char *src, size_t srclen,
 
   assert(ccm_ctx);
 
+#ifdef WITH_AESNI
+  if (ccm_ctx->use_aesni)
+    return aesni_ccm_encrypt_message(&ccm_ctx->aesni,
+                                     ccm_ctx->tag_length /* M */,
+                                     ccm_ctx->l /* L */,
+                                     nonce,
+                                     buf, srclen,
+                                     aad, la);
+#endif /* WITH_AESNI */
+
   len = dtls_ccm_encrypt_message(&ccm_ctx->ctx,
                                  ccm_ctx->tag_length /* M */,
                                  ccm_ctx->l /* L */,
@@ -257,6 +270,16 @@ dtls_ccm_decrypt(aes128_ccm_t *ccm_ctx, const unsigned char *src,
 
   assert(ccm_ctx);
 
+#ifdef WITH_AESNI
+  if (ccm_ctx->use_aesni)
+    return aesni_ccm_decrypt_message(&ccm_ctx->aesni,
+                                     ccm_ctx->tag_length /* M */,
+                                     ccm_ctx->l /* L */,
+                                     nonce,
+                                     buf, srclen,
+                                     aad, la);
+#endif /* WITH_AESNI */
+
   len = dtls_ccm_decrypt_message(&ccm_ctx->ctx,
                                  ccm_ctx->tag_length /* M */,
                                  ccm_ctx->l /* L */,
@@ -509,6 +532,33 @@ int dtls_ecdsa_verify_sig(const unsigned char *pub_key_x,
 }
 #endif /* DTLS_ECC */
 
+/**
+ * Sets up the key schedule of \p ctx for \p key. The schedule is only
+ * expanded again when the key differs from the one of the previous
+ * record, i.e. once per epoch and direction.
+ */
+static int
+dtls_cipher_set_key(struct dtls_cipher_context_t *ctx,
+                    const unsigned char *key, size_t keylen)
+{
+  if (keylen == ctx->key_length && memcmp(ctx->key, key, keylen) == 0)
+    return 0;
+
+  ctx->key_length = 0;
+  if (keylen > sizeof(ctx->key) ||
+      rijndael_set_key_enc_only(&ctx->data.ctx, key, 8 * keylen) < 0)
+    return -1;
+
+#ifdef WITH_AESNI
+  ctx->data.use_aesni = aesni_supported() &&
+                        aesni_set_key(&ctx->data.aesni, key, 8 * keylen) == 0;
+#endif /* WITH_AESNI */
+
+  memcpy(ctx->key, key, keylen);
+  ctx->key_length = keylen;
+  return 0;
+}
+
 int dtls_encrypt_params(const dtls_ccm_params_t *params,
                         const unsigned char *src, size_t length,
                         unsigned char *buf,
@@ -516,11 +566,11 @@ int dtls_encrypt_params(const dtls_ccm_params_t *params,
                         const unsigned char *aad, size_t la)
 {
   int ret;
-  struct dtls_cipher_context_t *ctx = &cipher_context;
+  struct dtls_cipher_context_t *ctx = &encrypt_context;
   ctx->data.tag_length = params->tag_length;
   ctx->data.l = params->l;
 
-  ret = rijndael_set_key_enc_only(&ctx->data.ctx, key, 8 * keylen);
+  ret = dtls_cipher_set_key(ctx, key, keylen);
   if (ret < 0)
   {
     /* cleanup everything in case the key has the wrong size */
@@ -556,11 +606,11 @@ int dtls_decrypt_params(const dtls_ccm_params_t *params,
                         const unsigned char *aad, size_t la)
 {
   int ret;
-  struct dtls_cipher_context_t *ctx = &cipher_context;
+  struct dtls_cipher_context_t *ctx = &decrypt_context;
   ctx->data.tag_length = params->tag_length;
   ctx->data.l = params->l;
 
-  ret = rijndael_set_key_enc_only(&ctx->data.ctx, key, 8 * keylen);
+  ret = dtls_cipher_set_key(ctx, key, keylen);
   if (ret < 0)
   {
     /* cleanup everything in case the key has the wrong size */
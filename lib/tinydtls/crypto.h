@@ -22,6 +22,7 @@
 #include <stdint.h>
 
 #include "aes/rijndael.h"
+#include "aes/aesni.h"
 
 #include "tinydtls.h"
 #include "global.h"
@@ -45,6 +46,9 @@
 #define MAX_KEYBLOCK_LENGTH  \
   (2 * DTLS_MAC_KEY_LENGTH + 2 * DTLS_KEY_LENGTH + 2 * DTLS_IV_LENGTH)
 
+/** Maximum length of a connection ID accepted from the server (RFC 9146). */
+#define DTLS_MAX_CID_LENGTH 16
+
 /** Length of DTLS master_secret */
 #define DTLS_MASTER_SECRET_LENGTH 48
 #define DTLS_RANDOM_LENGTH 32
@@ -59,6 +63,11 @@ typedef enum {
 /** Crypto context for TLS_PSK_WITH_AES_128_CCM_8 cipher suite. */
 typedef struct {
   rijndael_ctx ctx;		       /**< AES-128 encryption context */
+#ifdef WITH_AESNI
+  aesni_ctx aesni;                     /**< AES-NI key schedule */
+  uint8_t use_aesni;                   /**< aesni holds the key and the
+                                        *   CPU supports AES-NI */
+#endif /* WITH_AESNI */
   uint8_t tag_length;                  /**< length of MAC tag (=M) */
   uint8_t l;                           /**< number of bytes in length
                                         *   field (= L) */
@@ -67,6 +76,8 @@ typedef struct {
 typedef struct dtls_cipher_context_t {
   /** numeric identifier of this cipher suite in host byte order. */
   aes128_ccm_t data;		/**< The crypto context */
+  unsigned char key[AES_MAXKEYBYTES];  /**< key the schedules were expanded from */
+  uint8_t key_length;                  /**< length of key, 0 if not set */
 } dtls_cipher_context_t;
 
 typedef struct {
@@ -118,6 +129,9 @@ typedef struct {
   uint8 key_block[MAX_KEYBLOCK_LENGTH];
   
   seqnum_t cseq;        /**<sequence number of last record received*/
+
+  uint8_t write_cid_length;                /**< length of the connection ID sent to the peer, 0 if not used */
+  uint8 write_cid[DTLS_MAX_CID_LENGTH];    /**< connection ID the peer asked for in its records (RFC 9146) */
 } dtls_security_parameters_t;
 
 struct netq_t;
@@ -138,6 +152,8 @@ typedef struct {
   dtls_cipher_t cipher;		/**< cipher type */
   unsigned int do_client_auth:1;
   unsigned int extended_master_secret:1;
+  uint8_t write_cid_length;                /**< length of the connection ID negotiated in the ServerHello */
+  uint8 write_cid[DTLS_MAX_CID_LENGTH];    /**< connection ID negotiated in the ServerHello */
   union {
 #ifdef DTLS_ECC
     dtls_handshake_parameters_ecdsa_t ecdsa;
@@ -76,7 +76,7 @@
 #define DTLS_HS_LENGTH sizeof(dtls_handshake_header_t)
 #define DTLS_CH_LENGTH sizeof(dtls_client_hello_t) /* no variable length fields! */
 #define DTLS_COOKIE_LENGTH_MAX 32
-#define DTLS_CH_LENGTH_MAX sizeof(dtls_client_hello_t) + DTLS_COOKIE_LENGTH_MAX + 12 + 26 + 12
+#define DTLS_CH_LENGTH_MAX sizeof(dtls_client_hello_t) + DTLS_COOKIE_LENGTH_MAX + 12 + 26 + 12 + 5
 #define DTLS_HV_LENGTH sizeof(dtls_hello_verify_t)
 #define DTLS_SH_LENGTH (2 + DTLS_RANDOM_LENGTH + 1 + 2 + 1)
 #define DTLS_SKEXEC_LENGTH (1 + 2 + 1 + 1 + DTLS_EC_KEY_SIZE + DTLS_EC_KEY_SIZE + 1 + 1 + 2 + 70)
@@ -737,6 +737,8 @@ calculate_key_block(dtls_context_t *ctx,
   security->cipher = handshake->cipher;
   security->compression = handshake->compression;
   security->rseq = 0;
+  security->write_cid_length = handshake->write_cid_length;
+  memcpy(security->write_cid, handshake->write_cid, handshake->write_cid_length);
 
   return 0;
 }
@@ -929,6 +931,18 @@ dtls_check_tls_extension(dtls_peer_t *peer,
       case TLS_EXT_EXTENDED_MASTER_SECRET:
         handshake->extended_master_secret = 1;
         break;
+      case TLS_EXT_CONNECTION_ID:
+        /* The connection ID in the ServerHello is the one the server
+         * wants to find in our records. We never ask for one in the
+         * records we receive, so a ClientHello offer is ignored. */
+        if (!client_hello) {
+          if (j < sizeof(uint8) || dtls_uint8_to_int(data) != j - sizeof(uint8)
+              || j - sizeof(uint8) > DTLS_MAX_CID_LENGTH)
+            goto error;
+          handshake->write_cid_length = j - sizeof(uint8);
+          memcpy(handshake->write_cid, data + sizeof(uint8), handshake->write_cid_length);
+        }
+        break;
       case TLS_EXT_SIG_HASH_ALGO:
         if (verify_ext_sig_hash_algo(data, j))
           goto error;
@@ -1282,6 +1296,7 @@ dtls_prepare_record(dtls_peer_t *peer, dtls_security_parameters_t *security,
   uint8 *p, *start;
   int res;
   unsigned int i;
+  uint8_t cid_length;
 
   if (*rlen < DTLS_RH_LENGTH) {
     dtls_alert("The sendbuf (%zu bytes) is too small\n", *rlen);
@@ -1293,7 +1308,22 @@ dtls_prepare_record(dtls_peer_t *peer, dtls_security_parameters_t *security,
     return dtls_alert_fatal_create(DTLS_ALERT_INTERNAL_ERROR);
   }
 
-  p = dtls_set_record_header(type, security->epoch, &(security->rseq), sendbuf);
+  /* only records protected with the negotiated keys carry the connection ID */
+  cid_length = security->cipher == TLS_NULL_WITH_NULL_NULL ? 0 : security->write_cid_length;
+
+  if (cid_length) {
+    /* tls12_cid record, see RFC 9146: the connection ID goes between the
+     * sequence number and the length, the real content type is encrypted
+     * at the end of the DTLSInnerPlaintext */
+    p = dtls_set_record_header(DTLS_CT_TLS12_CID, security->epoch, &(security->rseq), sendbuf);
+    p -= sizeof(uint16);
+    memcpy(p, security->write_cid, cid_length);
+    p += cid_length;
+    memset(p, 0, sizeof(uint16));
+    p += sizeof(uint16);
+  } else {
+    p = dtls_set_record_header(type, security->epoch, &(security->rseq), sendbuf);
+  }
   start = p;
 
   if (security->cipher == TLS_NULL_WITH_NULL_NULL) {
@@ -1317,8 +1347,15 @@ dtls_prepare_record(dtls_peer_t *peer, dtls_security_parameters_t *security,
      * seq_num(2+6) + type(1) + version(2) + length(2)
      */
 #define A_DATA_LEN 13
+    /**
+     * with a connection ID: seq_num_placeholder(8) + tls12_cid(1) +
+     * cid_length(1) + tls12_cid(1) + version(2) + epoch(2) + seq_num(6) +
+     * cid + length_of_DTLSInnerPlaintext(2)
+     */
+#define A_DATA_CID_LEN (23 + DTLS_MAX_CID_LENGTH)
     unsigned char nonce[DTLS_CCM_BLOCKSIZE];
-    unsigned char A_DATA[A_DATA_LEN];
+    unsigned char A_DATA[A_DATA_CID_LEN];
+    size_t a_data_len;
     /* For backwards-compatibility, dtls_encrypt_params is called with
      * M=<macLen> and L=3. */
     const dtls_ccm_params_t params = { nonce, 8, 3 };
@@ -1377,7 +1414,7 @@ dtls_prepare_record(dtls_peer_t *peer, dtls_security_parameters_t *security,
 
     for (i = 0; i < data_array_len; i++) {
       /* check the minimum that we need for packets that are not encrypted */
-      if (*rlen < res + DTLS_RH_LENGTH + data_len_array[i]) {
+      if (*rlen < res + DTLS_RH_LENGTH + cid_length + data_len_array[i]) {
         dtls_debug("dtls_prepare_record: send buffer too small\n");
         return dtls_alert_fatal_create(DTLS_ALERT_INTERNAL_ERROR);
       }
@@ -1387,6 +1424,17 @@ dtls_prepare_record(dtls_peer_t *peer, dtls_security_parameters_t *security,
       res += data_len_array[i];
     }
 
+    if (cid_length) {
+      /* DTLSInnerPlaintext: content followed by the real type, no padding */
+      if (*rlen < res + DTLS_RH_LENGTH + cid_length + sizeof(uint8)) {
+        dtls_debug("dtls_prepare_record: send buffer too small\n");
+        return dtls_alert_fatal_create(DTLS_ALERT_INTERNAL_ERROR);
+      }
+      dtls_int_to_uint8(p, type);
+      p += sizeof(uint8);
+      res += sizeof(uint8);
+    }
+
     memset(nonce, 0, DTLS_CCM_BLOCKSIZE);
     memcpy(nonce, dtls_kb_local_iv(security, peer->role),
 	   dtls_kb_iv_size(security, peer->role));
@@ -1401,14 +1449,26 @@ dtls_prepare_record(dtls_peer_t *peer, dtls_security_parameters_t *security,
      * additional_data = seq_num + TLSCompressed.type +
      *                   TLSCompressed.version + TLSCompressed.length;
      */
-    memcpy(A_DATA, &DTLS_RECORD_HEADER(sendbuf)->epoch, 8); /* epoch and seq_num */
-    memcpy(A_DATA + 8,  &DTLS_RECORD_HEADER(sendbuf)->content_type, 3); /* type and version */
-    dtls_int_to_uint16(A_DATA + 11, res - 8); /* length */
+    if (cid_length) {
+      /* RFC 9146, Section 5 */
+      memset(A_DATA, 0xff, 8); /* seq_num_placeholder */
+      dtls_int_to_uint8(A_DATA + 8, DTLS_CT_TLS12_CID);
+      dtls_int_to_uint8(A_DATA + 9, cid_length);
+      memcpy(A_DATA + 10, &DTLS_RECORD_HEADER(sendbuf)->content_type, 11); /* tls12_cid, version, epoch and seq_num */
+      memcpy(A_DATA + 21, security->write_cid, cid_length);
+      dtls_int_to_uint16(A_DATA + 21 + cid_length, res - 8); /* length of the DTLSInnerPlaintext */
+      a_data_len = 23 + cid_length;
+    } else {
+      memcpy(A_DATA, &DTLS_RECORD_HEADER(sendbuf)->epoch, 8); /* epoch and seq_num */
+      memcpy(A_DATA + 8,  &DTLS_RECORD_HEADER(sendbuf)->content_type, 3); /* type and version */
+      dtls_int_to_uint16(A_DATA + 11, res - 8); /* length */
+      a_data_len = A_DATA_LEN;
+    }
 
     res = dtls_encrypt_params(&params, start + 8, res - 8, start + 8,
                dtls_kb_local_write_key(security, peer->role),
                dtls_kb_key_size(security, peer->role),
-               A_DATA, A_DATA_LEN);
+               A_DATA, a_data_len);
 
     if (res < 0)
       return res;
@@ -1418,9 +1478,9 @@ dtls_prepare_record(dtls_peer_t *peer, dtls_security_parameters_t *security,
   }
 
   /* fix length of fragment in sendbuf */
-  dtls_int_to_uint16(sendbuf + 11, res);
+  dtls_int_to_uint16(sendbuf + 11 + cid_length, res);
 
-  *rlen = DTLS_RH_LENGTH + res;
+  *rlen = DTLS_RH_LENGTH + cid_length + res;
   return 0;
 }
 
@@ -2652,7 +2712,7 @@ dtls_send_client_hello(dtls_context_t *ctx, dtls_peer_t *peer,
   ecdsa = is_ecdsa_supported(ctx, 1);
 
   cipher_size = 2 + ((ecdsa) ? 2 : 0) + ((psk) ? 2 : 0);
-  extension_size = 4 + ((ecdsa) ? 6 + 6 + 8 + 6 + 8: 0);
+  extension_size = 4 + 5 + ((ecdsa) ? 6 + 6 + 8 + 6 + 8: 0);
 
   if (cipher_size == 0) {
     dtls_crit("no cipher callbacks implemented\n");
@@ -2801,6 +2861,19 @@ dtls_send_client_hello(dtls_context_t *ctx, dtls_peer_t *peer,
   p += sizeof(uint16);
   handshake->extended_master_secret = 1;
 
+  /* connection ID, see RFC 9146 */
+  dtls_int_to_uint16(p, TLS_EXT_CONNECTION_ID);
+  p += sizeof(uint16);
+
+  /* length of this extension type */
+  dtls_int_to_uint16(p, 1);
+  p += sizeof(uint16);
+
+  /* zero length: the server sends plain records to us, but may
+   * give us a connection ID to put into the records we send */
+  dtls_int_to_uint8(p, 0);
+  p += sizeof(uint8);
+
   handshake->hs_state.read_epoch = dtls_security_params(peer)->epoch;
   assert((buf <= p) && ((unsigned int)(p - buf) <= sizeof(buf)));
 
@@ -2886,8 +2959,9 @@ check_server_hello(dtls_context_t *ctx,
   data += sizeof(uint8);
   data_length -= sizeof(uint8);
 
-  /* Server may not support extended master secret */
+  /* Server may not support extended master secret nor connection IDs */
   handshake->extended_master_secret = 0;
+  handshake->write_cid_length = 0;
   return dtls_check_tls_extension(peer, data, data_length, 0);
 
 error:
@@ -4475,6 +4549,31 @@ dtls_connect(dtls_context_t *ctx, const session_t *dst) {
   return res;
 }
 
+int
+dtls_restore_peer(dtls_context_t *ctx, const session_t *dst,
+                  const dtls_security_parameters_t *params) {
+  dtls_peer_t *peer;
+
+  if (dtls_get_peer(ctx, dst))
+    return -1;
+
+  peer = dtls_new_peer(dst);
+  if (!peer) {
+    dtls_crit("cannot create new peer\n");
+    return -1;
+  }
+
+  peer->role = DTLS_CLIENT;
+  peer->state = DTLS_STATE_CONNECTED;
+  memcpy(peer->security_params[0], params, sizeof(dtls_security_parameters_t));
+
+  if (dtls_add_peer(ctx, peer) < 0) {
+    dtls_free_peer(peer);
+    return -1;
+  }
+  return 0;
+}
+
 static void
 dtls_retransmit(dtls_context_t *context, netq_t *node) {
   if (!context || !node)
@@ -304,6 +304,19 @@ int dtls_connect(dtls_context_t *ctx, const session_t *dst);
  */
 int dtls_connect_peer(dtls_context_t *ctx, dtls_peer_t *peer);
 
+/**
+ * Restores a client session with the specified remote peer @p dst
+ * from security parameters saved while it was connected, so that
+ * application data can be exchanged without a new handshake.
+ *
+ * @param ctx    The DTLS context to use.
+ * @param dst    The remote party of the session.
+ * @param params The security parameters of the current epoch.
+ * @return @c 0 on success, a value less than zero on error.
+ */
+int dtls_restore_peer(dtls_context_t *ctx, const session_t *dst,
+                      const dtls_security_parameters_t *params);
+
 /**
  * Closes the DTLS connection associated with @p remote. This function
  * returns zero on success, and a value less than zero on error.
@@ -370,6 +383,7 @@ void dtls_check_retransmit(dtls_context_t *context, clock_time_t *next);
 #define DTLS_CT_ALERT 21
 #define DTLS_CT_HANDSHAKE 22
 #define DTLS_CT_APPLICATION_DATA 23
+#define DTLS_CT_TLS12_CID 25 /* see RFC 9146 */
 
 #ifdef __GNUC__
 #define PACK(__Declaration__) __Declaration__ __attribute__((__packed__))
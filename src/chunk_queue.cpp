@@ -0,0 +1,79 @@
+#include "logging.h"
+LOG_SOURCE_CATEGORY("comm.chunk_queue")
+
+#include "chunk_queue.h"
+#include <string.h>
+#include <new>
+
+using namespace trackle;
+
+ChunkQueue::ChunkQueue() : pool(nullptr), slot_size(0), capacity(0), chunk_size(0), head(0), tail(0)
+{
+}
+
+ChunkQueue::~ChunkQueue()
+{
+	delete[] pool;
+}
+
+bool ChunkQueue::configure(uint16_t capacity_, uint16_t chunk_size_)
+{
+	const uint32_t pending = tail.load() - head.load();
+	if (pending)
+	{
+		LOG(WARN, "Discarding %d queued chunks", pending);
+	}
+
+	delete[] pool;
+	pool = nullptr;
+	capacity = 0;
+	head = 0;
+	tail = 0;
+	if (!capacity_)
+		return true;
+
+	// keep slots pointer aligned
+	slot_size = sizeof(Slot) + chunk_size_;
+	slot_size = (slot_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	pool = new (std::nothrow) uint8_t[slot_size * capacity_];
+	if (!pool)
+	{
+		LOG(ERROR, "Cannot allocate chunk queue of %d chunks", capacity_);
+		return false;
+	}
+	capacity = capacity_;
+	chunk_size = chunk_size_;
+	return true;
+}
+
+bool ChunkQueue::push(const FileTransfer::Descriptor &descriptor, const unsigned char *chunk)
+{
+	const uint32_t t = tail.load(std::memory_order_relaxed);
+	if (!enabled() || t - head.load(std::memory_order_acquire) >= capacity || descriptor.chunk_size > chunk_size)
+		return false;
+
+	Slot *s = slot(t);
+	s->descriptor = descriptor;
+	memcpy(s + 1, chunk, descriptor.chunk_size);
+
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+int ChunkQueue::drain(Writer writer)
+{
+	int failed = 0;
+	while (enabled())
+	{
+		const uint32_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			break;
+
+		Slot *s = slot(h);
+		if (writer(s->descriptor, (const unsigned char *)(s + 1), nullptr))
+			failed++;
+
+		head.store(h + 1, std::memory_order_release);
+	}
+	return failed;
+}
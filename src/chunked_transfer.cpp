@@ -47,8 +47,15 @@ namespace trackle
                 file.file_address = 0;
                 file.chunk_address = 0;
             }
+            delta_update = flags & UPDATE_FLAG_DELTA;
+            compressed_update = flags & UPDATE_FLAG_COMPRESSED;
+            if (decoded_update())
+            {
+                // the file is decoded as it's received, so the chunks must come in order
+                flags &= ~(1 << 0);
+            }
             // check the parameters only
-            bool success = !callbacks->prepare_for_firmware_update(file, 1, NULL);
+            bool success = !callbacks->prepare_for_firmware_update(file, PrepareFlag::DRY_RUN | (delta_update ? PrepareFlag::DELTA : 0), NULL);
             if (success)
             {
                 success = file.chunk_count(file.chunk_size) < MAX_CHUNKS;
@@ -64,25 +71,54 @@ namespace trackle
 
             if (success)
             {
-                if (!callbacks->prepare_for_firmware_update(file, 0, NULL))
+                chunk_size = file.chunk_size; // save chunk size since the descriptor size is overwritten
+                Message updateReady;
+                channel.create(updateReady);
+                // updateReady will have the maximum capacity
+                int offset = updateReady.capacity() - chunk_bitmap_size();
+                bitmap = queue + offset; // this relies on the fact that we know the channels use a static buffer
+
+                // only fast OTA tracks the chunks in the bitmap
+                resumable = (flags & 1) && checkpoint_interval;
+                bool resumed = resumable && restore_transfer_state();
+                // the new image is prepared once its length is read from the patch or the compressed stream
+                if (delta_update)
+                {
+                    delta.begin(this);
+                }
+                if (compressed_update)
+                {
+                    decompressor.begin(this);
+                }
+                int prepared = decoded_update() ? 0 : callbacks->prepare_for_firmware_update(file, resumed ? PrepareFlag::RESUME : 0, NULL);
+                if (prepared && resumed)
+                {
+                    // the stored chunks are gone, e.g. held in memory before a reboot
+                    LOG(WARN, "Cannot resume transfer, starting over");
+                    callbacks->save_transfer_state(NULL, 0);
+                    resumed = false;
+                    prepared = callbacks->prepare_for_firmware_update(file, 0, NULL);
+                }
+                if (!prepared)
                 {
                     LOG_DEBUG(TRACE, "starting file length %d chunks %d chunk_size %d",
                               file.file_length, file.chunk_count(file.chunk_size),
                               file.chunk_size);
                     last_chunk_millis = callbacks->millis();
                     chunk_index = 0;
-                    chunk_size = file.chunk_size; // save chunk size since the descriptor size is overwritten
+                    chunks_since_checkpoint = 0;
+                    fast_transfer = flags & 1;
+                    received_end = 0;
+                    report_cursor = 0;
                     updating = 1;
-                    Message updateReady;
-                    channel.create(updateReady);
-                    // updateReady will have the maximum capacity
-                    int offset = updateReady.capacity() - chunk_bitmap_size();
-                    bitmap = queue + offset; // this relies on the fact that we know the channels use a static buffer
 
                     // when not in fast OTA mode, the chunk missing buffer is set to 1 since the protocol
                     // handles missing chunks one by one. Also we don't know the actual size of the file to
                     // know the correct size of the bitmap.
-                    set_chunks_received(flags & 1 ? 0 : 0xFF);
+                    if (!resumed)
+                    {
+                        set_chunks_received(flags & 1 ? 0 : 0xFF);
+                    }
 
                     // send update_reaady - use fast OTA if available
                     size_t size = Messages::update_ready(updateReady.buf(), 0, token, (flags & 0x1), channel.is_unreliable());
@@ -91,6 +127,11 @@ namespace trackle
                     error = channel.send(updateReady);
                     if (error)
                         LOG_DEBUG(TRACE, "error sending updateReady");
+                    else if (resumed)
+                    {
+                        // ask right away for the chunks still missing
+                        error = send_missing_chunks(channel, MISSED_CHUNKS_TO_SEND);
+                    }
                 }
             }
             return error;
@@ -156,7 +197,8 @@ namespace trackle
                 const uint8_t *chunk = queue + payload;
                 file.chunk_size = message.length() - payload;
                 file.chunk_address = file.file_address + (chunk_index * chunk_size);
-                if (chunk_index >= MAX_CHUNKS)
+                // a chunk past the end of the file would be counted as received, in place of a missing one
+                if (chunk_index >= MAX_CHUNKS || chunk_index >= file.chunk_count(chunk_size))
                 {
                     LOG(WARN, "invalid chunk index %d", chunk_index);
                     return NO_ERROR;
@@ -166,9 +208,11 @@ namespace trackle
                 bool crc_valid = (crc == given_crc);
                 LOG_DEBUG(TRACE, "chunk idx=%d crc=%d fast=%d updating=%d", chunk_index,
                           crc_valid, fast_ota, updating);
-                if (crc_valid)
+                // a chunk that can't be saved now, e.g. when the writer is behind, is handled as a bad one.
+                // A chunk stored before the transfer was resumed isn't written again
+                bool stored = resumable && is_chunk_received(chunk_index);
+                if (crc_valid && (stored || !save_chunk(chunk)))
                 {
-                    callbacks->save_firmware_chunk(file, chunk, NULL);
                     if (!fast_ota)
                     {
                         // message is confirmable for regular OTA or when
@@ -176,15 +220,27 @@ namespace trackle
                     }
                     flag_chunk_received(chunk_index);
                     chunk_index++;
+                    received_end = std::max(received_end, (unsigned)chunk_index);
+                    if (resumable && !stored && ++chunks_since_checkpoint >= checkpoint_interval)
+                    {
+                        save_transfer_state();
+                    }
                 }
                 else
                 {
-                    LOG(WARN, "chunk crc bad %d: wanted %x got %x", chunk_index, given_crc, crc);
+                    if (!crc_valid)
+                    {
+                        LOG(WARN, "chunk crc bad %d: wanted %x got %x", chunk_index, given_crc, crc);
+                    }
                     if (!fast_ota)
                     {
                         response_size = Messages::chunk_received(response.buf(), 0, token, ChunkReceivedCode::BAD, channel.is_unreliable());
                     }
                     // fast OTA will request the chunk later
+                    if (decoded_update() && decoding_failed())
+                    {
+                        abort_decoded_update();
+                    }
                 }
                 if (response_size)
                 {
@@ -206,7 +262,7 @@ namespace trackle
             memset(buf, 0, sizeof(buf));
             if (code != ChunkReceivedCode::BAD)
             {
-                callbacks->finish_firmware_update(file, UpdateFlag::SUCCESS | UpdateFlag::VALIDATE_ONLY, buf);
+                callbacks->finish_firmware_update(stored_file(), UpdateFlag::SUCCESS | UpdateFlag::VALIDATE_ONLY, buf);
                 data_len = strnlen(buf, sizeof(buf) - 1);
                 if (data_len)
                 {
@@ -244,12 +300,14 @@ namespace trackle
             LOG_DEBUG(TRACE, "update done received");
             chunk_index_t index = next_chunk_missing(0);
             bool missing = index != NO_CHUNKS_MISSING;
+            // a decoded file is received in order, so it's complete only if the new image is
+            bool failed = is_updating() && decoded_update() && !decoding_complete();
             uint8_t *queue = message.buf();
             message_id_t msg_id = CoAP::message_id(queue);
             response.set_id(msg_id);
 
             notify_update_done(message, response, channel, token,
-                               missing ? ChunkReceivedCode::BAD : ChunkReceivedCode::OK);
+                               missing || failed ? ChunkReceivedCode::BAD : ChunkReceivedCode::OK);
             ProtocolError error = channel.send(response);
             // how can we busy wait for the server to ACK this?
             if (error)
@@ -262,11 +320,20 @@ namespace trackle
                 return NO_ERROR;
             }
 
-            if (!missing)
+            if (failed)
+            {
+                LOG(ERROR, "update done - decoded image incomplete");
+                abort_decoded_update();
+            }
+            else if (!missing)
             {
                 LOG_DEBUG(TRACE, "update done - all done!");
+                if (resumable)
+                {
+                    callbacks->save_transfer_state(NULL, 0);
+                }
                 reset_updating();
-                callbacks->finish_firmware_update(file, UpdateFlag::SUCCESS, NULL);
+                callbacks->finish_firmware_update(stored_file(), UpdateFlag::SUCCESS, NULL);
             }
             else
             {
@@ -283,10 +350,10 @@ namespace trackle
         }
 
         ProtocolError ChunkedTransfer::send_missing_chunks(MessageChannel &channel,
-                                                           size_t count)
+                                                           size_t count, chunk_index_t start, unsigned end)
         {
             size_t sent = 0;
-            chunk_index_t idx = 0;
+            chunk_index_t idx = start;
             Message message;
             channel.create(message, 7 + (count * 2));
 
@@ -299,7 +366,7 @@ namespace trackle
             buf[5] = 'c';
             buf[6] = 0xff; // payload marker
 
-            while ((idx = next_chunk_missing(chunk_index_t(idx))) != NO_CHUNKS_MISSING && sent < count)
+            while ((idx = next_chunk_missing(chunk_index_t(idx))) != NO_CHUNKS_MISSING && idx < end && sent < count)
             {
                 buf[(sent * 2) + 7] = idx >> 8;
                 buf[(sent * 2) + 8] = idx & 0xFF;
@@ -324,8 +391,50 @@ namespace trackle
 
         ProtocolError ChunkedTransfer::idle(MessageChannel &channel)
         {
-            /* Timeout to resend missing chunks removed.
-             * Leaving idle() here in case we need to add something in the future. */
+            // missing chunks are reported during the transfer only in fast OTA, until the server sends UpdateDone
+            if (updating != 1 || !fast_transfer || !bitmap)
+            {
+                return NO_ERROR;
+            }
+
+            system_tick_t now = callbacks->millis();
+            if (report_timeout && now - last_chunk_millis >= report_timeout)
+            {
+                // the flight stalled: ask again for everything missing so far
+                last_chunk_millis = now;
+                report_cursor = 0;
+                if (next_chunk_missing(0) != NO_CHUNKS_MISSING)
+                {
+                    LOG_DEBUG(TRACE, "no chunks for %d ms, reporting missing chunks", report_timeout);
+                    // a report that can't be sent is tried again after the next timeout, the transfer goes on
+                    ProtocolError error = send_missing_chunks(channel, MISSED_CHUNKS_TO_SEND);
+                    if (error)
+                    {
+                        LOG(WARN, "missing chunks not reported: %d", error);
+                    }
+                }
+                return NO_ERROR;
+            }
+
+            // a gap far enough behind the received chunks won't be filled by the current flight
+            if (report_distance && received_end > report_cursor + report_distance)
+            {
+                unsigned end = received_end - report_distance;
+                chunk_index_t idx = next_chunk_missing(report_cursor);
+                if (idx == NO_CHUNKS_MISSING || idx >= end)
+                {
+                    report_cursor = end;
+                    return NO_ERROR;
+                }
+                // the cursor moves only past the chunks reported, a report that can't be sent is tried again
+                ProtocolError error = send_missing_chunks(channel, MISSED_CHUNKS_TO_SEND, idx, end);
+                if (error)
+                {
+                    LOG(WARN, "missing chunks not reported: %d", error);
+                    return NO_ERROR;
+                }
+                report_cursor = missed_chunk_index + 1;
+            }
             return NO_ERROR;
         }
 
@@ -335,25 +444,164 @@ namespace trackle
             {
                 // was updating but had an error, inform the client
                 LOG(WARN, "handle received message failed - aborting transfer");
-                callbacks->finish_firmware_update(file, 0, NULL);
+                if (resumable && bitmap)
+                {
+                    save_transfer_state();
+                }
+                callbacks->finish_firmware_update(stored_file(), 0, NULL);
+            }
+        }
+
+        int ChunkedTransfer::save_chunk(const unsigned char *chunk)
+        {
+            if (compressed_update)
+            {
+                return decompressor.apply(chunk, chunk_data_length());
+            }
+            if (delta_update)
+            {
+                return delta.apply(chunk, chunk_data_length());
             }
+            return callbacks->save_firmware_chunk(file, chunk, NULL);
+        }
+
+        uint16_t ChunkedTransfer::chunk_data_length()
+        {
+            // the cloud pads the last chunk up to the chunk size
+            uint32_t offset = file.chunk_address - file.file_address;
+            return offset < file.file_length ? std::min((uint32_t)file.chunk_size, file.file_length - offset) : 0;
+        }
+
+        void ChunkedTransfer::abort_decoded_update()
+        {
+            LOG(WARN, "decoding the update failed - aborting transfer");
+            decompressor.end();
+            reset_updating();
+            callbacks->finish_firmware_update(target, 0, NULL);
+        }
+
+        int ChunkedTransfer::begin_target(uint32_t length)
+        {
+            target = file;
+            target.file_length = length;
+            target.chunk_size = DeltaPatch::BLOCK_SIZE;
+            target.chunk_address = target.file_address;
+            return callbacks->prepare_for_firmware_update(target, PrepareFlag::DELTA, NULL);
+        }
+
+        int ChunkedTransfer::read_source(uint32_t offset, uint8_t *buf, size_t length)
+        {
+            return callbacks->read_installed_firmware(offset, buf, length);
+        }
+
+        int ChunkedTransfer::write_target(uint32_t offset, const uint8_t *buf, size_t length)
+        {
+            target.chunk_address = target.file_address + offset;
+            target.chunk_size = length;
+            return callbacks->save_firmware_chunk(target, buf, NULL);
+        }
+
+        int ChunkedTransfer::begin_output(uint32_t length, size_t block_size)
+        {
+            if (delta_update)
+            {
+                // the patch has its own header
+                return 0;
+            }
+            target = file;
+            target.file_length = length;
+            target.chunk_size = block_size;
+            target.chunk_address = target.file_address;
+            return callbacks->prepare_for_firmware_update(target, 0, NULL);
+        }
+
+        int ChunkedTransfer::write_output(uint32_t offset, const uint8_t *buf, size_t length)
+        {
+            return delta_update ? delta.apply(buf, length) : write_target(offset, buf, length);
+        }
+
+        uint64_t ChunkedTransfer::chunk_bitmap_word(unsigned word)
+        {
+            uint64_t value = ~uint64_t(0);
+            // the bitmap isn't aligned
+            memcpy(&value, bitmap + word * 8, std::min(8u, chunk_bitmap_size() - word * 8));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            value = __builtin_bswap64(value);
+#endif
+            return value;
         }
 
         chunk_index_t ChunkedTransfer::next_chunk_missing(chunk_index_t start)
         {
-            chunk_index_t chunk = NO_CHUNKS_MISSING;
-            chunk_index_t chunks = file.chunk_count(chunk_size);
-            chunk_index_t idx = start;
-            for (; idx < chunks; idx++)
+            const unsigned chunks = file.chunk_count(chunk_size);
+            if (received_chunks >= chunks)
             {
-                if (!is_chunk_received(idx))
+                return NO_CHUNKS_MISSING;
+            }
+            unsigned idx = std::max((unsigned)start, first_missing);
+            unsigned chunk = chunks;
+            for (unsigned word = idx / 64; word * 64 < chunks; word++)
+            {
+                uint64_t missing = ~chunk_bitmap_word(word);
+                if (word == idx / 64)
+                {
+                    missing &= ~uint64_t(0) << (idx % 64);
+                }
+                if (missing)
                 {
-                    // serial_dump("next missing chunk %d from %d", idx, start);
-                    chunk = idx;
+                    chunk = std::min(chunks, word * 64 + __builtin_ctzll(missing));
                     break;
                 }
             }
-            return chunk;
+            if (start <= first_missing)
+            {
+                first_missing = chunk;
+            }
+            // serial_dump("next missing chunk %d from %d", chunk, start);
+            return chunk < chunks ? chunk_index_t(chunk) : NO_CHUNKS_MISSING;
+        }
+
+        bool ChunkedTransfer::restore_transfer_state()
+        {
+            // the state is restored just before the bitmap, the buffer is free at this point
+            size_t bytes = chunk_bitmap_size();
+            uint8_t *data = bitmap - sizeof(TransferState);
+            if (callbacks->restore_transfer_state(data, sizeof(TransferState) + bytes) != int(sizeof(TransferState) + bytes))
+            {
+                return false;
+            }
+            TransferState state;
+            memcpy(&state, data, sizeof(state));
+            if (state.file_length != file.file_length || state.file_address != file.file_address ||
+                state.chunk_size != chunk_size || state.store != file.store ||
+                state.bitmap_crc != callbacks->calculate_crc(bitmap, bytes))
+            {
+                LOG(INFO, "Stored transfer state doesn't match, starting over");
+                return false;
+            }
+            LOG(INFO, "Resuming transfer");
+            count_chunks_received();
+            return true;
+        }
+
+        void ChunkedTransfer::save_transfer_state()
+        {
+            size_t bytes = chunk_bitmap_size();
+            TransferState state;
+            memset(&state, 0, sizeof(state));
+            state.file_length = file.file_length;
+            state.file_address = file.file_address;
+            state.chunk_size = chunk_size;
+            state.store = file.store;
+            state.bitmap_crc = callbacks->calculate_crc(bitmap, bytes);
+            // the chunk has been stored, so the buffer before the bitmap is free
+            uint8_t *data = bitmap - sizeof(TransferState);
+            memcpy(data, &state, sizeof(state));
+            if (callbacks->save_transfer_state(data, sizeof(TransferState) + bytes))
+            {
+                LOG(WARN, "Cannot save transfer state");
+            }
+            chunks_since_checkpoint = 0;
         }
 
         void ChunkedTransfer::set_chunks_received(uint8_t value)
@@ -361,6 +609,25 @@ namespace trackle
             size_t bytes = chunk_bitmap_size();
             if (bytes)
                 memset(bitmap, value, bytes);
+            received_chunks = value ? file.chunk_count(chunk_size) : 0;
+            first_missing = 0;
+        }
+
+        void ChunkedTransfer::count_chunks_received()
+        {
+            const unsigned chunks = file.chunk_count(chunk_size);
+            received_chunks = 0;
+            for (unsigned word = 0; word * 64 < chunks; word++)
+            {
+                uint64_t received = chunk_bitmap_word(word);
+                if (chunks - word * 64 < 64)
+                {
+                    // the bits past the last chunk
+                    received &= ~(~uint64_t(0) << (chunks - word * 64));
+                }
+                received_chunks += __builtin_popcountll(received);
+            }
+            first_missing = 0;
         }
 
     }
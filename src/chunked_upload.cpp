@@ -0,0 +1,408 @@
+#include "logging.h"
+LOG_SOURCE_CATEGORY("comm.upload")
+
+#include "chunked_upload.h"
+#include "messages.h"
+#include "crc32.h"
+#include <new>
+
+namespace trackle
+{
+    namespace protocol
+    {
+
+        /**
+         * @return the payload marker of the message, or the end if there's no payload.
+         */
+        static uint8_t *find_payload(uint8_t *queue, uint8_t *end)
+        {
+            uint8_t *option = queue + 4 + (queue[0] & 0x0F);
+            while (option < end && *option != 0xff)
+            {
+                size_t option_length = CoAP::option_decode(&option);
+                option += option_length;
+            }
+            return option;
+        }
+
+        chunk_index_t ChunkedUpload::next_pending(chunk_index_t from) const
+        {
+            unsigned word = from / 64;
+            const unsigned words = (chunk_count + 63) / 64;
+            if (word >= words)
+                return NO_CHUNKS_MISSING;
+
+            uint64_t bits = pending[word] & (~uint64_t(0) << (from % 64));
+            while (!bits)
+            {
+                if (++word == words)
+                    return NO_CHUNKS_MISSING;
+                bits = pending[word];
+            }
+            return chunk_index_t(word * 64 + __builtin_ctzll(bits));
+        }
+
+        void ChunkedUpload::set_pending(chunk_index_t index)
+        {
+            pending[index / 64] |= uint64_t(1) << (index % 64);
+            if (index < cursor)
+                cursor = index;
+        }
+
+        ProtocolError ChunkedUpload::begin(MessageChannel &channel, const char *name_, uint32_t length)
+        {
+            if (state != IDLE)
+            {
+                return INVALID_STATE;
+            }
+            if (!length || (length + CHUNK_SIZE - 1) / CHUNK_SIZE >= MAX_CHUNKS)
+            {
+                LOG(ERROR, "upload of %lu bytes not supported", (unsigned long)length);
+                return INSUFFICIENT_STORAGE;
+            }
+
+            strncpy(name, name_ ? name_ : "", MAX_NAME_LENGTH);
+            name[MAX_NAME_LENGTH] = 0;
+            file_length = length;
+            chunk_count = (length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+            const unsigned words = (chunk_count + 63) / 64;
+            delete[] pending;
+            pending = new (std::nothrow) uint64_t[words];
+            if (!pending)
+            {
+                return INSUFFICIENT_STORAGE;
+            }
+            memset(pending, 0xFF, words * sizeof(uint64_t));
+            if (chunk_count % 64)
+            {
+                pending[words - 1] = (uint64_t(1) << (chunk_count % 64)) - 1;
+            }
+            cursor = 0;
+            crc_next = 0;
+            crc = 0;
+            window_first = 0;
+            sent_since_checkpoint = 0;
+            checkpoints_pending = 0;
+            for (uint8_t i = 0; i < MAX_CHECKPOINTS; i++)
+                checkpoints[i].active = false;
+            send_failing = false;
+            upload_id++;
+
+            ProtocolError error = send_begin(channel);
+            if (error)
+            {
+                delete[] pending;
+                pending = nullptr;
+                return error;
+            }
+            LOG(INFO, "upload of %s started, %lu bytes in %d chunks", name, (unsigned long)file_length, chunk_count);
+            state = BEGIN_SENT;
+            return NO_ERROR;
+        }
+
+        ProtocolError ChunkedUpload::send_begin(MessageChannel &channel)
+        {
+            Message message;
+            const size_t name_length = strlen(name);
+            ProtocolError error = channel.create(message, 13 + name_length);
+            if (error)
+                return error;
+
+            uint8_t *buf = message.buf();
+            buf[0] = 0x41; // confirmable, one-byte token
+            buf[1] = 0x02; // code 0.02 POST
+            buf[2] = 0;
+            buf[3] = 0;
+            buf[4] = upload_id;
+            buf[5] = 0xb1; // one-byte Uri-Path option
+            buf[6] = 'U';
+            buf[7] = 0xff; // payload marker
+            buf[8] = CHUNK_SIZE >> 8;
+            buf[9] = CHUNK_SIZE & 0xFF;
+            buf[10] = file_length >> 24;
+            buf[11] = (file_length >> 16) & 0xFF;
+            buf[12] = (file_length >> 8) & 0xFF;
+            buf[13] = file_length & 0xFF;
+            memcpy(buf + 14, name, name_length);
+            message.set_length(14 + name_length);
+
+            error = channel.send(message);
+            if (!error && message.has_id())
+            {
+                callbacks->add_ack_handler(message.get_id(), CompletionHandler(begin_acked, this, upload_id));
+            }
+            return error;
+        }
+
+        ProtocolError ChunkedUpload::send_chunk(MessageChannel &channel, chunk_index_t index, bool checkpoint)
+        {
+            const uint32_t offset = uint32_t(index) * CHUNK_SIZE;
+            const uint32_t length = std::min(uint32_t(CHUNK_SIZE), file_length - offset);
+            Message message;
+            ProtocolError error = channel.create(message, 10 + length);
+            if (error)
+                return error;
+
+            uint8_t *buf = message.buf();
+            buf[0] = checkpoint ? 0x40 : 0x50; // confirmable or non-confirmable, no token
+            buf[1] = 0x02;                     // code 0.02 POST
+            buf[2] = 0;
+            buf[3] = 0;
+            buf[4] = 0xb1; // one-byte Uri-Path option
+            buf[5] = 'C';
+            buf[6] = 0x42; // two-byte Uri-Query option
+            buf[7] = index >> 8;
+            buf[8] = index & 0xFF;
+            buf[9] = 0xff; // payload marker
+            if (callbacks->read_upload(offset, buf + 10, length) != int(length))
+            {
+                LOG(ERROR, "upload read failed at %lu", (unsigned long)offset);
+                complete(SYSTEM_ERROR_IO);
+                return NO_ERROR;
+            }
+            message.set_length(10 + length);
+
+            error = channel.send(message);
+            if (error)
+                return error;
+
+            // chunks are sent in order the first time, so the CRC is computed as they are read
+            if (index == crc_next)
+            {
+                crc = crc32c(crc, buf + 10, length);
+                crc_next++;
+            }
+            if (checkpoint && message.has_id())
+            {
+                Checkpoint *slot = &checkpoints[checkpoints[0].active ? 1 : 0];
+                slot->first = window_first;
+                slot->end = crc_next;
+                slot->active = true;
+                checkpoints_pending++;
+                callbacks->add_ack_handler(message.get_id(), CompletionHandler(checkpoint_acked, slot, upload_id));
+            }
+            if (checkpoint)
+                window_first = crc_next;
+            return NO_ERROR;
+        }
+
+        ProtocolError ChunkedUpload::send_done(MessageChannel &channel)
+        {
+            Message message;
+            ProtocolError error = channel.create(message, 11);
+            if (error)
+                return error;
+
+            uint8_t *buf = message.buf();
+            buf[0] = 0x40; // confirmable, no token
+            buf[1] = 0x03; // code 0.03 PUT
+            buf[2] = 0;
+            buf[3] = 0;
+            buf[4] = 0xb1; // one-byte Uri-Path option
+            buf[5] = 'U';
+            buf[6] = 0xff; // payload marker
+            buf[7] = crc >> 24;
+            buf[8] = (crc >> 16) & 0xFF;
+            buf[9] = (crc >> 8) & 0xFF;
+            buf[10] = crc & 0xFF;
+            message.set_length(11);
+
+            error = channel.send(message);
+            if (!error && message.has_id())
+            {
+                callbacks->add_ack_handler(message.get_id(), CompletionHandler(done_acked, this, upload_id));
+            }
+            return error;
+        }
+
+        ProtocolError ChunkedUpload::idle(MessageChannel &channel)
+        {
+            if (state == DONE_SENT && callbacks->millis() - done_millis >= RESULT_TIMEOUT)
+            {
+                LOG(ERROR, "upload result not received");
+                complete(SYSTEM_ERROR_TIMEOUT);
+                return NO_ERROR;
+            }
+
+            const uint16_t half_window = std::max(1, window / 2);
+            while (state == SENDING && checkpoints_pending < MAX_CHECKPOINTS)
+            {
+                chunk_index_t index = next_pending(cursor);
+                if (index == NO_CHUNKS_MISSING)
+                {
+                    // UploadDone once the cloud has acknowledged the last window, to not race the missing chunks
+                    if (checkpoints_pending)
+                        break;
+                    ProtocolError error = send_done(channel);
+                    if (error)
+                    {
+                        send_failed(error);
+                        break;
+                    }
+                    send_failing = false;
+                    state = DONE_SENT;
+                    done_millis = callbacks->millis();
+                    break;
+                }
+
+                bool checkpoint = ++sent_since_checkpoint >= half_window || index == chunk_count - 1;
+                ProtocolError error = send_chunk(channel, index, checkpoint);
+                if (error)
+                {
+                    sent_since_checkpoint--;
+                    send_failed(error);
+                    break;
+                }
+                send_failing = false;
+                if (state != SENDING)
+                    break; // the file couldn't be read
+                if (checkpoint)
+                    sent_since_checkpoint = 0;
+                pending[index / 64] &= ~(uint64_t(1) << (index % 64));
+                cursor = index;
+            }
+            return NO_ERROR;
+        }
+
+        /**
+         * The chunks stay pending when the channel can't take a message, so that the error
+         * doesn't reach the protocol loop and close the connection.
+         */
+        void ChunkedUpload::send_failed(ProtocolError error)
+        {
+            const system_tick_t now = callbacks->millis();
+            if (!send_failing)
+            {
+                LOG(WARN, "upload message not sent: %d", error);
+                send_failing = true;
+                send_failing_since = now;
+            }
+            else if (now - send_failing_since >= SEND_TIMEOUT)
+            {
+                LOG(ERROR, "upload messages not sent for %lu ms", (unsigned long)(now - send_failing_since));
+                complete(SYSTEM_ERROR_IO);
+            }
+        }
+
+        ProtocolError ChunkedUpload::handle_chunks_missed(Message &message, MessageChannel &channel)
+        {
+            uint8_t *queue = message.buf();
+            uint8_t *end = queue + message.length();
+            uint8_t *payload = find_payload(queue, end);
+
+            if (state == SENDING || state == DONE_SENT)
+            {
+                unsigned count = 0;
+                for (uint8_t *p = payload + 1; p + 1 < end; p += 2)
+                {
+                    chunk_index_t index = (p[0] << 8) | p[1];
+                    if (index < chunk_count)
+                    {
+                        set_pending(index);
+                        count++;
+                    }
+                }
+                LOG(INFO, "cloud missed %d upload chunks", count);
+                if (count && state == DONE_SENT)
+                {
+                    state = SENDING;
+                    sent_since_checkpoint = 0;
+                }
+            }
+
+            if (CoAP::type(queue) == CoAPType::CON)
+            {
+                message.set_length(Messages::empty_ack(queue, queue[2], queue[3]));
+                return channel.send(message);
+            }
+            return NO_ERROR;
+        }
+
+        ProtocolError ChunkedUpload::handle_result(Message &message, MessageChannel &channel)
+        {
+            uint8_t *queue = message.buf();
+            uint8_t *end = queue + message.length();
+            uint8_t *payload = find_payload(queue, end);
+            const int result = payload + 1 < end ? payload[1] : -1;
+
+            ProtocolError error = NO_ERROR;
+            if (CoAP::type(queue) == CoAPType::CON)
+            {
+                message.set_length(Messages::empty_ack(queue, queue[2], queue[3]));
+                error = channel.send(message);
+            }
+
+            if (state != IDLE)
+            {
+                if (result)
+                {
+                    LOG(ERROR, "upload of %s refused by the cloud: %d", name, result);
+                }
+                complete(result ? SYSTEM_ERROR_IO : SYSTEM_ERROR_NONE);
+            }
+            return error;
+        }
+
+        void ChunkedUpload::begin_acked(int error, const void *, void *callback_data, void *reserved)
+        {
+            ChunkedUpload *self = (ChunkedUpload *)callback_data;
+            if (!self->is_current(reserved))
+                return;
+            if (error)
+                self->complete(error);
+            else
+                self->state = SENDING;
+        }
+
+        void ChunkedUpload::checkpoint_acked(int error, const void *, void *callback_data, void *reserved)
+        {
+            Checkpoint *checkpoint = (Checkpoint *)callback_data;
+            ChunkedUpload *self = checkpoint->owner;
+            if (!self->is_current(reserved) || !checkpoint->active)
+                return;
+            checkpoint->active = false;
+            if (self->checkpoints_pending)
+                self->checkpoints_pending--;
+
+            if (error == SYSTEM_ERROR_TIMEOUT)
+            {
+                // the retransmits of the checkpoint ran out, the chunks sent again in the window are
+                // reported by the cloud if it missed them too
+                LOG(WARN, "upload checkpoint not acknowledged, sending chunks %d-%d again", checkpoint->first, checkpoint->end - 1);
+                for (chunk_index_t index = checkpoint->first; index < checkpoint->end; index++)
+                    self->set_pending(index);
+            }
+            else if (error)
+            {
+                self->complete(error);
+            }
+        }
+
+        void ChunkedUpload::done_acked(int error, const void *, void *callback_data, void *reserved)
+        {
+            ChunkedUpload *self = (ChunkedUpload *)callback_data;
+            if (self->is_current(reserved) && error)
+                self->complete(error);
+        }
+
+        void ChunkedUpload::complete(int error)
+        {
+            LOG(INFO, "upload of %s complete: %d", name, error);
+            state = IDLE;
+            upload_id++;
+            delete[] pending;
+            pending = nullptr;
+            callbacks->upload_complete(name, error);
+        }
+
+        void ChunkedUpload::cancel()
+        {
+            if (state != IDLE)
+            {
+                complete(SYSTEM_ERROR_ABORTED);
+            }
+        }
+
+    }
+}
@@ -87,5 +87,37 @@ namespace trackle
             return option_length;
         }
 
+        /**
+         * Decodes an extended option delta or length, given its nibble.
+         */
+        static uint16_t option_extended_decode(unsigned char **p, unsigned char nibble)
+        {
+            uint16_t value = nibble;
+            if (13 == nibble)
+            {
+                value = **p + 13;
+                (*p)++;
+            }
+            else if (14 == nibble)
+            {
+                value = ((*(*p) << 8) | *(*p + 1)) + 269;
+                (*p) += 2;
+            }
+            return value;
+        }
+
+        size_t CoAP::option_decode(unsigned char **option, uint16_t *delta)
+        {
+            const unsigned char header = **option;
+            (*option)++;
+            *delta = option_extended_decode(option, header >> 4);
+            if (15 == (header & 0x0f))
+            {
+                // reserved value in CoAP spec
+                return 0;
+            }
+            return option_extended_decode(option, header & 0x0f);
+        }
+
     }
 }
@@ -0,0 +1,201 @@
+#include "logging.h"
+LOG_SOURCE_CATEGORY("comm.decompressor")
+
+#include "decompressor.h"
+#include "crc32.h"
+#include <string.h>
+#include <new>
+
+namespace trackle
+{
+    namespace protocol
+    {
+
+        static uint32_t read_uint32(const uint8_t *buf)
+        {
+            return uint32_t(buf[0]) << 24 | uint32_t(buf[1]) << 16 | uint32_t(buf[2]) << 8 | buf[3];
+        }
+
+        void Decompressor::begin(Target *target)
+        {
+            end();
+            this->target = target;
+            state = HEADER;
+            header_length = 0;
+            crc = 0;
+            position = 0;
+            flushed = 0;
+            bit_buffer = 0;
+            bit_count = 0;
+        }
+
+        void Decompressor::end()
+        {
+            delete[] window;
+            window = nullptr;
+        }
+
+        bool Decompressor::parse_header()
+        {
+            window_bits = header[4];
+            lookahead_bits = header[5];
+            length = read_uint32(header + 6);
+            expected_crc = read_uint32(header + 10);
+            if (memcmp(header, "THS1", 4) || window_bits < 4 || window_bits > MAX_WINDOW_BITS ||
+                lookahead_bits < 3 || lookahead_bits >= window_bits)
+            {
+                LOG(ERROR, "Invalid compressed stream");
+                return false;
+            }
+            window = new (std::nothrow) uint8_t[1 << window_bits];
+            if (!window)
+            {
+                LOG(ERROR, "Cannot allocate decompression window");
+                return false;
+            }
+            if (target->begin_output(length, 1 << window_bits))
+            {
+                return false;
+            }
+            state = length ? TAG : DONE;
+            return true;
+        }
+
+        bool Decompressor::get_bits(uint8_t count, uint16_t &value)
+        {
+            if (bit_count < count)
+            {
+                return false;
+            }
+            bit_count -= count;
+            value = (bit_buffer >> bit_count) & ((1u << count) - 1);
+            return true;
+        }
+
+        bool Decompressor::flush()
+        {
+            // the window is written when full, so its content is contiguous
+            size_t n = position - flushed;
+            const uint8_t *data = window + (flushed & ((1u << window_bits) - 1));
+            crc = crc32c(crc, data, n);
+            flushed = position;
+            return !target->write_output(position - n, data, n);
+        }
+
+        bool Decompressor::put(uint8_t byte)
+        {
+            if (position == length)
+            {
+                LOG(ERROR, "Compressed stream exceeds its length");
+                return false;
+            }
+            const uint32_t mask = (1u << window_bits) - 1;
+            window[position & mask] = byte;
+            position++;
+            if (!(position & mask) || position == length)
+            {
+                return flush();
+            }
+            return true;
+        }
+
+        int Decompressor::apply(const uint8_t *data, size_t size)
+        {
+            while (state != FAILED && state != DONE && (size || bit_count))
+            {
+                if (state == HEADER)
+                {
+                    header[header_length++] = *data++;
+                    size--;
+                    if (header_length == sizeof(header) && !parse_header())
+                    {
+                        state = FAILED;
+                    }
+                    continue;
+                }
+
+                // keep up to 24 bits ready, enough for any field
+                while (size && bit_count <= 24)
+                {
+                    bit_buffer = (bit_buffer << 8) | *data++;
+                    bit_count += 8;
+                    size--;
+                }
+
+                uint16_t value;
+                bool ready = true;
+                switch (state)
+                {
+                case TAG:
+                    if ((ready = get_bits(1, value)))
+                        state = value ? LITERAL : INDEX;
+                    break;
+
+                case LITERAL:
+                    if ((ready = get_bits(8, value)))
+                    {
+                        state = put(value) ? TAG : FAILED;
+                    }
+                    break;
+
+                case INDEX:
+                    if ((ready = get_bits(window_bits, value)))
+                    {
+                        index = value + 1;
+                        state = COUNT;
+                    }
+                    break;
+
+                case COUNT:
+                    if ((ready = get_bits(lookahead_bits, value)))
+                    {
+                        if (index > position)
+                        {
+                            LOG(ERROR, "Invalid back reference");
+                            state = FAILED;
+                            break;
+                        }
+                        const uint32_t mask = (1u << window_bits) - 1;
+                        state = TAG;
+                        for (uint16_t i = 0; i <= value && state == TAG; i++)
+                        {
+                            if (!put(window[(position - index) & mask]))
+                            {
+                                state = FAILED;
+                            }
+                        }
+                    }
+                    break;
+
+                default:
+                    break;
+                }
+
+                if (state != FAILED && position == length)
+                {
+                    // what's left of the last byte is padding
+                    state = crc == expected_crc ? DONE : FAILED;
+                    if (state == FAILED)
+                    {
+                        LOG(ERROR, "Decompressed data CRC mismatch");
+                    }
+                    bit_count = 0;
+                }
+                if (!ready && !size)
+                {
+                    break; // wait for more data
+                }
+            }
+            if (state == DONE && size)
+            {
+                LOG(ERROR, "Data after the end of the compressed stream");
+                state = FAILED;
+            }
+            if (state == DONE || state == FAILED)
+            {
+                end();
+            }
+            return state == FAILED ? -1 : 0;
+        }
+    }
+}
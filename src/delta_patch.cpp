@@ -0,0 +1,174 @@
+#include "logging.h"
+LOG_SOURCE_CATEGORY("comm.delta_patch")
+
+#include "delta_patch.h"
+#include "crc32.h"
+#include <string.h>
+#include <algorithm>
+
+namespace trackle
+{
+    namespace protocol
+    {
+
+        static uint32_t read_uint32(const uint8_t *buf)
+        {
+            return uint32_t(buf[0]) << 24 | uint32_t(buf[1]) << 16 | uint32_t(buf[2]) << 8 | buf[3];
+        }
+
+        void DeltaPatch::begin(Target *target)
+        {
+            this->target = target;
+            state = HEADER;
+            control_length = 0;
+            new_length = 0;
+            new_crc = 0;
+            crc = 0;
+            new_position = 0;
+            old_position = 0;
+            block_length = 0;
+        }
+
+        bool DeltaPatch::parse_control()
+        {
+            if (state == HEADER)
+            {
+                if (memcmp(control, "TDP1", 4))
+                {
+                    LOG(ERROR, "Invalid delta patch");
+                    return false;
+                }
+                new_length = read_uint32(control + 4);
+                new_crc = read_uint32(control + 8);
+                if (target->begin_target(new_length))
+                {
+                    return false;
+                }
+                state = new_length ? CONTROL : DONE;
+                return true;
+            }
+
+            diff_length = read_uint32(control);
+            extra_length = read_uint32(control + 4);
+            seek = int32_t(read_uint32(control + 8));
+            if (diff_length > new_length - new_position || extra_length > new_length - new_position - diff_length)
+            {
+                LOG(ERROR, "Delta patch exceeds the image length");
+                return false;
+            }
+            state = diff_length ? DIFF : EXTRA;
+            return true;
+        }
+
+        bool DeltaPatch::emit(const uint8_t *data, size_t length)
+        {
+            crc = crc32c(crc, data, length);
+            while (length)
+            {
+                size_t n = std::min(length, BLOCK_SIZE - block_length);
+                memcpy(block + block_length, data, n);
+                block_length += n;
+                new_position += n;
+                data += n;
+                length -= n;
+                if (block_length == BLOCK_SIZE || new_position == new_length)
+                {
+                    if (target->write_target(new_position - block_length, block, block_length))
+                    {
+                        return false;
+                    }
+                    block_length = 0;
+                }
+            }
+            return true;
+        }
+
+        size_t DeltaPatch::apply_diff(const uint8_t *data, size_t length)
+        {
+            // the old bytes are read in pieces, so that the stack use is bounded
+            uint8_t old[64];
+            size_t n = std::min(std::min(length, sizeof(old)), (size_t)diff_length);
+            if (target->read_source(old_position, old, n) != int(n))
+            {
+                LOG(ERROR, "Cannot read the installed image at %lu", (unsigned long)old_position);
+                return 0;
+            }
+            for (size_t i = 0; i < n; i++)
+            {
+                old[i] += data[i];
+            }
+            if (!emit(old, n))
+            {
+                return 0;
+            }
+            old_position += n;
+            diff_length -= n;
+            return n;
+        }
+
+        int DeltaPatch::apply(const uint8_t *data, size_t length)
+        {
+            while (length && state != FAILED)
+            {
+                size_t n = 0;
+                switch (state)
+                {
+                case HEADER:
+                case CONTROL:
+                    n = std::min(length, sizeof(control) - control_length);
+                    memcpy(control + control_length, data, n);
+                    control_length += n;
+                    if (control_length == sizeof(control))
+                    {
+                        control_length = 0;
+                        if (!parse_control())
+                        {
+                            state = FAILED;
+                        }
+                    }
+                    break;
+
+                case DIFF:
+                    n = apply_diff(data, length);
+                    if (!n)
+                    {
+                        state = FAILED;
+                    }
+                    else if (!diff_length)
+                    {
+                        state = EXTRA;
+                    }
+                    break;
+
+                case EXTRA:
+                    n = std::min(length, (size_t)extra_length);
+                    if (!emit(data, n))
+                    {
+                        state = FAILED;
+                    }
+                    extra_length -= n;
+                    break;
+
+                default:
+                    // data after the end of the new image
+                    state = FAILED;
+                    break;
+                }
+
+                data += n;
+                length -= n;
+                if (state == EXTRA && !extra_length)
+                {
+                    old_position += seek;
+                    state = new_position == new_length ? DONE : CONTROL;
+                }
+            }
+            if (state == DONE && crc != new_crc)
+            {
+                LOG(ERROR, "Delta patch CRC mismatch");
+                state = FAILED;
+            }
+            return state == FAILED ? -1 : 0;
+        }
+    }
+}
@@ -127,6 +127,39 @@ namespace trackle
 	{
 		system_tick_t (*getMillis)() = NULL;
 
+		/**
+		 * The session persisted with the PERSIST_SESSION type. The sequence numbers are saved
+		 * SEQUENCE_GAP ahead of the live ones so the session only has to be saved again once
+		 * every SEQUENCE_GAP records, and a restored session never reuses a sequence number
+		 * or a message ID that was already sent. The receive window is saved RECEIVE_GAP records
+		 * ahead of the last one received, and saved again once the cloud went past it: a restored
+		 * session rejects every record up to there, the ones received before the restart and the
+		 * next few the cloud sends, which are recovered by the CoAP retransmissions.
+		 */
+		struct SessionPersist
+		{
+			uint16_t size;
+			uint16_t version;
+			uint32_t keys_checksum;
+			uint8_t compression;
+			uint8_t cipher;
+			uint16_t epoch;
+			uint64_t rseq;
+			uint64_t cseq;
+			uint64_t cseq_bitfield;
+			message_id_t next_coap_id;
+			uint8_t key_block[MAX_KEYBLOCK_LENGTH];
+			uint8_t write_cid_length;
+			uint8_t write_cid[DTLS_MAX_CID_LENGTH];
+			uint32_t crc;
+		};
+
+		static_assert(sizeof(SessionPersist) <= sizeof(SessionPersistDataOpaque), "SessionPersist does not fit the persisted session size");
+
+		const uint16_t SESSION_PERSIST_VERSION = 3;
+		const uint64_t SEQUENCE_GAP = 1024;
+		const uint64_t RECEIVE_GAP = 16;
+
 #define EXIT_ERROR(x, msg)                                                                       \
 	if (x)                                                                                       \
 	{                                                                                            \
@@ -155,6 +188,16 @@ namespace trackle
 			// copy server public key
 			memcpy(server_certificate, server_public, server_public_len);
 
+			// a persisted session is only valid for the keys it was negotiated with
+			if (callbacks.calculate_crc)
+			{
+				uint8_t keys[ECDSA_KEY_LENGTH + DTLS_PUBLIC_KEY_LENGTH];
+				memcpy(keys, ecdsa_priv_key, ECDSA_KEY_LENGTH);
+				memcpy(keys + ECDSA_KEY_LENGTH, server_certificate, DTLS_PUBLIC_KEY_LENGTH);
+				keys_checksum = callbacks.calculate_crc(keys, sizeof(keys));
+				memset(keys, 0, sizeof(keys));
+			}
+
 			static dtls_handler_t cb = {
 				.write = send_to_peer,
 				.read = read_from_peer,
@@ -186,6 +229,7 @@ namespace trackle
 		 */
 		inline int DTLSMessageChannel::send(const uint8_t *data, size_t len)
 		{
+			// tls12_cid records (type 25) are never rewritten: the cloud finds their session from any address
 			// if (move_session && len && data[0] == 0x70)
 			if (move_session && len && data[0] == 23)
 			{
@@ -206,6 +250,12 @@ namespace trackle
 				return callbacks.send(data, len, callbacks.tx_context);
 		}
 
+		bool DTLSMessageChannel::has_connection_id()
+		{
+			dtls_peer_t *peer = dtls_get_peer(dtls_context, &dst);
+			return peer && dtls_security_params(peer)->write_cid_length > 0;
+		}
+
 		void DTLSMessageChannel::reset_session()
 		{
 			LOG(TRACE, "DTLSMessageChannel::reset_session");
@@ -216,6 +266,95 @@ namespace trackle
 			{
 				dtls_reset_peer(dtls_context, peer);
 			}
+			discard_saved_session();
+		}
+
+		void DTLSMessageChannel::save_session()
+		{
+			dtls_peer_t *peer = dtls_get_peer(dtls_context, &dst);
+			if (!peer || peer->state != DTLS_STATE_CONNECTED || !callbacks.save || !coap_state)
+			{
+				return;
+			}
+
+			const dtls_security_parameters_t *params = dtls_security_params(peer);
+			SessionPersist data;
+			memset(&data, 0, sizeof(data));
+			data.size = sizeof(data);
+			data.version = SESSION_PERSIST_VERSION;
+			data.keys_checksum = keys_checksum;
+			data.compression = params->compression;
+			data.cipher = params->cipher;
+			data.epoch = params->epoch;
+			data.rseq = params->rseq + SEQUENCE_GAP;
+			data.cseq = params->cseq.cseq + RECEIVE_GAP;
+			// the records received after the save are somewhere below cseq, so none of them is accepted
+			data.cseq_bitfield = ~uint64_t(0);
+			data.next_coap_id = *coap_state + SEQUENCE_GAP;
+			memcpy(data.key_block, params->key_block, sizeof(data.key_block));
+			data.write_cid_length = params->write_cid_length;
+			memcpy(data.write_cid, params->write_cid, sizeof(data.write_cid));
+			data.crc = callbacks.calculate_crc((const uint8_t *)&data, offsetof(SessionPersist, crc));
+
+			if (callbacks.save(&data, sizeof(data), TrackleCallbacks::PERSIST_SESSION, NULL) == 0)
+			{
+				saved_rseq_limit = data.rseq;
+				saved_cseq_limit = data.cseq;
+			}
+			memset(&data, 0, sizeof(data));
+		}
+
+		bool DTLSMessageChannel::restore_session()
+		{
+			if (!callbacks.restore || !callbacks.calculate_crc || !coap_state)
+			{
+				return false;
+			}
+
+			SessionPersist data;
+			int restored = callbacks.restore(&data, sizeof(data), TrackleCallbacks::PERSIST_SESSION, NULL);
+			bool valid = restored == int(sizeof(data)) && data.size == sizeof(data) &&
+						 data.version == SESSION_PERSIST_VERSION && data.keys_checksum == keys_checksum &&
+						 data.crc == callbacks.calculate_crc((const uint8_t *)&data, offsetof(SessionPersist, crc));
+
+			if (valid)
+			{
+				dtls_security_parameters_t params;
+				memset(&params, 0, sizeof(params));
+				params.compression = (dtls_compression_t)data.compression;
+				params.cipher = (dtls_cipher_t)data.cipher;
+				params.epoch = data.epoch;
+				params.rseq = data.rseq;
+				params.cseq.cseq = data.cseq;
+				params.cseq.bitfield = data.cseq_bitfield;
+				memcpy(params.key_block, data.key_block, sizeof(params.key_block));
+				params.write_cid_length = data.write_cid_length;
+				memcpy(params.write_cid, data.write_cid, sizeof(params.write_cid));
+
+				valid = dtls_restore_peer(dtls_context, &dst, &params) == 0;
+				memset(&params, 0, sizeof(params));
+			}
+
+			if (valid)
+			{
+				*coap_state = data.next_coap_id;
+				// the restored sequence number is already at the saved limit, save again on the next record
+				saved_rseq_limit = data.rseq;
+				saved_cseq_limit = data.cseq;
+			}
+			memset(&data, 0, sizeof(data));
+			return valid;
+		}
+
+		void DTLSMessageChannel::discard_saved_session()
+		{
+			if (saved_rseq_limit && callbacks.save)
+			{
+				SessionPersist data;
+				memset(&data, 0, sizeof(data));
+				callbacks.save(&data, sizeof(data), TrackleCallbacks::PERSIST_SESSION, NULL);
+			}
+			saved_rseq_limit = 0;
 		}
 
 		inline int DTLSMessageChannel::recv(uint8_t *data, size_t len)
@@ -318,7 +457,14 @@ namespace trackle
 				/* delete peer if not connected */
 				dtls_peer_t *peer = dtls_get_peer(dtls_context, &dst);
 
-				if (!peer)
+				if (!peer && restore_session())
+				{
+					// the device restarted since the session was saved: resume without a handshake
+					// but still say HELLO, so the cloud learns about the restart
+					LOG(TRACE, "persisted session restored");
+					return SESSION_RESUMED;
+				}
+				else if (!peer)
 				{
 					LOG(TRACE, "peer not extists");
 					toConnect = true;
@@ -402,6 +548,7 @@ namespace trackle
 				{
 					LOG(TRACE, "valid session created");
 					valid_dtls_session = true;
+					save_session();
 					return SESSION_CONNECTED;
 				}
 
@@ -434,19 +581,33 @@ namespace trackle
 
 			if (len > 0)
 			{
+				const uint8_t record_type = buf[0];
 				dtls_handle_message(dtls_context, &dst, buf, len);
 				memset(buf, 0, buflen);
 				memcpy(buf, dtls_data.read_buf, dtls_data.read_len);
 
+				// a replay of the records past the saved window would be accepted after a restart
+				peer = dtls_get_peer(dtls_context, &dst);
+				if (saved_rseq_limit && peer && dtls_security_params(peer)->cseq.cseq > saved_cseq_limit)
+				{
+					save_session();
+				}
+
 				// check malformed TODO add check len 15
 				int res = memcmp(dtls_data.read_buf, malformed, dtls_data.read_len);
-				if (res == 0)
+				if (record_type == DTLS_CT_APPLICATION_DATA && dtls_data.read_len == 0)
+				{
+					// a record of this session dropped by the replay window, like the ones a restored session skips
+					LOG(TRACE, "Replayed dtls record dropped");
+				}
+				else if (res == 0)
 				{
 					LOG(TRACE, "Malformed dtls packet");
 					malformed_counter++;
 
-					// todo scrivere funzionamento
-					if (malformed_counter == 1)
+					// the cloud lost the session: without a connection ID it might be an IP change,
+					// with a connection ID the session is really gone
+					if (malformed_counter == 1 && !has_connection_id())
 					{
 						LOG(TRACE, "Handle ip change");
 						this->command(MessageChannel::MOVE_SESSION, nullptr);
@@ -534,6 +695,12 @@ namespace trackle
 #endif
 
 			int ret = dtls_write(dtls_context, &dst, message.buf(), message.length());
+
+			dtls_peer_t *peer = dtls_get_peer(dtls_context, &dst);
+			if (ret >= 0 && saved_rseq_limit && peer && dtls_security_params(peer)->rseq >= saved_rseq_limit)
+			{
+				save_session();
+			}
 			return (ret >= 0 ? NO_ERROR : IO_ERROR_GENERIC_ESTABLISH);
 		}
 
@@ -559,11 +726,11 @@ namespace trackle
 				break;
 
 			case LOAD_SESSION:
-				// sessionPersist.restore(callbacks.restore);
+				// the persisted session is restored by establish() when there is no live peer
 				break;
 
 			case SAVE_SESSION:
-				// sessionPersist.save(callbacks.save);
+				save_session();
 				break;
 			}
 			return NO_ERROR;
@@ -0,0 +1,121 @@
+#include "logging.h"
+LOG_SOURCE_CATEGORY("comm.event_queue")
+
+#include "event_queue.h"
+#include <string.h>
+#include <new>
+
+using namespace trackle;
+
+EventQueue::EventQueue() : slab(nullptr), slot_size(0), capacity(0), max_event_length(0), policy(EVENT_QUEUE_DROP_NEWEST),
+						   head(0), tail(0), enqueued(0), dispatched(0), dropped(0), dispatched_inline(0), high_watermark(0)
+{
+}
+
+EventQueue::~EventQueue()
+{
+	delete[] slab;
+}
+
+bool EventQueue::configure(uint16_t capacity_, uint16_t max_event_length_, Event_Queue_Policy policy_)
+{
+	const uint32_t pending = tail.load() - head.load();
+	if (pending)
+	{
+		LOG(WARN, "Discarding %d queued events", pending);
+		dropped += pending;
+	}
+
+	delete[] slab;
+	slab = nullptr;
+	capacity = 0;
+	head = 0;
+	tail = 0;
+	policy = policy_;
+	if (!capacity_)
+		return true;
+
+	// name and data are stored with their terminators, keep slots pointer aligned
+	slot_size = sizeof(Slot) + max_event_length_ + 2;
+	slot_size = (slot_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	slab = new (std::nothrow) uint8_t[slot_size * capacity_];
+	if (!slab)
+	{
+		LOG(ERROR, "Cannot allocate event queue of %d events", capacity_);
+		return false;
+	}
+	capacity = capacity_;
+	max_event_length = max_event_length_;
+	return true;
+}
+
+bool EventQueue::push(const FilteringEventHandler &handler, const char *event_name, const char *data)
+{
+	const size_t name_length = strlen(event_name);
+	const size_t data_length = data ? strlen(data) : 0;
+	const uint32_t t = tail.load(std::memory_order_relaxed);
+	const uint32_t depth = t - head.load(std::memory_order_acquire);
+
+	if (depth >= capacity || name_length + data_length > max_event_length)
+	{
+		if (policy == EVENT_QUEUE_DISPATCH_INLINE)
+		{
+			dispatched_inline.fetch_add(1, std::memory_order_relaxed);
+			invoke_event_handler(handler.handler, handler.handler_data, event_name, data);
+		}
+		else
+		{
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			LOG(WARN, "Event queue full, dropping %s", event_name);
+		}
+		return false;
+	}
+
+	Slot *s = slot(t);
+	s->handler = handler.handler;
+	s->handler_data = handler.handler_data;
+	s->name_length = name_length;
+	s->data_length = data_length;
+	s->has_data = data != nullptr;
+	char *name_copy = (char *)(s + 1);
+	memcpy(name_copy, event_name, name_length + 1);
+	char *data_copy = name_copy + name_length + 1;
+	memcpy(data_copy, data ? data : "", data_length + 1);
+
+	tail.store(t + 1, std::memory_order_release);
+	enqueued.fetch_add(1, std::memory_order_relaxed);
+	if (depth + 1 > high_watermark.load(std::memory_order_relaxed))
+		high_watermark.store(depth + 1, std::memory_order_relaxed);
+	return true;
+}
+
+int EventQueue::drain(int max_events)
+{
+	int count = 0;
+	while (enabled() && (max_events <= 0 || count < max_events))
+	{
+		const uint32_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			break;
+
+		Slot *s = slot(h);
+		const char *name_copy = (const char *)(s + 1);
+		const char *data_copy = s->has_data ? name_copy + s->name_length + 1 : nullptr;
+		invoke_event_handler(s->handler, s->handler_data, name_copy, data_copy);
+
+		head.store(h + 1, std::memory_order_release);
+		dispatched.fetch_add(1, std::memory_order_relaxed);
+		count++;
+	}
+	return count;
+}
+
+void EventQueue::get_metrics(Event_Queue_Metrics *metrics) const
+{
+	metrics->enqueued = enqueued.load(std::memory_order_relaxed);
+	metrics->dispatched = dispatched.load(std::memory_order_relaxed);
+	metrics->dropped = dropped.load(std::memory_order_relaxed);
+	metrics->dispatched_inline = dispatched_inline.load(std::memory_order_relaxed);
+	metrics->depth = tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	metrics->high_watermark = high_watermark.load(std::memory_order_relaxed);
+}
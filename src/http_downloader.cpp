@@ -0,0 +1,465 @@
+#include "logging.h"
+LOG_SOURCE_CATEGORY("comm.http_downloader")
+
+#include "http_downloader.h"
+#include "crc32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#define HTTP_DOWNLOADER_SOCKETS 1
+#endif
+
+using namespace trackle;
+
+#ifdef HTTP_DOWNLOADER_SOCKETS
+
+static int socket_connect(const char *host, uint16_t port, bool secure, uint32_t timeout)
+{
+	if (secure)
+	{
+		LOG(ERROR, "https needs a TLS transport");
+		return -1;
+	}
+
+	char service[8];
+	snprintf(service, sizeof(service), "%u", port);
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addresses = NULL;
+	if (getaddrinfo(host, service, &hints, &addresses) != 0)
+	{
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next)
+	{
+		fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		struct timeval tv;
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+		if (connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	return fd;
+}
+
+static int socket_send(int handle, const unsigned char *buf, uint32_t length)
+{
+#ifdef MSG_NOSIGNAL
+	return send(handle, buf, length, MSG_NOSIGNAL);
+#else
+	return send(handle, buf, length, 0);
+#endif
+}
+
+static int socket_receive(int handle, unsigned char *buf, uint32_t length)
+{
+	return recv(handle, buf, length, 0);
+}
+
+static void socket_close(int handle)
+{
+	close(handle);
+}
+
+static const Http_Transport socket_transport = {socket_connect, socket_send, socket_receive, socket_close};
+
+const Http_Transport *HttpDownloader::default_transport()
+{
+	return &socket_transport;
+}
+
+#else
+
+const Http_Transport *HttpDownloader::default_transport()
+{
+	return NULL;
+}
+
+#endif
+
+HttpDownloader::HttpDownloader() : transport(NULL), executor(NULL), sink(NULL), port(80), secure(false), expected_crc(0), file_length(0),
+								   connections(0), active(0), failed(false), error(NONE), running(false), done(false)
+{
+}
+
+bool HttpDownloader::parse_url(const char *url)
+{
+	const char *rest;
+	if (!strncmp(url, "http://", 7))
+	{
+		secure = false;
+		port = 80;
+		rest = url + 7;
+	}
+	else if (!strncmp(url, "https://", 8))
+	{
+		secure = true;
+		port = 443;
+		rest = url + 8;
+	}
+	else
+	{
+		return false;
+	}
+
+	const char *slash = strchr(rest, '/');
+	std::string authority = slash ? std::string(rest, slash - rest) : std::string(rest);
+	path = slash ? std::string(slash) : std::string("/");
+
+	size_t colon = authority.rfind(':');
+	if (colon != std::string::npos && authority.find(']', colon) == std::string::npos)
+	{
+		int value = atoi(authority.c_str() + colon + 1);
+		if (value <= 0 || value > 0xFFFF)
+			return false;
+		port = value;
+		authority.erase(colon);
+	}
+	if (authority.size() > 2 && authority[0] == '[')
+	{
+		authority = authority.substr(1, authority.size() - 2);
+	}
+	host = authority;
+	return !host.empty();
+}
+
+/**
+ * Sends a GET of the given bytes and reads the response header.
+ *
+ * @param partial Set to false when the server ignored the range and sends the whole file.
+ * @param range_start Set to the first byte of the response body.
+ * @param total Set to the length of the file.
+ * @param body Filled with the bytes of the body received with the header, at least BLOCK_SIZE long.
+ * @param body_length Set to the number of bytes in body.
+ * @return The handle of the connection, or an Error.
+ */
+int HttpDownloader::open_request(uint32_t first, uint32_t last, bool &partial, uint32_t &range_start, uint32_t &total, unsigned char *body, uint32_t &body_length)
+{
+	int handle = transport->connect(host.c_str(), port, secure, STALL_TIMEOUT);
+	if (handle < 0)
+	{
+		return CONNECTION;
+	}
+
+	char authority[8] = "";
+	if (port != (secure ? 443 : 80))
+	{
+		snprintf(authority, sizeof(authority), ":%u", port);
+	}
+	char request[512];
+	int length = snprintf(request, sizeof(request),
+						  "GET %s HTTP/1.1\r\nHost: %s%s\r\nRange: bytes=%lu-%lu\r\nConnection: close\r\nUser-Agent: trackle\r\n\r\n",
+						  path.c_str(), host.c_str(), authority, (unsigned long)first, (unsigned long)last);
+	if (length >= (int)sizeof(request))
+	{
+		LOG(ERROR, "url too long");
+		transport->close(handle);
+		return BAD_URL;
+	}
+	for (int sent = 0; sent < length;)
+	{
+		int n = transport->send(handle, (const unsigned char *)request + sent, length - sent);
+		if (n <= 0)
+		{
+			transport->close(handle);
+			return CONNECTION;
+		}
+		sent += n;
+	}
+
+	// the header is read in the request buffer, what follows it is the start of the body
+	char header[BLOCK_SIZE + 1];
+	uint32_t received = 0;
+	char *end = NULL;
+	while (!end)
+	{
+		if (received == BLOCK_SIZE)
+		{
+			LOG(ERROR, "http header too long");
+			transport->close(handle);
+			return HTTP_STATUS;
+		}
+		int n = transport->receive(handle, (unsigned char *)header + received, BLOCK_SIZE - received);
+		if (n <= 0)
+		{
+			transport->close(handle);
+			return CONNECTION;
+		}
+		received += n;
+		header[received] = 0;
+		end = strstr(header, "\r\n\r\n");
+	}
+	*end = 0;
+	body_length = received - (end + 4 - header);
+	memcpy(body, end + 4, body_length);
+
+	int status = 0;
+	sscanf(header, "HTTP/%*d.%*d %d", &status);
+	long content_length = -1;
+	unsigned long from = 0, to = 0, size = 0;
+	bool content_range = false;
+	for (char *line = strstr(header, "\r\n"); line; line = strstr(line, "\r\n"))
+	{
+		line += 2;
+		if (!strncasecmp(line, "Content-Length:", 15))
+			content_length = strtol(line + 15, NULL, 10);
+		else if (!strncasecmp(line, "Content-Range:", 14))
+			content_range = sscanf(line + 14, " bytes %lu-%lu/%lu", &from, &to, &size) == 3;
+	}
+
+	partial = status == 206;
+	if (status == 206 && content_range)
+	{
+		range_start = from;
+		total = size;
+	}
+	else if (status == 200 && content_length >= 0)
+	{
+		range_start = 0;
+		total = content_length;
+	}
+	else
+	{
+		LOG(ERROR, "http status %d", status);
+		transport->close(handle);
+		return HTTP_STATUS;
+	}
+	return handle;
+}
+
+int HttpDownloader::download_range(Range &range)
+{
+	unsigned char block[BLOCK_SIZE];
+	uint8_t retries = 0;
+
+	while (range.offset < range.end && !failed)
+	{
+		uint32_t fill = 0, range_start = 0, total = 0;
+		bool partial;
+		int handle = open_request(range.offset, range.end - 1, partial, range_start, total, block, fill);
+		if (handle == BAD_URL)
+		{
+			return BAD_URL;
+		}
+		if (handle >= 0 && (range_start != range.offset || total != file_length))
+		{
+			LOG(ERROR, "unexpected range %lu/%lu", (unsigned long)range_start, (unsigned long)total);
+			transport->close(handle);
+			return HTTP_STATUS;
+		}
+
+		bool progress = false;
+		while (handle >= 0 && range.offset < range.end && !failed)
+		{
+			uint32_t want = range.end - range.offset < BLOCK_SIZE ? range.end - range.offset : BLOCK_SIZE;
+			if (fill < want)
+			{
+				int n = transport->receive(handle, block + fill, want - fill);
+				if (n <= 0)
+				{
+					break;
+				}
+				fill += n;
+				continue;
+			}
+
+			int result;
+			{
+				std::lock_guard<std::mutex> lock(sink_lock);
+				result = sink->write(range.offset, block, want);
+			}
+			if (result)
+			{
+				transport->close(handle);
+				return SINK;
+			}
+			range.crc = crc32c(range.crc, block, want);
+			range.offset += want;
+			progress = true;
+			fill -= want;
+			memmove(block, block + want, fill);
+		}
+		if (handle >= 0)
+		{
+			transport->close(handle);
+		}
+
+		if (range.offset < range.end && !failed)
+		{
+			retries = progress ? 1 : retries + 1;
+			if (retries > MAX_RETRIES)
+			{
+				return handle == HTTP_STATUS ? HTTP_STATUS : CONNECTION;
+			}
+			LOG(WARN, "range %lu-%lu interrupted at %lu, retry %d", (unsigned long)range.start, (unsigned long)range.end,
+				(unsigned long)range.offset, retries);
+		}
+	}
+	return NONE;
+}
+
+void HttpDownloader::finish_range(int result)
+{
+	if (result != NONE)
+	{
+		int expected = NONE;
+		error.compare_exchange_strong(expected, result);
+		failed = true;
+	}
+	if (--active)
+	{
+		return;
+	}
+
+	// the last range to finish checks the whole image
+	if (!failed && expected_crc)
+	{
+		uint32_t crc = ranges[0].crc;
+		for (uint8_t i = 1; i < connections; i++)
+		{
+			crc = crc32c_combine(crc, ranges[i].crc, ranges[i].end - ranges[i].start);
+		}
+		if (crc != expected_crc)
+		{
+			LOG(ERROR, "crc mismatch %08lx, expected %08lx", (unsigned long)crc, (unsigned long)expected_crc);
+			error = CRC_MISMATCH;
+		}
+	}
+	LOG(INFO, "download %s", error == NONE ? "complete" : "failed");
+	sink->end(error == NONE);
+	done = true;
+}
+
+void HttpDownloader::range_job(void *arg)
+{
+	Range &range = *(Range *)arg;
+	range.owner->finish_range(range.owner->download_range(range));
+}
+
+void HttpDownloader::probe_job(void *arg)
+{
+	HttpDownloader &self = *(HttpDownloader *)arg;
+	unsigned char body[BLOCK_SIZE];
+	uint32_t body_length = 0, range_start = 0, total = 0;
+	bool ranges = false;
+
+	// the first byte tells the length of the file and if ranges are supported
+	int handle = CONNECTION;
+	for (uint8_t attempt = 0; attempt <= MAX_RETRIES && handle == CONNECTION; attempt++)
+	{
+		handle = self.open_request(0, 0, ranges, range_start, total, body, body_length);
+	}
+	if (handle < 0 || !total)
+	{
+		if (handle >= 0)
+			self.transport->close(handle);
+		self.error = handle < 0 ? handle : HTTP_STATUS;
+		self.done = true;
+		return;
+	}
+	self.transport->close(handle);
+
+	self.file_length = total;
+	if (!ranges)
+	{
+		// a server without ranges sends the whole file with 200, so it's fetched with one connection
+		self.connections = 1;
+	}
+	uint32_t blocks = (total + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (self.connections > blocks)
+	{
+		self.connections = blocks;
+	}
+	uint32_t blocks_per_range = (blocks + self.connections - 1) / self.connections;
+	self.connections = (blocks + blocks_per_range - 1) / blocks_per_range;
+	for (uint8_t i = 0; i < self.connections; i++)
+	{
+		Range &range = self.ranges[i];
+		range.owner = &self;
+		range.start = range.offset = i * blocks_per_range * BLOCK_SIZE;
+		range.end = (i + 1) * blocks_per_range * BLOCK_SIZE;
+		if (range.end > total)
+			range.end = total;
+		range.crc = 0;
+	}
+	LOG(INFO, "downloading %lu bytes with %d connections", (unsigned long)total, self.connections);
+
+	if (self.sink->begin(total, BLOCK_SIZE))
+	{
+		self.error = SINK;
+		self.done = true;
+		return;
+	}
+	self.active = self.connections;
+	for (uint8_t i = 1; i < self.connections; i++)
+	{
+		(*self.executor)(range_job, &self.ranges[i]);
+	}
+	range_job(&self.ranges[0]);
+}
+
+int HttpDownloader::start(const char *url, uint32_t crc, executorCallback *executor_, uint8_t connections_, const Http_Transport *transport_, Sink *sink_)
+{
+	if (running)
+	{
+		return BUSY;
+	}
+	if (!url || !parse_url(url))
+	{
+		LOG(ERROR, "not valid url");
+		return BAD_URL;
+	}
+	if (!transport_ || !executor_ || !sink_)
+	{
+		return CONNECTION;
+	}
+
+	transport = transport_;
+	executor = executor_;
+	sink = sink_;
+	expected_crc = crc;
+	connections = connections_ < 1 ? 1 : connections_ > MAX_CONNECTIONS ? MAX_CONNECTIONS : connections_;
+	file_length = 0;
+	failed = false;
+	error = NONE;
+	done = false;
+	running = true;
+	(*executor)(probe_job, this);
+	return NONE;
+}
+
+bool HttpDownloader::poll(int &result)
+{
+	if (!done)
+	{
+		return false;
+	}
+	done = false;
+	result = error;
+	running = false;
+	return true;
+}
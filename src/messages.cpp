@@ -15,6 +15,9 @@ namespace trackle
 			// 1 byte for the option length
 			// plus length of token
 			size_t path_idx = 5 + (buf[0] & 0x0F);
+			// an Observe option of a GET request precedes the Uri-Path
+			if (path_idx <= length && (buf[path_idx - 1] & 0xF0) == 0x60)
+				path_idx += 1 + (buf[path_idx - 1] & 0x0F);
 			if (path_idx < length)
 				path = buf[path_idx];
 
@@ -27,6 +30,8 @@ namespace trackle
 					return CoAPMessageType::VARIABLE_REQUEST;
 				case 'd':
 					return CoAPMessageType::DESCRIBE;
+				case 'C':
+					return CoAPMessageType::UPLOAD_CHUNKS_MISSED;
 				default:
 					break;
 				}
@@ -60,6 +65,8 @@ namespace trackle
 					return CoAPMessageType::UPDATE_PROPERTY;
 				case 'u':
 					return CoAPMessageType::UPDATE_DONE;
+				case 'U':
+					return CoAPMessageType::UPLOAD_RESULT;
 				case 's':
 					// todo - use a single message SIGNAL and decode the rest of the message to determine desired state
 					if (buf[8])
@@ -423,7 +430,8 @@ namespace trackle
 		{
 			for (uint8_t i = 0; i < MAX_CONCURRENT_MESSAGES; i++)
 			{
-				if (block_messages[i].token == token)
+				// a free block keeps the token of its last publish, or 0, it must not take the reply to another message
+				if (block_messages[i].transmissionRunning && block_messages[i].token == token)
 				{
 					return &block_messages[i];
 				}
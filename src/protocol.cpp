@@ -61,17 +61,32 @@ namespace trackle
             case CoAPMessageType::DESCRIBE:
             {
                 // 4 bytes header, 1 byte token, 2 bytes Uri-Path
-                // 2 bytes optional single character Uri-Query for describe flags
+                // 2 bytes optional single character Uri-Query for describe flags, optional Block2
                 int descriptor_type = DESCRIBE_DEFAULT;
-                if (message.length() > 8 && queue[8] <= DESCRIBE_MAX)
+                uint32_t block2 = CoAP::NO_BLOCK;
+                unsigned char *option = queue + 4 + (queue[0] & 0x0F);
+                unsigned char *end = queue + message.length();
+                uint16_t option_number = CoAPOption::NONE;
+                while (option < end && 0xff != *option)
                 {
-                    descriptor_type = queue[8];
-                }
-                else if (message.length() > 8)
-                {
-                    LOG(WARN, "Invalid DESCRIBE flags %02x", queue[8]);
+                    uint16_t delta;
+                    size_t option_length = CoAP::option_decode(&option, &delta);
+                    option_number += delta;
+                    if (CoAPOption::URI_QUERY == option_number && option_length == 1 && *option <= DESCRIBE_MAX)
+                    {
+                        descriptor_type = *option;
+                    }
+                    else if (CoAPOption::URI_QUERY == option_number)
+                    {
+                        LOG(WARN, "Invalid DESCRIBE flags %02x", *option);
+                    }
+                    else if (CoAPOption::BLOCK2 == option_number && option_length <= 3)
+                    {
+                        block2 = CoAP::option_uint_decode(option, option_length);
+                    }
+                    option += option_length;
                 }
-                error = send_description(token, msg_id, descriptor_type);
+                error = send_description(token, msg_id, descriptor_type, block2);
                 break;
             }
 
@@ -81,12 +96,20 @@ namespace trackle
 
             case CoAPMessageType::VARIABLE_REQUEST:
             {
+                if (Variables::is_bulk_request(message))
+                {
+                    return variables.handle_bulk_variable_request(message, channel, token, msg_id, descriptor);
+                }
                 char variable_key[MAX_VARIABLE_KEY_LENGTH + 1];
                 char variable_args[MAX_FUNCTION_ARG_LENGTH + 1];
                 return variables.handle_variable_request(variable_key, variable_args, message,
                                                          channel, token, msg_id,
                                                          descriptor.variable_type,
-                                                         descriptor.get_variable);
+                                                         descriptor.get_variable,
+                                                         descriptor.find_variable,
+                                                         descriptor.get_cached_variable,
+                                                         descriptor.read_variable,
+                                                         callbacks.millis());
             }
             case CoAPMessageType::SAVE_BEGIN:
                 // fall through
@@ -98,6 +121,11 @@ namespace trackle
             case CoAPMessageType::UPDATE_DONE:
                 return chunkedTransfer.handle_update_done(token, message, channel);
 
+            case CoAPMessageType::UPLOAD_CHUNKS_MISSED:
+                return chunkedUpload.handle_chunks_missed(message, channel);
+            case CoAPMessageType::UPLOAD_RESULT:
+                return chunkedUpload.handle_result(message, channel);
+
             case CoAPMessageType::EVENT:
                 return subscriptions.handle_event(message, descriptor.call_event_handler, channel);
 
@@ -184,8 +212,18 @@ namespace trackle
             const auto codeDetail = (int)responseCode & 0x1f;
             LOG(TRACE, "message id %d complete with code %d.%02d", msg_id, codeClass, codeDetail);
 
+            // Server received previous block of the describe message, send the next.
+            if (responseCode == CoAPCode::CONTINUE && description_post.active && description_post.msg_id == msg_id)
+            {
+                ack_handlers.setResult(msg_id);
+                Message message;
+                if (channel.create(message) == NO_ERROR)
+                {
+                    generate_and_send_description(channel, message, true, 0, 0, description_post.desc_flags, description_post.next_block);
+                }
+            }
             // Server received previous block, send the next.
-            if (responseCode == CoAPCode::CONTINUE)
+            else if (responseCode == CoAPCode::CONTINUE)
             {
                 // printf("RECEIVED CONTINUE\n");
                 ack_handlers.setResult(msg_id);
@@ -296,6 +334,8 @@ namespace trackle
 
             chunkedTransferCallbacks.init(&this->callbacks);
             chunkedTransfer.init(&chunkedTransferCallbacks);
+            chunkedUploadCallbacks.init(this);
+            chunkedUpload.init(&chunkedUploadCallbacks);
 
             initialized = true;
         }
@@ -345,6 +385,7 @@ namespace trackle
         {
             static system_tick_t t;
             static message_id_t id;
+            static bool session_resumed;
 
             switch (this->status)
             {
@@ -355,6 +396,9 @@ namespace trackle
                 LOG_CATEGORY("comm.protocol.handshake");
                 LOG(INFO, "Establish secure connection");
                 chunkedTransfer.reset();
+                chunkedUpload.cancel();
+                variables.reset_observers();
+                description_post.active = false;
                 pinger.reset();
                 timesync_.reset();
 
@@ -377,6 +421,7 @@ namespace trackle
                 uint32_t channel_flags = 0;
 
                 ProtocolError error = channel.establish(channel_flags, application_state_checksum());
+                session_resumed = (error == SESSION_RESUMED);
 
                 /*
                  * NO_ERROR in case handshake is not completed
@@ -470,12 +515,21 @@ namespace trackle
                         LOG(INFO, "Handshake completed");
                         channel.notify_established();
 
-                        /* Send system Describe */
-                        error = post_description(DescriptionType::DESCRIBE_DEFAULT);
-                        if (error)
+                        /* Send system Describe. A resumed session is the one the cloud got the describe on,
+                         * only the parts that changed since are posted, a new session gets all of them */
+                        const int desc_flags = session_resumed ? changed_description_flags() : DescriptionType::DESCRIBE_DEFAULT;
+                        if (desc_flags)
+                        {
+                            error = post_description(desc_flags);
+                            if (error)
+                            {
+                                this->status = CHANNEL_INIT;
+                                return error;
+                            }
+                        }
+                        else
                         {
-                            this->status = CHANNEL_INIT;
-                            return error;
+                            LOG(INFO, "Describe unchanged, not posted");
                         }
 
                         this->status = CHANNEL_INIT;
@@ -519,6 +573,10 @@ namespace trackle
             channel.create(message);
             uint8_t flags = was_ota_upgrade_successful ? HELLO_FLAG_OTA_UPGRADE_SUCCESSFUL : 0;
             flags |= HELLO_FLAG_DIAGNOSTICS_SUPPORT | HELLO_FLAG_IMMEDIATE_UPDATES_SUPPORT | HELLO_FLAG_OTA_PROTOCOL_V3;
+            if (compressed_ota)
+            {
+                flags |= HELLO_FLAG_COMPRESSED_OTA;
+            }
             size_t len = build_hello(message, flags);
             message.set_length(len);
             message.set_confirm_received(true);
@@ -608,6 +666,7 @@ namespace trackle
             {
                 // bail if and only if there was an error
                 chunkedTransfer.cancel();
+                chunkedUpload.cancel();
                 return error;
             }
             return error;
@@ -633,50 +692,7 @@ namespace trackle
                 if (desc_flags & DESCRIBE_APPLICATION)
                 {
                     has_content = true;
-                    appender.append("\"f\":[");
-
-                    int num_keys = descriptor.num_functions();
-                    int i;
-                    for (i = 0; i < num_keys; ++i)
-                    {
-                        if (i)
-                        {
-                            appender.append(',');
-                        }
-                        appender.append('"');
-
-                        const char *key = descriptor.get_function_key(i);
-                        size_t function_name_length = strlen(key);
-                        if (MAX_FUNCTION_KEY_LENGTH < function_name_length)
-                        {
-                            function_name_length = MAX_FUNCTION_KEY_LENGTH;
-                        }
-                        appender.append((const uint8_t *)key, function_name_length);
-                        appender.append('"');
-                    }
-
-                    appender.append("],\"v\":{");
-
-                    num_keys = descriptor.num_variables();
-                    for (i = 0; i < num_keys; ++i)
-                    {
-                        if (i)
-                        {
-                            appender.append(',');
-                        }
-                        appender.append('"');
-                        const char *key = descriptor.get_variable_key(i);
-                        size_t variable_name_length = strlen(key);
-                        TrackleReturnType::Enum t = descriptor.variable_type(key);
-                        if (MAX_VARIABLE_KEY_LENGTH < variable_name_length)
-                        {
-                            variable_name_length = MAX_VARIABLE_KEY_LENGTH;
-                        }
-                        appender.append((const uint8_t *)key, variable_name_length);
-                        appender.append("\":");
-                        appender.append('0' + (char)t);
-                    }
-                    appender.append('}');
+                    append_app_description(appender);
                 }
 
                 if (descriptor.append_system_info && (desc_flags & DESCRIBE_SYSTEM))
@@ -692,32 +708,228 @@ namespace trackle
             }
         }
 
-        ProtocolError Protocol::generate_and_send_description(MessageChannel &channel, Message &message,
-                                                              size_t header_size, int desc_flags)
+        namespace
+        {
+            class VectorAppender : public Appender
+            {
+                std::vector<uint8_t> &data;
+
+            public:
+                VectorAppender(std::vector<uint8_t> &data) : data(data) {}
+
+                bool append(const uint8_t *buf, size_t length) override
+                {
+                    data.insert(data.end(), buf, buf + length);
+                    return true;
+                }
+            };
+        }
+
+        void Protocol::append_app_description(Appender &appender)
+        {
+            if (descriptor.app_state_selector_info)
+            {
+                const uint32_t crc = descriptor.app_state_selector_info(TrackleAppStateSelector::DESCRIBE_APP, TrackleAppStateUpdate::COMPUTE, 0, nullptr);
+                if (!app_description_cached || crc != app_description_crc)
+                {
+                    app_description.clear();
+                    VectorAppender cache(app_description);
+                    serialize_app_description(cache, descriptor);
+                    app_description_crc = crc;
+                    app_description_cached = true;
+                }
+                appender.append(app_description.data(), app_description.size());
+            }
+            else
+            {
+                serialize_app_description(appender, descriptor);
+            }
+        }
+
+        void Protocol::serialize_app_description(Appender &appender, const TrackleDescriptor &descriptor)
+        {
+            appender.append("\"f\":[");
+
+            int num_keys = descriptor.num_functions();
+            int i;
+            for (i = 0; i < num_keys; ++i)
+            {
+                if (i)
+                {
+                    appender.append(',');
+                }
+                appender.append('"');
+
+                const char *key = descriptor.get_function_key(i);
+                size_t function_name_length = strlen(key);
+                if (MAX_FUNCTION_KEY_LENGTH < function_name_length)
+                {
+                    function_name_length = MAX_FUNCTION_KEY_LENGTH;
+                }
+                appender.append((const uint8_t *)key, function_name_length);
+                appender.append('"');
+            }
+
+            appender.append("],\"v\":{");
+
+            num_keys = descriptor.num_variables();
+            for (i = 0; i < num_keys; ++i)
+            {
+                if (i)
+                {
+                    appender.append(',');
+                }
+                appender.append('"');
+                const char *key = descriptor.get_variable_key(i);
+                size_t variable_name_length = strlen(key);
+                TrackleReturnType::Enum t = descriptor.variable_type(key);
+                if (MAX_VARIABLE_KEY_LENGTH < variable_name_length)
+                {
+                    variable_name_length = MAX_VARIABLE_KEY_LENGTH;
+                }
+                appender.append((const uint8_t *)key, variable_name_length);
+                appender.append("\":");
+                appender.append('0' + (char)t);
+            }
+            appender.append('}');
+        }
+
+        int Protocol::changed_description_flags()
+        {
+            int desc_flags = DescriptionType::DESCRIBE_DEFAULT;
+            if (descriptor.app_state_selector_info)
+            {
+                const TrackleAppStateSelector::Enum selectors[] = {TrackleAppStateSelector::DESCRIBE_APP, TrackleAppStateSelector::DESCRIBE_SYSTEM};
+                const int flags[] = {DESCRIBE_APPLICATION, DESCRIBE_SYSTEM};
+                for (int i = 0; i < 2; i++)
+                {
+                    const uint32_t persisted = descriptor.app_state_selector_info(selectors[i], TrackleAppStateUpdate::LOAD, 0, nullptr);
+                    if (persisted && persisted == descriptor.app_state_selector_info(selectors[i], TrackleAppStateUpdate::COMPUTE, 0, nullptr))
+                    {
+                        desc_flags &= ~flags[i];
+                    }
+                }
+            }
+            return desc_flags;
+        }
+
+        namespace
+        {
+            /**
+             * Keeps the window of the appended content starting at offset, and counts the whole length.
+             */
+            class WindowAppender : public Appender
+            {
+                uint8_t *buffer;
+                size_t offset;
+                size_t length;
+                size_t total;
+
+            public:
+                WindowAppender(uint8_t *buffer, size_t offset, size_t length) : buffer(buffer), offset(offset), length(length), total(0) {}
+
+                bool append(const uint8_t *data, size_t size) override
+                {
+                    const size_t start = std::max(total, offset);
+                    const size_t end = std::min(total + size, offset + length);
+                    if (start < end)
+                    {
+                        memcpy(buffer + (start - offset), data + (start - total), end - start);
+                    }
+                    total += size;
+                    return true;
+                }
+
+                size_t size() const { return total; }
+            };
+        }
+
+        ProtocolError Protocol::generate_and_send_description(MessageChannel &channel, Message &message, bool post, token_t token,
+                                                              message_id_t msg_id, int desc_flags, uint32_t block)
         {
             ProtocolError error;
 
-            BufferAppender appender((message.buf() + header_size), (message.capacity() - header_size));
+            // the content is generated at the position of the payload of a block, and moved back when it fits in a single message
+            const size_t max_header = 16; // header and token, Uri-Path, Uri-Query, Block option, payload marker
+            uint8_t *buf = message.buf();
+            uint8_t *payload = buf + max_header;
+            const size_t max_length = message.capacity() - max_header;
+            size_t block_size = MAX_BLOCK2_SIZE;
+            while (block_size > max_length)
+            {
+                block_size >>= 1;
+            }
+
+            size_t offset = 0;
+            size_t length = max_length;
+            if (block != CoAP::NO_BLOCK)
+            {
+                // the block size requested by the cloud may be reduced, the block number is scaled accordingly
+                offset = (block >> 4) * CoAP::block_size(block);
+                block_size = std::min(block_size, CoAP::block_size(block));
+                length = block_size;
+            }
+
+            WindowAppender appender(payload, offset, length);
             build_describe_message(appender, desc_flags);
+            const size_t total = appender.size();
 
-            const size_t msglen = (appender.next() - (uint8_t *)message.buf());
-            message.set_length(msglen);
-            if (appender.overflowed())
+            size_t header_size;
+            size_t payload_length;
+            bool more = false;
+            if (block == CoAP::NO_BLOCK && total <= max_length)
+            {
+                header_size = post ? Messages::describe_post_header(buf, message.capacity(), 0, (desc_flags & 0xFF))
+                                   : Messages::description(buf, msg_id, token);
+                payload_length = total;
+            }
+            else if (offset >= total && offset > 0)
+            {
+                LOG(WARN, "Describe block out of range");
+                message.set_length(Messages::coded_ack(buf, RESPONSE_CODE(4, 2), msg_id >> 8, msg_id & 0xFF));
+                return channel.send(message);
+            }
+            else
             {
-                LOG(ERROR, "Describe message overflowed by %d bytes", appender.overflowed());
-                // There is no point in continuing to run, the device will be constantly reconnecting
-                // to the cloud. It's better to clearly indicate that the describe message is never going
-                // to go through to the cloud by going into a panic state, otherwise one would have to
-                // sift through logs to find 'Describe message overflowed by %d bytes' message to understand
-                // what's going on.
+                payload_length = std::min(block_size, total - offset);
+                more = offset + payload_length < total;
+                const uint32_t value = CoAP::block_value(offset / block_size, more, block_size);
+                uint8_t option[3];
+                const size_t option_length = CoAP::option_uint_encode(option, value);
+                if (post)
+                {
+                    const char query = (desc_flags & 0xFF);
+                    header_size = CoAP::header(buf, CoAPType::CON, CoAPCode::POST);
+                    header_size += CoAP::uri_path(buf + header_size, CoAPOption::NONE, "d");
+                    header_size += CoAP::add_option(buf + header_size, CoAPOption::URI_PATH, CoAPOption::URI_QUERY, &query, 1);
+                    header_size += CoAP::add_option(buf + header_size, CoAPOption::URI_QUERY, CoAPOption::BLOCK1, option, option_length);
+                }
+                else
+                {
+                    header_size = CoAP::header(buf, CoAPType::ACK, CoAPCode::CONTENT, 1, &token, msg_id);
+                    header_size += CoAP::add_option(buf + header_size, CoAPOption::NONE, CoAPOption::BLOCK2, option, option_length);
+                }
+                buf[header_size++] = 0xff; // payload marker
             }
+            memmove(buf + header_size, payload, payload_length);
+            message.set_length(header_size + payload_length);
 
-            LOG(INFO, "Posting '%s%s%s' describe message", desc_flags & DESCRIBE_SYSTEM ? "S" : "",
-                desc_flags & DESCRIBE_APPLICATION ? "A" : "", desc_flags & DESCRIBE_METRICS ? "M" : "");
+            LOG(INFO, "Posting '%s%s%s' describe message%s", desc_flags & DESCRIBE_SYSTEM ? "S" : "",
+                desc_flags & DESCRIBE_APPLICATION ? "A" : "", desc_flags & DESCRIBE_METRICS ? "M" : "",
+                block == CoAP::NO_BLOCK && !more ? "" : " block");
 
             error = channel.send(message);
 
-            if (error == NO_ERROR && descriptor.app_state_selector_info &&
+            if (post)
+            {
+                // the next block is sent when the cloud acknowledges this one with 2.31 Continue
+                description_post.active = (error == NO_ERROR && more);
+                description_post.desc_flags = desc_flags;
+                description_post.next_block = CoAP::block_value(offset / block_size + 1, false, block_size);
+                description_post.msg_id = message.get_id();
+            }
+
+            if (error == NO_ERROR && !more && descriptor.app_state_selector_info &&
                 (desc_flags & DESCRIBE_APPLICATION || desc_flags & DESCRIBE_SYSTEM))
             {
                 this->channel.command(Channel::SAVE_SESSION);
@@ -750,10 +962,8 @@ namespace trackle
         {
             Message message;
             channel.create(message);
-            const size_t header_size =
-                Messages::describe_post_header(message.buf(), message.capacity(), 0, (desc_flags & 0xFF));
 
-            return generate_and_send_description(channel, message, header_size, desc_flags);
+            return generate_and_send_description(channel, message, true, 0, 0, desc_flags);
         }
 
         /**
@@ -761,15 +971,13 @@ namespace trackle
          * @param desc_flags Flags describing the information to provide. A combination of {@code
          * DESCRIBE_APPLICATION) and {@code DESCRIBE_SYSTEM) flags.
          */
-        ProtocolError Protocol::send_description(token_t token, message_id_t msg_id, int desc_flags)
+        ProtocolError Protocol::send_description(token_t token, message_id_t msg_id, int desc_flags, uint32_t block2)
         {
             Message message;
             channel.create(message);
-            uint8_t *buf = message.buf();
             message.set_id(msg_id);
-            size_t desc = Messages::description(buf, msg_id, token);
 
-            return generate_and_send_description(channel, message, desc, desc_flags);
+            return generate_and_send_description(channel, message, false, token, msg_id, desc_flags, block2);
         }
 
         int Protocol::ChunkedTransferCallbacks::prepare_for_firmware_update(FileTransfer::Descriptor &data, uint32_t flags, void *reserved)
@@ -797,6 +1005,45 @@ namespace trackle
             return callbacks->millis();
         }
 
+        int Protocol::ChunkedTransferCallbacks::save_transfer_state(const void *data, size_t length)
+        {
+            return callbacks->save(data, length, TrackleCallbacks::PERSIST_OTA, NULL);
+        }
+
+        int Protocol::ChunkedTransferCallbacks::restore_transfer_state(void *data, size_t max_length)
+        {
+            return callbacks->restore(data, max_length, TrackleCallbacks::PERSIST_OTA, NULL);
+        }
+
+        int Protocol::ChunkedTransferCallbacks::read_installed_firmware(uint32_t offset, uint8_t *buf, size_t length)
+        {
+            // older callers don't provide it
+            return callbacks->read_firmware ? callbacks->read_firmware(offset, buf, length, NULL) : -1;
+        }
+
+        system_tick_t Protocol::ChunkedUploadCallbacks::millis()
+        {
+            return protocol->callbacks.millis();
+        }
+
+        void Protocol::ChunkedUploadCallbacks::add_ack_handler(message_id_t msg_id, CompletionHandler handler)
+        {
+            protocol->add_ack_handler(msg_id, std::move(handler), SEND_EVENT_ACK_TIMEOUT);
+        }
+
+        int Protocol::ChunkedUploadCallbacks::read_upload(uint32_t offset, uint8_t *buf, size_t length)
+        {
+            return read ? read(offset, buf, length) : -1;
+        }
+
+        void Protocol::ChunkedUploadCallbacks::upload_complete(const char *name, int error)
+        {
+            if (completion)
+            {
+                completion(name, error);
+            }
+        }
+
         int Protocol::get_describe_data(trackle_protocol_describe_data *data, void *reserved)
         {
             data->maximum_size = 1024;             // a conservative guess based on dtls and lightssl encryption overhead and the CoAP data
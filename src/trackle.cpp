@@ -11,6 +11,9 @@
 #include <vector>
 
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 #include "hal_platform.h"
 
@@ -25,6 +28,17 @@
 #include "tinydtls_set_rand.h"
 #include "tinydtls_set_get_millis.h"
 #include "messages.h"
+#include "event_queue.h"
+#include "chunk_queue.h"
+#include "http_downloader.h"
+#include "crc32.h"
+#include "key_index.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define FIRMWARE_FILE_SINK 1
+#endif
 
 using namespace trackle::protocol;
 
@@ -34,6 +48,7 @@ using namespace trackle::protocol;
 // var key len = MAX_FUNCTION_KEY_LENGTH + 5 // "..":x,
 // remove 2 from total (2 are commas for last funct and var)
 // TOTAL LEN = 50 + 20 * (MAX_VARIABLE_KEY_LENGTH + 3) + 20 * (MAX_FUNCTION_KEY_LENGTH + 5) + (MAX_COMPONENTS_LIST_LENGTH + 7) - 2 = 1015
+// (for 20 functions and 20 variables with the longest keys)
 
 #define DEFAULT_CONNECTION_TIMEOUT 1000
 #define RECONNECTION_TIMEOUT 3750
@@ -85,12 +100,17 @@ publishSendCallback *sendPublishCb = NULL;
 prepareFirmwareUpdateCallback *prepareFirmwareCb = NULL;
 firmwareChunkCallback *firmwareChunkCb = NULL;
 finishFirmwareUpdateCallback *finishUpdateCb = NULL;
+readFirmwareCallback *readFirmwareCb = NULL;
 randomNumberCallback *getRandomCb = NULL;
 rebootCallback *systemRebootCb = NULL;
 otaUpdateCallback *otaUpdateCb = NULL;
+executorCallback *otaDownloadExecutor = NULL;
 pincodeCallback *pincodeCb = NULL;
 connectionStatusCallback *connectionStatusCb = NULL;
 updateStateCallback *updateStateCb = NULL;
+eventQueueNotifyCallback *eventQueueNotifyCb = NULL;
+
+trackle::EventQueue event_queue;
 
 uint32_t counter = 0; // MAX_COUNTER 9.999.999
 uint32_t prefix = 0;  // 4.294.967.296 -> 1.990.000.000
@@ -258,9 +278,31 @@ char describe_iccid[DESCRIBE_ATTR_SIZE + 1];
 
 // TRACKLE.VARIABLE ------------------------------------------------------------
 
+/**
+ * Cached value of a variable, kept serialized as it is sent to the cloud.
+ * The payload is written by the refresh job, possibly on another thread, and read by the protocol loop.
+ * The job gets this object, which keeps its own copy of the getter: vars may grow, and move, meanwhile.
+ */
+struct CachedVariable
+{
+    void *(*funct)(const char *);
+    TrackleReturnType::Enum type;
+    std::atomic<system_tick_t> ttl;
+    std::atomic<system_tick_t> refreshed;
+    std::atomic<bool> valid;
+    std::atomic<bool> refreshing;
+    std::mutex lock;
+    std::vector<uint8_t> payload; // guarded by lock
+
+    CachedVariable(void *(*funct)(const char *), TrackleReturnType::Enum type, system_tick_t ttl)
+        : funct(funct), type(type), ttl(ttl), refreshed(0), valid(false), refreshing(false) {}
+};
+
 struct CloudVariableTypeBase
 {
     char userVarKey[MAX_VARIABLE_KEY_LENGTH + 1];
+    CachedVariable *cache; // NULL unless setVariableCache() was called
+    user_variable_reader_cb_t reader; // set for variables added with getReader(), that have no funct
     Data_TypeDef userVarType;
     Data_TypeDef stringVarType;
 
@@ -277,13 +319,33 @@ struct CloudVariableTypeBase
         userVarKey[sizeof(userVarKey) - 1] = '\0';
         userVarType = type;
         funct = fn;
+        cache = NULL;
+        reader = NULL;
     };
 };
 
 std::vector<CloudVariableTypeBase> vars;
+trackle::KeyIndex vars_index(MAX_VARIABLE_KEY_LENGTH);
+uint32_t vars_crc = 0; // checksum of the keys and types of vars, updated as they are added
+
+static TrackleReturnType::Enum wrapVarTypeInEnum(const CloudVariableTypeBase *item);
+
+static const char *var_key_at(uint16_t position)
+{
+    return vars[position].userVarKey;
+}
 
 /**
- * It searches the vars array for a variable with the given key, and returns a pointer to that variable
+ * It returns the callback handed to the protocol for a variable. A variable with a reader has no getter:
+ * the protocol reads it through readUserVar(), and only needs a callback that is not NULL to find it.
+ */
+static const void *var_callback(const CloudVariableTypeBase *item)
+{
+    return item->reader ? (const void *)&item->reader : (const void *)item->funct;
+}
+
+/**
+ * It looks up the variable with the given key in the vars hash index, and returns a pointer to that variable
  * if found, or NULL if not found
  *
  * @param varKey The key of the variable to be found.
@@ -292,14 +354,23 @@ std::vector<CloudVariableTypeBase> vars;
  */
 CloudVariableTypeBase *find_var_by_key(const char *varKey)
 {
-    for (int i = (int)vars.size(); i-- > 0;)
-    {
-        if (0 == strncmp(vars[i].userVarKey, varKey, MAX_VARIABLE_KEY_LENGTH))
-        {
-            return &vars[i];
-        }
-    }
-    return NULL;
+    int position = vars_index.find(varKey, var_key_at);
+    return position < 0 ? NULL : &vars[position];
+}
+
+/**
+ * It appends a variable to the vars array and indexes its key
+ *
+ * @param item The variable to add.
+ */
+static void add_var(const CloudVariableTypeBase &item)
+{
+    vars.push_back(item);
+    vars_index.add(item.userVarKey, vars.size() - 1, var_key_at);
+
+    const uint8_t type = wrapVarTypeInEnum(&item);
+    vars_crc = crc32c(vars_crc, (const unsigned char *)item.userVarKey, strlen(item.userVarKey) + 1);
+    vars_crc = crc32c(vars_crc, &type, sizeof(type));
 }
 
 /**
@@ -341,7 +412,7 @@ bool Trackle::isEnabled()
     return cloudEnabled;
 }
 
-bool Trackle::addGet(const char *varKey, void *(*fn)(const char *), Data_TypeDef userVarType)
+bool Trackle::addGet(const char *varKey, void *(*fn)(const char *), Data_TypeDef userVarType, user_variable_reader_cb_t reader)
 {
     if (!varKey)
     {
@@ -353,7 +424,7 @@ bool Trackle::addGet(const char *varKey, void *(*fn)(const char *), Data_TypeDef
         LOG(WARN, "Tried to set variable with empty name");
         return false;
     }
-    if (!fn)
+    if (!fn && !reader)
     {
         LOG(WARN, "Tried to set variable callback\"%s\" with NULL pointer", varKey);
         return false;
@@ -376,46 +447,48 @@ bool Trackle::addGet(const char *varKey, void *(*fn)(const char *), Data_TypeDef
     if (userVarType == VAR_BOOLEAN)
     {
         CloudVariableTypeBase item = CloudVariableTypeBase(fn, varKey, VAR_BOOLEAN);
-        vars.push_back(item);
+        add_var(item);
         LOG(TRACE, "Set variable \"%s\" as boolean with value \"%d\"", item.userVarKey, 0);
     }
     else if (userVarType == VAR_INT)
     {
         CloudVariableTypeBase item = CloudVariableTypeBase(fn, varKey, VAR_INT);
-        vars.push_back(item);
+        add_var(item);
         LOG(TRACE, "Set variable \"%s\" as int with value \"%d\"", item.userVarKey, 0);
     }
     else if (userVarType == VAR_LONG)
     {
         CloudVariableTypeBase item = CloudVariableTypeBase(fn, varKey, VAR_LONG);
-        vars.push_back(item);
+        add_var(item);
         LOG(TRACE, "Set variable \"%s\" as long with value \"%d\"", item.userVarKey, 0);
     }
     else if (userVarType == VAR_STRING)
     {
         CloudVariableTypeBase item = CloudVariableTypeBase(fn, varKey, VAR_STRING);
         item.stringVarType = VAR_STRING;
-        vars.push_back(item);
+        item.reader = reader;
+        add_var(item);
         LOG(TRACE, "Set variable \"%s\" as string value \"%s\"", item.userVarKey, "");
     }
     else if (userVarType == VAR_JSON)
     {
         CloudVariableTypeBase item = CloudVariableTypeBase(fn, varKey, VAR_JSON);
         item.stringVarType = VAR_JSON;
-        vars.push_back(item);
+        item.reader = reader;
+        add_var(item);
         LOG(TRACE, "Set variable \"%s\" as json value \"%s\"", item.userVarKey, "");
     }
     else if (userVarType == VAR_CHAR)
     {
         CloudVariableTypeBase item = CloudVariableTypeBase(fn, varKey, VAR_STRING);
         item.stringVarType = VAR_CHAR;
-        vars.push_back(item);
+        add_var(item);
         LOG(TRACE, "Set variable \"%s\" as char value \"%s\"", item.userVarKey, "");
     }
     else if (userVarType == VAR_DOUBLE)
     {
         CloudVariableTypeBase item = CloudVariableTypeBase(fn, varKey, VAR_DOUBLE);
-        vars.push_back(item);
+        add_var(item);
         LOG(TRACE, "Set variable \"%s\" as double with value \"%f\"", item.userVarKey, 0);
     }
     else
@@ -464,11 +537,24 @@ bool Trackle::get(const char *varKey, void *(*fn)(const char *), Data_TypeDef ty
     return addGet(varKey, fn, type);
 }
 
+bool Trackle::getReader(const char *varKey, user_variable_reader_cb_t fn, Data_TypeDef type)
+{
+    if (type != VAR_STRING && type != VAR_JSON)
+    {
+        LOG(WARN, "Tried to set reader of var \"%s\" with type %d", varKey, type);
+        return false;
+    }
+
+    // the variable has no getter, the protocol reads it through readUserVar()
+    return addGet(varKey, NULL, type, fn);
+}
+
 // TRACKLE.FUNCTION ------------------------------------------------------------
 
 struct CloudFunctionTypeBase
 {
     user_function_int_char_t *pUserFunc;
+    user_function_async_t *pAsyncFunc; // set instead of pUserFunc for functions completed with completeFunction()
     Function_PermissionDef permission;
     char userFuncKey[MAX_FUNCTION_KEY_LENGTH + 1];
     CloudFunctionTypeBase(const char *funcKey, user_function_int_char_t *userFunc, Function_PermissionDef perms)
@@ -476,6 +562,7 @@ struct CloudFunctionTypeBase
         strncpy(userFuncKey, funcKey, sizeof(userFuncKey));
         userFuncKey[sizeof(userFuncKey) - 1] = '\0';
         pUserFunc = userFunc;
+        pAsyncFunc = NULL;
         permission = perms;
     };
 };
@@ -506,8 +593,16 @@ bool user_is_owner(const char *user_id)
     return false;
 }
 
+trackle::KeyIndex funcs_index(MAX_FUNCTION_KEY_LENGTH);
+uint32_t funcs_crc = 0; // checksum of the keys of funcs, updated as they are added
+
+static const char *func_key_at(uint16_t position)
+{
+    return funcs[position].userFuncKey;
+}
+
 /**
- * It searches the `funcs` array for a function with the given `funcKey` and returns a pointer to the
+ * It looks up the function with the given `funcKey` in the `funcs` hash index and returns a pointer to the
  * function if found, or `NULL` if not found
  *
  * @param funcKey The key of the function to be found.
@@ -516,21 +611,18 @@ bool user_is_owner(const char *user_id)
  */
 CloudFunctionTypeBase *find_func_by_key(const char *funcKey)
 {
-    if (!funcKey)
-    {
-        return NULL;
-    }
-    for (int i = (int)funcs.size(); i-- > 0;)
-    {
-        if (0 == strncmp(funcs[i].userFuncKey, funcKey, MAX_FUNCTION_KEY_LENGTH))
-        {
-            return &funcs[i];
-        }
-    }
-    return NULL;
+    int position = funcs_index.find(funcKey, func_key_at);
+    return position < 0 ? NULL : &funcs[position];
 }
 
-bool Trackle::post(const char *funcKey, user_function_int_char_t *func, Function_PermissionDef permission)
+/**
+ * It appends a function to the funcs array and indexes its key
+ *
+ * @param item The function to add.
+ *
+ * @return false if the function limit is reached or the key is already used.
+ */
+static bool add_func(const CloudFunctionTypeBase &item)
 {
     if (funcs.size() >= MAX_FUNCTION_COUNT)
     {
@@ -538,20 +630,212 @@ bool Trackle::post(const char *funcKey, user_function_int_char_t *func, Function
         return false;
     }
 
-    CloudFunctionTypeBase *old_item = find_func_by_key(funcKey);
+    CloudFunctionTypeBase *old_item = find_func_by_key(item.userFuncKey);
 
     if (old_item)
     {
-        LOG(WARN, "Tried to add already-existing function \"%s\" (\"%s\" exists)", funcKey, old_item->userFuncKey);
+        LOG(WARN, "Tried to add already-existing function \"%s\" (\"%s\" exists)", item.userFuncKey, old_item->userFuncKey);
         return false;
     }
 
-    CloudFunctionTypeBase item = CloudFunctionTypeBase(funcKey, func, permission);
     funcs.push_back(item);
-    LOG(TRACE, "Set %s function \"%s\"", (permission == ALL_USERS ? "PUBLIC" : "OWNER ONLY"), item.userFuncKey);
+    funcs_index.add(item.userFuncKey, funcs.size() - 1, func_key_at);
+    funcs_crc = crc32c(funcs_crc, (const unsigned char *)item.userFuncKey, strlen(item.userFuncKey) + 1);
+    LOG(TRACE, "Set %s function \"%s\"", (item.permission == ALL_USERS ? "PUBLIC" : "OWNER ONLY"), item.userFuncKey);
     return true;
 }
 
+bool Trackle::post(const char *funcKey, user_function_int_char_t *func, Function_PermissionDef permission)
+{
+    return add_func(CloudFunctionTypeBase(funcKey, func, permission));
+}
+
+bool Trackle::postAsync(const char *funcKey, user_function_async_t *func, Function_PermissionDef permission)
+{
+    CloudFunctionTypeBase item = CloudFunctionTypeBase(funcKey, NULL, permission);
+    item.pAsyncFunc = func;
+    return add_func(item);
+}
+
+// Asynchronous function calls waiting for completeFunction(). The status word packs the call state
+// in the top 2 bits and the completion token in the others, so that completeFunction() can claim
+// a call from any thread with a single compare-and-swap.
+#define ASYNC_CALL_FREE 0u
+#define ASYNC_CALL_PENDING 1u
+#define ASYNC_CALL_CLAIMED 2u
+#define ASYNC_CALL_DONE 3u
+#define ASYNC_CALL_STATUS(state, token) (((uint32_t)(state) << 30) | ((token)&0x3fffffff))
+#define ASYNC_CALL_STATE(status) ((status) >> 30)
+
+struct AsyncFunctionCall
+{
+    std::atomic<uint32_t> status;
+    int result;                                          // written by completeFunction() while claimed
+    system_tick_t started;                               // protocol loop only
+    TrackleDescriptor::FunctionResultCallback callback; // protocol loop only
+};
+
+#define DEFAULT_MAX_PENDING_FUNCTIONS 4
+#define DEFAULT_FUNCTION_TIMEOUT 10000
+
+// completeFunction() reads the count before the calls, it's set after the calls are allocated and cleared before
+// they are freed; async_completing counts the completeFunction() in progress, the calls are freed once it's 0
+std::unique_ptr<AsyncFunctionCall[]> async_calls;
+std::atomic<uint8_t> async_calls_count(0);
+std::atomic<int> async_completing(0);
+uint8_t max_pending_functions = DEFAULT_MAX_PENDING_FUNCTIONS;
+system_tick_t async_function_timeout = DEFAULT_FUNCTION_TIMEOUT;
+uint32_t async_call_generation = 0;
+
+bool Trackle::setFunctionAsyncLimits(uint8_t maxPending, uint32_t timeout)
+{
+    const uint8_t count = async_calls_count.load();
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (ASYNC_CALL_STATE(async_calls[i].status.load()) != ASYNC_CALL_FREE)
+        {
+            LOG(WARN, "function call limits not changed, a call is pending");
+            return false;
+        }
+    }
+
+    async_function_timeout = timeout;
+    if (maxPending != max_pending_functions)
+    {
+        // the calls are allocated again by the next call, once no completeFunction() can read them
+        max_pending_functions = maxPending;
+        async_calls_count.store(0);
+        while (async_completing.load())
+        {
+        }
+        async_calls.reset();
+    }
+    return true;
+}
+
+bool Trackle::completeFunction(uint32_t completionToken, int result)
+{
+    async_completing.fetch_add(1);
+    const uint8_t index = completionToken & 0xff;
+    bool completed = false;
+    if (index < async_calls_count.load())
+    {
+        AsyncFunctionCall &call = async_calls[index];
+        uint32_t expected = ASYNC_CALL_STATUS(ASYNC_CALL_PENDING, completionToken);
+        if (call.status.compare_exchange_strong(expected, ASYNC_CALL_STATUS(ASYNC_CALL_CLAIMED, completionToken)))
+        {
+            call.result = result;
+            call.status.store(ASYNC_CALL_STATUS(ASYNC_CALL_DONE, completionToken), std::memory_order_release);
+            completed = true;
+        }
+    }
+    async_completing.fetch_sub(1);
+
+    if (!completed)
+    {
+        LOG(WARN, "function completion %u is unknown or timed out", completionToken);
+    }
+    return completed;
+}
+
+/**
+ * It starts an asynchronous function call, keeping the result callback until the call is completed
+ *
+ * @param function The async function to call.
+ * @param arg The argument passed to the function.
+ * @param is_owner If the caller is an owner of the device.
+ * @param callback The callback that sends the result to the cloud.
+ *
+ * @return 0 on success, 29 (too many requests) when the concurrency limit is reached.
+ */
+static int start_async_call(CloudFunctionTypeBase *function, const char *arg, bool is_owner,
+                            TrackleDescriptor::FunctionResultCallback callback)
+{
+    if (!async_calls)
+    {
+        async_calls.reset(new AsyncFunctionCall[max_pending_functions]);
+        for (uint8_t i = 0; i < max_pending_functions; i++)
+        {
+            async_calls[i].status = ASYNC_CALL_STATUS(ASYNC_CALL_FREE, 0);
+        }
+        async_calls_count.store(max_pending_functions);
+    }
+
+    const uint8_t count = async_calls_count.load(std::memory_order_relaxed);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        AsyncFunctionCall &call = async_calls[i];
+        if (ASYNC_CALL_STATE(call.status.load(std::memory_order_acquire)) != ASYNC_CALL_FREE)
+        {
+            continue;
+        }
+        const uint32_t completion_token = ((++async_call_generation << 8) | i) & 0x3fffffff;
+        call.started = (*callbacks.millis)();
+        call.callback = callback;
+        call.status.store(ASYNC_CALL_STATUS(ASYNC_CALL_PENDING, completion_token), std::memory_order_release);
+        (*function->pAsyncFunc)(arg, is_owner, completion_token);
+        return 0;
+    }
+
+    LOG(WARN, "too many pending calls, function %s refused", function->userFuncKey);
+    return 29;
+}
+
+/**
+ * It sends the results of the completed asynchronous function calls, and releases the timed out ones.
+ * To be called from the protocol loop.
+ */
+void process_async_calls()
+{
+    const uint8_t count = async_calls_count.load(std::memory_order_relaxed);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        AsyncFunctionCall &call = async_calls[i];
+        uint32_t status = call.status.load(std::memory_order_acquire);
+        if (ASYNC_CALL_STATE(status) == ASYNC_CALL_DONE)
+        {
+            // no callback when the call was cancelled by a new session
+            if (call.callback)
+                call.callback((const void *)(intptr_t)call.result, TrackleReturnType::INT);
+            call.callback = nullptr;
+            call.status.store(ASYNC_CALL_STATUS(ASYNC_CALL_FREE, 0), std::memory_order_release);
+        }
+        else if (ASYNC_CALL_STATE(status) == ASYNC_CALL_PENDING &&
+                 (*callbacks.millis)() - call.started > async_function_timeout &&
+                 call.status.compare_exchange_strong(status, ASYNC_CALL_STATUS(ASYNC_CALL_FREE, 0)))
+        {
+            LOG(WARN, "function completion %u timed out", status & 0x3fffffff);
+            call.callback = nullptr;
+        }
+    }
+}
+
+/**
+ * It drops the pending asynchronous calls when a new session starts: their results would answer
+ * requests of the previous session. A completion arriving later is refused by completeFunction().
+ * To be called from the protocol loop.
+ */
+void cancel_async_calls()
+{
+    const uint8_t count = async_calls_count.load(std::memory_order_relaxed);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        AsyncFunctionCall &call = async_calls[i];
+        uint32_t status = call.status.load(std::memory_order_acquire);
+        if (ASYNC_CALL_STATE(status) == ASYNC_CALL_FREE)
+        {
+            continue;
+        }
+        LOG(WARN, "function completion %u cancelled by a new session", status & 0x3fffffff);
+        call.callback = nullptr;
+        // a call claimed by completeFunction() is released by process_async_calls() once done
+        if (ASYNC_CALL_STATE(status) != ASYNC_CALL_CLAIMED)
+        {
+            call.status.compare_exchange_strong(status, ASYNC_CALL_STATUS(ASYNC_CALL_FREE, 0));
+        }
+    }
+}
+
 // TRACKLE.PUBLISH
 
 /**
@@ -570,6 +854,8 @@ inline uint32_t convert(uint32_t flags)
     return flags;
 }
 
+static void publish_completed(int error, const void *data, void *callbackData, void *reserved);
+
 bool Trackle::sendPublish(const char *eventName, const char *data, int ttl, Event_Type eventType, Event_Flags eventFlag, uint32_t msg_key)
 {
     if (!cloudEnabled)
@@ -647,7 +933,7 @@ bool Trackle::sendPublish(const char *eventName, const char *data, int ttl, Even
             block->transmissionRunning = true;
             block->ttl = ttl;
             block->flags = flags;
-            block->completionCb = completedPublishCb;
+            block->completionCb = publish_completed;
 
             d.handler_callback = trackle::protocol::genericBlockCompletionCallback;
             d.handler_data = (void *)msg_key;
@@ -736,6 +1022,218 @@ bool Trackle::syncState(string data)
     return sendPublish("trackle/p", data.c_str(), DEFAULT_TTL, PUBLIC, WITH_ACK, 0);
 }
 
+// TRACKLE.PROPERTIES ----------------------------------------------------------
+
+struct CloudProperty
+{
+    string name;
+    string value;        // JSON encoded
+    uint32_t generation; // properties_generation of the last change
+    uint32_t crc;        // checksum of name and value, part of properties_hash
+};
+
+#define PROPERTIES_RETRY_MIN 1000  // ms, first delay after a failed sync
+#define PROPERTIES_RETRY_MAX 60000 // ms, the delay doubles at each failure up to this
+
+static std::vector<CloudProperty> properties;
+static uint32_t properties_generation = 0;        // incremented at each change
+static uint32_t properties_synced_generation = 0; // changes up to this generation were acknowledged by the cloud
+static uint32_t properties_sent_generation = 0;   // changes up to this generation were sent or are being sent
+static uint32_t properties_hash = 0;              // xor of the checksums of all the properties
+static system_tick_t properties_first_change = 0; // time of the first change not sent yet
+static uint32_t properties_sync_window = 0;
+static bool properties_full_sync = false; // requested by the cloud
+static uint32_t properties_pending_key = 0;           // msg_key of the sync waiting for its ACK, 0 if none
+static uint32_t properties_pending_generation = 0;    // properties_generation when the pending sync was built
+static bool properties_pending_full = false;          // the pending sync is the whole state
+static system_tick_t properties_retry_at = 0;         // no sync from loop() before this time
+static uint32_t properties_retry_delay = 0;           // 0 when the last sync succeeded
+static uint32_t properties_oversize_generation = 0;   // generation whose state does not fit in an event
+static bool properties_oversize = false;
+
+/**
+ * It computes the checksum of a property, the CRC-32 of its name, a NUL and its value
+ */
+static uint32_t property_crc(const string &name, const string &value)
+{
+    uint32_t crc = crc32c(0, (const unsigned char *)name.c_str(), name.size() + 1);
+    return crc32c(crc, (const unsigned char *)value.data(), value.size());
+}
+
+bool Trackle::setProperty(const char *name, const char *value)
+{
+    if (!name || !name[0] || !value)
+    {
+        return false;
+    }
+
+    CloudProperty *property = NULL;
+    for (size_t i = 0; i < properties.size() && !property; i++)
+    {
+        if (properties[i].name == name)
+        {
+            property = &properties[i];
+        }
+    }
+    if (property && property->value == value)
+    {
+        return true;
+    }
+
+    if (!property)
+    {
+        properties.push_back(CloudProperty());
+        property = &properties.back();
+        property->name = name;
+        property->crc = 0;
+    }
+    if (properties_generation == properties_sent_generation)
+    {
+        properties_first_change = (*callbacks.millis)();
+    }
+
+    property->value = value;
+    property->generation = ++properties_generation;
+    properties_hash ^= property->crc;
+    property->crc = property_crc(property->name, property->value);
+    properties_hash ^= property->crc;
+    return true;
+}
+
+void Trackle::setPropertySyncWindow(uint32_t window)
+{
+    properties_sync_window = window;
+}
+
+/**
+ * It is called when a sync could not be sent or was not acknowledged, the changes stay pending and the
+ * next sync from loop() is delayed by a doubling backoff
+ */
+static void properties_sync_failed(bool full)
+{
+    properties_pending_key = 0;
+    properties_sent_generation = properties_synced_generation;
+    properties_full_sync |= full;
+    properties_retry_delay = properties_retry_delay ? std::min(properties_retry_delay * 2, (uint32_t)PROPERTIES_RETRY_MAX) : PROPERTIES_RETRY_MIN;
+    properties_retry_at = (*callbacks.millis)() + properties_retry_delay;
+    LOG(WARN, "properties sync failed, retrying in %lu ms", (unsigned long)properties_retry_delay);
+}
+
+/**
+ * Completion callback of the events published with ACK. It marks the changes of the pending properties
+ * sync as synced once the cloud acknowledged it, then calls the user callback.
+ */
+static void publish_completed(int error, const void *data, void *callbackData, void *reserved)
+{
+    if (properties_pending_key && (uint32_t)(uintptr_t)callbackData == properties_pending_key)
+    {
+        if (error == SYSTEM_ERROR_NONE)
+        {
+            properties_pending_key = 0;
+            properties_synced_generation = properties_pending_generation;
+            properties_retry_delay = 0;
+        }
+        else
+        {
+            properties_sync_failed(properties_pending_full);
+        }
+    }
+
+    if (completedPublishCb)
+    {
+        completedPublishCb(error, data, callbackData, reserved);
+    }
+}
+
+bool Trackle::syncProperties(bool full)
+{
+    if (properties.empty() || (!full && properties_generation == properties_sent_generation))
+    {
+        return true;
+    }
+    if (properties_pending_key)
+    {
+        // one sync at a time, the changes made meanwhile are sent once it is acknowledged
+        return false;
+    }
+
+    // {"g":<generation>,"h":"<hash>","p":{<changed properties>}}, or the whole state in the trackle/p format
+    char header[48];
+    string json;
+    if (!full)
+    {
+        snprintf(header, sizeof(header), "{\"g\":%lu,\"h\":\"%08lx\",\"p\":", (unsigned long)properties_generation, (unsigned long)properties_hash);
+        json = header;
+    }
+    json += '{';
+    for (size_t i = 0; i < properties.size(); i++)
+    {
+        if (full || properties[i].generation > properties_synced_generation)
+        {
+            if (json.back() != '{')
+            {
+                json += ',';
+            }
+            json += '"' + properties[i].name + "\":" + properties[i].value;
+        }
+    }
+    json += full ? "}" : "}}";
+
+    if (json.size() > MAX_BLOCK_SIZE * MAX_BLOCKS_NUMBER)
+    {
+        // retrying can't help, loop() waits for the next change
+        if (!properties_oversize || properties_oversize_generation != properties_generation)
+        {
+            LOG(ERROR, "properties not synced: %u bytes, more than the %u of an event", (unsigned)json.size(), (unsigned)(MAX_BLOCK_SIZE * MAX_BLOCKS_NUMBER));
+        }
+        properties_oversize = true;
+        properties_oversize_generation = properties_generation;
+        return false;
+    }
+    properties_oversize = false;
+
+    properties_pending_key = getNextPublishCounter();
+    properties_pending_generation = properties_generation;
+    properties_pending_full = full;
+    properties_sent_generation = properties_generation;
+    properties_full_sync = false;
+    const uint32_t msg_key = properties_pending_key;
+    if (!sendPublish(full ? "trackle/p" : "trackle/p/d", json.c_str(), DEFAULT_TTL, PUBLIC, WITH_ACK, msg_key))
+    {
+        // an error from the protocol already went through publish_completed()
+        if (properties_pending_key == msg_key)
+        {
+            properties_sync_failed(full);
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * It sends the properties changed since the last sync, once the sync window elapsed since the first of them
+ * changed, or all of them when the cloud asked for it. To be called from the loop when connected.
+ */
+void sync_changed_properties(Trackle *trackle)
+{
+    const system_tick_t now = (*callbacks.millis)();
+    if (properties_pending_key || (properties_oversize && properties_oversize_generation == properties_generation) ||
+        (properties_retry_delay && (int32_t)(now - properties_retry_at) < 0))
+    {
+        return;
+    }
+
+    if (properties_full_sync)
+    {
+        trackle->syncProperties(true);
+    }
+    else if (properties_generation != properties_sent_generation &&
+             now - properties_first_change >= properties_sync_window)
+    {
+        trackle->syncProperties(false);
+    }
+}
+
 bool Trackle::getTime()
 {
     return trackle_protocol_send_time_request(protocol);
@@ -787,7 +1285,7 @@ bool Trackle::registerEvent(const char *eventName, Subscription_Scope_Type event
 }
 
 bool Trackle::addSubscription(const char *eventName, EventHandler handler, void *handlerData,
-                              Subscription_Scope_Type scope, const char *deviceId, void *reserved)
+                              Subscription_Scope_Type scope, const char *deviceId, void *reserved, uint8_t flags)
 
 {
     char charDeviceId[13] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
@@ -821,7 +1319,7 @@ bool Trackle::addSubscription(const char *eventName, EventHandler handler, void
     }
 
     SubscriptionScope::Enum eventScope = convert(scope);
-    bool success = trackle_protocol_add_event_handler(protocol, eventName, handler, eventScope, charDeviceId, handlerData);
+    bool success = trackle_protocol_add_event_handler(protocol, eventName, handler, eventScope, charDeviceId, handlerData, flags);
     if (success && cloud_flag_connected())
     {
         registerEvent(eventName, scope, deviceId);
@@ -849,11 +1347,65 @@ bool Trackle::subscribe(const char *eventName, EventHandler handler, Subscriptio
     return addSubscription(eventName, handler, NULL, scope, deviceID, NULL);
 }
 
+bool Trackle::subscribeStream(const char *eventName, EventStreamHandler handler, void *handlerData, Subscription_Scope_Type scope, const char *deviceID)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+    return addSubscription(eventName, (EventHandler)handler, handlerData, scope, deviceID, NULL, EventHandlerFlags::STREAM);
+#pragma GCC diagnostic pop
+}
+
 void Trackle::unsubscribe()
 {
     trackle_protocol_remove_event_handlers(protocol, NULL);
 }
 
+void subscribe_trackle_handler(void *handler, const char *event_name, const char *data);
+
+/**
+ * Called by the protocol for each handler matching an inbound event. When the event queue is enabled
+ * the event is copied in the queue, otherwise the handler is called right away.
+ */
+void call_event_handler(uint16_t size, FilteringEventHandler *handler, const char *event_name, const char *data, void *reserved)
+{
+    (void)size;
+    (void)reserved;
+    // system events are never deferred
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+    if (!event_queue.enabled() || handler->handler == (EventHandler)subscribe_trackle_handler)
+#pragma GCC diagnostic pop
+    {
+        invoke_event_handler(handler->handler, handler->handler_data, event_name, data);
+        return;
+    }
+
+    if (event_queue.push(*handler, event_name, data) && eventQueueNotifyCb)
+        (*eventQueueNotifyCb)();
+}
+
+bool Trackle::setEventQueue(uint16_t capacity, uint16_t maxEventLength, Event_Queue_Policy policy)
+{
+    return event_queue.configure(capacity, maxEventLength, policy);
+}
+
+void Trackle::setEventQueueNotifyCallback(eventQueueNotifyCallback *notify)
+{
+    eventQueueNotifyCb = notify;
+}
+
+int Trackle::processEvents(int maxEvents)
+{
+    return event_queue.drain(maxEvents);
+}
+
+void Trackle::getEventQueueMetrics(Event_Queue_Metrics *metrics)
+{
+    event_queue.get_metrics(metrics);
+}
+
+static int start_ota_download(const char *url, uint32_t crc);
+
 /**
  * It handles all the events that are sent to the device from the Trackle cloud
  *
@@ -893,6 +1445,11 @@ void subscribe_trackle_handler(void *handler, const char *event_name, const char
             }
         }
     }
+    else if (strcmp(event_name, "trackle/p/sync") == 0)
+    {
+        // the cloud detected a drift of the properties hash
+        properties_full_sync = true;
+    }
     else if (strcmp(event_name, "trackle/device/reset") == 0)
     {
         if (systemRebootCb)
@@ -906,7 +1463,7 @@ void subscribe_trackle_handler(void *handler, const char *event_name, const char
     }
     else if (strcmp(event_name, "trackle/device/update") == 0)
     {
-        if (otaUpdateCb)
+        if (otaUpdateCb || otaDownloadExecutor)
         {
             if (ota_data.running)
             {
@@ -957,7 +1514,7 @@ void subscribe_trackle_handler(void *handler, const char *event_name, const char
 
                 if (ota_type > 0)
                 {
-                    int ota_error = (*otaUpdateCb)(url, crc);
+                    int ota_error = otaDownloadExecutor ? start_ota_download(url, crc) : (*otaUpdateCb)(url, crc);
                     char ota_cloud_message[256];
 
                     if (ota_error == NO_ERROR) // ota ok
@@ -1018,9 +1575,12 @@ void HAL_OTA_Flashed_ResetStatus(void) {}
  *
  * @return The return type of the variable.
  */
-TrackleReturnType::Enum wrapVarTypeInEnum(const char *varKey)
+static TrackleReturnType::Enum wrapVarTypeInEnum(const CloudVariableTypeBase *item)
 {
-    CloudVariableTypeBase *item = find_var_by_key(varKey);
+    if (!item)
+    {
+        return TrackleReturnType::INT;
+    }
     if (item->userVarType == VAR_BOOLEAN)
     {
         return TrackleReturnType::BOOLEAN;
@@ -1037,16 +1597,235 @@ TrackleReturnType::Enum wrapVarTypeInEnum(const char *varKey)
     {
         return TrackleReturnType::STRING;
     }
-    else if (item->userVarType == VAR_JSON)
+    else if (item->userVarType == VAR_JSON)
+    {
+        return TrackleReturnType::JSON;
+    }
+    else if (item->userVarType == VAR_DOUBLE)
+    {
+        return TrackleReturnType::DOUBLE;
+    }
+
+    return TrackleReturnType::INT;
+}
+
+TrackleReturnType::Enum wrapVarTypeInEnum(const char *varKey)
+{
+    return wrapVarTypeInEnum(find_var_by_key(varKey));
+}
+
+/**
+ * It looks up a variable once and returns both its callback and its type
+ *
+ * @param varKey The variable key.
+ * @param type Set to the return type of the variable.
+ *
+ * @return The callback of the variable, or NULL if there is no such variable.
+ */
+const void *findUserVar(const char *varKey, TrackleReturnType::Enum *type)
+{
+    CloudVariableTypeBase *item = find_var_by_key(varKey);
+    if (!item)
+    {
+        return NULL;
+    }
+    *type = wrapVarTypeInEnum(item);
+    return var_callback(item);
+}
+
+// VARIABLE CACHE
+
+static executorCallback *variableRefreshExecutor = NULL;
+
+/**
+ * It serializes the value returned by a variable getter, with the same encoding used by Messages::variable_value
+ *
+ * @param funct The getter of the variable.
+ * @param type The type of the variable.
+ * @param arg The argument passed to the getter.
+ * @param payload Filled with the serialized value.
+ */
+static void serialize_var(void *(*funct)(const char *), TrackleReturnType::Enum type, const char *arg, std::vector<uint8_t> &payload)
+{
+    payload.clear();
+    switch (type)
+    {
+    case TrackleReturnType::BOOLEAN:
+    {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+        const bool value = ((user_variable_bool_cb_t)funct)(arg);
+#pragma GCC diagnostic pop
+        payload.push_back(value ? 1 : 0);
+        break;
+    }
+    case TrackleReturnType::INT:
+    {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+        const int32_t value = ((user_variable_int32_cb_t)funct)(arg);
+#pragma GCC diagnostic pop
+        payload.push_back((value >> 24) & 0xff);
+        payload.push_back((value >> 16) & 0xff);
+        payload.push_back((value >> 8) & 0xff);
+        payload.push_back((value >> 0) & 0xff);
+        break;
+    }
+    case TrackleReturnType::DOUBLE:
+    {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+        const double value = ((user_variable_double_cb_t)funct)(arg);
+#pragma GCC diagnostic pop
+        const uint8_t *bytes = (const uint8_t *)&value;
+        payload.insert(payload.end(), bytes, bytes + sizeof(value));
+        break;
+    }
+    case TrackleReturnType::STRING:
+    case TrackleReturnType::JSON:
+    {
+        const char *value = ((user_variable_char_cb_t)funct)(arg);
+        payload.insert(payload.end(), value, value + strlen(value));
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * It calls the getter of a cached variable and stores the serialized value.
+ * Runs on the refresh executor, or inline when there is none.
+ *
+ * @param arg The CachedVariable to refresh, its refreshing flag already set.
+ */
+static void refresh_var(void *arg)
+{
+    CachedVariable *cache = (CachedVariable *)arg;
+
+    std::vector<uint8_t> payload;
+    serialize_var(cache->funct, cache->type, "", payload);
+    {
+        std::lock_guard<std::mutex> guard(cache->lock);
+        cache->payload.swap(payload);
+        cache->refreshed = (*callbacks.millis)();
+        cache->valid = true;
+    }
+    cache->refreshing = false;
+}
+
+/**
+ * It copies the cached value of a variable in the response. Values are only refreshed on demand, by the
+ * request that finds them expired: inline when there is no executor or the value was never computed,
+ * otherwise on the executor while the expired value is still served.
+ *
+ * @param varKey The variable key.
+ * @param arg The argument of the request, only requests without argument are cached.
+ * @param offset The offset of the first byte to copy.
+ * @param buf The buffer receiving the serialized value.
+ * @param max_length The size of the buffer.
+ *
+ * @return The whole length of the value, or -1 if the variable is not cached.
+ */
+int getCachedUserVar(const char *varKey, const char *arg, size_t offset, uint8_t *buf, size_t max_length)
+{
+    CloudVariableTypeBase *item = find_var_by_key(varKey);
+    if (!item || !item->cache || (arg && arg[0]))
+    {
+        return -1;
+    }
+
+    CachedVariable *cache = item->cache;
+    const bool expired = !cache->valid || (*callbacks.millis)() - cache->refreshed >= cache->ttl;
+    bool expected = false;
+    if (expired && cache->refreshing.compare_exchange_strong(expected, true))
+    {
+        if (variableRefreshExecutor && cache->valid)
+        {
+            (*variableRefreshExecutor)(refresh_var, cache);
+        }
+        else
+        {
+            refresh_var(cache);
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(cache->lock);
+    if (!cache->valid)
+    {
+        return -1;
+    }
+    if (offset < cache->payload.size())
+    {
+        memcpy(buf, cache->payload.data() + offset, std::min(cache->payload.size() - offset, max_length));
+    }
+    return cache->payload.size();
+}
+
+/**
+ * It reads a slice of a variable added with a reader.
+ *
+ * @param varKey The variable key.
+ * @param arg The argument of the request.
+ * @param offset The offset of the first byte to copy.
+ * @param buf The buffer receiving the value.
+ * @param max_length The size of the buffer.
+ *
+ * @return The whole length of the value, or -1 if the variable has no reader.
+ */
+int readUserVar(const char *varKey, const char *arg, size_t offset, uint8_t *buf, size_t max_length)
+{
+    CloudVariableTypeBase *item = find_var_by_key(varKey);
+    if (!item || !item->reader)
+    {
+        return -1;
+    }
+    return (*item->reader)(arg, offset, (char *)buf, max_length);
+}
+
+bool Trackle::setVariableCache(const char *varKey, uint32_t ttl)
+{
+    CloudVariableTypeBase *item = find_var_by_key(varKey);
+    if (!item || item->userVarType == VAR_LONG || item->reader)
+    {
+        LOG(WARN, "Cannot cache variable \"%s\"", varKey);
+        return false;
+    }
+
+    if (!item->cache && ttl)
+    {
+        item->cache = new CachedVariable(item->funct, wrapVarTypeInEnum(item), ttl);
+    }
+    else if (item->cache && !ttl)
     {
-        return TrackleReturnType::JSON;
+        if (item->cache->refreshing)
+        {
+            LOG(WARN, "Variable \"%s\" is being refreshed", varKey);
+            return false;
+        }
+        delete item->cache;
+        item->cache = NULL;
     }
-    else if (item->userVarType == VAR_DOUBLE)
+    else if (item->cache)
     {
-        return TrackleReturnType::DOUBLE;
+        item->cache->ttl = ttl;
     }
+    return true;
+}
 
-    return TrackleReturnType::INT;
+void Trackle::setVariableRefreshExecutor(executorCallback *executor)
+{
+    variableRefreshExecutor = executor;
+}
+
+void Trackle::notifyVariableChanged(const char *varKey)
+{
+    trackle_protocol_notify_variable_changed(protocol, varKey);
+}
+
+void Trackle::setVariableObserveIntervals(uint32_t minInterval, uint32_t maxInterval)
+{
+    trackle_protocol_set_variable_observe_intervals(protocol, minInterval, maxInterval);
 }
 
 /**
@@ -1106,7 +1885,7 @@ int update_state(const char *function_key, const char *arg, const char *user_cal
     if (updateStateCb)
     {
         int result = (*updateStateCb)(function_key, arg, user_is_owner(user_caller_id));
-        callback((void *)result, TrackleReturnType::INT);
+        callback((const void *)(intptr_t)result, TrackleReturnType::INT);
         return 0;
     }
     return 5; // error 500 updateStateCb not exists
@@ -1138,8 +1917,14 @@ int call_function(const char *function_key, const char *arg, const char *user_ca
     {
         if (function->permission == ALL_USERS || (function->permission == OWNER_ONLY && user_is_owner(user_caller_id)))
         {
+            if (function->pAsyncFunc)
+            {
+                // the result is sent once the call is completed, the request is only acknowledged now
+                LOG(TRACE, "function %s called with args %s, completion pending", function_key, arg);
+                return start_async_call(function, arg, user_is_owner(user_caller_id), callback);
+            }
             int result = (*function->pUserFunc)(arg, user_is_owner(user_caller_id));
-            callback((void *)result, TrackleReturnType::INT);
+            callback((const void *)(intptr_t)result, TrackleReturnType::INT);
             LOG(TRACE, "function %s called with args %s, result = %d", function_key, arg, result);
         }
         else
@@ -1190,7 +1975,7 @@ const char *getUserVariableKey(int variable_index)
 const void *getUserVar(const char *varKey)
 {
     CloudVariableTypeBase *item = find_var_by_key(varKey);
-    return (const void *)item->funct;
+    return var_callback(item);
 }
 
 /**
@@ -1203,12 +1988,14 @@ const void *getUserVar(const char *varKey)
  *
  * @return The system information.
  */
-bool appendSystemInfo(appender_fn appender, void *append, void *reserved)
+static string systemInfo()
 {
-    product_details_t details;
-    details.size = sizeof(details);
+    return "\"i\":" + int_to_string(connectionPropType.ping_interval) + "." + int_to_string(connectionType) + ",\"o\":" + int_to_string(otaMethod) + ",\"p\":" + int_to_string(PLATFORM_ID) + ",\"s\":\"" + int_to_string(VERSION_MAJOR) + "." + int_to_string(VERSION_MINOR) + "." + int_to_string(VERSION_PATCH) + VERSION_DEV + "\"" + components_list + describe_iccid + describe_imei;
+}
 
-    string json = "\"i\":" + int_to_string(connectionPropType.ping_interval) + "." + int_to_string(connectionType) + ",\"o\":" + int_to_string(otaMethod) + ",\"p\":" + int_to_string(PLATFORM_ID) + ",\"s\":\"" + int_to_string(VERSION_MAJOR) + "." + int_to_string(VERSION_MINOR) + "." + int_to_string(VERSION_PATCH) + VERSION_DEV + "\"" + components_list + describe_iccid + describe_imei;
+bool appendSystemInfo(appender_fn appender, void *append, void *reserved)
+{
+    string json = systemInfo();
 
     LOG(TRACE, "%s", json.c_str());
     const char *result = json.c_str();
@@ -1216,30 +2003,73 @@ bool appendSystemInfo(appender_fn appender, void *append, void *reserved)
     return true;
 }
 
-/* CRC-32 (Ethernet, ZIP, etc.) polynomial in reversed bit order. */
-#define POLY 0xedb88320
+static uint32_t app_state_crc[3]; // persisted checksums, indexed by TrackleAppStateSelector
+static bool app_state_crc_restored = false;
+
+static void restore_app_state_crc()
+{
+    if (app_state_crc_restored)
+    {
+        return;
+    }
+    app_state_crc_restored = true;
+    if (!callbacks.restore || (*callbacks.restore)(app_state_crc, sizeof(app_state_crc), TrackleCallbacks::PERSIST_APP_STATE, NULL) != sizeof(app_state_crc))
+    {
+        memset(app_state_crc, 0, sizeof(app_state_crc));
+    }
+}
 
 /**
- * Calculate CRC-32
+ * It computes and persists the checksums of the application state, used by the protocol to skip the describe
+ * messages the cloud already got. The checksum of functions and variables is kept up to date as they are added.
+ * The persisted checksums are saved with the save session callback, with type PERSIST_APP_STATE, and restored
+ * on the first LOAD, so that they survive a restart together with the DTLS session.
  *
- * @param crc The initial value of the CRC.
- * @param buf The buffer to calculate the CRC32C for.
- * @param len the length of the data to be crc'ed
+ * @param selector The part of the application state.
+ * @param operation COMPUTE, PERSIST, COMPUTE_AND_PERSIST or LOAD.
+ * @param data The checksum to persist with PERSIST.
+ * @param reserved Reserved for future use.
  *
- * @return The CRC32 checksum of the data.
+ * @return The computed checksum with COMPUTE, the persisted one with LOAD, 0 otherwise.
  */
-uint32_t crc32c(uint32_t crc, const unsigned char *buf, uint32_t len)
+uint32_t appStateSelectorInfo(TrackleAppStateSelector::Enum selector, TrackleAppStateUpdate::Enum operation, uint32_t data, void *reserved)
 {
-    int k;
+    if (operation == TrackleAppStateUpdate::LOAD)
+    {
+        restore_app_state_crc();
+        return app_state_crc[selector];
+    }
 
-    crc = ~crc;
-    while (len--)
+    uint32_t crc = data;
+    if (operation & TrackleAppStateUpdate::COMPUTE)
+    {
+        if (selector == TrackleAppStateSelector::DESCRIBE_APP)
+        {
+            const uint32_t chk[2] = {funcs_crc, vars_crc};
+            crc = crc32c(0, (const unsigned char *)chk, sizeof(chk));
+        }
+        else if (selector == TrackleAppStateSelector::DESCRIBE_SYSTEM)
+        {
+            const string json = systemInfo();
+            crc = crc32c(0, (const unsigned char *)json.data(), json.size());
+        }
+        else
+        {
+            // subscriptions are computed by the protocol
+            return 0;
+        }
+    }
+    if (operation & TrackleAppStateUpdate::PERSIST)
     {
-        crc ^= *buf++;
-        for (k = 0; k < 8; k++)
-            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        restore_app_state_crc();
+        app_state_crc[selector] = crc;
+        if (callbacks.save)
+        {
+            (*callbacks.save)(app_state_crc, sizeof(app_state_crc), TrackleCallbacks::PERSIST_APP_STATE, NULL);
+        }
+        return 0;
     }
-    return ~crc;
+    return crc;
 }
 
 /**
@@ -1564,6 +2394,11 @@ void Trackle::setFinishFirmwareUpdateCallback(finishFirmwareUpdateCallback *fini
     finishUpdateCb = finish;
 }
 
+void Trackle::setReadFirmwareCallback(readFirmwareCallback *read)
+{
+    readFirmwareCb = read;
+}
+
 void Trackle::setOtaUpdateCallback(otaUpdateCallback *updateCb)
 {
     otaUpdateCb = updateCb;
@@ -1874,6 +2709,7 @@ int Trackle::connect()
     if (trackle_protocol_is_initialized(protocol))
     {
         LOG(TRACE, "Protocol already initialized");
+        cancel_async_calls();
         setConnectionStatus(SOCKET_CONNECTING);
         int res = -1;
 
@@ -1909,6 +2745,8 @@ void Trackle::disconnect()
     (*disconnectCb)();
 }
 
+static void check_ota_download(Trackle *trackle);
+
 void Trackle::loop()
 {
     // ignore if not enabled
@@ -1919,6 +2757,9 @@ void Trackle::loop()
     if (connectionStatus == SOCKET_READY /* || connectionStatus == SOCKET_NOT_CONNECTED*/)
     {
         int res = trackle_protocol_event_loop(protocol);
+        process_async_calls();
+        sync_changed_properties(this);
+        check_ota_download(this);
         if (!res)
             connectionError(CON_ERROR_LOOP);
         if (!res && cloudStatus != res)
@@ -2041,8 +2882,232 @@ void Trackle::setKeys(const uint8_t client[PRIVATE_KEY_LENGTH])
  * Return 0 on success.
  */
 char *file_content;
+uint32_t file_content_length = 0; // lost on reboot, unlike the persisted transfer state
 uint64_t file_index = 0; // uint32_t is enough for correct use; use uint64_t for easier non-overflowing calculations
 
+// file sink, used instead of file_content when a firmware file is set
+string firmware_file_path;
+uint32_t firmware_file_sync_chunks = 0; // chunks written between two fsync, 0 to sync only at the end
+int firmware_file = -1;
+uint32_t firmware_file_address = 0; // address of the first byte of the image, also for file_content
+uint32_t firmware_file_unsynced = 0;
+
+#ifdef FIRMWARE_FILE_SINK
+
+/**
+ * It opens the firmware file and reserves its whole length, so that chunks can be written at their offset
+ * in any order and a full disk is detected before the transfer starts.
+ */
+static int open_firmware_file(uint32_t file_length, bool resume)
+{
+    if (firmware_file >= 0)
+    {
+        close(firmware_file);
+    }
+    // a resumed transfer keeps the chunks already written
+    firmware_file = open(firmware_file_path.c_str(), O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+    if (firmware_file < 0)
+    {
+        LOG(ERROR, "Cannot open firmware file %s", firmware_file_path.c_str());
+        return -1;
+    }
+    int error = -1;
+#if defined(__linux__)
+    error = fallocate(firmware_file, 0, 0, file_length);
+#elif !defined(__APPLE__)
+    error = posix_fallocate(firmware_file, 0, file_length);
+#endif
+    if (error)
+    {
+        // no preallocation support on this platform or filesystem
+        error = ftruncate(firmware_file, file_length);
+    }
+    if (error)
+    {
+        LOG(ERROR, "Cannot reserve %lu bytes for firmware file", (unsigned long)file_length);
+        close(firmware_file);
+        firmware_file = -1;
+        return -1;
+    }
+    firmware_file_unsynced = 0;
+    return 0;
+}
+
+/**
+ * It writes a chunk at its offset in the firmware file, syncing every firmware_file_sync_chunks chunks.
+ */
+static int write_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsigned char *chunk)
+{
+    if (firmware_file < 0)
+    {
+        return -1;
+    }
+    uint32_t offset = descriptor.chunk_address - firmware_file_address;
+    if (offset >= descriptor.file_length)
+    {
+        return -1;
+    }
+    // the last chunk is padded up to chunk_size
+    size_t length = std::min((uint32_t)descriptor.chunk_size, descriptor.file_length - offset);
+    while (length)
+    {
+        ssize_t written = pwrite(firmware_file, chunk, length, offset);
+        if (written <= 0)
+        {
+            LOG(ERROR, "Cannot write firmware chunk at %lu", (unsigned long)offset);
+            return -1;
+        }
+        chunk += written;
+        offset += written;
+        length -= written;
+    }
+    if (firmware_file_sync_chunks && ++firmware_file_unsynced >= firmware_file_sync_chunks)
+    {
+        fsync(firmware_file);
+        firmware_file_unsynced = 0;
+    }
+    return 0;
+}
+
+/**
+ * It syncs and closes the firmware file.
+ */
+static int close_firmware_file()
+{
+    if (firmware_file < 0)
+    {
+        return -1;
+    }
+    int error = fsync(firmware_file);
+    close(firmware_file);
+    firmware_file = -1;
+    return error;
+}
+
+#else
+
+// no file API on this platform, setFirmwareUpdateFile() is refused
+
+static int open_firmware_file(uint32_t file_length, bool resume)
+{
+    return -1;
+}
+
+static int write_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsigned char *chunk)
+{
+    return -1;
+}
+
+static int close_firmware_file()
+{
+    return -1;
+}
+
+#endif
+
+void Trackle::setFirmwareUpdateFile(const char *path, uint32_t syncChunks)
+{
+#ifndef FIRMWARE_FILE_SINK
+    if (path && path[0])
+    {
+        LOG(WARN, "Firmware file %s ignored: no file support on this platform", path);
+        return;
+    }
+#endif
+    firmware_file_path = path ? path : "";
+    firmware_file_sync_chunks = syncChunks;
+}
+
+// writer thread, fed by the protocol loop through firmware_queue
+executorCallback *firmwareWriteExecutor = NULL;
+uint16_t firmware_queue_capacity = 0;
+trackle::ChunkQueue firmware_queue;
+std::atomic<bool> firmware_writer_running(false);
+std::atomic<bool> firmware_write_failed(false);
+std::mutex firmware_writer_mutex; // held while the queue is drained or configured
+
+static int store_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsigned char *chunk, void *reserved);
+
+/**
+ * It stores the queued chunks, with firmware_writer_mutex held.
+ */
+static void drain_firmware_queue()
+{
+    if (firmware_queue.drain(store_firmware_chunk))
+    {
+        firmware_write_failed = true;
+    }
+}
+
+/**
+ * Writer job, run by the executor. It stores the queued chunks until the queue is empty.
+ */
+static void write_queued_firmware_chunks(void *)
+{
+    std::lock_guard<std::mutex> lock(firmware_writer_mutex);
+    do
+    {
+        drain_firmware_queue();
+        firmware_writer_running = false;
+        // a chunk queued after the drain but before the flag was cleared didn't schedule a new job
+    } while (!firmware_queue.empty() && !firmware_writer_running.exchange(true));
+}
+
+/**
+ * It stores the chunks still queued. They are written here rather than waiting for the writer job, that may
+ * not have started yet, e.g. with an executor that runs the jobs on the protocol loop thread; a job that is
+ * writing a chunk holds the lock until it's done.
+ */
+static void finish_firmware_writes()
+{
+    std::lock_guard<std::mutex> lock(firmware_writer_mutex);
+    drain_firmware_queue();
+}
+
+void Trackle::setOtaCheckpointInterval(uint16_t chunks)
+{
+    trackle_protocol_set_ota_checkpoint_interval(protocol, chunks);
+}
+
+void Trackle::setCompressedOta(bool enabled)
+{
+    trackle_protocol_set_compressed_ota(protocol, enabled);
+}
+
+void Trackle::setOtaMissingChunksReport(uint16_t distance, uint32_t timeout)
+{
+    trackle_protocol_set_ota_missing_chunks_report(protocol, distance, timeout);
+}
+
+bool Trackle::uploadFile(const char *name, uint32_t length, uploadReadCallback *read, uploadCompletionCallback *completion)
+{
+    if (!connected())
+    {
+        LOG(WARN, "Upload not started: not connected");
+        return false;
+    }
+    int error = trackle_protocol_begin_upload(protocol, name, length, read, completion);
+    if (error)
+    {
+        LOG(WARN, "Upload not started: %d", error);
+    }
+    return !error;
+}
+
+void Trackle::setUploadWindow(uint16_t chunks)
+{
+    trackle_protocol_set_upload_window(protocol, chunks);
+}
+
+void Trackle::setFirmwareWriteExecutor(executorCallback *executor, uint16_t chunks)
+{
+    std::lock_guard<std::mutex> lock(firmware_writer_mutex);
+    drain_firmware_queue();
+    firmwareWriteExecutor = executor;
+    firmware_queue_capacity = executor ? chunks : 0;
+    firmware_queue.configure(0, 0);
+}
+
 /**
  * It's called to tell the application that a firmware update is about to start
  *
@@ -2060,6 +3125,24 @@ int default_prepare_for_firmware_update(FileTransfer::Descriptor &descriptor, ui
         return -1;
     }
 
+    if ((flags & trackle::protocol::PrepareFlag::DELTA) && !readFirmwareCb)
+    {
+        LOG(WARN, "Delta update refused: the installed firmware can't be read");
+        return -1;
+    }
+
+    if (!(flags & trackle::protocol::PrepareFlag::DRY_RUN))
+    {
+        // the buffers are sized on the chunks of this transfer
+        std::lock_guard<std::mutex> lock(firmware_writer_mutex);
+        drain_firmware_queue();
+        firmware_write_failed = false;
+        if (!firmware_queue.configure(firmware_queue_capacity, descriptor.chunk_size))
+        {
+            return -1;
+        }
+    }
+
     if (prepareFirmwareCb)
     {
         Chunk new_chunk;
@@ -2070,27 +3153,49 @@ int default_prepare_for_firmware_update(FileTransfer::Descriptor &descriptor, ui
 
         (*prepareFirmwareCb)(new_chunk, flags, reserved);
     }
+    else if (!firmware_file_path.empty())
+    {
+        LOG(TRACE, "prepare_for_firmware_update length: %d file: %s", descriptor.file_length, firmware_file_path.c_str());
+        if (!(flags & trackle::protocol::PrepareFlag::DRY_RUN))
+        {
+            firmware_file_address = descriptor.file_address;
+            return open_firmware_file(descriptor.file_length, flags & trackle::protocol::PrepareFlag::RESUME);
+        }
+    }
     else
     {
         LOG(TRACE, "prepare_for_firmware_update length: %d", descriptor.file_length);
-        file_content = new char[descriptor.file_length];
+        if (flags & trackle::protocol::PrepareFlag::RESUME)
+        {
+            // the chunks of the interrupted transfer are kept only until a reboot
+            if (!file_content || file_content_length != descriptor.file_length)
+            {
+                LOG(WARN, "Cannot resume: the firmware received so far is lost");
+                return -1;
+            }
+        }
+        else if (!(flags & trackle::protocol::PrepareFlag::DRY_RUN))
+        {
+            file_content = new char[descriptor.file_length];
+            file_content_length = descriptor.file_length;
+        }
+        firmware_file_address = descriptor.file_address;
         file_index = 0;
     }
     return 0;
 }
 
 /**
- * It's a callback function that is called by the firmware update library to save the firmware chunk
+ * It stores a firmware chunk with the save chunk callback, in the firmware file or in memory.
  *
  * @param descriptor a structure containing the following fields:
  * @param chunk the chunk of data to be saved
  * @param reserved This is a pointer to a structure that is passed to the callback function.
  *
- * @return The return value is the number of bytes written to the file.
+ * @return 0 on success.
  */
-int default_save_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsigned char *chunk, void *reserved)
+static int store_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsigned char *chunk, void *reserved)
 {
-    LOG(TRACE, "save_firmware_chunk");
 
     if (firmwareChunkCb)
     {
@@ -2102,8 +3207,14 @@ int default_save_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsi
 
         (*firmwareChunkCb)(new_chunk, chunk, reserved);
     }
+    else if (!firmware_file_path.empty())
+    {
+        return write_firmware_chunk(descriptor, chunk);
+    }
     else
     {
+        // chunks can arrive out of order with fast OTA and parallel downloads
+        file_index = descriptor.chunk_address - firmware_file_address;
         for (int i = 0; i < descriptor.chunk_size; i++)
         {
             if (file_index + i < descriptor.file_length)
@@ -2117,6 +3228,36 @@ int default_save_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsi
     return 0;
 }
 
+/**
+ * It's a callback function that is called by the firmware update library to save the firmware chunk.
+ * With a writer executor the chunk is queued and stored on the writer thread.
+ *
+ * @param descriptor a structure containing the following fields:
+ * @param chunk the chunk of data to be saved
+ * @param reserved This is a pointer to a structure that is passed to the callback function.
+ *
+ * @return 0 if the chunk was saved or queued, otherwise the chunk is requested again later.
+ */
+int default_save_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsigned char *chunk, void *reserved)
+{
+    LOG(TRACE, "save_firmware_chunk");
+
+    if (!firmware_queue.enabled())
+    {
+        return store_firmware_chunk(descriptor, chunk, reserved);
+    }
+    if (!firmware_queue.push(descriptor, chunk))
+    {
+        LOG(WARN, "Firmware writer busy, chunk at %lu deferred", (unsigned long)descriptor.chunk_address);
+        return -1;
+    }
+    if (!firmware_writer_running.exchange(true))
+    {
+        (*firmwareWriteExecutor)(write_queued_firmware_chunks, NULL);
+    }
+    return 0;
+}
+
 /**
  * It's called when the firmware update is complete
  *
@@ -2129,6 +3270,21 @@ int default_finish_firmware_update(FileTransfer::Descriptor &data, uint32_t flag
 {
 
     LOG(TRACE, "finish_firmware_update OK");
+    finish_firmware_writes();
+    if (!firmware_file_path.empty())
+    {
+        if (flags & trackle::protocol::UpdateFlag::VALIDATE_ONLY)
+        {
+            return 0;
+        }
+        // the file is complete only on success, otherwise it's just closed
+        bool success = !close_firmware_file() && !firmware_write_failed && (flags & trackle::protocol::UpdateFlag::SUCCESS);
+        if (success && finishUpdateCb)
+        {
+            (*finishUpdateCb)((char *)firmware_file_path.c_str(), data.file_length);
+        }
+        return success ? 0 : -1;
+    }
     if (finishUpdateCb)
     {
         (*finishUpdateCb)(file_content, data.file_length);
@@ -2139,6 +3295,93 @@ int default_finish_firmware_update(FileTransfer::Descriptor &data, uint32_t flag
     return -1;
 }
 
+/**
+ * It reads the installed firmware with the application callback, for delta updates.
+ *
+ * @param offset The offset in the installed firmware.
+ * @param buf The buffer to fill.
+ * @param length The number of bytes to read.
+ *
+ * @return The number of bytes read, -1 if the firmware can't be read.
+ */
+int default_read_firmware(uint32_t offset, unsigned char *buf, size_t length, void *)
+{
+    return readFirmwareCb ? (*readFirmwareCb)(offset, buf, length) : -1;
+}
+
+/**
+ * It stores the image of a SEND_URL update, downloaded by the library, like the chunks of a PUSH update.
+ */
+class FirmwareDownloadSink : public trackle::HttpDownloader::Sink
+{
+    FileTransfer::Descriptor descriptor;
+
+public:
+    int begin(uint32_t length, uint16_t block_size) override
+    {
+        descriptor.file_length = length;
+        descriptor.file_address = 0;
+        descriptor.chunk_address = 0;
+        descriptor.chunk_size = block_size;
+        return default_prepare_for_firmware_update(descriptor, 0, NULL);
+    }
+
+    int write(uint32_t offset, const unsigned char *buf, uint32_t length) override
+    {
+        // the download already runs out of the protocol loop, so the chunk is stored without the writer queue
+        descriptor.chunk_address = offset;
+        descriptor.chunk_size = length;
+        return store_firmware_chunk(descriptor, buf, NULL);
+    }
+
+    void end(bool success) override
+    {
+        // an incomplete image in memory isn't passed to the application
+        if (success || !firmware_file_path.empty())
+        {
+            default_finish_firmware_update(descriptor, success ? trackle::protocol::UpdateFlag::SUCCESS : trackle::protocol::UpdateFlag::ERROR, NULL);
+        }
+    }
+};
+
+uint8_t ota_download_connections = 0;
+const Http_Transport *ota_download_transport = NULL;
+trackle::HttpDownloader ota_downloader;
+FirmwareDownloadSink ota_download_sink;
+
+/**
+ * It starts the download of a SEND_URL update, instead of passing the URL to the application.
+ */
+static int start_ota_download(const char *url, uint32_t crc)
+{
+    const Http_Transport *transport = ota_download_transport ? ota_download_transport : trackle::HttpDownloader::default_transport();
+    return ota_downloader.start(url, crc, otaDownloadExecutor, ota_download_connections, transport, &ota_download_sink);
+}
+
+/**
+ * It reports the result of the download to the cloud once it's over.
+ */
+static void check_ota_download(Trackle *trackle)
+{
+    int result;
+    if (ota_downloader.poll(result))
+    {
+        trackle->setOtaUpdateDone(result);
+    }
+}
+
+void Trackle::setOtaDownloader(executorCallback *executor, uint8_t connections, const Http_Transport *transport)
+{
+    if (ota_downloader.is_running())
+    {
+        LOG(WARN, "Ota download in progress, downloader not changed");
+        return;
+    }
+    otaDownloadExecutor = executor;
+    ota_download_connections = connections;
+    ota_download_transport = transport;
+}
+
 /**
  * This is the default signal function.
  * When the signaling starts or stops, print a message to the log.
@@ -2176,6 +3419,7 @@ Trackle::Trackle(void)
     callbacks.prepare_for_firmware_update = default_prepare_for_firmware_update;
     callbacks.save_firmware_chunk = default_save_firmware_chunk;
     callbacks.finish_firmware_update = default_finish_firmware_update;
+    callbacks.read_firmware = default_read_firmware;
     callbacks.set_time = default_system_set_time_cb;
     callbacks.signal = default_signal_cb;
     callbacks.send = wrapSend;
@@ -2194,8 +3438,13 @@ Trackle::Trackle(void)
     descriptor.get_variable_key = getUserVariableKey;
     descriptor.variable_type = wrapVarTypeInEnum;
     descriptor.get_variable = getUserVar;
+    descriptor.find_variable = findUserVar;
+    descriptor.get_cached_variable = getCachedUserVar;
+    descriptor.read_variable = readUserVar;
     descriptor.append_system_info = appendSystemInfo;
+    descriptor.app_state_selector_info = appStateSelectorInfo;
     descriptor.append_metrics = diagnostic::appendMetrics;
+    descriptor.call_event_handler = call_event_handler;
 
     TinyDtls_set_log_callback(TrackleLib_tinydtls_log_wrapper);
     TinyDtls_set_rand(HAL_RNG_GetRandomNumber);
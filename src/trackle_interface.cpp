@@ -44,18 +44,66 @@ bool trackleGet(Trackle *v, const char *varKey, void *(*fn)(const char *), Data_
     return v->get(varKey, fn, (Data_TypeDef)type);
 }
 
+bool trackleGetReader(Trackle *v, const char *varKey, user_variable_reader_cb_t fn, Data_TypeDef type)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->getReader(varKey, fn, type);
+}
+
 /*bool trackleGetInt(Trackle* v, const char* varKey, int* var) {
     return v->get(varKey, var, VAR_INT);
 }*/
 
 // TRACKLE.FUNCTION ------------------------------------------------------------
 
+bool trackleSetVariableCache(Trackle *v, const char *varKey, uint32_t ttl)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->setVariableCache(varKey, ttl);
+}
+
+void trackleSetVariableRefreshExecutor(Trackle *v, executorCallback *executor)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setVariableRefreshExecutor(executor);
+}
+
+void trackleNotifyVariableChanged(Trackle *v, const char *varKey)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->notifyVariableChanged(varKey);
+}
+
+void trackleSetVariableObserveIntervals(Trackle *v, uint32_t minInterval, uint32_t maxInterval)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setVariableObserveIntervals(minInterval, maxInterval);
+}
+
 bool tracklePost(Trackle *v, const char *funcKey, user_function_int_char_t *func, Function_PermissionDef permission)
 {
     IF_NOT_INITIALIZED_WARNING();
     return v->post(funcKey, func, permission);
 }
 
+bool tracklePostAsync(Trackle *v, const char *funcKey, user_function_async_t *func, Function_PermissionDef permission)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->postAsync(funcKey, func, permission);
+}
+
+bool trackleCompleteFunction(Trackle *v, uint32_t completionToken, int result)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->completeFunction(completionToken, result);
+}
+
+bool trackleSetFunctionAsyncLimits(Trackle *v, uint8_t maxPending, uint32_t timeout)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->setFunctionAsyncLimits(maxPending, timeout);
+}
+
 // TRACKLE.PUBLISH
 
 bool tracklePublish(Trackle *v, const char *eventName, const char *data, int ttl, Event_Type eventType, Event_Flags eventFlag, uint32_t msg_key)
@@ -70,6 +118,24 @@ bool trackleSyncState(Trackle *v, const char *data)
     return v->syncState(data);
 }
 
+bool trackleSetProperty(Trackle *v, const char *name, const char *value)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->setProperty(name, value);
+}
+
+void trackleSetPropertySyncWindow(Trackle *v, uint32_t window)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setPropertySyncWindow(window);
+}
+
+bool trackleSyncProperties(Trackle *v, bool full)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->syncProperties(full);
+}
+
 bool trackleGetTime(Trackle *v)
 {
     IF_NOT_INITIALIZED_WARNING();
@@ -83,12 +149,42 @@ bool trackleSubscribe(Trackle *v, const char *eventName, EventHandler handler, S
     return v->subscribe(eventName, (EventHandler)handler, (Subscription_Scope_Type)scope, deviceID);
 }
 
+bool trackleSubscribeStream(Trackle *v, const char *eventName, EventStreamHandler handler, void *handlerData, Subscription_Scope_Type scope, const char *deviceID)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->subscribeStream(eventName, handler, handlerData, scope, deviceID);
+}
+
 void trackleUnsubscribe(Trackle *v)
 {
     IF_NOT_INITIALIZED_WARNING();
     v->unsubscribe();
 }
 
+bool trackleSetEventQueue(Trackle *v, uint16_t capacity, uint16_t maxEventLength, Event_Queue_Policy policy)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->setEventQueue(capacity, maxEventLength, policy);
+}
+
+void trackleSetEventQueueNotifyCallback(Trackle *v, eventQueueNotifyCallback *notify)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setEventQueueNotifyCallback(notify);
+}
+
+int trackleProcessEvents(Trackle *v, int maxEvents)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->processEvents(maxEvents);
+}
+
+void trackleGetEventQueueMetrics(Trackle *v, Event_Queue_Metrics *metrics)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->getEventQueueMetrics(metrics);
+}
+
 // TRACKLE.CALLBACK ------------------------------------------------------------
 
 void trackleSetMillis(Trackle *v, millisCallback *millis)
@@ -161,11 +257,65 @@ void trackleSetFinishFirmwareUpdateCallback(Trackle *v, finishFirmwareUpdateCall
     v->setFinishFirmwareUpdateCallback(finish);
 }
 
+void trackleSetFirmwareUpdateFile(Trackle *v, const char *path, uint32_t syncChunks)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setFirmwareUpdateFile(path, syncChunks);
+}
+
+void trackleSetFirmwareWriteExecutor(Trackle *v, executorCallback *executor, uint16_t chunks)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setFirmwareWriteExecutor(executor, chunks);
+}
+
+void trackleSetOtaCheckpointInterval(Trackle *v, uint16_t chunks)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setOtaCheckpointInterval(chunks);
+}
+
+void trackleSetCompressedOta(Trackle *v, bool enabled)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setCompressedOta(enabled);
+}
+
+void trackleSetOtaMissingChunksReport(Trackle *v, uint16_t distance, uint32_t timeout)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setOtaMissingChunksReport(distance, timeout);
+}
+
+bool trackleUploadFile(Trackle *v, const char *name, uint32_t length, uploadReadCallback *read, uploadCompletionCallback *completion)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    return v->uploadFile(name, length, read, completion);
+}
+
+void trackleSetUploadWindow(Trackle *v, uint16_t chunks)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setUploadWindow(chunks);
+}
+
+void trackleSetReadFirmwareCallback(Trackle *v, readFirmwareCallback *read)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setReadFirmwareCallback(read);
+}
+
 void trackleSetOtaUpdateCallback(Trackle *v, otaUpdateCallback *updateCb)
 {
     v->setOtaUpdateCallback(updateCb);
 }
 
+void trackleSetOtaDownloader(Trackle *v, executorCallback *executor, uint8_t connections, const Http_Transport *transport)
+{
+    IF_NOT_INITIALIZED_WARNING();
+    v->setOtaDownloader(executor, connections, transport);
+}
+
 void trackleSetOtaUpdateDone(Trackle *v, int error_code)
 {
     v->setOtaUpdateDone(error_code);
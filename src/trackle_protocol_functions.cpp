@@ -101,10 +101,10 @@ bool trackle_protocol_send_subscription_scope(ProtocolFacade *protocol, const ch
 }
 
 bool trackle_protocol_add_event_handler(ProtocolFacade *protocol, const char *event_name,
-                                        EventHandler handler, SubscriptionScope::Enum scope, const char *device_id, void *handler_data)
+                                        EventHandler handler, SubscriptionScope::Enum scope, const char *device_id, void *handler_data, uint8_t flags)
 {
     ASSERT_ON_SYSTEM_OR_MAIN_THREAD();
-    return protocol->add_event_handler(event_name, handler, handler_data, scope, device_id);
+    return protocol->add_event_handler(event_name, handler, handler_data, scope, device_id, flags);
 }
 
 bool trackle_protocol_send_time_request(ProtocolFacade *protocol, void *reserved)
@@ -128,6 +128,55 @@ void trackle_protocol_remove_event_handlers(ProtocolFacade *protocol, const char
     protocol->remove_event_handlers(event_name);
 }
 
+void trackle_protocol_notify_variable_changed(ProtocolFacade *protocol, const char *variable_key, void *reserved)
+{
+    ASSERT_ON_SYSTEM_THREAD();
+    (void)reserved;
+    protocol->notify_variable_changed(variable_key);
+}
+
+void trackle_protocol_set_variable_observe_intervals(ProtocolFacade *protocol, system_tick_t min_interval, system_tick_t max_interval, void *reserved)
+{
+    ASSERT_ON_SYSTEM_THREAD();
+    (void)reserved;
+    protocol->set_variable_observe_intervals(min_interval, max_interval);
+}
+
+void trackle_protocol_set_ota_checkpoint_interval(ProtocolFacade *protocol, uint16_t chunks, void *reserved)
+{
+    ASSERT_ON_SYSTEM_THREAD();
+    (void)reserved;
+    protocol->set_ota_checkpoint_interval(chunks);
+}
+
+void trackle_protocol_set_compressed_ota(ProtocolFacade *protocol, bool enabled, void *reserved)
+{
+    ASSERT_ON_SYSTEM_THREAD();
+    (void)reserved;
+    protocol->set_compressed_ota(enabled);
+}
+
+void trackle_protocol_set_ota_missing_chunks_report(ProtocolFacade *protocol, uint16_t distance, system_tick_t timeout, void *reserved)
+{
+    ASSERT_ON_SYSTEM_THREAD();
+    (void)reserved;
+    protocol->set_ota_missing_chunks_report(distance, timeout);
+}
+
+int trackle_protocol_begin_upload(ProtocolFacade *protocol, const char *name, uint32_t length, uploadReadCallback *read, uploadCompletionCallback *completion, void *reserved)
+{
+    ASSERT_ON_SYSTEM_THREAD();
+    (void)reserved;
+    return protocol->begin_upload(name, length, read, completion);
+}
+
+void trackle_protocol_set_upload_window(ProtocolFacade *protocol, uint16_t chunks, void *reserved)
+{
+    ASSERT_ON_SYSTEM_THREAD();
+    (void)reserved;
+    protocol->set_upload_window(chunks);
+}
+
 void trackle_protocol_set_product_id(ProtocolFacade *protocol, product_id_t product_id, unsigned, void *)
 {
     ASSERT_ON_SYSTEM_OR_MAIN_THREAD();
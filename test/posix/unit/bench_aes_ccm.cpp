@@ -0,0 +1,120 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include <stdlib.h>
+#include <string.h>
+
+extern "C"
+{
+#include "tinydtls.h"
+#include "crypto.h"
+#include "ccm.h"
+#include "aesni.h"
+}
+
+// TLS_ECDHE_ECDSA_WITH_AES_128_CCM_8: 8 byte tag, 12 byte nonce, 13 bytes of additional data
+#define M 8
+#define L 3
+#define AAD_LENGTH 13
+#define BYTES (16 << 20)
+
+static unsigned char key[16];
+static unsigned char nonce[DTLS_CCM_BLOCKSIZE];
+static unsigned char aad[AAD_LENGTH];
+static unsigned char record[1500];
+
+static double portable(size_t size, bool decrypt)
+{
+	rijndael_ctx ctx;
+	rijndael_set_key_enc_only(&ctx, key, 128);
+	const int rounds = BYTES / size;
+	uint64_t start = unit_micros();
+	for (int i = 0; i < rounds; i++)
+	{
+		if (decrypt)
+			dtls_ccm_decrypt_message(&ctx, M, L, nonce, record, size + M, aad, AAD_LENGTH);
+		else
+			dtls_ccm_encrypt_message(&ctx, M, L, nonce, record, size, aad, AAD_LENGTH);
+	}
+	return (double)rounds * size / (unit_micros() - start);
+}
+
+#ifdef WITH_AESNI
+static double aesni(size_t size, bool decrypt)
+{
+	aesni_ctx ctx;
+	aesni_set_key(&ctx, key, 128);
+	const int rounds = BYTES / size;
+	uint64_t start = unit_micros();
+	for (int i = 0; i < rounds; i++)
+	{
+		if (decrypt)
+			aesni_ccm_decrypt_message(&ctx, M, L, nonce, record, size + M, aad, AAD_LENGTH);
+		else
+			aesni_ccm_encrypt_message(&ctx, M, L, nonce, record, size, aad, AAD_LENGTH);
+	}
+	return (double)rounds * size / (unit_micros() - start);
+}
+#endif
+
+// the whole record path of dtls.c: key schedule cache and backend dispatch
+static double encrypt_params(size_t size)
+{
+	static unsigned char out[1500 + M];
+	dtls_ccm_params_t params = {nonce, M, L};
+	const int rounds = BYTES / size;
+	uint64_t start = unit_micros();
+	for (int i = 0; i < rounds; i++)
+		dtls_encrypt_params(&params, record, size, out, key, sizeof(key), aad, AAD_LENGTH);
+	return (double)rounds * size / (unit_micros() - start);
+}
+
+int main()
+{
+	srand(1);
+	for (size_t i = 0; i < sizeof(key); i++)
+		key[i] = rand();
+	for (size_t i = 0; i < sizeof(nonce); i++)
+		nonce[i] = rand();
+	for (size_t i = 0; i < sizeof(record); i++)
+		record[i] = rand();
+
+#ifdef WITH_AESNI
+	const bool has_aesni = aesni_supported();
+#else
+	const bool has_aesni = false;
+#endif
+	printf("AES-NI %s, MB/s\n", has_aesni ? "supported" : "not supported");
+	printf("record   portable enc/dec    AES-NI enc/dec    dtls_encrypt_params\n");
+	const size_t sizes[] = {16, 64, 256, 1024, 1400};
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		const size_t size = sizes[s];
+		printf("%5zu B  %8.1f %8.1f", size, portable(size, false), portable(size, true));
+#ifdef WITH_AESNI
+		if (has_aesni)
+			printf("  %8.1f %8.1f", aesni(size, false), aesni(size, true));
+		else
+#endif
+			printf("  %8s %8s", "-", "-");
+		printf("  %10.1f\n", encrypt_params(size));
+	}
+	return 0;
+}
@@ -0,0 +1,73 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "ota_harness.h"
+#include <stdlib.h>
+
+#define CHUNK_SIZE 512
+
+using namespace trackle::protocol;
+
+/**
+ * A fast OTA transfer that lost 1% of the chunks: time spent by UpdateDone in
+ * scanning the bitmap for the missing chunks, reported MISSED_CHUNKS_TO_SEND
+ * at a time, until the cloud sent all of them again.
+ */
+static void run(unsigned chunks)
+{
+	OtaTarget target;
+	OtaCloud cloud(target, CHUNK_SIZE, 1, chunks / 8 + 2048);
+	std::vector<uint8_t> data(CHUNK_SIZE, 0x5A);
+	cloud.begin(chunks * CHUNK_SIZE);
+	srand(1);
+	unsigned missing = 0;
+	for (unsigned i = 0; i < chunks; i++)
+	{
+		if (rand() % 100)
+			cloud.chunk(i, &data[0], CHUNK_SIZE);
+		else
+			missing++;
+	}
+	cloud.requested();
+
+	uint64_t scanning = 0, worst = 0;
+	unsigned reports = 0;
+	while (!target.completed() && reports <= missing)
+	{
+		uint64_t start = unit_micros();
+		cloud.done();
+		uint64_t elapsed = unit_micros() - start;
+		scanning += elapsed;
+		worst = elapsed > worst ? elapsed : worst;
+		std::vector<uint16_t> requested = cloud.requested();
+		for (size_t i = 0; i < requested.size(); i++)
+			cloud.chunk(requested[i], &data[0], CHUNK_SIZE);
+		reports++;
+	}
+	printf("%5u chunks, %3u missing: %3u UpdateDone, %5llu us total, %4llu us max%s\n", chunks, missing, reports,
+		   (unsigned long long)scanning, (unsigned long long)worst, target.completed() ? "" : " INCOMPLETE");
+}
+
+int main()
+{
+	run(10000);
+	run(65000);
+	return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "crc32.h"
+#include <stdlib.h>
+#include <vector>
+
+#define ROUNDS 64
+
+static uint32_t crc32_bitwise(uint32_t crc, const unsigned char *buf, uint32_t len)
+{
+	crc = ~crc;
+	while (len--)
+	{
+		crc ^= *buf++;
+		for (int k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+	}
+	return ~crc;
+}
+
+static void run(const char *name, uint32_t (*crc)(uint32_t, const unsigned char *, uint32_t), const std::vector<unsigned char> &buf)
+{
+	uint32_t value = 0;
+	uint64_t start = unit_micros();
+	for (int i = 0; i < ROUNDS; i++)
+		value = crc(value, &buf[0], buf.size());
+	uint64_t elapsed = unit_micros() - start;
+	printf("%-12s %7.1f MB/s (%08lx)\n", name, (double)ROUNDS * buf.size() / elapsed, (unsigned long)value);
+}
+
+int main()
+{
+	std::vector<unsigned char> buf(1 << 20);
+	srand(1);
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = rand();
+	run("bitwise", crc32_bitwise, buf);
+	run("slice-by-8", crc32c, buf);
+	return 0;
+}
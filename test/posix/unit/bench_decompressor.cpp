@@ -0,0 +1,91 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "compress.h"
+#include "decompressor.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 20
+#define CHUNK_SIZE 512
+
+using namespace trackle::protocol;
+
+class Output : public Decompressor::Target
+{
+public:
+	std::vector<uint8_t> data;
+
+	int begin_output(uint32_t length, size_t block_size) override
+	{
+		data.assign(length, 0);
+		return 0;
+	}
+
+	int write_output(uint32_t offset, const uint8_t *buf, size_t length) override
+	{
+		memcpy(&data[offset], buf, length);
+		return 0;
+	}
+};
+
+/**
+ * A firmware image, the test binary itself when it can be read.
+ */
+static std::vector<uint8_t> firmware(const char *path)
+{
+	std::vector<uint8_t> data(200000);
+	FILE *f = fopen(path, "rb");
+	if (f)
+	{
+		data.resize(fread(&data[0], 1, data.size(), f));
+		fclose(f);
+	}
+	else
+	{
+		for (size_t i = 0; i < data.size(); i++)
+			data[i] = rand() % 4 ? (uint8_t)(i / 32) : rand();
+	}
+	return data;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<uint8_t> image = firmware(argv[0]);
+	for (unsigned window_bits = 8; window_bits <= Decompressor::MAX_WINDOW_BITS; window_bits++)
+	{
+		std::vector<uint8_t> stream = StreamCompressor::compress(image, window_bits, 4);
+		Output output;
+		Decompressor decompressor;
+		uint64_t start = unit_micros();
+		for (int round = 0; round < ROUNDS; round++)
+		{
+			decompressor.begin(&output);
+			for (size_t i = 0; i < stream.size(); i += CHUNK_SIZE)
+				decompressor.apply(&stream[i], std::min((size_t)CHUNK_SIZE, stream.size() - i));
+		}
+		uint64_t elapsed = unit_micros() - start;
+		bool ok = decompressor.complete() && output.data == image;
+		printf("window %2u bits: %zu -> %zu bytes (%2.0f%%), %6.1f MB/s%s\n", window_bits, image.size(), stream.size(),
+			   100.0 * stream.size() / image.size(), (double)ROUNDS * image.size() / elapsed, ok ? "" : " MISMATCH");
+		decompressor.end();
+	}
+	return 0;
+}
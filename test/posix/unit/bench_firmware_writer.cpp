@@ -0,0 +1,94 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "trackle.h"
+#include "file_transfer.h"
+#include <thread>
+
+int default_prepare_for_firmware_update(FileTransfer::Descriptor &descriptor, uint32_t flags, void *reserved);
+int default_save_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsigned char *chunk, void *reserved);
+int default_finish_firmware_update(FileTransfer::Descriptor &data, uint32_t flags, void *);
+
+#define CHUNK_SIZE 512
+#define CHUNKS 40
+#define SINK_DELAY_MS 5
+
+static Trackle device;
+
+static void prepare(Chunk data, uint32_t flags, void *reserved)
+{
+}
+
+// storage that takes 5 ms per chunk, e.g. a flash page erase
+static void slow_sink(Chunk data, const unsigned char *chunk, void *reserved)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(SINK_DELAY_MS));
+}
+
+static void thread_executor(void (*job)(void *), void *arg)
+{
+	std::thread(job, arg).detach();
+}
+
+/**
+ * Time the protocol loop spends in the save chunk callback, that delays the ACK
+ * of the next chunks, and in the finish callback waiting for the writer.
+ */
+static void run(const char *name, executorCallback *executor)
+{
+	unsigned char chunk[CHUNK_SIZE] = {0};
+	FileTransfer::Descriptor descriptor;
+	descriptor.file_length = CHUNKS * CHUNK_SIZE;
+	descriptor.file_address = 0;
+	descriptor.chunk_size = CHUNK_SIZE;
+	descriptor.chunk_address = 0;
+
+	device.setFirmwareWriteExecutor(executor, CHUNKS);
+	default_prepare_for_firmware_update(descriptor, 0, NULL);
+
+	uint64_t worst = 0, total = 0;
+	for (int i = 0; i < CHUNKS; i++)
+	{
+		descriptor.chunk_address = i * CHUNK_SIZE;
+		uint64_t start = unit_micros();
+		default_save_firmware_chunk(descriptor, chunk, NULL);
+		uint64_t elapsed = unit_micros() - start;
+		total += elapsed;
+		worst = elapsed > worst ? elapsed : worst;
+	}
+	uint64_t start = unit_micros();
+	default_finish_firmware_update(descriptor, 0, NULL);
+	uint64_t finish = unit_micros() - start;
+
+	printf("%-10s save chunk avg %6llu us, max %6llu us; finish %6llu us; total %6llu us\n", name,
+		   (unsigned long long)(total / CHUNKS), (unsigned long long)worst, (unsigned long long)finish,
+		   (unsigned long long)(total + finish));
+	device.setFirmwareWriteExecutor(NULL, 0);
+}
+
+int main()
+{
+	device.setPrepareForFirmwareUpdateCallback(prepare);
+	device.setSaveFirmwareChunkCallback(slow_sink);
+	printf("%d chunks of %d bytes, %d ms sink\n", CHUNKS, CHUNK_SIZE, SINK_DELAY_MS);
+	run("inline", NULL);
+	run("executor", thread_executor);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "test_channel.h"
+#include "event_builder.h"
+
+using namespace trackle::protocol;
+
+static unsigned delivered;
+
+static void count(const char *event_name, const char *data)
+{
+	delivered++;
+}
+
+/**
+ * Time to dispatch one inbound event with a growing number of subscriptions,
+ * of which only two match the event name.
+ */
+int main()
+{
+	const unsigned sizes[] = {6, 64, 512};
+	const unsigned EVENTS = 20000;
+	TestChannel channel;
+	channel.unreliable = false;
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		Subscriptions s;
+		char filter[32];
+		for (unsigned h = 0; h + 2 < sizes[i]; h++)
+		{
+			snprintf(filter, sizeof(filter), "sensor/%u/temperature", h);
+			s.add_event_handler(filter, count, NULL, SubscriptionScope::MY_DEVICES, NULL);
+		}
+		s.add_event_handler("alarm", count, NULL, SubscriptionScope::MY_DEVICES, NULL);
+		s.add_event_handler("alarm/door", count, NULL, SubscriptionScope::MY_DEVICES, NULL);
+
+		uint8_t event[PROTOCOL_BUFFER_SIZE];
+		uint8_t buf[PROTOCOL_BUFFER_SIZE];
+		const size_t length = build_event(event, "alarm/door/open", -1, "1", 1);
+
+		delivered = 0;
+		const uint64_t start = unit_micros();
+		for (unsigned e = 0; e < EVENTS; e++)
+		{
+			// handle_event terminates the strings in place, start from a fresh copy
+			memcpy(buf, event, length);
+			Message message(buf, sizeof(buf), length);
+			s.handle_event(message, nullptr, channel);
+		}
+		const uint64_t elapsed = unit_micros() - start;
+		CHECK_EQ(delivered, 2 * EVENTS);
+		printf("%4u subscriptions: %.3f us per event\n", sizes[i], (double)elapsed / EVENTS);
+	}
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,84 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "trackle.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+int getCachedUserVar(const char *varKey, const char *arg, size_t offset, uint8_t *buf, size_t max_length);
+
+static Trackle device;
+static const int GETTER_MICROS = 2000;
+static const int REQUESTS = 500;
+
+static system_tick_t real_millis()
+{
+	return unit_micros() / 1000;
+}
+
+// a getter reading a slow sensor
+static int slow_sensor(const char *arg)
+{
+	std::this_thread::sleep_for(std::chrono::microseconds(GETTER_MICROS));
+	return 42;
+}
+
+static void thread_job(void (*job)(void *arg), void *arg)
+{
+	std::thread(job, arg).detach();
+}
+
+/**
+ * Latency of the requests for a variable whose getter takes 2 ms, one request every 0.5 ms.
+ */
+static void measure(const char *label, const char *key)
+{
+	std::vector<uint32_t> latencies;
+	uint8_t buf[4];
+	for (int i = 0; i < REQUESTS; i++)
+	{
+		const uint64_t start = unit_micros();
+		if (getCachedUserVar(key, "", 0, buf, sizeof(buf)) < 0)
+			slow_sensor(""); // not cached: the getter answers the request
+		latencies.push_back(unit_micros() - start);
+		std::this_thread::sleep_for(std::chrono::microseconds(500));
+	}
+	std::sort(latencies.begin(), latencies.end());
+	printf("%-28s p50 %6u us  p99 %6u us  max %6u us\n", label, latencies[REQUESTS / 2],
+		   latencies[REQUESTS * 99 / 100], latencies.back());
+}
+
+int main()
+{
+	device.setMillis(real_millis);
+	device.get("uncached", slow_sensor);
+	device.get("inline", slow_sensor);
+	device.get("executor", slow_sensor);
+	device.setVariableCache("inline", 20);
+	device.setVariableCache("executor", 20);
+
+	measure("no cache", "uncached");
+	measure("ttl 20 ms, inline refresh", "inline");
+	device.setVariableRefreshExecutor(thread_job);
+	measure("ttl 20 ms, executor", "executor");
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	return 0;
+}
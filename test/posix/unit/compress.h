@@ -0,0 +1,102 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include "crc32.h"
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Reference encoder of the stream read by Decompressor: "THS1" header and a
+ * heatshrink bit stream, built with a plain longest match search.
+ */
+class StreamCompressor
+{
+public:
+	static std::vector<uint8_t> compress(const std::vector<uint8_t> &in, unsigned window_bits, unsigned lookahead_bits)
+	{
+		StreamCompressor bits;
+		const size_t max_length = 1u << lookahead_bits, max_distance = 1u << window_bits;
+		size_t i = 0;
+		while (i < in.size())
+		{
+			size_t best = 0, best_distance = 0;
+			for (size_t d = 1; d <= max_distance && d <= i; d++)
+			{
+				size_t l = 0;
+				while (l < max_length && i + l < in.size() && in[i + l] == in[i + l - d])
+					l++;
+				if (l > best)
+				{
+					best = l;
+					best_distance = d;
+				}
+			}
+			if (best * 8 > 1 + window_bits + lookahead_bits + 8)
+			{
+				bits.put(0, 1);
+				bits.put(best_distance - 1, window_bits);
+				bits.put(best - 1, lookahead_bits);
+				i += best;
+			}
+			else
+			{
+				bits.put(1, 1);
+				bits.put(in[i], 8);
+				i++;
+			}
+		}
+		bits.flush();
+
+		std::vector<uint8_t> stream = {'T', 'H', 'S', '1', (uint8_t)window_bits, (uint8_t)lookahead_bits};
+		uint32_t length = in.size(), crc = crc32c(0, &in[0], in.size());
+		for (int k = 3; k >= 0; k--)
+			stream.push_back(length >> (k * 8));
+		for (int k = 3; k >= 0; k--)
+			stream.push_back(crc >> (k * 8));
+		stream.insert(stream.end(), bits.out.begin(), bits.out.end());
+		return stream;
+	}
+
+private:
+	std::vector<uint8_t> out;
+	uint32_t accumulator = 0;
+	int count = 0;
+
+	void put(uint32_t value, int bits)
+	{
+		while (bits--)
+		{
+			accumulator = accumulator << 1 | ((value >> bits) & 1);
+			if (++count == 8)
+			{
+				out.push_back(accumulator);
+				accumulator = 0;
+				count = 0;
+			}
+		}
+	}
+
+	void flush()
+	{
+		if (count)
+			out.push_back(accumulator << (8 - count));
+	}
+};
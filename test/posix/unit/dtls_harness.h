@@ -0,0 +1,442 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include "dtls_message_channel.h"
+#include "tinydtls_set_rand.h"
+#include "tinydtls_set_get_millis.h"
+#include "uECC.h"
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using trackle::protocol::DTLSMessageChannel;
+using trackle::protocol::Message;
+using trackle::protocol::ProtocolError;
+
+/**
+ * A device DTLSMessageChannel and a tinydtls server playing the cloud, connected in memory:
+ * every datagram sent by one side is queued for the other, so a test can look at the records,
+ * drop them, tamper with them or send them again.
+ *
+ * tinydtls has a single context per process, so every boot of the device runs in a worker
+ * process forked before the cloud's context is created, and driven through a socket. The
+ * persisted session is kept by the test process, so it outlives the boots.
+ */
+typedef std::vector<uint8_t> Datagram;
+
+static std::deque<Datagram> to_cloud, to_device;
+static std::vector<Datagram> device_sent; // every datagram of the device, as it sent it
+static uint32_t random_state = 1;
+
+static uint32_t test_random() { return random_state = random_state * 1103515245 + 12345; }
+static void test_tinydtls_millis(uint32_t *ms) { *ms = 1000; }
+static system_tick_t test_millis() { return 1000; }
+
+static uint32_t test_crc(const uint8_t *data, uint32_t length)
+{
+	uint32_t crc = 2166136261u;
+	while (length--)
+		crc = (crc ^ *data++) * 16777619u;
+	return crc;
+}
+
+/**
+ * The device's persisted session, as the save/restore callbacks would keep it in flash.
+ */
+struct Storage
+{
+	Datagram session;
+	int saves = 0;
+};
+static Storage storage;
+
+/**
+ * The keys of both sides: the device's in the DER form of the device key, the cloud's as the
+ * subject public key info the channel is configured with.
+ */
+struct Keys
+{
+	uint8_t device_private[32], device_public[64];
+	uint8_t cloud_private[32], cloud_public[64];
+	uint8_t device_der[106];
+	uint8_t cloud_info[DTLS_PUBLIC_KEY_LENGTH];
+
+	void generate()
+	{
+		TinyDtls_set_rand(test_random);
+		TinyDtls_set_get_millis(test_tinydtls_millis);
+		dtls_init();
+		uECC_make_key(device_public, device_private, uECC_secp256r1());
+		uECC_make_key(cloud_public, cloud_private, uECC_secp256r1());
+
+		static const uint8_t private_header[] = {0x30, 104, 0x04, 32};
+		static const uint8_t public_header[] = {0xa1, 68, 0x03, 66, 0x00, 0x04};
+		memcpy(device_der, private_header, sizeof(private_header));
+		memcpy(device_der + 4, device_private, 32);
+		memcpy(device_der + 36, public_header, sizeof(public_header));
+		memcpy(device_der + 42, device_public, 64);
+
+		static const uint8_t info_header[] = {0x30, 0x59, 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01, 0x06,
+											  0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07, 0x03, 0x42, 0x00, 0x04};
+		memcpy(cloud_info, info_header, sizeof(info_header));
+		memcpy(cloud_info + sizeof(info_header), cloud_public, 64);
+	}
+};
+static Keys keys;
+
+/**
+ * The cloud side of the session, a plain tinydtls server.
+ */
+struct TestCloud
+{
+	dtls_context_t *context;
+	dtls_handler_t handler;
+	session_t session;
+	std::vector<std::string> received;
+
+	static int write(dtls_context_t *ctx, session_t *session, uint8 *data, size_t len)
+	{
+		to_device.push_back(Datagram(data, data + len));
+		return (int)len;
+	}
+
+	static int read(dtls_context_t *ctx, session_t *session, uint8 *data, size_t len)
+	{
+		((TestCloud *)ctx->app)->received.push_back(std::string((const char *)data, len));
+		return 0;
+	}
+
+	static int get_ecdsa_key(dtls_context_t *ctx, const session_t *session, const dtls_ecdsa_key_t **result)
+	{
+		static const dtls_ecdsa_key_t key = {DTLS_ECDH_CURVE_SECP256R1, keys.cloud_private, keys.cloud_public, keys.cloud_public + 32};
+		*result = &key;
+		return 0;
+	}
+
+	static int verify_ecdsa_key(dtls_context_t *ctx, const session_t *session, const unsigned char *x, const unsigned char *y, size_t size)
+	{
+		return 0;
+	}
+
+	/**
+	 * To be called once the device workers are forked.
+	 */
+	void start()
+	{
+		memset(&handler, 0, sizeof(handler));
+		handler.write = write;
+		handler.read = read;
+		handler.get_ecdsa_key = get_ecdsa_key;
+		handler.verify_ecdsa_key = verify_ecdsa_key;
+		context = dtls_new_context(this);
+		dtls_set_handler(context, &handler);
+		memset(&session, 0, sizeof(session));
+		session.size = sizeof(session.addr);
+	}
+
+	/**
+	 * Without the device's certificate the handshake messages are only checked by the Finished ones,
+	 * so the session keys are agreed even if a hello message was tampered with.
+	 */
+	void set_client_auth(bool client_auth)
+	{
+		handler.verify_ecdsa_key = client_auth ? verify_ecdsa_key : nullptr;
+	}
+
+	/**
+	 * Handles the datagrams the device sent.
+	 */
+	void process()
+	{
+		while (!to_cloud.empty())
+		{
+			Datagram d = to_cloud.front();
+			to_cloud.pop_front();
+			if (!d.empty())
+				dtls_handle_message(context, &session, d.data(), (int)d.size());
+		}
+	}
+
+	/**
+	 * Sends the data to the device in a record of the session, returns the record.
+	 */
+	Datagram send(const char *data)
+	{
+		dtls_write(context, &session, (uint8 *)data, strlen(data));
+		return to_device.back();
+	}
+
+	/**
+	 * Forgets the device, like a cloud restarted with an empty session cache.
+	 */
+	void reset()
+	{
+		dtls_peer_t *peer = dtls_get_peer(context, &session);
+		if (peer)
+			dtls_reset_peer(context, peer);
+		to_device.clear();
+		to_cloud.clear();
+	}
+};
+
+/**
+ * The requests to a device worker, and the messages it sends back: the datagrams and the
+ * persisted session go through the test process, the reply ends the request.
+ */
+enum WorkerMessage
+{
+	INIT_STATUS = 'I',
+	ESTABLISH = 'E',
+	RECEIVE = 'R',
+	SEND = 'W',
+	REPLY = 'A',
+	DATAGRAM = 'D',
+	SAVE = 'S',
+	LOAD = 'L',
+	LOADED = 'B'
+};
+
+static int worker_fd;
+static Datagram worker_input;
+
+static Datagram worker_read()
+{
+	uint8_t buf[2048];
+	ssize_t len = recv(worker_fd, buf, sizeof(buf), 0);
+	if (len <= 0)
+		_exit(0); // the test is over
+	return Datagram(buf, buf + len);
+}
+
+static void worker_write(uint8_t type, const uint8_t *data, size_t length)
+{
+	Datagram d(1, type);
+	d.insert(d.end(), data, data + length);
+	send(worker_fd, d.data(), d.size(), 0);
+}
+
+static int worker_send(const unsigned char *buf, uint32_t buflen, void *handle)
+{
+	worker_write(DATAGRAM, buf, buflen);
+	return (int)buflen;
+}
+
+static int worker_receive(unsigned char *buf, uint32_t buflen, void *handle)
+{
+	int len = (int)std::min((size_t)buflen, worker_input.size());
+	memcpy(buf, worker_input.data(), len);
+	worker_input.clear();
+	return len;
+}
+
+static int worker_save(const void *data, size_t length, uint8_t type, void *reserved)
+{
+	worker_write(SAVE, (const uint8_t *)data, length);
+	return 0;
+}
+
+static int worker_restore(void *data, size_t max_length, uint8_t type, void *reserved)
+{
+	worker_write(LOAD, nullptr, 0);
+	Datagram d = worker_read();
+	size_t length = std::min(max_length, d.size() - 1);
+	memcpy(data, d.data() + 1, length);
+	return (int)length;
+}
+
+/**
+ * The channel as the protocol uses it, the acknowledgements are left to the test.
+ */
+class DeviceChannel : public DTLSMessageChannel
+{
+public:
+	ProtocolError wait_ack(trackle::protocol::message_id_t id) override { return trackle::protocol::NO_ERROR; }
+};
+
+static void worker_run()
+{
+	static DeviceChannel channel;
+	static trackle::protocol::message_id_t coap_id = 1;
+	DTLSMessageChannel::Callbacks callbacks;
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.millis = test_millis;
+	callbacks.send = worker_send;
+	callbacks.receive = worker_receive;
+	callbacks.save = worker_save;
+	callbacks.restore = worker_restore;
+	callbacks.calculate_crc = test_crc;
+	channel.init(keys.device_der, sizeof(keys.device_der), keys.cloud_info, sizeof(keys.cloud_info), (const uint8_t *)"0123456789ab",
+				 callbacks, &coap_id);
+	channel.set_handshake_timeout(10000);
+
+	for (;;)
+	{
+		Datagram request = worker_read();
+		worker_input.assign(request.begin() + 1, request.end());
+		int32_t result = trackle::protocol::NO_ERROR;
+		Datagram reply(sizeof(result));
+		uint32_t flags = 0;
+		uint8_t buf[PROTOCOL_BUFFER_SIZE];
+		Message message(buf, sizeof(buf));
+		switch (request[0])
+		{
+		case INIT_STATUS:
+			channel.init_status();
+			break;
+		case ESTABLISH:
+			result = channel.establish(flags, 0);
+			break;
+		case RECEIVE:
+			result = channel.receive(message);
+			reply.insert(reply.end(), message.buf(), message.buf() + message.length());
+			break;
+		case SEND:
+			memcpy(buf, worker_input.data(), worker_input.size());
+			message.set_length(worker_input.size());
+			worker_input.clear();
+			result = channel.send(message);
+			break;
+		}
+		memcpy(reply.data(), &result, sizeof(result));
+		worker_write(REPLY, reply.data(), reply.size());
+	}
+}
+
+/**
+ * A boot of the device, from its start to its restart.
+ */
+struct Device
+{
+	int fd;
+
+	/**
+	 * Forks the worker, to be called before the cloud is started.
+	 */
+	void spawn()
+	{
+		int fds[2];
+		socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+		fflush(stdout);
+		if (fork() == 0)
+		{
+			close(fds[0]);
+			worker_fd = fds[1];
+			worker_run();
+		}
+		close(fds[1]);
+		fd = fds[0];
+	}
+
+	ProtocolError call(uint8_t type, const Datagram &input = Datagram(), std::string *output = nullptr)
+	{
+		Datagram request(1, type);
+		request.insert(request.end(), input.begin(), input.end());
+		::send(fd, request.data(), request.size(), 0);
+		for (;;)
+		{
+			uint8_t buf[2048];
+			ssize_t len = recv(fd, buf, sizeof(buf), 0);
+			if (len <= 0)
+				return trackle::protocol::UNKNOWN;
+			switch (buf[0])
+			{
+			case DATAGRAM:
+				to_cloud.push_back(Datagram(buf + 1, buf + len));
+				device_sent.push_back(to_cloud.back());
+				break;
+			case SAVE:
+				storage.session.assign(buf + 1, buf + len);
+				storage.saves++;
+				break;
+			case LOAD:
+			{
+				Datagram loaded(1, LOADED);
+				loaded.insert(loaded.end(), storage.session.begin(), storage.session.end());
+				::send(fd, loaded.data(), loaded.size(), 0);
+				break;
+			}
+			case REPLY:
+			{
+				int32_t result;
+				memcpy(&result, buf + 1, sizeof(result));
+				if (output)
+					output->assign((const char *)buf + 1 + sizeof(result), len - 1 - sizeof(result));
+				return (ProtocolError)result;
+			}
+			}
+		}
+	}
+
+	/**
+	 * Runs establish() until the session is connected or resumed or the handshake failed, the cloud
+	 * answering on the way. The datagrams of both sides go through tamper(), when given, an emptied
+	 * datagram is lost.
+	 */
+	ProtocolError establish(TestCloud &cloud, void (*tamper)(Datagram &d, bool to_device) = nullptr)
+	{
+		call(INIT_STATUS);
+		ProtocolError error = call(ESTABLISH);
+		for (int i = 0; i < 50 && error == trackle::protocol::NO_ERROR; i++)
+		{
+			for (size_t j = 0; tamper && j < to_cloud.size(); j++)
+				tamper(to_cloud[j], false);
+			cloud.process();
+			Datagram d;
+			if (!to_device.empty())
+			{
+				d = to_device.front();
+				to_device.pop_front();
+				if (tamper)
+					tamper(d, true);
+			}
+			error = call(ESTABLISH, d);
+		}
+		return error;
+	}
+
+	/**
+	 * Receives the next datagram of the cloud, returns the data of its record, empty when it was dropped.
+	 */
+	std::string receive(ProtocolError *error = nullptr)
+	{
+		Datagram d;
+		if (!to_device.empty())
+		{
+			d = to_device.front();
+			to_device.pop_front();
+		}
+		std::string data;
+		ProtocolError e = call(RECEIVE, d, &data);
+		if (error)
+			*error = e;
+		return data;
+	}
+
+	ProtocolError send(const char *data)
+	{
+		return call(SEND, Datagram(data, data + strlen(data)));
+	}
+};
@@ -0,0 +1,95 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Encodes a CoAP option with the extended delta/length forms.
+ */
+static inline uint8_t *build_option(uint8_t *p, unsigned delta, const uint8_t *value, size_t length)
+{
+	uint8_t *header = p++;
+	unsigned d = delta < 13 ? delta : delta < 269 ? 13 : 14;
+	unsigned l = length < 13 ? length : length < 269 ? 13 : 14;
+	*header = (d << 4) | l;
+	if (d == 13)
+		*p++ = delta - 13;
+	else if (d == 14)
+	{
+		*p++ = (delta - 269) >> 8;
+		*p++ = delta - 269;
+	}
+	if (l == 13)
+		*p++ = length - 13;
+	else if (l == 14)
+	{
+		*p++ = (length - 269) >> 8;
+		*p++ = length - 269;
+	}
+	memcpy(p, value, length);
+	return p + length;
+}
+
+/**
+ * Builds a confirmable public event as the cloud sends it: POST e/<name>, one
+ * Uri-Path option per name segment, an optional block option (Block1 = 27,
+ * Block2 = 23) and the payload.
+ */
+static inline size_t build_event(uint8_t *buf, const char *name, int block_value, const char *payload, size_t payload_length,
+								 unsigned block_option = 27)
+{
+	uint8_t *p = buf;
+	*p++ = 0x41; // CON, one byte token
+	*p++ = 0x02; // POST
+	*p++ = 0x00;
+	*p++ = 0x07;
+	*p++ = 0xAA;
+	p = build_option(p, 11, (const uint8_t *)"e", 1);
+	for (const char *segment = name;;)
+	{
+		const char *slash = strchr(segment, '/');
+		size_t length = slash ? slash - segment : strlen(segment);
+		p = build_option(p, 0, (const uint8_t *)segment, length);
+		if (!slash)
+			break;
+		segment = slash + 1;
+	}
+	if (block_value >= 0)
+	{
+		uint8_t value[3];
+		size_t length = 0;
+		if (block_value > 0xFFFF)
+			value[length++] = block_value >> 16;
+		if (block_value > 0xFF)
+			value[length++] = block_value >> 8;
+		if (block_value > 0)
+			value[length++] = block_value;
+		p = build_option(p, block_option - 11, value, length);
+	}
+	if (payload_length)
+	{
+		*p++ = 0xFF;
+		memcpy(p, payload, payload_length);
+		p += payload_length;
+	}
+	return p - buf;
+}
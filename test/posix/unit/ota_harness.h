@@ -0,0 +1,247 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include "chunked_transfer.h"
+#include "crc32.h"
+#include "test_channel.h"
+#include <string.h>
+#include <vector>
+
+/**
+ * Device side of an OTA transfer driven by ChunkedTransfer: the chunks are
+ * written to an in-memory flash and the transfer state is persisted in memory,
+ * so a test can drop the connection or "reboot" between two sessions.
+ */
+class OtaTarget : public trackle::protocol::ChunkedTransfer::Callbacks
+{
+public:
+	std::vector<uint8_t> flash;
+	std::vector<uint8_t> installed; // read by delta updates
+	std::vector<uint8_t> persisted;
+	std::vector<uint32_t> prepare_flags;
+	std::vector<uint32_t> finish_flags;
+	int writes;
+	bool keeps_chunks; // false once the chunks written so far are lost, e.g. held in RAM across a reboot
+	system_tick_t now;
+
+	OtaTarget() : writes(0), keeps_chunks(true), now(0) {}
+
+	/**
+	 * The transfer ended with a valid image, not just validated or aborted.
+	 */
+	bool completed() const
+	{
+		using namespace trackle::protocol;
+		return !finish_flags.empty() && (finish_flags.back() & (UpdateFlag::SUCCESS | UpdateFlag::VALIDATE_ONLY)) == UpdateFlag::SUCCESS;
+	}
+
+	int prepare_for_firmware_update(FileTransfer::Descriptor &descriptor, uint32_t flags, void *) override
+	{
+		prepare_flags.push_back(flags);
+		if (flags & trackle::protocol::PrepareFlag::DRY_RUN)
+			return 0;
+		if ((flags & trackle::protocol::PrepareFlag::RESUME) && !keeps_chunks)
+			return -1;
+		if (!(flags & trackle::protocol::PrepareFlag::RESUME))
+			flash.assign(descriptor.file_length, 0);
+		keeps_chunks = true;
+		return 0;
+	}
+
+	int save_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsigned char *chunk, void *) override
+	{
+		uint32_t offset = descriptor.chunk_address - descriptor.file_address;
+		if (offset + descriptor.chunk_size > flash.size())
+			flash.resize(offset + descriptor.chunk_size); // the padding of the last chunk is kept, to spot it
+		memcpy(&flash[offset], chunk, descriptor.chunk_size);
+		writes++;
+		return 0;
+	}
+
+	int finish_firmware_update(FileTransfer::Descriptor &descriptor, uint32_t flags, void *) override
+	{
+		finish_flags.push_back(flags);
+		return 0;
+	}
+
+	uint32_t calculate_crc(const unsigned char *buf, uint32_t length) override
+	{
+		return crc32c(0, buf, length);
+	}
+
+	system_tick_t millis() override { return now; }
+
+	int save_transfer_state(const void *data, size_t length) override
+	{
+		persisted.assign((const uint8_t *)data, (const uint8_t *)data + length);
+		return 0;
+	}
+
+	int restore_transfer_state(void *data, size_t max_length) override
+	{
+		if (persisted.empty() || persisted.size() > max_length)
+			return -1;
+		memcpy(data, &persisted[0], persisted.size());
+		return persisted.size();
+	}
+
+	int read_installed_firmware(uint32_t offset, uint8_t *buf, size_t length) override
+	{
+		if (offset + length > installed.size())
+			return -1;
+		memcpy(buf, &installed[offset], length);
+		return length;
+	}
+};
+
+/**
+ * Cloud side: builds the UpdateBegin, chunk and UpdateDone messages in a single
+ * buffer, like the channel receives them, since ChunkedTransfer keeps its
+ * bitmap at the end of that buffer.
+ */
+class OtaCloud
+{
+public:
+	trackle::protocol::ChunkedTransfer transfer;
+	TestChannel channel;
+	uint16_t chunk_size;
+	uint32_t file_address;
+	// UpdateBegin flags: 1 fast OTA, ChunkedTransfer::UPDATE_FLAG_DELTA, ChunkedTransfer::UPDATE_FLAG_COMPRESSED
+	uint8_t flags;
+
+	// the buffers are larger than PROTOCOL_BUFFER_SIZE for bitmaps of many chunks
+	OtaCloud(OtaTarget &target, uint16_t chunk_size, uint8_t flags = 1, size_t buffer_size = PROTOCOL_BUFFER_SIZE)
+		: channel(buffer_size), chunk_size(chunk_size), file_address(0x80000), flags(flags), wire(buffer_size)
+	{
+		transfer.init(&target);
+	}
+
+	trackle::protocol::ProtocolError begin(uint32_t file_length)
+	{
+		uint8_t *b = &wire[0];
+		memset(b, 0, 20);
+		b[0] = 0x41; // CON, one byte token
+		b[1] = 0x02;
+		b[3] = 0x01;
+		b[4] = 0xAA;
+		b[5] = 0xb1; // Uri-Path "u"
+		b[6] = 'u';
+		b[7] = 0xff;
+		b[8] = flags;
+		b[9] = chunk_size >> 8;
+		b[10] = chunk_size;
+		encode32(b + 11, file_length);
+		b[15] = 0; // firmware store
+		encode32(b + 16, file_address);
+		trackle::protocol::Message message(&wire[0], wire.size(), 20);
+		return transfer.handle_update_begin(0xAA, message, channel);
+	}
+
+	/**
+	 * Sends a chunk as fast OTA does, with its CRC and index. The length may be
+	 * longer than the data left in the file, as the cloud pads the last chunk.
+	 */
+	trackle::protocol::ProtocolError chunk(uint16_t index, const uint8_t *data, uint16_t length)
+	{
+		uint8_t *b = &wire[0];
+		b[0] = 0x51; // NON, one byte token
+		b[1] = 0x02;
+		b[2] = 0x00;
+		b[3] = 0x02;
+		b[4] = 0xAA;
+		b[5] = 0xb1; // Uri-Path "c"
+		b[6] = 'c';
+		b[7] = 0x44; // Uri-Query: CRC
+		encode32(b + 8, crc32c(0, data, length));
+		b[12] = 0x02; // Uri-Query: index
+		b[13] = index >> 8;
+		b[14] = index;
+		b[15] = 0xff;
+		memcpy(b + 16, data, length);
+		trackle::protocol::Message message(&wire[0], wire.size(), 16 + length);
+		return transfer.handle_chunk(0xAA, message, channel);
+	}
+
+	/**
+	 * Sends every chunk of the file in order, the last one padded to chunk_size.
+	 */
+	void stream(const std::vector<uint8_t> &file, unsigned first = 0, unsigned last = ~0u)
+	{
+		std::vector<uint8_t> padded(file);
+		padded.resize((file.size() + chunk_size - 1) / chunk_size * chunk_size, 0xFF);
+		unsigned chunks = padded.size() / chunk_size;
+		for (unsigned i = first; i < chunks && i < last; i++)
+			chunk(i, &padded[i * chunk_size], chunk_size);
+	}
+
+	trackle::protocol::ProtocolError done()
+	{
+		uint8_t *b = &wire[0];
+		b[0] = 0x41;
+		b[1] = 0x03; // PUT
+		b[2] = 0x00;
+		b[3] = 0x03;
+		b[4] = 0xAA;
+		b[5] = 0xff;
+		trackle::protocol::Message message(&wire[0], wire.size(), 6);
+		return transfer.handle_update_done(0xAA, message, channel);
+	}
+
+	/**
+	 * The connection dropped: the transfer is cancelled, as the protocol does
+	 * when the session ends.
+	 */
+	void drop()
+	{
+		transfer.cancel();
+		transfer.reset();
+	}
+
+	/**
+	 * The chunks requested by the device since the last call, in the missing chunks messages.
+	 */
+	std::vector<uint16_t> requested()
+	{
+		std::vector<uint16_t> chunks;
+		for (size_t i = 0; i < channel.sent.size(); i++)
+		{
+			const std::vector<uint8_t> &m = channel.sent[i];
+			if (m.size() >= 7 && m[1] == 0x01 && m[4] == 0xb1 && m[5] == 'c')
+			{
+				for (size_t j = 7; j + 1 < m.size(); j += 2)
+					chunks.push_back(m[j] << 8 | m[j + 1]);
+			}
+		}
+		channel.sent.clear();
+		return chunks;
+	}
+
+private:
+	std::vector<uint8_t> wire;
+
+	static void encode32(uint8_t *p, uint32_t value)
+	{
+		p[0] = value >> 24;
+		p[1] = value >> 16;
+		p[2] = value >> 8;
+		p[3] = value;
+	}
+};
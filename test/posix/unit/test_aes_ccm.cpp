@@ -0,0 +1,229 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include <stdlib.h>
+#include <string.h>
+
+extern "C"
+{
+#include "tinydtls.h"
+#include "crypto.h"
+#include "ccm.h"
+#include "aesni.h"
+}
+
+/**
+ * AES-128-CCM packet vectors of RFC 3610, section 8: the packet is the bytes 00, 01, 02...
+ * of which the first are the additional data, the nonce is 00 00 00 xx xx-1 xx-2 xx-3 A0..A5
+ * with xx = 2 + the vector number.
+ */
+struct Vector
+{
+	int number;
+	size_t header;
+	size_t length;
+	size_t M;
+	const char *output;
+};
+
+static const Vector vectors[] = {
+	{1, 8, 31, 8, "0001020304050607588C979A61C663D2F066D0C2C0F989806D5F6B61DAC38417E8D12CFDF926E0"},
+	{2, 8, 32, 8, "000102030405060772C91A36E135F8CF291CA894085C87E3CC15C439C9E43A3BA091D56E10400916"},
+	{3, 8, 33, 8, "000102030405060751B1E5F44A197D1DA46B0F8E2D282AE871E838BB64DA8596574ADAA76FBD9FB0C5"},
+	{4, 12, 31, 8, "000102030405060708090A0BA28C6865939A9A79FAAA5C4C2A9D4A91CDAC8C96C861B9C9E61EF1"},
+	{7, 8, 31, 10, "00010203040506070135D1B2C95F41D5D1D4FEC185D166B8094E999DFED96C048C56602C97ACBB7490"},
+};
+
+static const char *KEY = "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF";
+
+static size_t hex(const char *s, unsigned char *out)
+{
+	size_t n = 0;
+	for (; s[0] && s[1]; s += 2)
+	{
+		char byte[3] = {s[0], s[1], 0};
+		out[n++] = strtoul(byte, NULL, 16);
+	}
+	return n;
+}
+
+static void vector_nonce(const Vector &v, unsigned char nonce[DTLS_CCM_BLOCKSIZE])
+{
+	memset(nonce, 0, DTLS_CCM_BLOCKSIZE);
+	for (int i = 0; i < 4; i++)
+		nonce[3 + i] = 2 + v.number - i;
+	for (int i = 0; i < 6; i++)
+		nonce[7 + i] = 0xA0 + i;
+}
+
+typedef long int (*ccm_function)(const unsigned char *key, size_t M, size_t L, const unsigned char nonce[DTLS_CCM_BLOCKSIZE],
+								 unsigned char *msg, size_t lm, const unsigned char *aad, size_t la);
+
+static long int portable_encrypt(const unsigned char *key, size_t M, size_t L, const unsigned char nonce[DTLS_CCM_BLOCKSIZE],
+								 unsigned char *msg, size_t lm, const unsigned char *aad, size_t la)
+{
+	rijndael_ctx ctx;
+	rijndael_set_key_enc_only(&ctx, key, 128);
+	return dtls_ccm_encrypt_message(&ctx, M, L, nonce, msg, lm, aad, la);
+}
+
+static long int portable_decrypt(const unsigned char *key, size_t M, size_t L, const unsigned char nonce[DTLS_CCM_BLOCKSIZE],
+								 unsigned char *msg, size_t lm, const unsigned char *aad, size_t la)
+{
+	rijndael_ctx ctx;
+	rijndael_set_key_enc_only(&ctx, key, 128);
+	return dtls_ccm_decrypt_message(&ctx, M, L, nonce, msg, lm, aad, la);
+}
+
+#ifdef WITH_AESNI
+static long int aesni_encrypt(const unsigned char *key, size_t M, size_t L, const unsigned char nonce[DTLS_CCM_BLOCKSIZE],
+							  unsigned char *msg, size_t lm, const unsigned char *aad, size_t la)
+{
+	aesni_ctx ctx;
+	aesni_set_key(&ctx, key, 128);
+	return aesni_ccm_encrypt_message(&ctx, M, L, nonce, msg, lm, aad, la);
+}
+
+static long int aesni_decrypt(const unsigned char *key, size_t M, size_t L, const unsigned char nonce[DTLS_CCM_BLOCKSIZE],
+							  unsigned char *msg, size_t lm, const unsigned char *aad, size_t la)
+{
+	aesni_ctx ctx;
+	aesni_set_key(&ctx, key, 128);
+	return aesni_ccm_decrypt_message(&ctx, M, L, nonce, msg, lm, aad, la);
+}
+#endif
+
+static void check_vectors(ccm_function encrypt, ccm_function decrypt)
+{
+	unsigned char key[16];
+	hex(KEY, key);
+	for (size_t k = 0; k < sizeof(vectors) / sizeof(vectors[0]); k++)
+	{
+		const Vector &v = vectors[k];
+		unsigned char nonce[DTLS_CCM_BLOCKSIZE], packet[64], expected[64], msg[64];
+		vector_nonce(v, nonce);
+		for (size_t i = 0; i < v.length; i++)
+			packet[i] = i;
+		CHECK_EQ(hex(v.output, expected), v.length + v.M);
+
+		const size_t lm = v.length - v.header;
+		memcpy(msg, packet + v.header, lm);
+		CHECK_EQ(encrypt(key, v.M, 2, nonce, msg, lm, packet, v.header), lm + v.M);
+		CHECK(memcmp(msg, expected + v.header, lm + v.M) == 0);
+
+		CHECK_EQ(decrypt(key, v.M, 2, nonce, msg, lm + v.M, packet, v.header), lm);
+		CHECK(memcmp(msg, packet + v.header, lm) == 0);
+
+		// a flipped bit of the ciphertext, the tag or the additional data fails the check
+		for (size_t bit = 0; bit < 3; bit++)
+		{
+			memcpy(msg, expected + v.header, lm + v.M);
+			if (bit == 0)
+				msg[0] ^= 1;
+			else if (bit == 1)
+				msg[lm + v.M - 1] ^= 0x80;
+			else
+				packet[0] ^= 1;
+			CHECK(decrypt(key, v.M, 2, nonce, msg, lm + v.M, packet, v.header) < 0);
+			packet[0] = 0;
+		}
+	}
+}
+
+static void test_rfc3610_portable()
+{
+	check_vectors(portable_encrypt, portable_decrypt);
+}
+
+static void test_rfc3610_aesni()
+{
+#ifdef WITH_AESNI
+	if (!aesni_supported())
+	{
+		printf("AES-NI not supported by this CPU\n");
+		return;
+	}
+	check_vectors(aesni_encrypt, aesni_decrypt);
+#endif
+}
+
+// the vectors through the public entry point, which picks the backend of this CPU
+static void test_rfc3610_encrypt_params()
+{
+	unsigned char key[16];
+	hex(KEY, key);
+	for (size_t k = 0; k < sizeof(vectors) / sizeof(vectors[0]); k++)
+	{
+		const Vector &v = vectors[k];
+		unsigned char nonce[DTLS_CCM_BLOCKSIZE], packet[64], expected[64], out[64], plain[64];
+		vector_nonce(v, nonce);
+		for (size_t i = 0; i < v.length; i++)
+			packet[i] = i;
+		hex(v.output, expected);
+
+		const size_t lm = v.length - v.header;
+		dtls_ccm_params_t params = {nonce, (uint8_t)v.M, 2};
+		CHECK_EQ(dtls_encrypt_params(&params, packet + v.header, lm, out, key, sizeof(key), packet, v.header), lm + v.M);
+		CHECK(memcmp(out, expected + v.header, lm + v.M) == 0);
+		CHECK_EQ(dtls_decrypt_params(&params, out, lm + v.M, plain, key, sizeof(key), packet, v.header), lm);
+		CHECK(memcmp(plain, packet + v.header, lm) == 0);
+	}
+}
+
+// every tag and length field size DTLS may use, with lengths around the block boundaries
+static void test_aesni_matches_portable()
+{
+#ifdef WITH_AESNI
+	if (!aesni_supported())
+		return;
+	srand(3);
+	int mismatches = 0;
+	for (int i = 0; i < 20000; i++)
+	{
+		unsigned char key[16], nonce[DTLS_CCM_BLOCKSIZE], aad[64], a[400], b[400];
+		for (size_t j = 0; j < sizeof(key); j++)
+			key[j] = rand();
+		for (size_t j = 0; j < sizeof(nonce); j++)
+			nonce[j] = rand();
+		const size_t M = i & 1 ? 8 : 16, L = i & 2 ? 3 : 2, lm = rand() % 300, la = rand() % 41;
+		for (size_t j = 0; j < la; j++)
+			aad[j] = rand();
+		for (size_t j = 0; j < lm; j++)
+			a[j] = b[j] = rand();
+
+		long int length = portable_encrypt(key, M, L, nonce, a, lm, aad, la);
+		if (aesni_encrypt(key, M, L, nonce, b, lm, aad, la) != length || memcmp(a, b, length))
+			mismatches++;
+		if (aesni_decrypt(key, M, L, nonce, b, length, aad, la) != (long int)lm ||
+			portable_decrypt(key, M, L, nonce, a, length, aad, la) != (long int)lm || memcmp(a, b, lm))
+			mismatches++;
+	}
+	CHECK_EQ(mismatches, 0);
+#endif
+}
+
+int main()
+{
+	RUN_TEST(test_rfc3610_portable);
+	RUN_TEST(test_rfc3610_aesni);
+	RUN_TEST(test_rfc3610_encrypt_params);
+	RUN_TEST(test_aesni_matches_portable);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,204 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "trackle.h"
+#include "trackle_descriptor.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+int call_function(const char *function_key, const char *arg, const char *user_caller_id,
+				  TrackleDescriptor::FunctionResultCallback callback, void *);
+void process_async_calls();
+void cancel_async_calls();
+
+static system_tick_t now;
+static system_tick_t clock_millis() { return now; }
+
+static std::vector<uint32_t> tokens; // received by the function, in the order of the calls
+static void async_function(const char *arg, bool is_owner, uint32_t completion_token) { tokens.push_back(completion_token); }
+
+static std::vector<int> results; // sent to the cloud
+static bool send_result(const void *result, TrackleReturnType::Enum type)
+{
+	CHECK_EQ(type, TrackleReturnType::INT);
+	results.push_back((int)(intptr_t)result);
+	return true;
+}
+
+static int call() { return call_function("async", "", "", send_result, NULL); }
+
+static void setup(Trackle &device)
+{
+	static bool posted = false;
+	device.setMillis(clock_millis);
+	if (!posted)
+		CHECK(device.postAsync("async", async_function));
+	posted = true;
+	tokens.clear();
+	results.clear();
+}
+
+// the result is sent by the loop once the call is completed, a token completes a single call
+static void test_completion()
+{
+	Trackle device;
+	setup(device);
+	CHECK(device.setFunctionAsyncLimits(4, 1000));
+
+	CHECK_EQ(call(), 0);
+	CHECK_EQ(call(), 0);
+	CHECK_EQ(tokens.size(), 2u);
+	CHECK(tokens[0] != tokens[1]);
+
+	CHECK(device.completeFunction(tokens[1], 7));
+	CHECK(!device.completeFunction(tokens[1], 8));
+	CHECK(results.empty());
+	process_async_calls();
+	CHECK_EQ(results.size(), 1u);
+	CHECK_EQ(results[0], 7);
+
+	CHECK(device.completeFunction(tokens[0], -3));
+	process_async_calls();
+	process_async_calls();
+	CHECK_EQ(results.size(), 2u);
+	CHECK_EQ(results[1], -3);
+	CHECK(!device.completeFunction(tokens[0] ^ 0x100, 1)); // the token of another call in the same slot
+}
+
+// calls over the limit are refused, and the limits can't change while a call is pending
+static void test_limits()
+{
+	Trackle device;
+	setup(device);
+	CHECK(device.setFunctionAsyncLimits(2, 1000));
+
+	CHECK_EQ(call(), 0);
+	CHECK_EQ(call(), 0);
+	CHECK_EQ(call(), 29);
+	CHECK(!device.setFunctionAsyncLimits(4, 1000));
+
+	CHECK(device.completeFunction(tokens[0], 1));
+	CHECK(!device.setFunctionAsyncLimits(4, 1000)); // the result is not sent yet
+	process_async_calls();
+	CHECK_EQ(call(), 0);
+	CHECK(device.completeFunction(tokens[1], 2));
+	CHECK(device.completeFunction(tokens[2], 3));
+	process_async_calls();
+	CHECK_EQ(results.size(), 3u);
+
+	CHECK(device.setFunctionAsyncLimits(4, 1000));
+	for (int i = 0; i < 4; i++)
+		CHECK_EQ(call(), 0);
+	CHECK_EQ(call(), 29);
+	cancel_async_calls();
+}
+
+// a call not completed in time is dropped, without a result, and its token is refused
+static void test_timeout()
+{
+	Trackle device;
+	setup(device);
+	CHECK(device.setFunctionAsyncLimits(1, 1000));
+	now = 5000;
+
+	CHECK_EQ(call(), 0);
+	now += 1000;
+	process_async_calls();
+	CHECK_EQ(call(), 29);
+	now += 1;
+	process_async_calls();
+	CHECK_EQ(call(), 0);
+	CHECK_EQ(tokens.size(), 2u);
+
+	CHECK(!device.completeFunction(tokens[0], 1));
+	CHECK(device.completeFunction(tokens[1], 2));
+	process_async_calls();
+	CHECK_EQ(results.size(), 1u);
+	CHECK_EQ(results[0], 2);
+}
+
+// a new session drops the pending calls, their results would answer the requests of the previous one
+static void test_session_reset_cancel()
+{
+	Trackle device;
+	setup(device);
+	CHECK(device.setFunctionAsyncLimits(3, 1000));
+
+	CHECK_EQ(call(), 0);
+	CHECK_EQ(call(), 0);
+	CHECK(device.completeFunction(tokens[1], 5)); // completed, not sent yet
+	cancel_async_calls();
+	CHECK(!device.completeFunction(tokens[0], 4));
+	process_async_calls();
+	CHECK(results.empty());
+
+	// all the calls are available to the new session
+	for (int i = 0; i < 3; i++)
+		CHECK_EQ(call(), 0);
+	CHECK(device.completeFunction(tokens[4], 6));
+	process_async_calls();
+	CHECK_EQ(results.size(), 1u);
+	CHECK_EQ(results[0], 6);
+	cancel_async_calls();
+}
+
+// completions from another thread, stale ones too, while the loop changes the limits between calls
+static void test_completion_while_resizing()
+{
+	Trackle device;
+	setup(device);
+	std::atomic<uint32_t> token(0);
+	std::atomic<bool> stop(false);
+	std::atomic<int> completed(0);
+	std::thread worker([&]
+					   {
+		while (!stop)
+		{
+			if (device.completeFunction(token.load(), 1))
+				completed++;
+			device.completeFunction(rand() & 0x3fffffff, 1);
+		} });
+
+	int sent = 0;
+	for (int i = 0; i < 2000; i++)
+	{
+		CHECK(device.setFunctionAsyncLimits(1 + i % 8, 1000));
+		CHECK_EQ(call(), 0);
+		token = tokens.back();
+		while (results.size() == (size_t)sent)
+			process_async_calls();
+		sent++;
+	}
+	stop = true;
+	worker.join();
+	CHECK_EQ(completed.load(), sent);
+	CHECK_EQ(results.size(), (size_t)sent);
+}
+
+int main()
+{
+	RUN_TEST(test_completion);
+	RUN_TEST(test_limits);
+	RUN_TEST(test_timeout);
+	RUN_TEST(test_session_reset_cancel);
+	RUN_TEST(test_completion_while_resizing);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,257 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "test_channel.h"
+#include "event_builder.h"
+#include <string>
+
+using namespace trackle::protocol;
+
+static std::string text_value = "hello";
+
+static bool get_bool(const char *arg) { return true; }
+static int get_int(const char *arg) { return -1234; }
+static double get_double(const char *arg) { return 2.5; }
+static const char *get_text(const char *arg) { return text_value.c_str(); }
+
+static const struct
+{
+	const char *key;
+	TrackleReturnType::Enum type;
+	const void *getter;
+} variables[] = {
+	{"flag", TrackleReturnType::BOOLEAN, (const void *)get_bool},
+	{"count", TrackleReturnType::INT, (const void *)get_int},
+	{"ratio", TrackleReturnType::DOUBLE, (const void *)get_double},
+	{"text", TrackleReturnType::STRING, (const void *)get_text},
+	{"a_key_exactly_thirty_two_chars_", TrackleReturnType::INT, (const void *)get_int},
+};
+
+static const void *find_variable(const char *key, TrackleReturnType::Enum *type)
+{
+	for (size_t i = 0; i < sizeof(variables) / sizeof(variables[0]); i++)
+	{
+		if (!strcmp(variables[i].key, key))
+		{
+			*type = variables[i].type;
+			return variables[i].getter;
+		}
+	}
+	return NULL;
+}
+
+struct Response
+{
+	uint8_t code;
+	std::string etag;
+	uint32_t block2;
+	std::string payload;
+};
+
+static Response parse_response(const std::vector<uint8_t> &sent)
+{
+	Response response;
+	response.code = sent[1];
+	response.block2 = CoAP::NO_BLOCK;
+	unsigned char *option = (unsigned char *)sent.data() + 4 + (sent[0] & 0x0F);
+	unsigned char *end = (unsigned char *)sent.data() + sent.size();
+	uint16_t number = 0;
+	while (option < end && *option != 0xFF)
+	{
+		uint16_t delta;
+		size_t length = CoAP::option_decode(&option, &delta);
+		number += delta;
+		if (number == CoAPOption::ETAG)
+			response.etag.assign((const char *)option, length);
+		else if (number == CoAPOption::BLOCK2)
+			response.block2 = CoAP::option_uint_decode(option, length);
+		option += length;
+	}
+	if (option < end)
+		response.payload.assign((const char *)option + 1, end - option - 1);
+	return response;
+}
+
+/**
+ * Sends GET v/<key> when single, GET v?<key>&<key>... otherwise, and returns the response.
+ */
+static Response request(const std::vector<std::string> &keys, bool single, int block2 = -1)
+{
+	uint8_t buf[PROTOCOL_BUFFER_SIZE];
+	uint8_t *p = buf;
+	*p++ = 0x41; // CON, one byte token
+	*p++ = 0x01; // GET
+	*p++ = 0x00;
+	*p++ = 0x09;
+	*p++ = 0x5A;
+	p = build_option(p, CoAPOption::URI_PATH, (const uint8_t *)"v", 1);
+	unsigned previous = CoAPOption::URI_PATH;
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		const unsigned number = single ? CoAPOption::URI_PATH : CoAPOption::URI_QUERY;
+		p = build_option(p, number - previous, (const uint8_t *)keys[i].data(), keys[i].size());
+		previous = number;
+	}
+	if (block2 >= 0)
+	{
+		uint8_t value[3];
+		p = build_option(p, CoAPOption::BLOCK2 - previous, value, CoAP::option_uint_encode(value, block2));
+	}
+
+	TestChannel channel;
+	Variables v;
+	TrackleDescriptor descriptor;
+	memset(&descriptor, 0, sizeof(descriptor));
+	descriptor.find_variable = find_variable;
+
+	Message message(buf, sizeof(buf), p - buf);
+	if (single)
+	{
+		char key[MAX_VARIABLE_KEY_LENGTH + 1];
+		char arg[MAX_VARIABLE_ARG_LENGTH + 1];
+		v.handle_variable_request(key, arg, message, channel, 0x5A, 9, NULL, NULL, find_variable);
+	}
+	else
+	{
+		CHECK(Variables::is_bulk_request(message));
+		v.handle_bulk_variable_request(message, channel, 0x5A, 9, descriptor);
+	}
+	CHECK_EQ(channel.sent.size(), 1);
+	return parse_response(channel.sent.back());
+}
+
+/**
+ * Reads the whole bulk payload block after block, checking that the ETag stays the same.
+ */
+static std::string read_blocks(const std::vector<std::string> &keys, size_t block_size, std::string *etag, bool single = false)
+{
+	std::string payload;
+	for (uint32_t num = 0;; num++)
+	{
+		Response r = request(keys, single, CoAP::block_value(num, false, block_size));
+		CHECK_EQ(r.code, CoAPCode::CONTENT);
+		if (num == 0)
+			*etag = r.etag;
+		CHECK(r.etag == *etag);
+		payload += r.payload;
+		if (r.block2 == CoAP::NO_BLOCK || !(r.block2 & 0x08))
+			break;
+	}
+	return payload;
+}
+
+static void test_bulk_matches_single_reads()
+{
+	text_value = "hello";
+	const std::vector<std::string> keys = {"flag", "count", "ratio", "text", "a_key_exactly_thirty_two_chars_"};
+	Response bulk = request(keys, false);
+	CHECK_EQ(bulk.code, CoAPCode::CONTENT);
+
+	size_t position = 0;
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		Response single = request(std::vector<std::string>(1, keys[i]), true);
+		TrackleReturnType::Enum type;
+		find_variable(keys[i].c_str(), &type);
+
+		CHECK(position + 3 <= bulk.payload.size());
+		const uint8_t *entry = (const uint8_t *)bulk.payload.data() + position;
+		const size_t length = (entry[1] << 8) | entry[2];
+		CHECK_EQ(entry[0], type);
+		CHECK(bulk.payload.substr(position + 3, length) == single.payload);
+		position += 3 + length;
+	}
+	CHECK_EQ(position, bulk.payload.size());
+}
+
+static void test_unknown_and_too_long_keys()
+{
+	// the long key starts with an existing one once truncated to MAX_VARIABLE_KEY_LENGTH
+	const std::vector<std::string> keys = {"missing", "a_key_exactly_thirty_two_chars_X", "count"};
+	Response bulk = request(keys, false);
+	CHECK(bulk.payload.size() == 3 + 3 + 3 + 4);
+	CHECK(bulk.payload.substr(0, 6) == std::string(6, '\0'));
+	CHECK_EQ((uint8_t)bulk.payload[6], TrackleReturnType::INT);
+}
+
+static void test_blocks_reassemble_to_single_response()
+{
+	text_value = std::string(300, 'x');
+	const std::vector<std::string> keys = {"text", "count", "text", "flag"};
+	Response whole = request(keys, false);
+	CHECK_EQ(whole.block2, CoAP::NO_BLOCK);
+
+	std::string etag;
+	CHECK(read_blocks(keys, 64, &etag) == whole.payload);
+	CHECK_EQ(etag.size(), 4);
+}
+
+static void test_etag_changes_with_lengths()
+{
+	const std::vector<std::string> keys = {"text", "count"};
+	text_value = std::string(200, 'a');
+	Response first = request(keys, false, CoAP::block_value(0, false, 64));
+
+	// same lengths, different content: the layout is the same
+	text_value = std::string(200, 'b');
+	Response same = request(keys, false, CoAP::block_value(1, false, 64));
+	CHECK(same.etag == first.etag);
+
+	// the value grew: the blocks after it moved
+	text_value = std::string(201, 'b');
+	Response moved = request(keys, false, CoAP::block_value(1, false, 64));
+	CHECK(moved.etag != first.etag);
+}
+
+// the blocks of a single value carry the hash of the whole value, a change between two blocks is seen by the client
+static void test_single_value_etag()
+{
+	text_value = std::string(2000, 'a');
+	Response first = request({"text"}, true);
+	CHECK_EQ(first.code, CoAPCode::CONTENT);
+	CHECK(first.block2 != CoAP::NO_BLOCK && (first.block2 & 0x08));
+	CHECK_EQ(first.etag.size(), 4);
+
+	std::string etag;
+	CHECK(read_blocks({"text"}, 64, &etag, true) == text_value);
+	CHECK(etag == first.etag);
+
+	// same length, different content
+	text_value[1500] = 'b';
+	Response changed = request({"text"}, true, CoAP::block_value(1, false, 64));
+	CHECK(changed.etag != first.etag);
+
+	// a value that fits in a response has no ETag
+	text_value = "hello";
+	Response single = request({"text"}, true);
+	CHECK_EQ(single.block2, CoAP::NO_BLOCK);
+	CHECK(single.etag.empty());
+	CHECK(single.payload == "hello");
+}
+
+int main()
+{
+	RUN_TEST(test_bulk_matches_single_reads);
+	RUN_TEST(test_unknown_and_too_long_keys);
+	RUN_TEST(test_blocks_reassemble_to_single_response);
+	RUN_TEST(test_etag_changes_with_lengths);
+	RUN_TEST(test_single_value_etag);
+	return UNIT_TEST_RESULT();
+}
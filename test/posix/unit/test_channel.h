@@ -0,0 +1,80 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include "protocol.h"
+#include <vector>
+
+/**
+ * In-memory message channel: every message sent is recorded, so a test can
+ * play the cloud side by inspecting them and feeding replies back in.
+ */
+class TestChannel : public trackle::protocol::MessageChannel
+{
+public:
+	typedef trackle::protocol::Message Message;
+	typedef trackle::protocol::ProtocolError ProtocolError;
+
+	std::vector<std::vector<uint8_t>> sent;
+	// error returned by send(), to simulate a failing transport
+	ProtocolError send_error;
+	bool unreliable;
+
+	TestChannel(size_t buffer_size = PROTOCOL_BUFFER_SIZE) : send_error(trackle::protocol::NO_ERROR), unreliable(true), buffer(buffer_size) {}
+
+	ProtocolError receive(Message &message) override
+	{
+		message.set_length(0);
+		return trackle::protocol::NO_ERROR;
+	}
+
+	ProtocolError send(Message &message) override
+	{
+		if (send_error)
+			return send_error;
+		sent.push_back(std::vector<uint8_t>(message.buf(), message.buf() + message.length()));
+		return trackle::protocol::NO_ERROR;
+	}
+
+	ProtocolError command(Command cmd, void *arg) override { return trackle::protocol::NO_ERROR; }
+	bool is_unreliable() override { return unreliable; }
+	ProtocolError establish(uint32_t &flags, uint32_t app_state_crc) override { return trackle::protocol::NO_ERROR; }
+	ProtocolError wait_ack(trackle::protocol::message_id_t id) override { return trackle::protocol::NO_ERROR; }
+
+	ProtocolError create(Message &message, size_t minimum_size) override
+	{
+		message.set_buffer(&buffer[0], buffer.size());
+		message.set_length(0);
+		return trackle::protocol::NO_ERROR;
+	}
+
+	ProtocolError response(Message &original, Message &response, size_t required) override
+	{
+		response.set_buffer(original.buf() + original.length(), original.capacity() - original.length());
+		return trackle::protocol::NO_ERROR;
+	}
+
+	ProtocolError notify_established() override { return trackle::protocol::NO_ERROR; }
+	void notify_client_messages_processed() override {}
+	void init_status() override {}
+
+private:
+	std::vector<uint8_t> buffer;
+};
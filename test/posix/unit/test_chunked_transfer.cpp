@@ -0,0 +1,167 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "ota_harness.h"
+#include <algorithm>
+#include <stdlib.h>
+
+#define CHUNK_SIZE 128
+#define CHUNKS 40
+
+using namespace trackle::protocol;
+
+static std::vector<uint8_t> image()
+{
+	std::vector<uint8_t> file(CHUNKS * CHUNK_SIZE - 50);
+	srand(11);
+	for (size_t i = 0; i < file.size(); i++)
+		file[i] = rand();
+	return file;
+}
+
+static bool contains(const std::vector<uint16_t> &chunks, uint16_t index)
+{
+	return std::find(chunks.begin(), chunks.end(), index) != chunks.end();
+}
+
+// a chunk past the end of the file is dropped, it doesn't stand for a missing one
+static void test_chunk_past_the_end()
+{
+	std::vector<uint8_t> file = image();
+	std::vector<uint8_t> padded(file);
+	padded.resize(CHUNKS * CHUNK_SIZE, 0xFF);
+	OtaTarget target;
+	OtaCloud cloud(target, CHUNK_SIZE);
+
+	CHECK_EQ(cloud.begin(file.size()), NO_ERROR);
+	for (unsigned i = 0; i < CHUNKS; i++)
+	{
+		if (i != 5)
+			cloud.chunk(i, &padded[i * CHUNK_SIZE], CHUNK_SIZE);
+	}
+	CHECK_EQ(cloud.chunk(CHUNKS + 3, &padded[5 * CHUNK_SIZE], CHUNK_SIZE), NO_ERROR);
+	CHECK_EQ(target.writes, CHUNKS - 1);
+	cloud.requested();
+
+	CHECK_EQ(cloud.done(), NO_ERROR);
+	CHECK(!target.completed());
+	CHECK(contains(cloud.requested(), 5));
+
+	cloud.chunk(5, &padded[5 * CHUNK_SIZE], CHUNK_SIZE);
+	CHECK_EQ(cloud.done(), NO_ERROR);
+	CHECK(target.completed());
+	CHECK(!memcmp(&target.flash[0], &file[0], file.size()));
+}
+
+// a gap is reported once the chunks received are far enough after it, a report that can't be sent is tried again
+static void test_gap_report_distance()
+{
+	std::vector<uint8_t> file = image();
+	std::vector<uint8_t> padded(file);
+	padded.resize(CHUNKS * CHUNK_SIZE, 0xFF);
+	OtaTarget target;
+	OtaCloud cloud(target, CHUNK_SIZE);
+	cloud.transfer.set_missing_chunks_report(8, 0);
+
+	CHECK_EQ(cloud.begin(file.size()), NO_ERROR);
+	cloud.requested();
+	for (unsigned i = 0; i < 20; i++)
+	{
+		if (i != 3)
+			cloud.chunk(i, &padded[i * CHUNK_SIZE], CHUNK_SIZE);
+	}
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	std::vector<uint16_t> requested = cloud.requested();
+	CHECK_EQ(requested.size(), 1u);
+	CHECK(contains(requested, 3));
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	CHECK(cloud.requested().empty());
+
+	for (unsigned i = 20; i < 36; i++)
+	{
+		if (i != 25)
+			cloud.chunk(i, &padded[i * CHUNK_SIZE], CHUNK_SIZE);
+	}
+	cloud.channel.send_error = IO_ERROR_GENERIC_SEND;
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	cloud.channel.send_error = NO_ERROR;
+	CHECK(cloud.requested().empty());
+
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	requested = cloud.requested();
+	CHECK_EQ(requested.size(), 1u);
+	CHECK(contains(requested, 25));
+	CHECK(cloud.transfer.is_updating());
+}
+
+// all the gaps are reported when no chunk is received for a while, a report that can't be sent after the next timeout
+static void test_stall_report_timeout()
+{
+	std::vector<uint8_t> file = image();
+	std::vector<uint8_t> padded(file);
+	padded.resize(CHUNKS * CHUNK_SIZE, 0xFF);
+	OtaTarget target;
+	OtaCloud cloud(target, CHUNK_SIZE);
+	cloud.transfer.set_missing_chunks_report(0, 1000);
+
+	CHECK_EQ(cloud.begin(file.size()), NO_ERROR);
+	cloud.requested();
+	for (unsigned i = 0; i < 10; i++)
+	{
+		if (i != 2 && i != 7)
+			cloud.chunk(i, &padded[i * CHUNK_SIZE], CHUNK_SIZE);
+	}
+	target.now = 999;
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	CHECK(cloud.requested().empty());
+
+	target.now = 1000;
+	cloud.channel.send_error = IO_ERROR_GENERIC_SEND;
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	cloud.channel.send_error = NO_ERROR;
+	target.now = 1999;
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	CHECK(cloud.requested().empty());
+
+	target.now = 2000;
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	std::vector<uint16_t> requested = cloud.requested();
+	CHECK(contains(requested, 2) && contains(requested, 7));
+	CHECK(!contains(requested, 5));
+
+	// a chunk received restarts the timeout
+	cloud.chunk(2, &padded[2 * CHUNK_SIZE], CHUNK_SIZE);
+	target.now = 2500;
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	CHECK(cloud.requested().empty());
+	target.now = 3000;
+	CHECK_EQ(cloud.transfer.idle(cloud.channel), NO_ERROR);
+	requested = cloud.requested();
+	CHECK(!contains(requested, 2) && contains(requested, 7));
+}
+
+int main()
+{
+	RUN_TEST(test_chunk_past_the_end);
+	RUN_TEST(test_gap_report_distance);
+	RUN_TEST(test_stall_report_timeout);
+	return UNIT_TEST_RESULT();
+}
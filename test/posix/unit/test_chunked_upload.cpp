@@ -0,0 +1,281 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "chunked_upload.h"
+#include "crc32.h"
+#include "test_channel.h"
+#include <map>
+#include <string.h>
+#include <vector>
+
+using namespace trackle;
+using namespace trackle::protocol;
+
+#define FILE_LENGTH (20 * ChunkedUpload::CHUNK_SIZE + 100)
+#define WINDOW 8
+
+/**
+ * Gives an id to every message, so that the confirmable ones get an acknowledgement handler.
+ */
+class UploadChannel : public TestChannel
+{
+	message_id_t next_id = 1;
+
+public:
+	ProtocolError send(Message &message) override
+	{
+		message.buf()[2] = next_id >> 8;
+		message.buf()[3] = next_id & 0xFF;
+		message.set_id(next_id++);
+		return TestChannel::send(message);
+	}
+};
+
+/**
+ * The device side: the file to upload and the acknowledgement handlers, completed by the cloud.
+ */
+class Device : public ChunkedUpload::Callbacks
+{
+public:
+	std::vector<uint8_t> file;
+	std::map<message_id_t, CompletionHandler> acks;
+	system_tick_t now = 0;
+	int result = 1; // until the upload completes
+
+	Device()
+	{
+		file.resize(FILE_LENGTH);
+		for (size_t i = 0; i < file.size(); i++)
+			file[i] = i * 7 + (i >> 8);
+	}
+
+	system_tick_t millis() override { return now; }
+
+	void add_ack_handler(message_id_t msg_id, CompletionHandler handler) override
+	{
+		acks[msg_id] = std::move(handler);
+	}
+
+	int read_upload(uint32_t offset, uint8_t *buf, size_t length) override
+	{
+		memcpy(buf, &file[offset], length);
+		return length;
+	}
+
+	void upload_complete(const char *name, int error) override
+	{
+		result = error;
+	}
+
+	/**
+	 * Fails the pending acknowledgements, as when the retransmits of their messages ran out.
+	 */
+	void time_out_acks()
+	{
+		std::map<message_id_t, CompletionHandler> expired;
+		expired.swap(acks);
+		for (auto &ack : expired)
+			ack.second.setError(SYSTEM_ERROR_TIMEOUT);
+	}
+};
+
+/**
+ * Stand-in for the cloud: stores the chunks it receives, acknowledges the confirmable messages and
+ * checks the file on UploadDone. While the link is down the messages are lost.
+ */
+class UploadCloud
+{
+public:
+	std::vector<uint8_t> data;
+	std::vector<int> received; // times each chunk was received
+	uint32_t done_crc = 0;
+	bool done = false;
+	bool link_down = false;
+	size_t delivered = 0; // messages of the channel processed
+
+	void deliver(UploadChannel &channel, Device &device)
+	{
+		for (; delivered < channel.sent.size(); delivered++)
+		{
+			const std::vector<uint8_t> &m = channel.sent[delivered];
+			if (link_down)
+				continue;
+
+			const uint8_t token_length = m[0] & 0x0F;
+			const char path = m[5 + token_length];
+			if (m[1] == 0x02 && path == 'U')
+			{
+				const uint32_t length = (m[10] << 24) | (m[11] << 16) | (m[12] << 8) | m[13];
+				data.assign(length, 0);
+				received.assign((length + ChunkedUpload::CHUNK_SIZE - 1) / ChunkedUpload::CHUNK_SIZE, 0);
+			}
+			else if (m[1] == 0x02 && path == 'C')
+			{
+				const chunk_index_t index = (m[7] << 8) | m[8];
+				memcpy(&data[index * ChunkedUpload::CHUNK_SIZE], &m[10], m.size() - 10);
+				received[index]++;
+			}
+			else if (m[1] == 0x03 && path == 'U')
+			{
+				done_crc = (m[7] << 24) | (m[8] << 16) | (m[9] << 8) | m[10];
+				done = true;
+			}
+
+			if (CoAP::type(&m[0]) == CoAPType::CON)
+			{
+				message_id_t id = (m[2] << 8) | m[3];
+				CompletionHandler handler = std::move(device.acks[id]);
+				device.acks.erase(id);
+				handler.setResult((void *)nullptr);
+			}
+		}
+	}
+
+	bool missing() const
+	{
+		for (size_t i = 0; i < received.size(); i++)
+			if (!received[i])
+				return true;
+		return false;
+	}
+
+	void send_result(ChunkedUpload &upload, UploadChannel &channel)
+	{
+		uint8_t ok = !missing() && crc32c(0, &data[0], data.size()) == done_crc ? 0 : 1;
+		uint8_t result[] = {0x50, 0x03, 0x77, 0x77, 0xb1, 'U', 0xff, ok};
+		Message message(result, sizeof(result), sizeof(result));
+		upload.handle_result(message, channel);
+	}
+};
+
+static void run(ChunkedUpload &upload, UploadChannel &channel, Device &device, UploadCloud &cloud)
+{
+	for (int i = 0; i < 1000 && device.result == 1; i++)
+	{
+		CHECK_EQ(upload.idle(channel), NO_ERROR);
+		cloud.deliver(channel, device);
+		if (cloud.done)
+			cloud.send_result(upload, channel);
+	}
+}
+
+static void test_upload()
+{
+	UploadChannel channel;
+	Device device;
+	UploadCloud cloud;
+	ChunkedUpload upload;
+	upload.init(&device);
+	upload.set_window(WINDOW);
+
+	CHECK_EQ(upload.begin(channel, "log.txt", FILE_LENGTH), NO_ERROR);
+	cloud.deliver(channel, device);
+	run(upload, channel, device, cloud);
+	CHECK_EQ(device.result, SYSTEM_ERROR_NONE);
+	CHECK(cloud.data == device.file);
+	for (size_t i = 0; i < cloud.received.size(); i++)
+		CHECK_EQ(cloud.received[i], 1);
+}
+
+static void test_checkpoint_timeout_sends_window_again()
+{
+	UploadChannel channel;
+	Device device;
+	UploadCloud cloud;
+	ChunkedUpload upload;
+	upload.init(&device);
+	upload.set_window(WINDOW);
+
+	CHECK_EQ(upload.begin(channel, "log.txt", FILE_LENGTH), NO_ERROR);
+	cloud.deliver(channel, device);
+
+	// the two windows sent while the link is down are lost with their checkpoints
+	cloud.link_down = true;
+	CHECK_EQ(upload.idle(channel), NO_ERROR);
+	cloud.deliver(channel, device);
+	CHECK_EQ(device.acks.size(), 2);
+	device.time_out_acks();
+	CHECK(upload.is_uploading());
+
+	// the chunks are sent again before UploadDone, the cloud has nothing to report
+	cloud.link_down = false;
+	run(upload, channel, device, cloud);
+	CHECK_EQ(device.result, SYSTEM_ERROR_NONE);
+	CHECK(cloud.data == device.file);
+	for (size_t i = 0; i < cloud.received.size(); i++)
+		CHECK_EQ(cloud.received[i], 1);
+}
+
+static void test_send_error_keeps_upload()
+{
+	UploadChannel channel;
+	Device device;
+	UploadCloud cloud;
+	ChunkedUpload upload;
+	upload.init(&device);
+	upload.set_window(WINDOW);
+
+	CHECK_EQ(upload.begin(channel, "log.txt", FILE_LENGTH), NO_ERROR);
+	cloud.deliver(channel, device);
+
+	// a channel out of buffers isn't a connection error, the chunks are sent once it recovers
+	channel.send_error = INSUFFICIENT_STORAGE;
+	CHECK_EQ(upload.idle(channel), NO_ERROR);
+	device.now += ChunkedUpload::SEND_TIMEOUT / 2;
+	CHECK_EQ(upload.idle(channel), NO_ERROR);
+	CHECK(upload.is_uploading());
+
+	channel.send_error = NO_ERROR;
+	run(upload, channel, device, cloud);
+	CHECK_EQ(device.result, SYSTEM_ERROR_NONE);
+	CHECK(cloud.data == device.file);
+}
+
+static void test_send_error_times_out()
+{
+	UploadChannel channel;
+	Device device;
+	UploadCloud cloud;
+	ChunkedUpload upload;
+	upload.init(&device);
+	upload.set_window(WINDOW);
+
+	CHECK_EQ(upload.begin(channel, "log.txt", FILE_LENGTH), NO_ERROR);
+	cloud.deliver(channel, device);
+
+	channel.send_error = IO_ERROR_GENERIC_SEND;
+	CHECK_EQ(upload.idle(channel), NO_ERROR);
+	device.now += ChunkedUpload::SEND_TIMEOUT - 1;
+	CHECK_EQ(upload.idle(channel), NO_ERROR);
+	CHECK(upload.is_uploading());
+	device.now += 1;
+	CHECK_EQ(upload.idle(channel), NO_ERROR);
+	CHECK(!upload.is_uploading());
+	CHECK_EQ(device.result, SYSTEM_ERROR_IO);
+}
+
+int main()
+{
+	RUN_TEST(test_upload);
+	RUN_TEST(test_checkpoint_timeout_sends_window_again);
+	RUN_TEST(test_send_error_keeps_upload);
+	RUN_TEST(test_send_error_times_out);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,112 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "ota_harness.h"
+#include "compress.h"
+#include <stdlib.h>
+
+using namespace trackle::protocol;
+
+/**
+ * Protocol with the hello exposed, the flags are recorded instead of building the message.
+ */
+class HelloProtocol : public Protocol
+{
+public:
+	uint8_t hello_flags;
+
+	HelloProtocol(TestChannel &channel) : Protocol(channel), hello_flags(0)
+	{
+		TrackleCallbacks callbacks = {};
+		callbacks.size = sizeof(callbacks);
+		callbacks.millis = millis;
+		TrackleDescriptor descriptor = {};
+		descriptor.size = sizeof(descriptor);
+		Protocol::init(callbacks, descriptor);
+	}
+
+	void send_hello()
+	{
+		message_id_t id;
+		hello(false, &id);
+	}
+
+	void init(const char *id, const TrackleKeys &keys, const TrackleCallbacks &callbacks, const TrackleDescriptor &descriptor,
+			  const Connection_Properties_Type &conPropType) override {}
+	int command(ProtocolCommands::Enum command, uint32_t data) override { return 0; }
+	int get_status(protocol_status *status) const override { return 0; }
+
+protected:
+	size_t build_hello(Message &message, uint8_t flags) override
+	{
+		hello_flags = flags;
+		return 0;
+	}
+
+private:
+	static system_tick_t millis() { return 0; }
+};
+
+// firmware-like data: runs of repeated structures with some noise
+static std::vector<uint8_t> image(size_t length)
+{
+	std::vector<uint8_t> data(length);
+	srand(5);
+	for (size_t i = 0; i < length; i++)
+		data[i] = rand() % 8 ? (uint8_t)(i / 64) : rand();
+	return data;
+}
+
+// the cloud pads the last chunk of the stream, the padding is not part of it
+static void test_padded_last_chunk()
+{
+	std::vector<uint8_t> firmware = image(12000);
+	std::vector<uint8_t> stream = StreamCompressor::compress(firmware, 8, 4);
+	OtaTarget target;
+	OtaCloud cloud(target, 200, ChunkedTransfer::UPDATE_FLAG_COMPRESSED);
+	CHECK(stream.size() % 200 != 0);
+	CHECK(stream.size() < firmware.size());
+
+	CHECK_EQ(cloud.begin(stream.size()), NO_ERROR);
+	cloud.stream(stream);
+	CHECK_EQ(cloud.done(), NO_ERROR);
+
+	CHECK(target.completed());
+	CHECK(target.flash == firmware);
+}
+
+// the cloud sends compressed updates only when the hello advertises them
+static void test_hello_flag_is_opt_in()
+{
+	TestChannel channel;
+	HelloProtocol protocol(channel);
+	protocol.send_hello();
+	CHECK_EQ(protocol.hello_flags & 0x40, 0);
+	protocol.set_compressed_ota(true);
+	protocol.send_hello();
+	CHECK_EQ(protocol.hello_flags & 0x40, 0x40);
+}
+
+int main()
+{
+	RUN_TEST(test_hello_flag_is_opt_in);
+	RUN_TEST(test_padded_last_chunk);
+	return UNIT_TEST_RESULT();
+}
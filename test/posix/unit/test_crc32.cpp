@@ -0,0 +1,80 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "crc32.h"
+#include <stdlib.h>
+#include <vector>
+
+// bit at a time reference
+static uint32_t crc32_bitwise(uint32_t crc, const unsigned char *buf, uint32_t len)
+{
+	crc = ~crc;
+	while (len--)
+	{
+		crc ^= *buf++;
+		for (int k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+	}
+	return ~crc;
+}
+
+static void test_check_value()
+{
+	CHECK_EQ(crc32c(0, (const unsigned char *)"123456789", 9), 0xcbf43926);
+	CHECK_EQ(crc32c(0, NULL, 0), 0);
+}
+
+// random offsets, lengths and seeds, so that every alignment and tail length is covered
+static void test_matches_bitwise()
+{
+	std::vector<unsigned char> buf(8192);
+	srand(1);
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = rand();
+	int mismatches = 0;
+	for (int i = 0; i < 20000; i++)
+	{
+		uint32_t offset = rand() % 4096, length = rand() % 2048, seed = rand();
+		if (crc32c(seed, &buf[offset], length) != crc32_bitwise(seed, &buf[offset], length))
+			mismatches++;
+	}
+	CHECK_EQ(mismatches, 0);
+}
+
+static void test_combine()
+{
+	std::vector<unsigned char> buf(3000);
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = i * 7;
+	for (uint32_t split = 0; split <= buf.size(); split += 37)
+	{
+		uint32_t first = crc32c(0, &buf[0], split);
+		uint32_t second = crc32c(0, &buf[0] + split, buf.size() - split);
+		CHECK_EQ(crc32c_combine(first, second, buf.size() - split), crc32c(0, &buf[0], buf.size()));
+	}
+}
+
+int main()
+{
+	RUN_TEST(test_check_value);
+	RUN_TEST(test_matches_bitwise);
+	RUN_TEST(test_combine);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,96 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "ota_harness.h"
+#include "delta_patch.h"
+#include <stdlib.h>
+
+using namespace trackle::protocol;
+
+static void put32(std::vector<uint8_t> &p, uint32_t value)
+{
+	p.push_back(value >> 24);
+	p.push_back(value >> 16);
+	p.push_back(value >> 8);
+	p.push_back(value);
+}
+
+/**
+ * Builds a patch from the installed image to a new one made of copies of old
+ * regions with a few changed bytes, and of new data.
+ */
+static std::vector<uint8_t> make_patch(const std::vector<uint8_t> &old_image, std::vector<uint8_t> &new_image, size_t length)
+{
+	std::vector<uint8_t> body;
+	uint32_t old_position = 0;
+	new_image.clear();
+	while (new_image.size() < length)
+	{
+		uint32_t diff = std::min((uint32_t)(rand() % 1500), (uint32_t)old_image.size() - old_position);
+		uint32_t extra = rand() % 100;
+		put32(body, diff);
+		put32(body, extra);
+		put32(body, 0);
+		for (uint32_t i = 0; i < diff; i++)
+		{
+			uint8_t b = old_image[old_position + i] + (rand() % 50 ? 0 : rand());
+			new_image.push_back(b);
+			body.push_back(uint8_t(b - old_image[old_position + i]));
+		}
+		for (uint32_t i = 0; i < extra; i++)
+		{
+			new_image.push_back(rand());
+			body.push_back(new_image.back());
+		}
+		old_position += diff;
+	}
+	std::vector<uint8_t> patch = {'T', 'D', 'P', '1'};
+	put32(patch, new_image.size());
+	put32(patch, crc32c(0, &new_image[0], new_image.size()));
+	patch.insert(patch.end(), body.begin(), body.end());
+	return patch;
+}
+
+// the cloud pads the last chunk of the patch, the padding is not part of it
+static void test_padded_last_chunk()
+{
+	OtaTarget target;
+	srand(11);
+	target.installed.resize(20000);
+	for (size_t i = 0; i < target.installed.size(); i++)
+		target.installed[i] = rand();
+	std::vector<uint8_t> new_image;
+	std::vector<uint8_t> patch = make_patch(target.installed, new_image, 15000);
+
+	OtaCloud cloud(target, 200, ChunkedTransfer::UPDATE_FLAG_DELTA);
+	CHECK(patch.size() % 200 != 0);
+	CHECK_EQ(cloud.begin(patch.size()), NO_ERROR);
+	cloud.stream(patch);
+	CHECK_EQ(cloud.done(), NO_ERROR);
+
+	CHECK(target.completed());
+	CHECK(target.flash == new_image);
+}
+
+int main()
+{
+	RUN_TEST(test_padded_last_chunk);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,376 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "test_channel.h"
+#include "trackle.h"
+#include "crc32.h"
+#include <string>
+
+using namespace trackle::protocol;
+
+uint32_t appStateSelectorInfo(TrackleAppStateSelector::Enum selector, TrackleAppStateUpdate::Enum operation, uint32_t data, void *reserved);
+bool appendSystemInfo(appender_fn appender, void *append, void *reserved);
+int num_functions(void);
+const char *getUserFunctionKey(int function_index);
+int numUserVariables(void);
+const char *getUserVariableKey(int variable_index);
+
+/**
+ * Channel that completes the handshake at once, either with a new or with a resumed session,
+ * and numbers the confirmable messages sent.
+ */
+class HandshakeChannel : public TestChannel
+{
+public:
+	ProtocolError established;
+
+	HandshakeChannel(size_t buffer_size = PROTOCOL_BUFFER_SIZE) : TestChannel(buffer_size), established(SESSION_CONNECTED), next_id(1), hello_pending(false) {}
+
+	ProtocolError establish(uint32_t &flags, uint32_t app_state_crc) override { return established; }
+	ProtocolError wait_ack(message_id_t id) override { return ACK_RECEIVED; }
+	void init_status() override { hello_pending = true; }
+
+	ProtocolError send(Message &message) override
+	{
+		if ((message.buf()[0] & 0x30) == 0) // confirmable, the replies keep the id of the request
+		{
+			message.buf()[2] = next_id >> 8;
+			message.buf()[3] = next_id & 0xFF;
+			message.set_id(next_id++);
+		}
+		ProtocolError error = TestChannel::send(message);
+		if (error == NO_ERROR && hello_pending)
+		{
+			// the hello is confirmable, the handshake waits for its ack
+			hello_pending = false;
+			return WAIT_FOR_ACK;
+		}
+		return error;
+	}
+
+private:
+	message_id_t next_id;
+	bool hello_pending;
+};
+
+/**
+ * Protocol with the descriptor of the library, the one whose describe checksums are persisted.
+ */
+class DescribeProtocol : public Protocol
+{
+public:
+	DescribeProtocol(HandshakeChannel &channel) : Protocol(channel)
+	{
+		TrackleCallbacks callbacks = {};
+		callbacks.size = sizeof(callbacks);
+		callbacks.millis = millis;
+		callbacks.calculate_crc = calculate_crc;
+		TrackleDescriptor descriptor = {};
+		descriptor.size = sizeof(descriptor);
+		descriptor.was_ota_upgrade_successful = was_ota_upgrade_successful;
+		descriptor.num_functions = num_functions;
+		descriptor.get_function_key = getUserFunctionKey;
+		descriptor.num_variables = numUserVariables;
+		descriptor.get_variable_key = getUserVariableKey;
+		descriptor.variable_type = variable_type;
+		descriptor.append_system_info = appendSystemInfo;
+		descriptor.app_state_selector_info = appStateSelectorInfo;
+		Protocol::init(callbacks, descriptor);
+		status = CHANNEL_INIT; // as the DTLS protocol does
+	}
+
+	/**
+	 * Runs the handshake until it completes, returns the describe messages posted.
+	 */
+	std::vector<std::string> connect(HandshakeChannel &channel, ProtocolError established)
+	{
+		channel.established = established;
+		channel.sent.clear();
+		int result = 0;
+		for (int i = 0; i < 10 && result == 0; i++)
+			result = begin();
+		CHECK_EQ(result, SESSION_CONNECTED);
+
+		std::vector<std::string> describes;
+		for (size_t i = 1; i < channel.sent.size(); i++) // the first one is the hello
+		{
+			const std::vector<uint8_t> &m = channel.sent[i];
+			const std::vector<uint8_t>::const_iterator marker = std::find(m.begin(), m.end(), 0xff);
+			CHECK(marker != m.end());
+			describes.push_back(std::string(marker + 1, m.end()));
+		}
+		return describes;
+	}
+
+	using Protocol::send_description;
+
+	void init(const char *id, const TrackleKeys &keys, const TrackleCallbacks &callbacks, const TrackleDescriptor &descriptor,
+			  const Connection_Properties_Type &conPropType) override {}
+	int command(ProtocolCommands::Enum command, uint32_t data) override { return 0; }
+	int get_status(protocol_status *status) const override { return 0; }
+
+protected:
+	size_t build_hello(Message &message, uint8_t flags) override
+	{
+		const uint8_t hello[] = {0x50, 0x02, 0x00, 0x01, 0xb1, 'h'};
+		memcpy(message.buf(), hello, sizeof(hello));
+		return sizeof(hello);
+	}
+
+private:
+	static system_tick_t millis() { return 0; }
+	static uint32_t calculate_crc(const uint8_t *data, uint32_t length) { return crc32c(0, data, length); }
+	static bool was_ota_upgrade_successful() { return false; }
+	static TrackleReturnType::Enum variable_type(const char *) { return TrackleReturnType::INT; }
+};
+
+/**
+ * A describe message as seen by the cloud: its code, the Block1 or Block2 option and the payload.
+ */
+struct Block
+{
+	uint8_t code;
+	message_id_t id;
+	uint32_t block;
+	std::string payload;
+
+	Block(const std::vector<uint8_t> &m, uint16_t block_option) : code(m[1]), id(m[2] << 8 | m[3]), block(CoAP::NO_BLOCK)
+	{
+		unsigned char *option = const_cast<unsigned char *>(&m[0]) + 4 + (m[0] & 0x0F);
+		unsigned char *end = const_cast<unsigned char *>(&m[0]) + m.size();
+		uint16_t option_number = CoAPOption::NONE;
+		while (option < end && 0xff != *option)
+		{
+			uint16_t delta;
+			size_t option_length = CoAP::option_decode(&option, &delta);
+			option_number += delta;
+			if (option_number == block_option)
+				block = CoAP::option_uint_decode(option, option_length);
+			option += option_length;
+		}
+		if (option < end)
+			payload.assign(option + 1, end);
+	}
+
+	uint32_t num() const { return block >> 4; }
+	bool more() const { return block & 0x08; }
+};
+
+// the whole describe, when it fits in a single message
+static std::string whole_describe(int desc_flags)
+{
+	HandshakeChannel channel;
+	DescribeProtocol protocol(channel);
+	CHECK_EQ(protocol.post_description(desc_flags), NO_ERROR);
+	CHECK_EQ(channel.sent.size(), 1u);
+	Block whole(channel.sent[0], CoAPOption::BLOCK1);
+	CHECK_EQ(whole.block, CoAP::NO_BLOCK);
+	return whole.payload;
+}
+
+static std::vector<uint8_t> store; // the persisted checksums
+static int saves;
+
+static int save(const void *buffer, size_t length, uint8_t type, void *reserved)
+{
+	CHECK_EQ(type, TrackleCallbacks::PERSIST_APP_STATE);
+	store.assign((const uint8_t *)buffer, (const uint8_t *)buffer + length);
+	saves++;
+	return 0;
+}
+
+static int restore(void *buffer, size_t length, uint8_t type, void *reserved)
+{
+	CHECK_EQ(type, TrackleCallbacks::PERSIST_APP_STATE);
+	if (store.size() != length)
+		return -1;
+	memcpy(buffer, &store[0], length);
+	return length;
+}
+
+static int cloud_function(const char *args, ...)
+{
+	return 0;
+}
+
+static bool has_app(const std::string &describe) { return describe.find("\"f\":[") != std::string::npos; }
+static bool has_system(const std::string &describe) { return describe.find("\"p\":") != std::string::npos; }
+
+// without save and restore callbacks nothing is restored, a resumed session gets the whole describe
+// (it runs first: the persisted checksums are restored once, on the first resumed session)
+static void test_no_persistence_callbacks()
+{
+	Trackle device;
+	device.setSaveSessionCallback(NULL);
+	device.setRestoreSessionCallback(NULL);
+	HandshakeChannel channel;
+	DescribeProtocol protocol(channel);
+
+	std::vector<std::string> describes = protocol.connect(channel, SESSION_RESUMED);
+	CHECK_EQ(describes.size(), 1u);
+	CHECK(has_app(describes[0]) && has_system(describes[0]));
+
+	// the checksums are still kept in memory for the sessions that follow
+	describes = protocol.connect(channel, SESSION_RESUMED);
+	CHECK_EQ(describes.size(), 0u);
+}
+
+static void test_describe_skipped_on_resume()
+{
+	Trackle device;
+	device.setSaveSessionCallback(save);
+	device.setRestoreSessionCallback(restore);
+	HandshakeChannel channel;
+	DescribeProtocol protocol(channel);
+
+	// a new session gets the whole describe, and its checksums are persisted
+	saves = 0;
+	std::vector<std::string> describes = protocol.connect(channel, SESSION_CONNECTED);
+	CHECK_EQ(describes.size(), 1u);
+	CHECK(has_app(describes[0]) && has_system(describes[0]));
+	CHECK(saves > 0);
+	uint32_t persisted[3];
+	CHECK_EQ(restore(persisted, sizeof(persisted), TrackleCallbacks::PERSIST_APP_STATE, NULL), (int)sizeof(persisted));
+	CHECK(persisted[TrackleAppStateSelector::DESCRIBE_APP] && persisted[TrackleAppStateSelector::DESCRIBE_SYSTEM]);
+
+	// the cloud already has it on the resumed session
+	describes = protocol.connect(channel, SESSION_RESUMED);
+	CHECK_EQ(describes.size(), 0u);
+
+	// not on a new one, even with matching checksums
+	describes = protocol.connect(channel, SESSION_CONNECTED);
+	CHECK_EQ(describes.size(), 1u);
+	CHECK(has_app(describes[0]) && has_system(describes[0]));
+
+	// only the part that changed is posted on resume
+	CHECK(device.post("describe_test", cloud_function));
+	describes = protocol.connect(channel, SESSION_RESUMED);
+	CHECK_EQ(describes.size(), 1u);
+	CHECK(has_app(describes[0]) && !has_system(describes[0]));
+	CHECK(describes[0].find("describe_test") != std::string::npos);
+	describes = protocol.connect(channel, SESSION_RESUMED);
+	CHECK_EQ(describes.size(), 0u);
+
+	// a persisted checksum that doesn't match is posted again
+	appStateSelectorInfo(TrackleAppStateSelector::DESCRIBE_SYSTEM, TrackleAppStateUpdate::PERSIST, 1, nullptr);
+	CHECK_EQ(restore(persisted, sizeof(persisted), TrackleCallbacks::PERSIST_APP_STATE, NULL), (int)sizeof(persisted));
+	CHECK_EQ(persisted[TrackleAppStateSelector::DESCRIBE_SYSTEM], 1u);
+	describes = protocol.connect(channel, SESSION_RESUMED);
+	CHECK_EQ(describes.size(), 1u);
+	CHECK(!has_app(describes[0]) && has_system(describes[0]));
+}
+
+// a describe larger than a datagram is posted in Block1 blocks, each one after the cloud continues the previous
+static void test_block1_post()
+{
+	Trackle device;
+	for (int i = 0; i < 8; i++)
+		CHECK(device.post(("block_function_" + std::to_string(i)).c_str(), cloud_function));
+	const std::string whole = whole_describe(DESCRIBE_DEFAULT);
+	CHECK(whole.size() > 3 * 64);
+
+	HandshakeChannel channel(128); // blocks of 64 bytes
+	DescribeProtocol protocol(channel);
+	CHECK_EQ(protocol.post_description(DESCRIBE_DEFAULT), NO_ERROR);
+	CHECK_EQ(channel.sent.size(), 1u);
+
+	std::string posted;
+	for (uint32_t num = 0;; num++)
+	{
+		Block block(channel.sent.back(), CoAPOption::BLOCK1);
+		CHECK_EQ(block.code, CoAPCode::POST);
+		CHECK_EQ(block.num(), num);
+		CHECK_EQ(CoAP::block_size(block.block), 64u);
+		CHECK_EQ(block.payload.size(), block.more() ? 64u : whole.size() - posted.size());
+		posted += block.payload;
+
+		// a CONTINUE for another message is not the one for this block
+		const size_t sent = channel.sent.size();
+		protocol.notify_message_complete(block.id - 1, CoAPCode::CONTINUE, 0);
+		protocol.notify_message_complete(block.id + 1, CoAPCode::CONTINUE, 0);
+		CHECK_EQ(channel.sent.size(), sent);
+
+		protocol.notify_message_complete(block.id, CoAPCode::CONTINUE, 0);
+		if (!block.more())
+		{
+			// the post is over, a late CONTINUE sends nothing
+			CHECK_EQ(channel.sent.size(), sent);
+			break;
+		}
+		CHECK_EQ(channel.sent.size(), sent + 1);
+	}
+	CHECK(posted == whole);
+	CHECK(channel.sent.size() > 3);
+}
+
+// the cloud reads a describe larger than a datagram in Block2 blocks, of the device block size at most
+static void test_block2_boundaries()
+{
+	Trackle device;
+	const std::string whole = whole_describe(DESCRIBE_DEFAULT);
+	const size_t blocks = (whole.size() + 63) / 64;
+
+	HandshakeChannel channel(128);
+	DescribeProtocol protocol(channel);
+
+	// a request without Block2 gets the first block
+	CHECK_EQ(protocol.send_description(0x11, 0x100, DESCRIBE_DEFAULT), NO_ERROR);
+	Block first(channel.sent.back(), CoAPOption::BLOCK2);
+	CHECK_EQ(first.code, CoAPCode::CONTENT);
+	CHECK_EQ(first.id, 0x100);
+	CHECK_EQ(first.num(), 0u);
+	CHECK(first.more());
+	CHECK(first.payload == whole.substr(0, 64));
+
+	std::string read;
+	for (uint32_t num = 0; num < blocks; num++)
+	{
+		CHECK_EQ(protocol.send_description(0x11, 0x100 + num, DESCRIBE_DEFAULT, CoAP::block_value(num, false, 64)), NO_ERROR);
+		Block block(channel.sent.back(), CoAPOption::BLOCK2);
+		CHECK_EQ(block.code, CoAPCode::CONTENT);
+		CHECK_EQ(block.num(), num);
+		CHECK_EQ(block.more(), num + 1 < blocks);
+		CHECK(block.payload == whole.substr(num * 64, 64));
+		read += block.payload;
+	}
+	CHECK(read == whole);
+
+	// a larger block size is reduced to the device one, the block number scaled to it
+	CHECK_EQ(protocol.send_description(0x11, 0x200, DESCRIBE_DEFAULT, CoAP::block_value(1, false, 128)), NO_ERROR);
+	Block scaled(channel.sent.back(), CoAPOption::BLOCK2);
+	CHECK_EQ(scaled.num(), 2u);
+	CHECK_EQ(CoAP::block_size(scaled.block), 64u);
+	CHECK(scaled.payload == whole.substr(128, 64));
+
+	// a block past the end is refused
+	CHECK_EQ(protocol.send_description(0x11, 0x201, DESCRIBE_DEFAULT, CoAP::block_value(blocks, false, 64)), NO_ERROR);
+	Block past(channel.sent.back(), CoAPOption::BLOCK2);
+	CHECK_EQ(past.code, RESPONSE_CODE(4, 2));
+	CHECK(past.payload.empty());
+}
+
+int main()
+{
+	RUN_TEST(test_no_persistence_callbacks);
+	RUN_TEST(test_describe_skipped_on_resume);
+	RUN_TEST(test_block1_post);
+	RUN_TEST(test_block2_boundaries);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,297 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "dtls_harness.h"
+
+using namespace trackle::protocol;
+
+static TestCloud cloud;
+static Device boots[6];
+static size_t next_boot = 0;
+
+static const uint8_t CID[] = {0xc1, 0xd0, 0x00, 0x2a};
+static Datagram server_cid_extension; // added to the ServerHello by tamper_hello()
+
+static uint16_t uint16_at(const Datagram &d, size_t p) { return d[p] << 8 | d[p + 1]; }
+
+static void add_uint16(Datagram &d, size_t p, int n)
+{
+	uint16_t v = uint16_at(d, p) + n;
+	d[p] = v >> 8;
+	d[p + 1] = v & 0xFF;
+}
+
+static void add_uint24(Datagram &d, size_t p, int n)
+{
+	uint32_t v = (d[p] << 16 | d[p + 1] << 8 | d[p + 2]) + n;
+	d[p] = v >> 16;
+	d[p + 1] = v >> 8;
+	d[p + 2] = v & 0xFF;
+}
+
+/**
+ * The offset of the record after the one at p, a tls12_cid record carries the CID of the test.
+ */
+static size_t next_record(const Datagram &d, size_t p)
+{
+	size_t header = d[p] == DTLS_CT_TLS12_CID ? 13 + sizeof(CID) : 13;
+	return p + header + uint16_at(d, p + header - 2);
+}
+
+/**
+ * The offset of the handshake record of the given type in the datagram, 0 if none.
+ */
+static size_t find_handshake(const Datagram &d, uint8_t type)
+{
+	for (size_t p = 0; p + 13 < d.size(); p = next_record(d, p))
+		if (d[p] == DTLS_CT_HANDSHAKE && d[p + 13] == type)
+			return p + 13;
+	return 0;
+}
+
+/**
+ * The offset of the extensions of the hello message at p.
+ */
+static size_t hello_extensions(const Datagram &d, size_t p)
+{
+	bool client = d[p] == 1;
+	p += 12 + 2 + 32; // handshake header, version and random
+	p += 1 + d[p];	  // session ID
+	if (client)
+	{
+		p += 1 + d[p];			  // cookie
+		p += 2 + uint16_at(d, p); // cipher suites
+		p += 1 + d[p];			  // compression methods
+	}
+	else
+		p += 2 + 1; // cipher suite and compression method
+	return p;
+}
+
+/**
+ * The offset of the extension of the hello message at p, 0 if none.
+ */
+static size_t find_extension(const Datagram &d, size_t p, uint16_t type)
+{
+	size_t extensions = hello_extensions(d, p);
+	size_t end = extensions + 2 + uint16_at(d, extensions);
+	for (p = extensions + 2; p < end; p += 4 + uint16_at(d, p + 2))
+		if (uint16_at(d, p) == type)
+			return p;
+	return 0;
+}
+
+/**
+ * Adds server_cid_extension to the ServerHello of the cloud.
+ */
+static void tamper_hello(Datagram &d, bool to_device)
+{
+	size_t hello = to_device ? find_handshake(d, 2) : 0;
+	if (!hello)
+		return;
+	size_t length = server_cid_extension.size();
+	size_t end = hello + 12 + (d[hello + 9] << 16 | d[hello + 10] << 8 | d[hello + 11]);
+	d.insert(d.begin() + end, server_cid_extension.begin(), server_cid_extension.end());
+	add_uint16(d, hello - 2, length);				   // record
+	add_uint24(d, hello + 1, length);				   // handshake message
+	add_uint24(d, hello + 9, length);				   // fragment
+	add_uint16(d, hello_extensions(d, hello), length); // extensions
+}
+
+/**
+ * Also keeps the cloud from agreeing on the extended master secret, which depends on the tampered
+ * hello messages, and holds back the records with the CID, that tinydtls can't read.
+ */
+static void tamper_session(Datagram &d, bool to_device)
+{
+	tamper_hello(d, to_device);
+	size_t hello = to_device ? 0 : find_handshake(d, 1);
+	size_t extension = hello ? find_extension(d, hello, TLS_EXT_EXTENDED_MASTER_SECRET) : 0;
+	if (extension)
+		d[extension] = 0xfe; // an extension the cloud doesn't know
+	for (size_t p = 0; !to_device && p < d.size();)
+	{
+		size_t next = next_record(d, p);
+		if (d[p] == DTLS_CT_TLS12_CID)
+			d.erase(d.begin() + p, d.begin() + next);
+		else
+			p = next;
+	}
+}
+
+static size_t find_record(uint8_t type, Datagram *record)
+{
+	size_t found = 0;
+	for (size_t i = 0; i < device_sent.size(); i++)
+		for (size_t p = 0; p < device_sent[i].size(); p = next_record(device_sent[i], p))
+			if (device_sent[i][p] == type)
+			{
+				*record = Datagram(device_sent[i].begin() + p, device_sent[i].begin() + next_record(device_sent[i], p));
+				found++;
+			}
+	return found;
+}
+
+/**
+ * The next boot of the device, with no persisted session and a cloud that doesn't know it.
+ */
+static Device &boot()
+{
+	storage = Storage();
+	cloud.reset();
+	device_sent.clear();
+	return boots[next_boot++];
+}
+
+// the ClientHello offers a zero-length connection ID, a cloud that ignores it gets plain records
+static void test_client_hello_offers_cid()
+{
+	Device &device = boot();
+	CHECK_EQ(device.establish(cloud), SESSION_CONNECTED);
+
+	size_t hello = find_handshake(device_sent[0], 1);
+	CHECK(hello);
+	size_t extension = find_extension(device_sent[0], hello, TLS_EXT_CONNECTION_ID);
+	CHECK(extension);
+	CHECK_EQ(uint16_at(device_sent[0], extension + 2), 1);
+	CHECK_EQ(device_sent[0][extension + 4], 0);
+
+	CHECK_EQ(device.send("status"), NO_ERROR);
+	CHECK_EQ(device_sent.back()[0], DTLS_CT_APPLICATION_DATA);
+	Datagram record;
+	CHECK_EQ(find_record(DTLS_CT_TLS12_CID, &record), 0u);
+}
+
+// a connection ID in the ServerHello is refused with a fatal alert when it's empty, longer than
+// DTLS_MAX_CID_LENGTH or its length doesn't match the extension's
+static void test_server_hello_cid_checked()
+{
+	const Datagram invalid[] = {
+		{0, 54, 0, 0},
+		{0, 54, 0, 18, 17, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17},
+		{0, 54, 0, 5, 6, 1, 2, 3, 4},
+		{0, 54, 0, 5, 3, 1, 2, 3, 4},
+	};
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+	{
+		server_cid_extension = invalid[i];
+		Device &device = boot();
+		CHECK(device.establish(cloud, tamper_hello) != SESSION_CONNECTED);
+		Datagram alert;
+		CHECK_EQ(find_record(DTLS_CT_ALERT, &alert), 1u);
+		CHECK(alert.size() == 15 && alert[13] == DTLS_ALERT_LEVEL_FATAL && alert[14] == DTLS_ALERT_HANDSHAKE_FAILURE);
+		Datagram ccs;
+		CHECK_EQ(find_record(DTLS_CT_CHANGE_CIPHER_SPEC, &ccs), 0u);
+	}
+}
+
+/**
+ * Decrypts the tls12_cid record with the client write key of the cloud, the additional data is built
+ * from the record header as RFC 9146, section 5, or as RFC 6347 when legacy is set.
+ * Returns the DTLSInnerPlaintext, empty if the record isn't authentic.
+ */
+static Datagram decrypt(const Datagram &record, const dtls_security_parameters_t *keys, bool legacy = false)
+{
+	const size_t header = 13 + sizeof(CID);
+	const uint8_t *fragment = record.data() + header;
+	const size_t length = record.size() - header - 8 - 8; // explicit nonce and MAC
+
+	uint8_t aad[23 + sizeof(CID)];
+	size_t aad_length;
+	if (legacy)
+	{
+		memcpy(aad, record.data() + 3, 8); // epoch and sequence number
+		memcpy(aad + 8, record.data(), 3); // type and version
+		aad[11] = length >> 8;
+		aad[12] = length & 0xFF;
+		aad_length = 13;
+	}
+	else
+	{
+		memset(aad, 0xff, 8);
+		aad[8] = DTLS_CT_TLS12_CID;
+		aad[9] = sizeof(CID);
+		memcpy(aad + 10, record.data(), 11); // type, version, epoch and sequence number
+		memcpy(aad + 21, record.data() + 11, sizeof(CID));
+		aad[21 + sizeof(CID)] = length >> 8;
+		aad[22 + sizeof(CID)] = length & 0xFF;
+		aad_length = sizeof(aad);
+	}
+
+	uint8_t nonce[DTLS_CCM_BLOCKSIZE] = {};
+	memcpy(nonce, dtls_kb_client_iv(keys, DTLS_SERVER), dtls_kb_iv_size(keys, DTLS_SERVER));
+	memcpy(nonce + dtls_kb_iv_size(keys, DTLS_SERVER), fragment, 8);
+	const dtls_ccm_params_t params = {nonce, 8, 3};
+	Datagram plaintext(length + 8);
+	int res = dtls_decrypt_params(&params, fragment + 8, length + 8, plaintext.data(), dtls_kb_client_write_key(keys, DTLS_SERVER),
+								  dtls_kb_key_size(keys, DTLS_SERVER), aad, aad_length);
+	plaintext.resize(res < 0 ? 0 : res);
+	return plaintext;
+}
+
+// with a connection ID from the cloud the encrypted records are tls12_cid ones, with the CID in the header
+// and the additional data of RFC 9146: a tampered header doesn't authenticate
+static void test_cid_record_additional_data()
+{
+	server_cid_extension = {0, 54, 0, 5, 4};
+	server_cid_extension.insert(server_cid_extension.end(), CID, CID + sizeof(CID));
+	Device &device = boot();
+	cloud.set_client_auth(false);
+	device.establish(cloud, tamper_session);
+	cloud.set_client_auth(true);
+
+	Datagram finished;
+	CHECK_EQ(find_record(DTLS_CT_TLS12_CID, &finished), 1u);
+	CHECK_EQ(finished.size(), 13 + sizeof(CID) + 8 + 12 + 12 + 1 + 8);
+	CHECK(finished[1] == 0xfe && finished[2] == 0xfd); // DTLS 1.2
+	CHECK_EQ(uint16_at(finished, 3), 1);			   // epoch
+	CHECK(memcmp(finished.data() + 11, CID, sizeof(CID)) == 0);
+	Datagram ccs;
+	CHECK_EQ(find_record(DTLS_CT_CHANGE_CIPHER_SPEC, &ccs), 1u); // still plain, epoch 0
+
+	dtls_peer_t *peer = dtls_get_peer(cloud.context, &cloud.session);
+	CHECK(peer && peer->state == DTLS_STATE_WAIT_FINISHED);
+	if (!peer || !peer->security_params[1] || finished.empty())
+		return;
+	const dtls_security_parameters_t *keys = peer->security_params[1]; // derived with the ChangeCipherSpec
+	Datagram plaintext = decrypt(finished, keys);
+	CHECK_EQ(plaintext.size(), 12u + 12 + 1);
+	CHECK(plaintext.size() && plaintext[0] == 20 && plaintext.back() == DTLS_CT_HANDSHAKE); // Finished, real type at the end
+
+	CHECK(decrypt(finished, keys, true).empty());
+	for (size_t i : {2u, 10u, 11u, 14u})
+	{
+		Datagram tampered = finished;
+		tampered[i] ^= 1;
+		CHECK(decrypt(tampered, keys).empty());
+	}
+}
+
+int main()
+{
+	keys.generate();
+	for (size_t i = 0; i < sizeof(boots) / sizeof(boots[0]); i++)
+		boots[i].spawn();
+	cloud.start();
+	RUN_TEST(test_client_hello_offers_cid);
+	RUN_TEST(test_server_hello_cid_checked);
+	RUN_TEST(test_cid_record_additional_data);
+	return UNIT_TEST_RESULT();
+}
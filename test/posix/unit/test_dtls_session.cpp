@@ -0,0 +1,109 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "dtls_harness.h"
+
+using namespace trackle::protocol;
+
+static TestCloud cloud;
+static Device boots[3];
+
+// the receive window is saved with the handshake, then again only once the cloud went past the gap it was saved with
+static void test_receive_window_saved_by_gap()
+{
+	Device &device = boots[0];
+	CHECK_EQ(device.establish(cloud), SESSION_CONNECTED);
+	CHECK_EQ(storage.saves, 1);
+
+	int received = 0;
+	while (storage.saves == 1 && received < 100)
+	{
+		cloud.send("command");
+		CHECK(device.receive() == "command");
+		received++;
+	}
+	CHECK_EQ(received, 17); // the handshake's Finished was record 0, saved 16 ahead
+	for (int i = 0; i < 16; i++)
+	{
+		cloud.send("command");
+		CHECK(device.receive() == "command");
+	}
+	CHECK_EQ(storage.saves, 2);
+	cloud.send("command");
+	CHECK(device.receive() == "command");
+	CHECK_EQ(storage.saves, 3);
+}
+
+// after a restart the restored session rejects the records received before, and the ones the cloud sends
+// up to the saved gap: they aren't taken for a lost session, and the records past it are accepted again
+static void test_restored_session_rejects_replay()
+{
+	cloud.reset();
+	storage = Storage();
+	std::vector<Datagram> records;
+	Device &before = boots[1];
+	CHECK_EQ(before.establish(cloud), SESSION_CONNECTED);
+	for (int i = 0; i < 20; i++)
+	{
+		records.push_back(cloud.send("command"));
+		CHECK(before.receive() == "command");
+	}
+	CHECK_EQ(storage.saves, 2);
+
+	Device &after = boots[2];
+	CHECK_EQ(after.establish(cloud), SESSION_RESUMED);
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		to_device.push_back(records[i]);
+		ProtocolError error;
+		CHECK(after.receive(&error).empty());
+		CHECK_EQ(error, NO_ERROR);
+	}
+	CHECK(to_cloud.empty()); // no move session ping
+
+	int dropped = 0;
+	cloud.send("fresh");
+	while (after.receive().empty() && dropped < 100)
+	{
+		dropped++;
+		cloud.send("fresh");
+	}
+	CHECK_EQ(dropped, 13); // records 21 to 33, the 17th saved the window up to 33
+	CHECK_EQ(storage.saves, 3);
+	cloud.send("next");
+	CHECK(after.receive() == "next");
+
+	// the device's own records go on past the ones sent before the restart
+	cloud.received.clear();
+	CHECK_EQ(after.send("status"), NO_ERROR);
+	cloud.process();
+	CHECK(cloud.received.size() == 1 && cloud.received[0] == "status");
+}
+
+int main()
+{
+	keys.generate();
+	for (size_t i = 0; i < sizeof(boots) / sizeof(boots[0]); i++)
+		boots[i].spawn();
+	cloud.start();
+	RUN_TEST(test_receive_window_saved_by_gap);
+	RUN_TEST(test_restored_session_rejects_replay);
+	return UNIT_TEST_RESULT();
+}
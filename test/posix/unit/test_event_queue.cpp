@@ -0,0 +1,297 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "event_queue.h"
+#include "trackle.h"
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace trackle;
+
+void call_event_handler(uint16_t size, FilteringEventHandler *handler, const char *event_name, const char *data, void *reserved);
+
+/**
+ * The events seen by a handler, in the order it was called.
+ */
+struct Recorder
+{
+	std::vector<std::string> names;
+	std::vector<std::string> data;
+	int null_data = 0;
+};
+
+static void record(void *handler_data, const char *event_name, const char *data)
+{
+	Recorder *recorder = (Recorder *)handler_data;
+	recorder->names.push_back(event_name);
+	recorder->data.push_back(data ? data : "");
+	if (!data)
+		recorder->null_data++;
+}
+
+static FilteringEventHandler handler_for(Recorder &recorder)
+{
+	FilteringEventHandler handler;
+	memset(&handler, 0, sizeof(handler));
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+	handler.handler = (EventHandler)record;
+#pragma GCC diagnostic pop
+	handler.handler_data = &recorder;
+	return handler;
+}
+
+static void test_fifo_order()
+{
+	EventQueue queue;
+	Recorder recorder;
+	FilteringEventHandler handler = handler_for(recorder);
+	CHECK(queue.configure(4, 32, EVENT_QUEUE_DROP_NEWEST));
+
+	CHECK(queue.push(handler, "a", "1"));
+	CHECK(queue.push(handler, "b", NULL));
+	CHECK(queue.push(handler, "c", "3"));
+	CHECK_EQ(recorder.names.size(), 0);
+
+	// up to the given number of events per call
+	CHECK_EQ(queue.drain(2), 2);
+	CHECK_EQ(queue.drain(0), 1);
+	CHECK_EQ(queue.drain(0), 0);
+	CHECK_EQ(recorder.names.size(), 3);
+	CHECK(recorder.names[0] == "a" && recorder.names[1] == "b" && recorder.names[2] == "c");
+	CHECK(recorder.data[0] == "1" && recorder.data[2] == "3");
+	// no data stays NULL, not an empty string
+	CHECK_EQ(recorder.null_data, 1);
+
+	// the slots are reused around the ring
+	for (int round = 0; round < 3; round++)
+	{
+		for (int i = 0; i < 4; i++)
+			CHECK(queue.push(handler, "ring", std::to_string(round * 4 + i).c_str()));
+		CHECK_EQ(queue.drain(0), 4);
+	}
+	CHECK(recorder.data.back() == "11");
+
+	Event_Queue_Metrics metrics;
+	queue.get_metrics(&metrics);
+	CHECK_EQ(metrics.enqueued, 15);
+	CHECK_EQ(metrics.dispatched, 15);
+	CHECK_EQ(metrics.depth, 0);
+	CHECK_EQ(metrics.high_watermark, 4);
+}
+
+static void test_overflow_drop_newest()
+{
+	EventQueue queue;
+	Recorder recorder;
+	FilteringEventHandler handler = handler_for(recorder);
+	CHECK(queue.configure(2, 32, EVENT_QUEUE_DROP_NEWEST));
+
+	CHECK(queue.push(handler, "a", NULL));
+	CHECK(queue.push(handler, "b", NULL));
+	CHECK(!queue.push(handler, "c", NULL));
+	CHECK_EQ(recorder.names.size(), 0);
+
+	CHECK_EQ(queue.drain(0), 2);
+	CHECK(recorder.names[0] == "a" && recorder.names[1] == "b");
+	Event_Queue_Metrics metrics;
+	queue.get_metrics(&metrics);
+	CHECK_EQ(metrics.dropped, 1);
+	CHECK_EQ(metrics.dispatched_inline, 0);
+}
+
+static void test_overflow_dispatch_inline()
+{
+	EventQueue queue;
+	Recorder recorder;
+	FilteringEventHandler handler = handler_for(recorder);
+	CHECK(queue.configure(2, 32, EVENT_QUEUE_DISPATCH_INLINE));
+
+	CHECK(queue.push(handler, "a", NULL));
+	CHECK(queue.push(handler, "b", NULL));
+	// the event that doesn't fit runs right away, before the queued ones
+	CHECK(!queue.push(handler, "c", "3"));
+	CHECK_EQ(recorder.names.size(), 1);
+	CHECK(recorder.names[0] == "c" && recorder.data[0] == "3");
+
+	CHECK_EQ(queue.drain(0), 2);
+	CHECK(recorder.names[1] == "a" && recorder.names[2] == "b");
+	Event_Queue_Metrics metrics;
+	queue.get_metrics(&metrics);
+	CHECK_EQ(metrics.dropped, 0);
+	CHECK_EQ(metrics.dispatched_inline, 1);
+}
+
+static void test_oversized_event()
+{
+	EventQueue queue;
+	Recorder recorder;
+	FilteringEventHandler handler = handler_for(recorder);
+	const std::string data(10, 'x');
+
+	// name and data together up to the maximum length
+	CHECK(queue.configure(4, 12, EVENT_QUEUE_DROP_NEWEST));
+	CHECK(queue.push(handler, "ab", data.c_str()));
+	CHECK(!queue.push(handler, "abc", data.c_str()));
+	CHECK_EQ(queue.drain(0), 1);
+	CHECK(recorder.names[0] == "ab" && recorder.data[0] == data);
+	Event_Queue_Metrics metrics;
+	queue.get_metrics(&metrics);
+	CHECK_EQ(metrics.dropped, 1);
+
+	CHECK(queue.configure(4, 12, EVENT_QUEUE_DISPATCH_INLINE));
+	CHECK(!queue.push(handler, "abc", data.c_str()));
+	CHECK_EQ(recorder.names.size(), 2);
+	CHECK(recorder.names[1] == "abc" && recorder.data[1] == data);
+}
+
+static void test_reconfigure_discards_pending()
+{
+	EventQueue queue;
+	Recorder recorder;
+	FilteringEventHandler handler = handler_for(recorder);
+	CHECK(queue.configure(4, 32, EVENT_QUEUE_DROP_NEWEST));
+	CHECK(queue.push(handler, "a", NULL));
+	CHECK(queue.push(handler, "b", NULL));
+
+	CHECK(queue.configure(0, 0, EVENT_QUEUE_DROP_NEWEST));
+	CHECK(!queue.enabled());
+	CHECK_EQ(queue.drain(0), 0);
+	CHECK_EQ(recorder.names.size(), 0);
+	Event_Queue_Metrics metrics;
+	queue.get_metrics(&metrics);
+	CHECK_EQ(metrics.dropped, 2);
+	CHECK_EQ(metrics.depth, 0);
+}
+
+struct Sequence
+{
+	int next = 0;
+	int out_of_order = 0;
+	int corrupted = 0;
+};
+
+static void check_sequence(void *handler_data, const char *event_name, const char *data)
+{
+	Sequence *sequence = (Sequence *)handler_data;
+	int value = atoi(data);
+	if (value < sequence->next)
+		sequence->out_of_order++;
+	// the name carries the same number, to spot a slot read while being written
+	if (strcmp(event_name + 1, data) || event_name[0] != 'e')
+		sequence->corrupted++;
+	sequence->next = value + 1;
+}
+
+// the protocol loop and a worker thread on the two ends of the ring
+static void test_producer_consumer_threads()
+{
+	const int events = 200000;
+	EventQueue queue;
+	Sequence sequence;
+	FilteringEventHandler handler;
+	memset(&handler, 0, sizeof(handler));
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+	handler.handler = (EventHandler)check_sequence;
+#pragma GCC diagnostic pop
+	handler.handler_data = &sequence;
+	CHECK(queue.configure(16, 32, EVENT_QUEUE_DROP_NEWEST));
+
+	std::atomic<bool> produced(false);
+	int consumed = 0;
+	std::thread consumer([&]
+						 {
+		for (;;)
+		{
+			bool last = produced;
+			int n = queue.drain(5);
+			consumed += n;
+			if (!n && last)
+				break;
+		} });
+
+	int queued = 0;
+	char name[16], data[16];
+	for (int i = 0; i < events; i++)
+	{
+		snprintf(name, sizeof(name), "e%d", i);
+		snprintf(data, sizeof(data), "%d", i);
+		if (queue.push(handler, name, data))
+			queued++;
+	}
+	produced = true;
+	consumer.join();
+
+	Event_Queue_Metrics metrics;
+	queue.get_metrics(&metrics);
+	CHECK_EQ(consumed, queued);
+	CHECK_EQ(metrics.dropped + metrics.dispatched, events);
+	CHECK_EQ(sequence.out_of_order, 0);
+	CHECK_EQ(sequence.corrupted, 0);
+	CHECK(metrics.high_watermark <= 16);
+}
+
+static Trackle device;
+static int notifications = 0;
+
+static void notify()
+{
+	notifications++;
+}
+
+// the inbound events of the protocol reach the handlers through processEvents()
+static void test_process_events()
+{
+	Recorder recorder;
+	FilteringEventHandler handler = handler_for(recorder);
+	CHECK(device.setEventQueue(4, 32, EVENT_QUEUE_DROP_NEWEST));
+	device.setEventQueueNotifyCallback(notify);
+
+	call_event_handler(sizeof(handler), &handler, "temperature", "21", NULL);
+	call_event_handler(sizeof(handler), &handler, "humidity", "40", NULL);
+	CHECK_EQ(notifications, 2);
+	CHECK_EQ(recorder.names.size(), 0);
+	CHECK_EQ(device.processEvents(), 2);
+	CHECK(recorder.names[0] == "temperature" && recorder.names[1] == "humidity");
+
+	// without the queue the handler runs right away
+	CHECK(device.setEventQueue(0, 0, EVENT_QUEUE_DROP_NEWEST));
+	call_event_handler(sizeof(handler), &handler, "pressure", "1013", NULL);
+	CHECK_EQ(recorder.names.size(), 3);
+	CHECK_EQ(device.processEvents(), 0);
+	CHECK_EQ(notifications, 2);
+	device.setEventQueueNotifyCallback(NULL);
+}
+
+int main()
+{
+	RUN_TEST(test_fifo_order);
+	RUN_TEST(test_overflow_drop_newest);
+	RUN_TEST(test_overflow_dispatch_inline);
+	RUN_TEST(test_oversized_event);
+	RUN_TEST(test_reconfigure_discards_pending);
+	RUN_TEST(test_producer_consumer_threads);
+	RUN_TEST(test_process_events);
+	return UNIT_TEST_RESULT();
+}
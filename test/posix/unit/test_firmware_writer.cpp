@@ -0,0 +1,125 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "trackle.h"
+#include "file_transfer.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+int default_prepare_for_firmware_update(FileTransfer::Descriptor &descriptor, uint32_t flags, void *reserved);
+int default_save_firmware_chunk(FileTransfer::Descriptor &descriptor, const unsigned char *chunk, void *reserved);
+int default_finish_firmware_update(FileTransfer::Descriptor &data, uint32_t flags, void *);
+
+#define CHUNK_SIZE 512
+#define CHUNKS 16
+
+static Trackle device;
+static std::vector<uint32_t> stored;
+static std::atomic<int> stored_count;
+static std::vector<std::pair<void (*)(void *), void *>> loop_jobs;
+
+static void prepare(Chunk data, uint32_t flags, void *reserved)
+{
+}
+
+static void save_chunk(Chunk data, const unsigned char *chunk, void *reserved)
+{
+	stored.push_back(data.chunk_address);
+	stored_count++;
+}
+
+static void slow_save_chunk(Chunk data, const unsigned char *chunk, void *reserved)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	stored_count++;
+}
+
+// runs the jobs from the "protocol loop", like a single threaded application
+static void loop_executor(void (*job)(void *), void *arg)
+{
+	loop_jobs.push_back(std::make_pair(job, arg));
+}
+
+static void thread_executor(void (*job)(void *), void *arg)
+{
+	std::thread(job, arg).detach();
+}
+
+static void transfer(FileTransfer::Descriptor &descriptor)
+{
+	unsigned char chunk[CHUNK_SIZE] = {0};
+	descriptor.file_length = CHUNKS * CHUNK_SIZE;
+	descriptor.file_address = 0x80000;
+	descriptor.chunk_size = CHUNK_SIZE;
+	descriptor.chunk_address = descriptor.file_address;
+	CHECK_EQ(default_prepare_for_firmware_update(descriptor, 0, NULL), 0);
+	for (int i = 0; i < CHUNKS; i++)
+	{
+		descriptor.chunk_address = descriptor.file_address + i * CHUNK_SIZE;
+		CHECK_EQ(default_save_firmware_chunk(descriptor, chunk, NULL), 0);
+	}
+	default_finish_firmware_update(descriptor, 0, NULL);
+}
+
+static void test_finish_with_loop_executor()
+{
+	stored.clear();
+	stored_count = 0;
+	loop_jobs.clear();
+	device.setSaveFirmwareChunkCallback(save_chunk);
+	device.setFirmwareWriteExecutor(loop_executor, CHUNKS);
+
+	// the writer job never ran, the finish stores the chunks instead of waiting for it
+	FileTransfer::Descriptor descriptor;
+	transfer(descriptor);
+	CHECK_EQ(stored.size(), CHUNKS);
+	for (size_t i = 0; i < stored.size(); i++)
+		CHECK_EQ(stored[i], descriptor.file_address + i * CHUNK_SIZE);
+
+	// the job scheduled by the first chunk finds nothing left to store
+	CHECK_EQ(loop_jobs.size(), 1);
+	for (size_t i = 0; i < loop_jobs.size(); i++)
+		loop_jobs[i].first(loop_jobs[i].second);
+	CHECK_EQ(stored.size(), CHUNKS);
+
+	device.setFirmwareWriteExecutor(NULL, 0);
+}
+
+static void test_finish_waits_for_writer_thread()
+{
+	stored_count = 0;
+	device.setSaveFirmwareChunkCallback(slow_save_chunk);
+	device.setFirmwareWriteExecutor(thread_executor, CHUNKS);
+
+	FileTransfer::Descriptor descriptor;
+	transfer(descriptor);
+	CHECK_EQ(stored_count, CHUNKS);
+
+	device.setFirmwareWriteExecutor(NULL, 0);
+}
+
+int main()
+{
+	device.setPrepareForFirmwareUpdateCallback(prepare);
+	RUN_TEST(test_finish_with_loop_executor);
+	RUN_TEST(test_finish_waits_for_writer_thread);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,324 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "http_downloader.h"
+#include "crc32.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace trackle;
+
+#define FILE_LENGTH (200 * 1024 + 123)
+#define CONNECTIONS 4
+#define TEST_STALL_TIMEOUT 300 // milliseconds, instead of HttpDownloader::STALL_TIMEOUT
+
+/**
+ * A range server on the loopback that breaks connections on demand: a drop closes
+ * the connection in the middle of the body, a stall stops sending and waits for the
+ * client to give up. The probe of the first byte is always served.
+ */
+class RangeServer
+{
+	int listener;
+	std::thread acceptor;
+	std::vector<std::thread> workers;
+	std::mutex lock;
+
+	void serve(int fd)
+	{
+		char request[2048];
+		int received = 0;
+		request[0] = 0;
+		while (!strstr(request, "\r\n\r\n") && received < (int)sizeof(request) - 1)
+		{
+			int n = recv(fd, request + received, sizeof(request) - 1 - received, 0);
+			if (n <= 0)
+			{
+				close(fd);
+				return;
+			}
+			received += n;
+			request[received] = 0;
+		}
+
+		unsigned long first = 0, last = data.size() - 1;
+		const char *range = strstr(request, "Range: bytes=");
+		bool partial = ranges && range && sscanf(range, "Range: bytes=%lu-%lu", &first, &last) == 2;
+		if (!partial)
+		{
+			first = 0;
+			last = data.size() - 1;
+		}
+		bool probe = partial && first == 0 && last == 0;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			requests.push_back(first);
+		}
+
+		char header[256];
+		uint32_t length = last - first + 1;
+		if (partial)
+			snprintf(header, sizeof(header), "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %lu-%lu/%lu\r\nContent-Length: %lu\r\n\r\n",
+					 first, last, (unsigned long)data.size(), (unsigned long)length);
+		else
+			snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n", (unsigned long)length);
+		send(fd, header, strlen(header), MSG_NOSIGNAL);
+
+		// the faults hit the body after the first blocks, so the client made some progress
+		uint32_t sent = length;
+		bool stall = false;
+		if (!probe && length > break_at && drops > 0 && drops-- > 0)
+			sent = break_at;
+		else if (!probe && length > break_at && stalls > 0 && stalls-- > 0)
+			sent = break_at, stall = true;
+
+		send(fd, &data[first], sent, MSG_NOSIGNAL);
+		if (stall)
+		{
+			// returns when the client closes the connection
+			char c;
+			while (recv(fd, &c, 1, 0) > 0)
+				;
+		}
+		close(fd);
+	}
+
+	void accept_loop()
+	{
+		for (;;)
+		{
+			int fd = accept(listener, NULL, NULL);
+			if (fd < 0)
+				return;
+			connections++;
+			std::lock_guard<std::mutex> guard(lock);
+			workers.push_back(std::thread(&RangeServer::serve, this, fd));
+		}
+	}
+
+public:
+	std::vector<unsigned char> data;
+	bool ranges = true;
+	uint32_t break_at = 3 * HttpDownloader::BLOCK_SIZE + 100;
+	std::atomic<int> drops;
+	std::atomic<int> stalls;
+	std::atomic<int> connections;
+	std::vector<unsigned long> requests;
+	uint16_t port;
+
+	RangeServer() : drops(0), stalls(0), connections(0)
+	{
+		data.resize(FILE_LENGTH);
+		srand(7);
+		for (size_t i = 0; i < data.size(); i++)
+			data[i] = rand();
+
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		bind(listener, (struct sockaddr *)&address, sizeof(address));
+		socklen_t length = sizeof(address);
+		getsockname(listener, (struct sockaddr *)&address, &length);
+		port = ntohs(address.sin_port);
+		listen(listener, 16);
+		acceptor = std::thread(&RangeServer::accept_loop, this);
+	}
+
+	~RangeServer()
+	{
+		shutdown(listener, SHUT_RDWR);
+		close(listener);
+		acceptor.join();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	std::string url() const
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "http://127.0.0.1:%u/firmware.bin", port);
+		return buf;
+	}
+
+	uint32_t crc() const
+	{
+		return crc32c(0, &data[0], data.size());
+	}
+};
+
+class MemorySink : public HttpDownloader::Sink
+{
+public:
+	std::vector<unsigned char> data;
+	int begins = 0;
+	int ends = 0;
+	bool success = false;
+
+	int begin(uint32_t length, uint16_t block_size)
+	{
+		data.assign(length, 0);
+		begins++;
+		return 0;
+	}
+
+	int write(uint32_t offset, const unsigned char *buf, uint32_t length)
+	{
+		if (offset + length > data.size())
+			return -1;
+		memcpy(&data[offset], buf, length);
+		return 0;
+	}
+
+	void end(bool success_)
+	{
+		success = success_;
+		ends++;
+	}
+};
+
+static void thread_executor(void (*job)(void *), void *arg)
+{
+	std::thread(job, arg).detach();
+}
+
+// the socket transport with a short stall timeout, to not wait seconds for a stalled connection
+static int short_timeout_connect(const char *host, uint16_t port, bool secure, uint32_t timeout)
+{
+	return HttpDownloader::default_transport()->connect(host, port, secure, TEST_STALL_TIMEOUT);
+}
+
+static int download(RangeServer &server, uint32_t crc, uint8_t connections, MemorySink &sink)
+{
+	static Http_Transport transport = *HttpDownloader::default_transport();
+	transport.connect = short_timeout_connect;
+
+	HttpDownloader downloader;
+	std::string url = server.url();
+	CHECK_EQ(downloader.start(url.c_str(), crc, thread_executor, connections, &transport, &sink), HttpDownloader::NONE);
+	int result;
+	while (!downloader.poll(result))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(!downloader.is_running());
+	CHECK_EQ(sink.ends, 1);
+	return result;
+}
+
+static void test_parallel_download()
+{
+	RangeServer server;
+	MemorySink sink;
+	CHECK_EQ(download(server, server.crc(), CONNECTIONS, sink), HttpDownloader::NONE);
+	CHECK(sink.success);
+	CHECK_EQ(sink.begins, 1);
+	CHECK(sink.data == server.data);
+	// the probe and one request per range
+	CHECK_EQ(server.connections, CONNECTIONS + 1);
+}
+
+static void test_resume_dropped_connections()
+{
+	RangeServer server;
+	server.drops = 3;
+	MemorySink sink;
+	CHECK_EQ(download(server, server.crc(), CONNECTIONS, sink), HttpDownloader::NONE);
+	CHECK(sink.success);
+	CHECK(sink.data == server.data);
+	CHECK_EQ(server.drops, 0);
+	CHECK_EQ(server.connections, CONNECTIONS + 1 + 3);
+
+	// a dropped range is requested again from the last block written, not from its start
+	const uint32_t blocks = (FILE_LENGTH + HttpDownloader::BLOCK_SIZE - 1) / HttpDownloader::BLOCK_SIZE;
+	const uint32_t range_length = (blocks + CONNECTIONS - 1) / CONNECTIONS * HttpDownloader::BLOCK_SIZE;
+	const uint32_t written = server.break_at / HttpDownloader::BLOCK_SIZE * HttpDownloader::BLOCK_SIZE;
+	int resumed = 0;
+	for (size_t i = 0; i < server.requests.size(); i++)
+		if (server.requests[i] % range_length == written)
+			resumed++;
+	CHECK_EQ(resumed, 3);
+}
+
+static void test_retry_stalled_connection()
+{
+	RangeServer server;
+	server.stalls = 1;
+	MemorySink sink;
+	uint64_t start = unit_micros();
+	CHECK_EQ(download(server, server.crc(), CONNECTIONS, sink), HttpDownloader::NONE);
+	CHECK(sink.success);
+	CHECK(sink.data == server.data);
+	CHECK_EQ(server.stalls, 0);
+	CHECK_EQ(server.connections, CONNECTIONS + 2);
+	// the stalled range waited for the receive timeout once
+	CHECK(unit_micros() - start >= TEST_STALL_TIMEOUT * 1000);
+}
+
+static void test_give_up_without_progress()
+{
+	RangeServer server;
+	server.break_at = 0;
+	server.drops = 1000;
+	MemorySink sink;
+	CHECK_EQ(download(server, server.crc(), 1, sink), HttpDownloader::CONNECTION);
+	CHECK(!sink.success);
+	// the probe, the first attempt and the retries
+	CHECK_EQ(server.connections, 1 + 1 + HttpDownloader::MAX_RETRIES);
+}
+
+static void test_server_without_ranges()
+{
+	RangeServer server;
+	server.ranges = false;
+	MemorySink sink;
+	CHECK_EQ(download(server, server.crc(), CONNECTIONS, sink), HttpDownloader::NONE);
+	CHECK(sink.success);
+	CHECK(sink.data == server.data);
+	// the whole file with one connection
+	CHECK_EQ(server.connections, 2);
+}
+
+static void test_crc_mismatch()
+{
+	RangeServer server;
+	MemorySink sink;
+	CHECK_EQ(download(server, server.crc() ^ 1, CONNECTIONS, sink), HttpDownloader::CRC_MISMATCH);
+	CHECK(!sink.success);
+}
+
+int main()
+{
+	RUN_TEST(test_parallel_download);
+	RUN_TEST(test_resume_dropped_connections);
+	RUN_TEST(test_retry_stalled_connection);
+	RUN_TEST(test_give_up_without_progress);
+	RUN_TEST(test_server_without_ranges);
+	RUN_TEST(test_crc_mismatch);
+	return UNIT_TEST_RESULT();
+}
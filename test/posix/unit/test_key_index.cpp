@@ -0,0 +1,160 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "key_index.h"
+#include "trackle.h"
+#include "protocol_defs.h"
+#include <string>
+#include <vector>
+
+using namespace trackle;
+using namespace trackle::protocol;
+
+#define MAX_KEY_LENGTH 32
+
+struct CloudFunctionTypeBase;
+CloudFunctionTypeBase *find_func_by_key(const char *funcKey);
+
+static std::vector<std::string> registry;
+
+static const char *key_at(uint16_t position)
+{
+	return registry[position].c_str();
+}
+
+// the same FNV-1a as the index, to pick keys that land in the same slot
+static uint32_t fnv1a(const std::string &key)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < key.size() && i < MAX_KEY_LENGTH; i++)
+	{
+		h ^= (uint8_t)key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void add(KeyIndex &index, const std::string &key)
+{
+	registry.push_back(key);
+	index.add(registry.back().c_str(), registry.size() - 1, key_at);
+}
+
+static void test_lookup_across_growth()
+{
+	registry.clear();
+	KeyIndex index(MAX_KEY_LENGTH);
+	CHECK_EQ(index.find("missing", key_at), -1);
+
+	// the table doubles at 8, 16, 32... entries, every entry must survive each rehash
+	int lost = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		add(index, "variable_" + std::to_string(i));
+		for (int j = 0; j <= i; j++)
+			if (index.find(registry[j].c_str(), key_at) != j)
+				lost++;
+	}
+	CHECK_EQ(lost, 0);
+	CHECK_EQ(index.find("variable_256", key_at), -1);
+	CHECK_EQ(index.find("variable_", key_at), -1);
+	CHECK_EQ(index.find("", key_at), -1);
+	CHECK_EQ(index.find(NULL, key_at), -1);
+}
+
+static void test_colliding_keys()
+{
+	registry.clear();
+	KeyIndex index(MAX_KEY_LENGTH);
+
+	// 12 keys with the same slot in the final 512 slot table, and so in every smaller one
+	std::vector<std::string> colliding;
+	const uint32_t slot = fnv1a("k0") & 511;
+	for (int i = 0; colliding.size() < 13; i++)
+	{
+		std::string key = "k" + std::to_string(i);
+		if ((fnv1a(key) & 511) == slot)
+			colliding.push_back(key);
+	}
+	const std::string absent = colliding.back();
+	colliding.pop_back();
+
+	for (size_t i = 0; i < colliding.size(); i++)
+	{
+		add(index, colliding[i]);
+		for (int j = 0; j < 20; j++)
+			add(index, "filler_" + std::to_string(i) + "_" + std::to_string(j));
+	}
+	for (size_t i = 0; i < colliding.size(); i++)
+		CHECK_EQ(index.find(colliding[i].c_str(), key_at), i * 21);
+	// the probe of a key in the same slot ends at the first free slot
+	CHECK_EQ(index.find(absent.c_str(), key_at), -1);
+}
+
+static void test_max_key_length()
+{
+	registry.clear();
+	KeyIndex index(MAX_KEY_LENGTH);
+	const std::string full(MAX_KEY_LENGTH, 'a');
+	const std::string shorter(MAX_KEY_LENGTH - 1, 'a');
+	add(index, full);
+	add(index, shorter);
+
+	CHECK_EQ(index.find(full.c_str(), key_at), 0);
+	CHECK_EQ(index.find(shorter.c_str(), key_at), 1);
+	// the registries truncate longer keys, so only the first MAX_KEY_LENGTH characters count
+	CHECK_EQ(index.find((full + "b").c_str(), key_at), 0);
+	CHECK_EQ(index.find((shorter + "b").c_str(), key_at), -1);
+}
+
+static int cloud_function(const char *args, ...)
+{
+	return 0;
+}
+
+static void test_function_registry()
+{
+	Trackle device;
+	const std::string long_key(MAX_FUNCTION_KEY_LENGTH, 'f');
+	CHECK(device.post(long_key.c_str(), cloud_function));
+	CHECK(device.post("duplicate", cloud_function));
+	CHECK(!device.post("duplicate", cloud_function));
+	for (size_t i = 2; i < MAX_FUNCTION_COUNT; i++)
+		CHECK(device.post(("function_" + std::to_string(i)).c_str(), cloud_function));
+	CHECK(!device.post("one_too_many", cloud_function));
+
+	int missing = 0;
+	for (size_t i = 2; i < MAX_FUNCTION_COUNT; i++)
+		if (!find_func_by_key(("function_" + std::to_string(i)).c_str()))
+			missing++;
+	CHECK_EQ(missing, 0);
+	CHECK(find_func_by_key(long_key.c_str()) != NULL);
+	CHECK(find_func_by_key("duplicate") != NULL);
+	CHECK(find_func_by_key("one_too_many") == NULL);
+}
+
+int main()
+{
+	RUN_TEST(test_lookup_across_growth);
+	RUN_TEST(test_colliding_keys);
+	RUN_TEST(test_max_key_length);
+	RUN_TEST(test_function_registry);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,137 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "ota_harness.h"
+#include <stdlib.h>
+
+#define CHUNK_SIZE 128
+#define CHUNKS 200
+#define CHECKPOINT 10
+
+using namespace trackle::protocol;
+
+static std::vector<uint8_t> image()
+{
+	std::vector<uint8_t> file(CHUNKS * CHUNK_SIZE - 50);
+	srand(3);
+	for (size_t i = 0; i < file.size(); i++)
+		file[i] = rand();
+	return file;
+}
+
+static void check_complete(OtaTarget &target, const std::vector<uint8_t> &file)
+{
+	CHECK(target.completed());
+	CHECK(target.flash.size() >= file.size() && !memcmp(&target.flash[0], &file[0], file.size()));
+	CHECK(target.persisted.empty());
+}
+
+// the connection drops after 120 chunks, the next session resumes from the stored ones
+static void test_resume_after_connection_drop()
+{
+	std::vector<uint8_t> file = image();
+	OtaTarget target;
+	OtaCloud cloud(target, CHUNK_SIZE);
+	cloud.transfer.set_checkpoint_interval(CHECKPOINT);
+
+	CHECK_EQ(cloud.begin(file.size()), NO_ERROR);
+	cloud.stream(file, 0, 120);
+	cloud.drop();
+	CHECK(!target.persisted.empty());
+	CHECK_EQ(target.writes, 120);
+
+	// UpdateReady can't tell the cloud to skip chunks, it streams all of them again
+	CHECK_EQ(cloud.begin(file.size()), NO_ERROR);
+	CHECK_EQ(target.prepare_flags.back(), PrepareFlag::RESUME);
+	cloud.stream(file);
+	CHECK_EQ(target.writes, CHUNKS); // the stored chunks are not written again
+	CHECK_EQ(cloud.done(), NO_ERROR);
+	check_complete(target, file);
+}
+
+// the chunks were held in memory and lost with a reboot: the persisted state is dropped and the transfer starts over
+static void test_restart_when_chunks_are_lost()
+{
+	std::vector<uint8_t> file = image();
+	OtaTarget target;
+	OtaCloud cloud(target, CHUNK_SIZE);
+	cloud.transfer.set_checkpoint_interval(CHECKPOINT);
+
+	CHECK_EQ(cloud.begin(file.size()), NO_ERROR);
+	cloud.stream(file, 0, 120);
+	cloud.drop();
+	target.keeps_chunks = false;
+	target.flash.assign(file.size(), 0);
+
+	CHECK_EQ(cloud.begin(file.size()), NO_ERROR);
+	CHECK_EQ(target.prepare_flags.back(), 0);
+	CHECK(target.persisted.empty());
+	cloud.stream(file);
+	CHECK_EQ(target.writes, 120 + CHUNKS);
+	CHECK_EQ(cloud.done(), NO_ERROR);
+	check_complete(target, file);
+}
+
+// the connection drops at random points, with chunks lost on the way
+static void test_random_connection_drops()
+{
+	std::vector<uint8_t> file = image();
+	OtaTarget target;
+	OtaCloud cloud(target, CHUNK_SIZE);
+	cloud.transfer.set_checkpoint_interval(CHECKPOINT);
+	std::vector<uint8_t> padded(file);
+	padded.resize(CHUNKS * CHUNK_SIZE, 0xFF);
+
+	srand(7);
+	int sessions = 0;
+	bool complete = false;
+	while (!complete && sessions < 100)
+	{
+		sessions++;
+		CHECK_EQ(cloud.begin(file.size()), NO_ERROR);
+		bool dropped = false;
+		for (int round = 0; round < 5 && !dropped && !complete; round++)
+		{
+			for (unsigned i = 0; i < CHUNKS && !dropped; i++)
+			{
+				dropped = rand() % 300 == 0;
+				if (!dropped && rand() % 20)
+					cloud.chunk(i, &padded[i * CHUNK_SIZE], CHUNK_SIZE);
+			}
+			if (!dropped)
+			{
+				cloud.done();
+				complete = target.completed();
+			}
+		}
+		if (!complete)
+			cloud.drop();
+	}
+	CHECK(complete);
+	check_complete(target, file);
+}
+
+int main()
+{
+	RUN_TEST(test_resume_after_connection_drop);
+	RUN_TEST(test_restart_when_chunks_are_lost);
+	RUN_TEST(test_random_connection_drops);
+	return UNIT_TEST_RESULT();
+}
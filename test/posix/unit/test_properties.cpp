@@ -0,0 +1,304 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "test_channel.h"
+#include "trackle.h"
+#include <string>
+
+using namespace trackle::protocol;
+
+extern ProtocolFacade *protocol;
+extern Connection_Status_Type connectionStatus;
+void sync_changed_properties(Trackle *trackle);
+void subscribe_trackle_handler(void *handler, const char *event_name, const char *data);
+
+static system_tick_t now = 10000;
+static system_tick_t clock_millis() { return now; }
+
+/**
+ * Channel that numbers the confirmable messages, the events published with ACK.
+ */
+class EventChannel : public TestChannel
+{
+	message_id_t next_id = 1;
+
+public:
+	ProtocolError send(Message &message) override
+	{
+		if ((message.buf()[0] & 0x30) == 0)
+		{
+			message.buf()[2] = next_id >> 8;
+			message.buf()[3] = next_id & 0xFF;
+			message.set_id(next_id++);
+		}
+		return TestChannel::send(message);
+	}
+};
+
+/**
+ * The protocol the library publishes on, the cloud side acknowledges or refuses its events.
+ */
+class EventProtocol : public Protocol
+{
+public:
+	EventProtocol(EventChannel &channel) : Protocol(channel)
+	{
+		TrackleCallbacks callbacks = {};
+		callbacks.size = sizeof(callbacks);
+		callbacks.millis = clock_millis;
+		TrackleDescriptor descriptor = {};
+		descriptor.size = sizeof(descriptor);
+		Protocol::init(callbacks, descriptor);
+	}
+
+	void init(const char *id, const TrackleKeys &keys, const TrackleCallbacks &callbacks, const TrackleDescriptor &descriptor,
+			  const Connection_Properties_Type &conPropType) override {}
+	int command(ProtocolCommands::Enum command, uint32_t data) override { return 0; }
+	int get_status(protocol_status *status) const override { return 0; }
+
+protected:
+	size_t build_hello(Message &message, uint8_t flags) override { return 0; }
+};
+
+struct Event
+{
+	message_id_t id;
+	token_t token;
+	std::string name;
+	std::string data;
+};
+
+static EventChannel channel;
+static EventProtocol event_protocol(channel);
+
+/**
+ * The events published since the last call.
+ */
+static std::vector<Event> published()
+{
+	std::vector<Event> events;
+	for (size_t i = 0; i < channel.sent.size(); i++)
+	{
+		const std::vector<uint8_t> &m = channel.sent[i];
+		Event e;
+		e.id = m[2] << 8 | m[3];
+		e.token = m[4];
+		unsigned char *option = (unsigned char *)m.data() + 4 + (m[0] & 0x0F);
+		unsigned char *end = (unsigned char *)m.data() + m.size();
+		uint16_t number = 0;
+		int path = 0;
+		while (option < end && *option != 0xFF)
+		{
+			uint16_t delta;
+			size_t length = CoAP::option_decode(&option, &delta);
+			number += delta;
+			if (number == CoAPOption::URI_PATH && path++ > 0) // after "e"
+				e.name += (e.name.empty() ? "" : "/") + std::string((const char *)option, length);
+			option += length;
+		}
+		if (option < end)
+			e.data.assign((const char *)option + 1, end - option - 1);
+		events.push_back(e);
+	}
+	channel.sent.clear();
+	return events;
+}
+
+/**
+ * Runs the sync of the loop, returns the event published if any. The time moves past the rate limit of the events.
+ */
+static bool sync(Trackle &device, Event *event)
+{
+	sync_changed_properties(&device);
+	std::vector<Event> events = published();
+	CHECK(events.size() <= 1);
+	if (events.empty())
+		return false;
+	*event = events[0];
+	return true;
+}
+
+static void ack(const Event &event) { event_protocol.notify_message_complete(event.id, CoAPCode::CHANGED, event.token); }
+static void refuse(const Event &event) { event_protocol.notify_message_complete(event.id, CoAPCode::SERVICE_UNAVAILABLE, event.token); }
+
+static bool has(const Event &event, const char *property) { return event.data.find(property) != std::string::npos; }
+
+static void setup(Trackle &device)
+{
+	device.setMillis(clock_millis);
+	device.setPropertySyncWindow(0);
+	protocol = &event_protocol;
+	connectionStatus = SOCKET_READY;
+	now += 5000;
+	channel.sent.clear();
+}
+
+// only the properties changed since the last acknowledged sync are sent, with the generation and hash of the state
+static void test_only_changes_sent()
+{
+	Trackle device;
+	setup(device);
+	Event event;
+
+	CHECK(device.setProperty("a", "1"));
+	CHECK(device.setProperty("b", "\"x\""));
+	CHECK(sync(device, &event));
+	CHECK(event.name == "trackle/p/d");
+	CHECK(event.data.find("{\"g\":2,\"h\":\"") == 0);
+	CHECK(has(event, "\"p\":{\"a\":1,\"b\":\"x\"}}"));
+	ack(event);
+	CHECK(!sync(device, &event));
+
+	now += 1000;
+	CHECK(device.setProperty("b", "\"y\""));
+	CHECK(device.setProperty("a", "1")); // unchanged
+	CHECK(sync(device, &event));
+	CHECK(has(event, "\"g\":3,"));
+	CHECK(has(event, "\"p\":{\"b\":\"y\"}}"));
+	ack(event);
+	CHECK(!sync(device, &event));
+}
+
+// the changes made during the sync window are sent together, once it elapsed from the first of them
+static void test_sync_window()
+{
+	Trackle device;
+	setup(device);
+	device.setPropertySyncWindow(500);
+	Event event;
+
+	CHECK(device.setProperty("a", "2"));
+	now += 100;
+	CHECK(!sync(device, &event));
+	CHECK(device.setProperty("b", "\"z\""));
+	now += 399;
+	CHECK(!sync(device, &event));
+	now += 1;
+	CHECK(sync(device, &event));
+	CHECK(has(event, "\"p\":{\"a\":2,\"b\":\"z\"}}"));
+	ack(event);
+	CHECK(!sync(device, &event));
+}
+
+// a change is synced only when the cloud acknowledged the event that carried it
+static void test_synced_on_ack()
+{
+	Trackle device;
+	setup(device);
+	Event event;
+
+	CHECK(device.setProperty("a", "3"));
+	CHECK(sync(device, &event));
+	CHECK(device.setProperty("b", "\"w\""));
+	CHECK(!sync(device, &event)); // one sync at a time
+	ack(event);
+	now += 1000;
+	CHECK(sync(device, &event));
+	CHECK(has(event, "\"p\":{\"b\":\"w\"}}")); // not a, acknowledged
+	ack(event);
+
+	// a refused sync is sent again, with the changes made meanwhile
+	now += 1000;
+	CHECK(device.setProperty("a", "4"));
+	CHECK(sync(device, &event));
+	refuse(event);
+	CHECK(device.setProperty("b", "\"v\""));
+	now += 1000;
+	CHECK(sync(device, &event));
+	CHECK(has(event, "\"p\":{\"a\":4,\"b\":\"v\"}}"));
+	ack(event);
+}
+
+// the syncs that fail are retried after a delay that doubles up to a minute, a success restarts it
+static void test_retry_backoff()
+{
+	Trackle device;
+	setup(device);
+	Event event;
+
+	CHECK(device.setProperty("a", "5"));
+	CHECK(sync(device, &event));
+	system_tick_t delay = 1000;
+	for (int i = 0; i < 8; i++)
+	{
+		refuse(event);
+		now += delay - 1;
+		CHECK(!sync(device, &event));
+		now += 1;
+		CHECK(sync(device, &event));
+		CHECK(has(event, "\"a\":5"));
+		delay = std::min(delay * 2, (system_tick_t)60000);
+	}
+	CHECK_EQ(delay, 60000u);
+	ack(event);
+
+	// a sync that can't be sent is retried too
+	now += 1000;
+	CHECK(device.setProperty("a", "6"));
+	connectionStatus = SOCKET_NOT_CONNECTED;
+	CHECK(!sync(device, &event));
+	connectionStatus = SOCKET_READY;
+	now += 999;
+	CHECK(!sync(device, &event));
+	now += 1;
+	CHECK(sync(device, &event));
+	CHECK(has(event, "\"a\":6"));
+	ack(event);
+
+	// the delay starts over after a success
+	now += 1000;
+	CHECK(device.setProperty("a", "7"));
+	CHECK(sync(device, &event));
+	refuse(event);
+	now += 1000;
+	CHECK(sync(device, &event));
+	ack(event);
+}
+
+// the cloud asks for the whole state when its hash drifted, it's sent again until acknowledged
+static void test_resync()
+{
+	Trackle device;
+	setup(device);
+	Event event;
+
+	subscribe_trackle_handler(&device, "trackle/p/sync", "");
+	CHECK(sync(device, &event));
+	CHECK(event.name == "trackle/p");
+	CHECK(event.data[0] == '{' && !has(event, "\"g\":"));
+	CHECK(has(event, "\"a\":7") && has(event, "\"b\":\"v\""));
+	refuse(event);
+	now += 1000;
+	CHECK(sync(device, &event));
+	CHECK(event.name == "trackle/p");
+	ack(event);
+	now += 1000;
+	CHECK(!sync(device, &event));
+}
+
+int main()
+{
+	RUN_TEST(test_only_changes_sent);
+	RUN_TEST(test_sync_window);
+	RUN_TEST(test_synced_on_ack);
+	RUN_TEST(test_retry_backoff);
+	RUN_TEST(test_resync);
+	return UNIT_TEST_RESULT();
+}
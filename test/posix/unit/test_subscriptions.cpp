@@ -0,0 +1,172 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "test_channel.h"
+#include "event_builder.h"
+#include <string>
+
+using namespace trackle::protocol;
+
+static Subscriptions *subscriptions;
+static std::string calls;
+
+static void record(void *tag, const char *event_name, const char *data)
+{
+	calls += (const char *)tag;
+}
+
+static void remove_foo(void *tag, const char *event_name, const char *data)
+{
+	record(tag, event_name, data);
+	subscriptions->remove_event_handlers("foo");
+}
+
+static void remove_all(void *tag, const char *event_name, const char *data)
+{
+	record(tag, event_name, data);
+	subscriptions->remove_event_handlers(NULL);
+}
+
+static void add_handler(Subscriptions &s, const char *filter, void (*handler)(void *, const char *, const char *), const char *tag)
+{
+	s.add_event_handler(filter, (EventHandler)handler, (void *)tag, SubscriptionScope::MY_DEVICES, NULL);
+}
+
+static void deliver(Subscriptions &s, const char *name, const char *payload)
+{
+	TestChannel channel;
+	uint8_t buf[PROTOCOL_BUFFER_SIZE];
+	Message message(buf, sizeof(buf), build_event(buf, name, -1, payload, strlen(payload)));
+	calls.clear();
+	s.handle_event(message, nullptr, channel);
+}
+
+static std::string received;
+
+static void receive(const char *event_name, const char *data)
+{
+	received = data ? data : "";
+}
+
+/**
+ * Delivers one message and returns the code of the piggybacked acknowledgement.
+ */
+static uint8_t deliver_block(Subscriptions &s, int block_value, const std::string &payload, unsigned block_option = 27)
+{
+	TestChannel channel;
+	uint8_t buf[PROTOCOL_BUFFER_SIZE];
+	Message message(buf, sizeof(buf), build_event(buf, "blocks", block_value, payload.data(), payload.size(), block_option));
+	s.handle_event(message, nullptr, channel);
+	CHECK_EQ(channel.sent.size(), 1);
+	return channel.sent.empty() ? 0 : channel.sent[0][1];
+}
+
+static void test_block1_event_is_reassembled()
+{
+	Subscriptions s;
+	s.add_event_handler("blocks", receive, NULL, SubscriptionScope::MY_DEVICES, NULL);
+	const std::string first(512, 'a'), second(512, 'b');
+	received.clear();
+
+	// SZX 5 = 512 bytes blocks
+	CHECK_EQ(deliver_block(s, 0x0D, first), CoAPCode::CONTINUE);
+	CHECK(received.empty());
+	CHECK_EQ(deliver_block(s, 0x1D, second), CoAPCode::CONTINUE);
+	CHECK_EQ(deliver_block(s, 0x25, "end"), CoAPCode::CHANGED);
+	CHECK(received == first + second + "end");
+
+	// a block out of sequence is refused
+	CHECK_EQ(deliver_block(s, 0x1D, second), CoAPCode::REQUEST_ENTITY_INCOMPLETE);
+}
+
+static void test_block2_option_is_ignored()
+{
+	Subscriptions s;
+	s.add_event_handler("blocks", receive, NULL, SubscriptionScope::MY_DEVICES, NULL);
+	received.clear();
+
+	// Block2 does not describe the posted payload: the event is delivered as it is
+	CHECK_EQ(deliver_block(s, 0x1D, "whole", 23), CoAPCode::EMPTY);
+	CHECK(received == "whole");
+}
+
+static void test_prefix_match_in_registration_order()
+{
+	Subscriptions s;
+	add_handler(s, "foo/bar", record, "A");
+	add_handler(s, "", record, "B");
+	add_handler(s, "foo", record, "C");
+	add_handler(s, "bar", record, "D");
+
+	deliver(s, "foo/bar/baz", "x");
+	CHECK(calls == "ABC");
+	deliver(s, "bar", "x");
+	CHECK(calls == "BD");
+}
+
+static void test_unsubscribe_during_dispatch()
+{
+	Subscriptions s;
+	subscriptions = &s;
+	add_handler(s, "foo", record, "A"); // removed by B after its turn
+	add_handler(s, "f", remove_foo, "B");
+	add_handler(s, "fo", record, "C");
+	add_handler(s, "foo", record, "D"); // removed by B before its turn
+	add_handler(s, "f", record, "E");
+
+	// the handlers after the removed ones keep their place in the dispatch
+	deliver(s, "foo", "x");
+	CHECK(calls == "ABCE");
+
+	deliver(s, "foo", "x");
+	CHECK(calls == "BCE");
+	int count = 0;
+	s.for_each([&count](FilteringEventHandler &handler)
+			   { count++; return NO_ERROR; });
+	CHECK_EQ(count, 3);
+}
+
+static void test_unsubscribe_all_during_dispatch()
+{
+	Subscriptions s;
+	subscriptions = &s;
+	add_handler(s, "e", remove_all, "A");
+	add_handler(s, "e", record, "B");
+
+	deliver(s, "event", "x");
+	CHECK(calls == "A");
+	deliver(s, "event", "x");
+	CHECK(calls == "");
+
+	// the table can be filled again afterwards
+	add_handler(s, "event", record, "C");
+	deliver(s, "event", "x");
+	CHECK(calls == "C");
+}
+
+int main()
+{
+	RUN_TEST(test_prefix_match_in_registration_order);
+	RUN_TEST(test_unsubscribe_during_dispatch);
+	RUN_TEST(test_unsubscribe_all_during_dispatch);
+	RUN_TEST(test_block1_event_is_reassembled);
+	RUN_TEST(test_block2_option_is_ignored);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,157 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "trackle.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// answers the cloud variable requests, see Trackle::setVariableCache()
+int getCachedUserVar(const char *varKey, const char *arg, size_t offset, uint8_t *buf, size_t max_length);
+
+static Trackle device;
+static system_tick_t now;
+static std::atomic<int> getter_calls;
+static std::atomic<int> getter_running;
+static std::atomic<int> getter_overlaps;
+
+static system_tick_t fake_millis()
+{
+	return now;
+}
+
+static system_tick_t real_millis()
+{
+	return unit_micros() / 1000;
+}
+
+static int counter(const char *arg)
+{
+	return ++getter_calls;
+}
+
+static int slow_counter(const char *arg)
+{
+	if (getter_running++)
+		getter_overlaps++;
+	std::this_thread::sleep_for(std::chrono::microseconds(200));
+	getter_running--;
+	return ++getter_calls;
+}
+
+static int32_t request(const char *key)
+{
+	uint8_t buf[4];
+	if (getCachedUserVar(key, "", 0, buf, sizeof(buf)) != 4)
+		return -1;
+	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static std::vector<std::pair<void (*)(void *), void *>> queued_jobs;
+
+static void queue_job(void (*job)(void *arg), void *arg)
+{
+	queued_jobs.push_back(std::make_pair(job, arg));
+}
+
+static void thread_job(void (*job)(void *arg), void *arg)
+{
+	std::thread(job, arg).detach();
+}
+
+static void test_refresh_inline_on_demand()
+{
+	device.setMillis(fake_millis);
+	device.setVariableRefreshExecutor(NULL);
+	device.get("inline", counter);
+	CHECK(device.setVariableCache("inline", 100));
+	getter_calls = 0;
+	now = 1000;
+
+	CHECK_EQ(request("inline"), 1);
+	now += 50;
+	CHECK_EQ(request("inline"), 1);
+
+	// nothing refreshes a value that is not requested
+	now += 10000;
+	device.loop();
+	CHECK_EQ(getter_calls, 1);
+
+	CHECK_EQ(request("inline"), 2);
+}
+
+static void test_refresh_on_executor()
+{
+	device.setMillis(fake_millis);
+	device.setVariableRefreshExecutor(queue_job);
+	device.get("queued", counter);
+	CHECK(device.setVariableCache("queued", 100));
+	getter_calls = 0;
+	queued_jobs.clear();
+
+	// never computed: refreshed inline
+	CHECK_EQ(request("queued"), 1);
+	CHECK_EQ(queued_jobs.size(), 0);
+
+	// expired: served while a single refresh is queued
+	now += 200;
+	CHECK_EQ(request("queued"), 1);
+	CHECK_EQ(request("queued"), 1);
+	CHECK_EQ(queued_jobs.size(), 1);
+
+	// variables added meanwhile move vars, the job must not depend on it
+	char key[16];
+	for (int i = 0; i < 64; i++)
+	{
+		snprintf(key, sizeof(key), "other%d", i);
+		device.get(key, counter);
+	}
+	queued_jobs[0].first(queued_jobs[0].second);
+	CHECK_EQ(request("queued"), 2);
+	device.setVariableRefreshExecutor(NULL);
+}
+
+static void test_single_refresh_in_flight()
+{
+	device.setMillis(real_millis);
+	device.setVariableRefreshExecutor(thread_job);
+	device.get("threaded", slow_counter);
+	CHECK(device.setVariableCache("threaded", 1));
+	getter_calls = 0;
+	getter_overlaps = 0;
+
+	const uint64_t end = unit_micros() + 100000;
+	while (unit_micros() < end)
+		CHECK(request("threaded") > 0);
+	while (getter_running)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	CHECK(getter_calls > 1);
+	CHECK_EQ(getter_overlaps, 0);
+	device.setVariableRefreshExecutor(NULL);
+}
+
+int main()
+{
+	RUN_TEST(test_refresh_inline_on_demand);
+	RUN_TEST(test_refresh_on_executor);
+	RUN_TEST(test_single_refresh_in_flight);
+	return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,232 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#include "unit_test.h"
+#include "test_channel.h"
+#include "event_builder.h"
+#include <string>
+
+using namespace trackle::protocol;
+
+static int values[6];
+
+// the getters get the argument of the request, not the key
+template <int N>
+static int get_value(const char *arg) { return values[N]; }
+
+static const void *getters[] = {(const void *)get_value<0>, (const void *)get_value<1>, (const void *)get_value<2>,
+								(const void *)get_value<3>, (const void *)get_value<4>, (const void *)get_value<5>};
+
+static const void *find_variable(const char *key, TrackleReturnType::Enum *type)
+{
+	if (key[0] != 'v' || key[1] < '0' || key[1] > '5' || key[2])
+		return NULL;
+	*type = TrackleReturnType::INT;
+	return getters[key[1] - '0'];
+}
+
+struct Notification
+{
+	uint8_t type;
+	uint8_t code;
+	token_t token;
+	uint32_t observe;
+	int value;
+};
+
+static Notification parse(const std::vector<uint8_t> &sent)
+{
+	Notification n;
+	n.type = sent[0] & 0x30;
+	n.code = sent[1];
+	n.token = sent[4];
+	n.observe = ~0u;
+	unsigned char *option = (unsigned char *)sent.data() + 4 + (sent[0] & 0x0F);
+	unsigned char *end = (unsigned char *)sent.data() + sent.size();
+	uint16_t number = 0;
+	while (option < end && *option != 0xFF)
+	{
+		uint16_t delta;
+		size_t length = CoAP::option_decode(&option, &delta);
+		number += delta;
+		if (number == CoAPOption::OBSERVE)
+			n.observe = CoAP::option_uint_decode(option, length);
+		option += length;
+	}
+	n.value = 0;
+	if (end - option == 5)
+		n.value = option[1] << 24 | option[2] << 16 | option[3] << 8 | option[4];
+	return n;
+}
+
+/**
+ * The device side: the observed variables and the channel the notifications are sent on.
+ */
+class Observed
+{
+public:
+	Variables variables;
+	TestChannel channel;
+	TrackleDescriptor descriptor;
+
+	Observed()
+	{
+		memset(&descriptor, 0, sizeof(descriptor));
+		descriptor.size = sizeof(descriptor);
+		descriptor.find_variable = find_variable;
+	}
+
+	/**
+	 * Sends GET v/<key> with Observe (0 registers, 1 deregisters), and returns the response.
+	 */
+	Notification observe(const char *key, token_t token, uint32_t observe = 0)
+	{
+		uint8_t buf[PROTOCOL_BUFFER_SIZE];
+		uint8_t *p = buf;
+		*p++ = 0x41; // CON, one byte token
+		*p++ = 0x01; // GET
+		*p++ = 0x00;
+		*p++ = 0x09;
+		*p++ = token;
+		uint8_t value[3];
+		p = build_option(p, CoAPOption::OBSERVE, value, CoAP::option_uint_encode(value, observe));
+		p = build_option(p, CoAPOption::URI_PATH - CoAPOption::OBSERVE, (const uint8_t *)"v", 1);
+		p = build_option(p, 0, (const uint8_t *)key, strlen(key));
+
+		Message message(buf, sizeof(buf), p - buf);
+		char variable_key[MAX_VARIABLE_KEY_LENGTH + 1];
+		char variable_arg[MAX_VARIABLE_ARG_LENGTH + 1];
+		channel.sent.clear();
+		CHECK_EQ(variables.handle_variable_request(variable_key, variable_arg, message, channel, token, 9, NULL, NULL, find_variable), NO_ERROR);
+		CHECK_EQ(channel.sent.size(), 1u);
+		return parse(channel.sent.back());
+	}
+
+	/**
+	 * Runs a pass of the notifications, returns the ones sent.
+	 */
+	std::vector<Notification> process(system_tick_t now = 0)
+	{
+		channel.sent.clear();
+		CHECK_EQ(variables.process_observers(channel, descriptor, now), NO_ERROR);
+		std::vector<Notification> sent;
+		for (size_t i = 0; i < channel.sent.size(); i++)
+			sent.push_back(parse(channel.sent[i]));
+		return sent;
+	}
+};
+
+// a registered variable is notified when it changes, with the token of the request and a new sequence
+static void test_register_and_notify()
+{
+	Observed device;
+	values[0] = 20;
+	Notification registered = device.observe("v0", 0x31);
+	CHECK_EQ(registered.code, CoAPCode::CONTENT);
+	CHECK_EQ(registered.observe, 0u);
+	CHECK_EQ(registered.value, 20);
+	CHECK(device.process().empty());
+
+	values[0] = 21;
+	CHECK(device.process().empty()); // not signalled
+	device.variables.notify_changed("v0");
+	std::vector<Notification> sent = device.process();
+	CHECK_EQ(sent.size(), 1u);
+	CHECK_EQ(sent[0].type, 0x10); // NON
+	CHECK_EQ(sent[0].code, CoAPCode::CONTENT);
+	CHECK_EQ(sent[0].token, 0x31);
+	CHECK_EQ(sent[0].observe, 1u);
+	CHECK_EQ(sent[0].value, 21);
+	CHECK(device.process().empty());
+
+	// a change back and forth between two passes is not notified
+	device.variables.notify_changed("v0");
+	CHECK(device.process().empty());
+
+	values[0] = 22;
+	device.variables.notify_changed(NULL);
+	sent = device.process();
+	CHECK_EQ(sent.size(), 1u);
+	CHECK_EQ(sent[0].observe, 2u);
+
+	// deregistered
+	device.observe("v0", 0x32, 1);
+	values[0] = 23;
+	device.variables.notify_changed(NULL);
+	CHECK(device.process().empty());
+}
+
+// a notification that can't be sent doesn't fail the connection, and is sent in a later pass
+static void test_failed_send_retried()
+{
+	Observed device;
+	values[1] = 5;
+	device.observe("v1", 0x41);
+
+	values[1] = 6;
+	device.variables.notify_changed("v1");
+	device.channel.send_error = IO_ERROR_GENERIC_SEND;
+	CHECK(device.process().empty());
+	CHECK(device.process().empty());
+	device.channel.send_error = NO_ERROR;
+
+	std::vector<Notification> sent = device.process();
+	CHECK_EQ(sent.size(), 1u);
+	CHECK_EQ(sent[0].observe, 1u); // the sequence isn't taken by the notifications not sent
+	CHECK_EQ(sent[0].value, 6);
+	CHECK(device.process().empty());
+}
+
+// the notifications of a pass are capped, the next pass goes on with the observers left
+static void test_notifications_per_pass()
+{
+	Observed device;
+	for (int i = 0; i < 6; i++)
+	{
+		const char key[] = {'v', char('0' + i), 0};
+		values[i] = i;
+		device.observe(key, 0x50 + i);
+	}
+	for (int i = 0; i < 6; i++)
+		values[i] = 100 + i;
+	device.variables.notify_changed(NULL);
+
+	std::vector<Notification> first = device.process();
+	CHECK_EQ(first.size(), (size_t)MAX_VARIABLE_NOTIFICATIONS);
+	std::vector<Notification> second = device.process();
+	CHECK_EQ(first.size() + second.size(), 6u);
+	bool notified[6] = {};
+	for (size_t i = 0; i < first.size() + second.size(); i++)
+	{
+		const Notification &n = i < first.size() ? first[i] : second[i - first.size()];
+		CHECK(n.token >= 0x50 && n.token < 0x56);
+		CHECK(!notified[n.token - 0x50]);
+		notified[n.token - 0x50] = true;
+		CHECK_EQ(n.value, 100 + n.token - 0x50);
+	}
+	CHECK(device.process().empty());
+}
+
+int main()
+{
+	RUN_TEST(test_register_and_notify);
+	RUN_TEST(test_failed_send_retried);
+	RUN_TEST(test_notifications_per_pass);
+	return UNIT_TEST_RESULT();
+}
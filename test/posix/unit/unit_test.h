@@ -0,0 +1,72 @@
+/**
+ ******************************************************************************
+  Copyright (c) 2022 IOTREADY S.r.l.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+
+/**
+ * Minimal assertion helpers for the unit tests: a failed check is reported
+ * and counted, and UNIT_TEST_RESULT() turns the count into the exit status.
+ */
+static int unit_test_failures = 0;
+
+#define CHECK(cond)                                                                 \
+	do                                                                              \
+	{                                                                               \
+		if (!(cond))                                                                \
+		{                                                                           \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			unit_test_failures++;                                                   \
+		}                                                                           \
+	} while (0)
+
+#define CHECK_EQ(actual, expected)                                                       \
+	do                                                                                   \
+	{                                                                                    \
+		long long _a = (long long)(actual), _e = (long long)(expected);                  \
+		if (_a != _e)                                                                    \
+		{                                                                                \
+			fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, \
+					_a, _e);                                                             \
+			unit_test_failures++;                                                        \
+		}                                                                                \
+	} while (0)
+
+#define RUN_TEST(test)                   \
+	do                                   \
+	{                                    \
+		int _before = unit_test_failures; \
+		test();                          \
+		printf("%s %s\n", _before == unit_test_failures ? "ok  " : "FAIL", #test); \
+	} while (0)
+
+#define UNIT_TEST_RESULT() (unit_test_failures ? 1 : 0)
+
+/**
+ * Monotonic time in microseconds, for the benchmarks.
+ */
+static inline uint64_t unit_micros()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}